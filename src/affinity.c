@@ -0,0 +1,159 @@
+#include "server.h"
+
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <linux/filter.h>
+#include <sched.h>
+#endif
+
+#define LOCALITY_REPORT_INTERVAL 60 // seconds between summaries
+
+// Per worker: how many accepted connections had their packets received on
+// the CPU the worker is pinned to.
+struct locality {
+    int cpu;
+    time_t reported;
+    uint64_t reported_accepted;
+    uint64_t accepted;
+    uint64_t local;
+    uint64_t unknown; // the kernel did not say
+};
+
+// Worker i runs on the i-th CPU the server was started on, wrapping around
+// when there are more workers than CPUs. Returns false where CPUs cannot be
+// listed or pinned to.
+bool affinity_assign(size_t workers, int *cpus, size_t *cpu_count) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == -1) {
+        log_perror(LOG_ERROR, "failed to read the allowed CPUs");
+        return false;
+    }
+    int allowed[CPU_SETSIZE];
+    size_t count = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &set))
+            allowed[count++] = cpu;
+    }
+    if (count == 0)
+        return false;
+    for (size_t i = 0; i < workers; ++i)
+        cpus[i] = allowed[i % count];
+    *cpu_count = count;
+    return true;
+#else
+    (void)workers;
+    (void)cpus;
+    (void)cpu_count;
+    log_msg(LOG_ERROR, "cpu_affinity is not supported on this platform");
+    return false;
+#endif
+}
+
+bool affinity_pin(int cpu) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+        log_perror(LOG_ERROR, "failed to pin worker to cpu %d", cpu);
+        return false;
+    }
+    return true;
+#else
+    (void)cpu;
+    return false;
+#endif
+}
+
+// Tells the kernel which CPU the worker behind a listening socket runs on,
+// so that it is preferred for connections received there.
+void affinity_set_incoming_cpu(int fd, int cpu) {
+#ifdef SO_INCOMING_CPU
+    if (setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) == -1)
+        log_perror(LOG_WARN, "failed to set SO_INCOMING_CPU");
+#else
+    (void)fd;
+    (void)cpu;
+#endif
+}
+
+// Attached to one socket of a reuseport group whose sockets joined in
+// worker order, the program picks the worker pinned to the CPU a connection
+// was received on. CPUs without a worker spread over all of them.
+bool affinity_steer(int fd, const int *cpus, size_t count) {
+#if defined(SO_ATTACH_REUSEPORT_CBPF) && defined(SKF_AD_CPU)
+    if (count == 0 || count * 2 + 3 > BPF_MAXINSNS)
+        return false;
+    struct sock_filter *code = malloc((count * 2 + 3) * sizeof(*code));
+    if (code == NULL) {
+        log_msg(LOG_FATAL, "OOM");
+        exit(EXIT_FAILURE);
+    }
+    size_t n = 0;
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+    for (size_t i = 0; i < count; ++i) {
+        code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (unsigned)cpus[i], 0, 1);
+        code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, (unsigned)i);
+    }
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (unsigned)count);
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0);
+
+    struct sock_fprog prog = {(unsigned short)n, code};
+    bool ok = setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == 0;
+    if (!ok)
+        log_perror(LOG_WARN, "failed to attach the reuseport steering program");
+    free(code);
+    return ok;
+#else
+    (void)fd;
+    (void)cpus;
+    (void)count;
+    log_msg(LOG_WARN, "reuseport steering is not supported on this platform");
+    return false;
+#endif
+}
+
+struct locality *locality_create(int cpu) {
+    struct locality *locality = calloc(1, sizeof(*locality));
+    if (locality == NULL) {
+        log_msg(LOG_FATAL, "OOM");
+        exit(EXIT_FAILURE);
+    }
+    locality->cpu = cpu;
+    locality->reported = time(NULL);
+    return locality;
+}
+
+void locality_accept(struct locality *locality, int fd) {
+    ++locality->accepted;
+#ifdef SO_INCOMING_CPU
+    int cpu;
+    socklen_t len = sizeof(cpu);
+    if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == -1 || cpu < 0)
+        ++locality->unknown;
+    else if (cpu == locality->cpu)
+        ++locality->local;
+#else
+    (void)fd;
+    ++locality->unknown;
+#endif
+}
+
+void locality_report(struct locality *locality) {
+    time_t now = time(NULL);
+    if (now - locality->reported < LOCALITY_REPORT_INTERVAL)
+        return;
+    locality->reported = now;
+    if (locality->accepted == locality->reported_accepted)
+        return;
+    locality->reported_accepted = locality->accepted;
+    uint64_t known = locality->accepted - locality->unknown;
+    log_msg(LOG_INFO, "locality on cpu %d: %llu of %llu connections received here (%.1f%%), %llu unknown",
+            locality->cpu, (unsigned long long)locality->local, (unsigned long long)known,
+            known ? 100.0 * (double)locality->local / (double)known : 0.0, (unsigned long long)locality->unknown);
+}
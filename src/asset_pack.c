@@ -0,0 +1,253 @@
+#include "server.h"
+#include "pack_format.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct pack_heads {
+    struct header_block block;
+    struct header_block h2_block;
+};
+
+// Opened and mapped by the master, the workers inherit the mapping. Nothing
+// is read at startup beyond the header, entries are checked as they are
+// found. Heads are built on first use in each worker's copy of heads.
+//
+// The pack is never written in place, asset_pack renames a new one over it,
+// so the mapping cannot shrink under a send.
+struct asset_pack {
+    const char *data;
+    size_t size;
+    const struct pack_header *header;
+    const struct pack_entry *entries;
+    const char *strings;
+    struct pack_heads **heads; // entry_count * PACK_VARIANTS
+};
+
+static bool within(const struct asset_pack *pack, uint64_t offset, uint64_t len) {
+    return offset <= pack->size && len <= pack->size - offset;
+}
+
+struct asset_pack *asset_pack_open(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        log_perror(LOG_FATAL, "failed to open asset pack %s", path);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        log_perror(LOG_FATAL, "failed to stat asset pack %s", path);
+        close(fd);
+        return NULL;
+    }
+    if ((size_t)st.st_size < sizeof(struct pack_header)) {
+        log_msg(LOG_FATAL, "asset pack %s is truncated", path);
+        close(fd);
+        return NULL;
+    }
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        log_perror(LOG_FATAL, "failed to map asset pack %s", path);
+        return NULL;
+    }
+
+    struct asset_pack *pack = calloc(1, sizeof(*pack));
+    if (pack == NULL) {
+        log_msg(LOG_FATAL, "OOM");
+        exit(EXIT_FAILURE);
+    }
+    pack->data = data;
+    pack->size = st.st_size;
+    pack->header = data;
+
+    const struct pack_header *header = pack->header;
+    bool valid = memcmp(header->magic, PACK_MAGIC, sizeof(PACK_MAGIC)) == 0 && header->version == PACK_VERSION &&
+                 header->entry_size == sizeof(struct pack_entry) && header->size == pack->size &&
+                 header->entry_count <= pack->size / sizeof(struct pack_entry) &&
+                 within(pack, header->entries, header->entry_count * sizeof(struct pack_entry)) &&
+                 header->entries % 8 == 0 && within(pack, header->strings, header->strings_size) &&
+                 (header->strings_size == 0 || pack->data[header->strings + header->strings_size - 1] == '\0');
+    if (!valid) {
+        log_msg(LOG_FATAL, "%s is not an asset pack of this server version", path);
+        munmap(data, pack->size);
+        free(pack);
+        return NULL;
+    }
+    pack->entries = (const struct pack_entry *)(pack->data + header->entries);
+    pack->strings = pack->data + header->strings;
+    madvise((void *)pack->data, header->strings + header->strings_size, MADV_WILLNEED);
+    log_msg(LOG_INFO, "serving %llu entries from asset pack %s", (unsigned long long)header->entry_count, path);
+    return pack;
+}
+
+static bool valid_string(const struct asset_pack *pack, uint64_t offset, uint64_t len) {
+    return offset < pack->header->strings_size && len < pack->header->strings_size - offset;
+}
+
+static bool valid_entry(const struct asset_pack *pack, const struct pack_entry *entry) {
+    if (!valid_string(pack, entry->content_type, 0) || !valid_string(pack, entry->etag, PACK_ETAG_LEN))
+        return false;
+    for (size_t i = 0; i < PACK_VARIANTS; ++i) {
+        if (!within(pack, entry->blobs[i].offset, entry->blobs[i].length))
+            return false;
+    }
+    return entry->blobs[PACK_IDENTITY].offset != 0;
+}
+
+// Binary search over the sorted entries, comparing like strcmp does.
+static const struct pack_entry *find_entry(const struct asset_pack *pack, const char *path, size_t len) {
+    size_t lo = 0, hi = pack->header->entry_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const struct pack_entry *entry = &pack->entries[mid];
+        if (!valid_string(pack, entry->path, entry->path_len))
+            return NULL;
+        size_t entry_len = entry->path_len;
+        int cmp = memcmp(pack->strings + entry->path, path, entry_len < len ? entry_len : len);
+        if (cmp == 0)
+            cmp = entry_len < len ? -1 : entry_len > len;
+        if (cmp == 0)
+            return entry;
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return NULL;
+}
+
+// Whether an Accept-Encoding list takes coding with a nonzero q value.
+static bool accepts(const char *list, size_t len, const char *coding) {
+    size_t coding_len = strlen(coding);
+    const char *end = list + len;
+    while (list < end) {
+        while (list < end && (*list == ' ' || *list == ','))
+            ++list;
+        const char *item = list;
+        while (list < end && *list != ',' && *list != ';' && *list != ' ')
+            ++list;
+        bool match = (size_t)(list - item) == coding_len && strncasecmp(item, coding, coding_len) == 0;
+        const char *params = list;
+        while (list < end && *list != ',')
+            ++list;
+        if (!match)
+            continue;
+        const char *q = params;
+        while (q < list && (*q == ' ' || *q == ';'))
+            ++q;
+        if (list - q >= 3 && (q[0] == 'q' || q[0] == 'Q') && q[1] == '=') {
+            for (q += 2; q < list && (*q == '0' || *q == '.'); ++q)
+                ;
+            return q < list && *q >= '1' && *q <= '9';
+        }
+        return true;
+    }
+    return false;
+}
+
+static enum pack_variant pick_variant(const struct pack_entry *entry, const struct http_req *req) {
+    if (req->accept_encoding == NULL)
+        return PACK_IDENTITY;
+    if (entry->blobs[PACK_BR].offset && accepts(req->accept_encoding, req->accept_encoding_len, "br"))
+        return PACK_BR;
+    if (entry->blobs[PACK_GZIP].offset && accepts(req->accept_encoding, req->accept_encoding_len, "gzip"))
+        return PACK_GZIP;
+    return PACK_IDENTITY;
+}
+
+static bool copy_block(struct header_block *block, const void *data, size_t len, size_t date_offset) {
+    char *copy = malloc(len);
+    if (copy == NULL)
+        return false;
+    memcpy(copy, data, len);
+    block->data = copy;
+    block->len = len;
+    block->date_offset = date_offset;
+    return true;
+}
+
+// Same fields and Date placement as the header cache builds for files, plus
+// the content coding. Every variant of an entry that has more than one
+// varies on Accept-Encoding.
+static struct pack_heads *build_heads(const struct asset_pack *pack, const struct pack_entry *entry,
+                                      enum pack_variant variant) {
+    static const char *const codings[PACK_VARIANTS] = {NULL, "br", "gzip"};
+    static const char *const suffixes[PACK_VARIANTS] = {"", "-br", "-gz"};
+    const char *type = pack->strings + entry->content_type;
+    const char *coding = codings[variant];
+    bool varies = entry->blobs[PACK_BR].offset || entry->blobs[PACK_GZIP].offset;
+    size_t size = entry->blobs[variant].length;
+    char last_modified[64], length[32], etag[PACK_ETAG_LEN + 8];
+    http_format_date(last_modified, sizeof(last_modified), (time_t)entry->mtime);
+    int length_len = snprintf(length, sizeof(length), "%zu", size);
+    int etag_len = snprintf(etag, sizeof(etag), "\"%.*s%s\"", PACK_ETAG_LEN, pack->strings + entry->etag,
+                            suffixes[variant]);
+
+    struct pack_heads *heads = calloc(1, sizeof(*heads));
+    if (heads == NULL)
+        return NULL;
+
+    static const char prefix[] = "HTTP/1.1 200 OK\r\nDate: ";
+    char buffer[1024];
+    int len = snprintf(buffer, sizeof(buffer), "%s\r\nContent-Length: %s\r\nContent-Type: %s\r\n%s%s%s%s"
+                       "Last-Modified: %s\r\nETag: %s\r\nConnection: Close\r\n\r\n",
+                       prefix, length, type, coding ? "Content-Encoding: " : "", coding ? coding : "",
+                       coding ? "\r\n" : "", varies ? "Vary: Accept-Encoding\r\n" : "", last_modified, etag);
+    bool ok = len > 0 && (size_t)len < sizeof(buffer) && copy_block(&heads->block, buffer, len, sizeof(prefix) - 1);
+
+    uint8_t h2_buffer[1024];
+    struct hpack_buf buf = {h2_buffer, 0, sizeof(h2_buffer)};
+    ok = ok && hpack_put_status(&buf, 200) && hpack_put_field(&buf, HPACK_DATE, last_modified, HTTP_DATE_LEN);
+    size_t date_offset = buf.len - HTTP_DATE_LEN;
+    ok = ok && hpack_put_field(&buf, HPACK_CONTENT_LENGTH, length, length_len) &&
+         hpack_put_field(&buf, HPACK_CONTENT_TYPE, type, strlen(type)) &&
+         (coding == NULL || hpack_put_field(&buf, HPACK_CONTENT_ENCODING, coding, strlen(coding))) &&
+         (!varies || hpack_put_field(&buf, HPACK_VARY, "Accept-Encoding", 15)) &&
+         hpack_put_field(&buf, HPACK_LAST_MODIFIED, last_modified, strlen(last_modified)) &&
+         hpack_put_field(&buf, HPACK_ETAG, etag, etag_len) &&
+         copy_block(&heads->h2_block, h2_buffer, buf.len, date_offset);
+    if (!ok) {
+        free((char *)heads->block.data);
+        free(heads);
+        return NULL;
+    }
+    return heads;
+}
+
+enum http_status_code asset_pack_lookup(struct asset_pack *pack, const struct http_req *req,
+                                        struct pack_file *file) {
+    const struct pack_entry *entry = find_entry(pack, req->path, strlen(req->path));
+    if (entry == NULL)
+        return HTTP_NOT_FOUND;
+    if (!valid_entry(pack, entry)) {
+        log_msg(LOG_ERROR, "corrupt asset pack entry for %s", req->path);
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (pack->heads == NULL) {
+        pack->heads = calloc(pack->header->entry_count * PACK_VARIANTS, sizeof(*pack->heads));
+        if (pack->heads == NULL) {
+            log_msg(LOG_FATAL, "OOM");
+            exit(EXIT_FAILURE);
+        }
+    }
+    enum pack_variant variant = pick_variant(entry, req);
+    struct pack_heads **heads = &pack->heads[(entry - pack->entries) * PACK_VARIANTS + variant];
+    if (*heads == NULL)
+        *heads = build_heads(pack, entry, variant);
+    if (*heads == NULL)
+        return HTTP_INTERNAL_SERVER_ERROR;
+
+    file->head = &(*heads)->block;
+    file->h2_head = &(*heads)->h2_block;
+    file->body = pack->data + entry->blobs[variant].offset;
+    file->size = entry->blobs[variant].length;
+    return HTTP_OK;
+}
@@ -0,0 +1,113 @@
+#include "server.h"
+
+#include <stdlib.h>
+#include <time.h>
+
+#define BUFFER_REPORT_INTERVAL 60 // seconds between pool summaries
+
+struct buffer_pool_stats {
+    uint64_t gets;
+    uint64_t hits;  // served from the free list
+    uint64_t grown; // outgrew the pool size, freed on release
+    size_t in_use;
+    size_t in_use_bytes;
+    size_t peak_in_use; // since the last report
+    size_t peak_bytes;
+};
+
+// Per worker, so nothing is shared and no locking is needed. Buffers of the
+// pool's size are kept for reuse up to max_free, anything else is freed.
+struct buffer_pool {
+    const char *name;
+    size_t size;
+    size_t max_free;
+    size_t free_count;
+    time_t reported;
+    uint64_t reported_gets;
+    struct buffer_pool_stats stats;
+    char *free_list[];
+};
+
+struct buffer_pool *buffer_pool_create(const char *name, size_t size, size_t max_free) {
+    struct buffer_pool *pool = calloc(1, sizeof(*pool) + max_free * sizeof(pool->free_list[0]));
+    if (pool == NULL) {
+        log_msg(LOG_FATAL, "OOM");
+        exit(EXIT_FAILURE);
+    }
+    pool->name = name;
+    pool->size = size;
+    pool->max_free = max_free;
+    pool->reported = time(NULL);
+    return pool;
+}
+
+size_t buffer_pool_size(const struct buffer_pool *pool) {
+    return pool->size;
+}
+
+static void track(struct buffer_pool *pool, size_t count, size_t bytes) {
+    struct buffer_pool_stats *stats = &pool->stats;
+    stats->in_use += count;
+    stats->in_use_bytes += bytes;
+    if (stats->in_use > stats->peak_in_use)
+        stats->peak_in_use = stats->in_use;
+    if (stats->in_use_bytes > stats->peak_bytes)
+        stats->peak_bytes = stats->in_use_bytes;
+}
+
+char *buffer_pool_get(struct buffer_pool *pool) {
+    ++pool->stats.gets;
+    track(pool, 1, pool->size);
+    if (pool->free_count) {
+        ++pool->stats.hits;
+        return pool->free_list[--pool->free_count];
+    }
+    char *buf = malloc(pool->size);
+    if (buf == NULL) {
+        log_msg(LOG_FATAL, "OOM");
+        exit(EXIT_FAILURE);
+    }
+    return buf;
+}
+
+// Keeps the first old_size bytes. The result is released with its new size.
+char *buffer_pool_grow(struct buffer_pool *pool, char *buf, size_t old_size, size_t new_size) {
+    if (old_size == pool->size)
+        ++pool->stats.grown;
+    char *grown = realloc(buf, new_size);
+    if (grown == NULL) {
+        log_msg(LOG_FATAL, "OOM");
+        exit(EXIT_FAILURE);
+    }
+    pool->stats.in_use_bytes -= old_size;
+    track(pool, 0, new_size);
+    return grown;
+}
+
+void buffer_pool_put(struct buffer_pool *pool, char *buf, size_t size) {
+    pool->stats.in_use -= 1;
+    pool->stats.in_use_bytes -= size;
+    if (size == pool->size && pool->free_count < pool->max_free)
+        pool->free_list[pool->free_count++] = buf;
+    else
+        free(buf);
+}
+
+void buffer_pool_report(struct buffer_pool *pool) {
+    time_t now = time(NULL);
+    if (now - pool->reported < BUFFER_REPORT_INTERVAL)
+        return;
+    pool->reported = now;
+
+    struct buffer_pool_stats *stats = &pool->stats;
+    if (stats->gets == pool->reported_gets)
+        return;
+    log_msg(LOG_INFO, "%s buffers: %llu taken, %.1f%% reused, %llu grown, peak %zu in use (%zu KiB) in the last %ds, "
+            "%zu idle",
+            pool->name, (unsigned long long)stats->gets, 100.0 * (double)stats->hits / (double)stats->gets,
+            (unsigned long long)stats->grown, stats->peak_in_use, stats->peak_bytes >> 10, BUFFER_REPORT_INTERVAL,
+            pool->free_count);
+    pool->reported_gets = stats->gets;
+    stats->peak_in_use = stats->in_use;
+    stats->peak_bytes = stats->in_use_bytes;
+}
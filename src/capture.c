@@ -0,0 +1,137 @@
+#include "server.h"
+#include "capture_format.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CAPTURE_BUF_SIZE (1 << 16)
+#define CAPTURE_FLUSH_INTERVAL 1 // seconds a record may wait in the buffer
+
+// Per worker. Records collect in the buffer and go out with one append
+// write, which the kernel keeps whole next to the other workers' writes to
+// the same file.
+struct capture {
+    int fd;
+    size_t max_size;
+    bool full; // stopped at max_size
+    time_t flushed;
+    size_t len;
+    char buf[CAPTURE_BUF_SIZE];
+};
+
+// Opened by the master, the workers inherit the descriptor. A new file gets
+// its header, an existing one of the same layout is appended to, and one of
+// any other is refused rather than mixed into.
+int capture_open(const char *path) {
+    int fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        log_perror(LOG_FATAL, "failed to open capture file %s", path);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        log_perror(LOG_FATAL, "failed to stat capture file %s", path);
+        close(fd);
+        return -1;
+    }
+    struct capture_header header = {CAPTURE_MAGIC, CAPTURE_VERSION, sizeof(struct capture_record)};
+    if (st.st_size == 0) {
+        if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+            log_perror(LOG_FATAL, "failed to write capture file %s", path);
+            close(fd);
+            return -1;
+        }
+    } else {
+        struct capture_header existing;
+        if (pread(fd, &existing, sizeof(existing), 0) != sizeof(existing) ||
+            memcmp(existing.magic, header.magic, sizeof(header.magic)) != 0 || existing.version != header.version ||
+            existing.record_size != header.record_size) {
+            log_msg(LOG_FATAL, "%s is not a capture file of this server version", path);
+            close(fd);
+            return -1;
+        }
+    }
+    log_msg(LOG_INFO, "capturing request heads to %s", path);
+    return fd;
+}
+
+struct capture *capture_create(int fd, size_t max_size) {
+    struct capture *capture = malloc(sizeof(*capture));
+    if (capture == NULL) {
+        log_msg(LOG_FATAL, "OOM");
+        exit(EXIT_FAILURE);
+    }
+    capture->fd = fd;
+    capture->max_size = max_size;
+    capture->full = false;
+    capture->flushed = time(NULL);
+    capture->len = 0;
+    return capture;
+}
+
+static bool reached_max_size(struct capture *capture, size_t len) {
+    struct stat st;
+    if (capture->max_size == 0 || fstat(capture->fd, &st) == -1 || (size_t)st.st_size + len <= capture->max_size)
+        return false;
+    log_msg(LOG_WARN, "capture file reached capture_max_size, no longer capturing");
+    capture->full = true;
+    return true;
+}
+
+static void write_out(struct capture *capture, const struct iovec *iov, int count, size_t len) {
+    if (reached_max_size(capture, len))
+        return;
+    if (writev(capture->fd, iov, count) != (ssize_t)len) {
+        log_perror(LOG_ERROR, "failed to write capture file, no longer capturing");
+        capture->full = true;
+    }
+}
+
+void capture_flush(struct capture *capture, bool force) {
+    time_t now = time(NULL);
+    if (capture->len == 0 || (!force && now - capture->flushed < CAPTURE_FLUSH_INTERVAL))
+        return;
+    capture->flushed = now;
+    struct iovec iov = {capture->buf, capture->len};
+    if (!capture->full)
+        write_out(capture, &iov, 1, capture->len);
+    capture->len = 0;
+}
+
+// Records wait in the buffer, so the event loop has to come back for them.
+bool capture_pending(const struct capture *capture) {
+    return capture->len != 0;
+}
+
+// req_data is the request buffer as read_req_data left it. Only the head is
+// kept, whatever follows it is left out.
+void capture_request(struct capture *capture, const char *req_data, bool tls) {
+    if (capture->full)
+        return;
+    const char *end = strstr(req_data, "\r\n\r\n");
+    if (end == NULL)
+        return;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    struct capture_record record;
+    record.time_ns = (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+    record.head_len = (uint32_t)(end + 4 - req_data);
+    record.flags = tls ? CAPTURE_TLS : 0;
+
+    size_t len = sizeof(record) + record.head_len;
+    if (capture->len + len > sizeof(capture->buf))
+        capture_flush(capture, true);
+    if (len > sizeof(capture->buf)) {
+        struct iovec iov[2] = {{&record, sizeof(record)}, {(void *)req_data, record.head_len}};
+        write_out(capture, iov, 2, len);
+        return;
+    }
+    memcpy(capture->buf + capture->len, &record, sizeof(record));
+    memcpy(capture->buf + capture->len + sizeof(record), req_data, record.head_len);
+    capture->len += len;
+}
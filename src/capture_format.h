@@ -0,0 +1,33 @@
+#ifndef CAPTURE_FORMAT_H
+#define CAPTURE_FORMAT_H
+
+#include <stdint.h>
+
+// Layout of capture files, written by the server's capture setting and read
+// by tools/replay.c, in the byte order of the host that wrote them.
+//
+//   header | record, head | record, head | ...
+//
+// Workers append whole batches of records to the same file, so records are
+// only roughly in time order and readers sort them.
+
+#define CAPTURE_MAGIC "SRVCAPT"
+#define CAPTURE_VERSION 1
+
+#define CAPTURE_TLS 1 // arrived on a tls listener
+
+struct capture_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size; // catches files from a different layout or byte order
+};
+
+// Followed by head_len bytes of the request head, up to and including the
+// blank line that ends it.
+struct capture_record {
+    uint64_t time_ns; // CLOCK_REALTIME when the head was complete
+    uint32_t head_len;
+    uint32_t flags;
+};
+
+#endif
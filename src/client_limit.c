@@ -0,0 +1,218 @@
+#include "server.h"
+
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#define CLIENT_TABLE_PROBES 8
+#define CLIENT_REPORT_INTERVAL 60 // seconds between summaries of limited clients
+#define TOKEN_SCALE 1000          // tokens are kept in thousandths
+
+// A client is an IPv4 or IPv6 address masked to the configured prefix.
+// IPv4-mapped IPv6 addresses count as IPv4.
+struct client_key {
+    uint8_t family; // 0 marks a free slot
+    uint8_t addr[16];
+};
+
+struct client_entry {
+    struct client_key key;
+    size_t conns;
+    uint64_t tokens;
+    uint64_t refilled_ms;
+    time_t last_seen;
+    bool limited; // rejected since the last report
+};
+
+struct client_limit_stats {
+    uint64_t conns_rejected;
+    uint64_t rate_limited;
+    uint64_t untracked; // accepted without an entry because the probe window was busy
+};
+
+// Per worker, so nothing is shared and no locking is needed.
+struct client_table {
+    size_t mask;
+    time_t reported;
+    struct client_limit_stats stats;
+    uint64_t reported_untracked;
+    struct client_entry entries[];
+};
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static void mask_prefix(uint8_t *addr, size_t len, int prefix) {
+    for (size_t i = 0; i < len; ++i) {
+        int bits = prefix - (int)i * 8;
+        if (bits >= 8)
+            continue;
+        addr[i] &= bits <= 0 ? 0 : (uint8_t)(0xff << (8 - bits));
+    }
+}
+
+static bool make_key(const struct sockaddr *addr, const struct server_settings *settings, struct client_key *key) {
+    static const uint8_t v4_mapped[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+    memset(key, 0, sizeof(*key));
+    if (addr->sa_family == AF_INET) {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+        key->family = AF_INET;
+        memcpy(key->addr, &in->sin_addr, 4);
+    } else if (addr->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+        if (memcmp(in6->sin6_addr.s6_addr, v4_mapped, sizeof(v4_mapped)) == 0) {
+            key->family = AF_INET;
+            memcpy(key->addr, in6->sin6_addr.s6_addr + 12, 4);
+        } else {
+            key->family = AF_INET6;
+            memcpy(key->addr, in6->sin6_addr.s6_addr, 16);
+        }
+    } else {
+        return false;
+    }
+    if (key->family == AF_INET)
+        mask_prefix(key->addr, 4, settings->client_prefix_v4);
+    else
+        mask_prefix(key->addr, 16, settings->client_prefix_v6);
+    return true;
+}
+
+static uint64_t key_hash(const struct client_key *key) {
+    uint64_t h = 14695981039346656037ull ^ key->family;
+    for (size_t i = 0; i < sizeof(key->addr); ++i) {
+        h ^= key->addr[i];
+        h *= 1099511628211ull;
+    }
+    return h ^ (h >> 31);
+}
+
+struct client_table *client_table_create(size_t size) {
+    size_t slots = CLIENT_TABLE_PROBES;
+    while (slots < size)
+        slots <<= 1;
+    struct client_table *table = page_alloc(sizeof(*table) + slots * sizeof(table->entries[0]), false);
+    table->mask = slots - 1;
+    table->reported = time(NULL);
+    return table;
+}
+
+// Finds the client's entry or takes over a free one or, failing that, the
+// least recently seen one without open connections. Returns NULL when every
+// candidate is busy, in which case the client goes untracked.
+static struct client_entry *find_entry(struct client_table *table, const struct client_key *key, time_t now) {
+    size_t home = key_hash(key) & table->mask;
+    struct client_entry *free_slot = NULL, *idle = NULL;
+    for (size_t i = 0; i < CLIENT_TABLE_PROBES; ++i) {
+        struct client_entry *entry = &table->entries[(home + i) & table->mask];
+        if (entry->key.family == key->family && memcmp(entry->key.addr, key->addr, sizeof(key->addr)) == 0)
+            return entry;
+        if (entry->key.family == 0) {
+            if (free_slot == NULL)
+                free_slot = entry;
+        } else if (entry->conns == 0 && (idle == NULL || entry->last_seen < idle->last_seen)) {
+            idle = entry;
+        }
+    }
+    struct client_entry *victim = free_slot ? free_slot : idle;
+    if (victim == NULL)
+        return NULL;
+    memset(victim, 0, sizeof(*victim));
+    victim->key = *key;
+    victim->refilled_ms = now_ms();
+    victim->tokens = UINT64_MAX; // filled to the burst on first refill
+    victim->last_seen = now;
+    return victim;
+}
+
+static bool take_token(struct client_entry *entry, const struct server_settings *settings) {
+    uint64_t burst = (uint64_t)(settings->client_burst ? settings->client_burst : settings->client_rate) * TOKEN_SCALE;
+    uint64_t now = now_ms();
+    uint64_t refill = (now - entry->refilled_ms) * (uint64_t)settings->client_rate * TOKEN_SCALE / 1000;
+    if (entry->tokens == UINT64_MAX || entry->tokens + refill >= burst)
+        entry->tokens = burst;
+    else
+        entry->tokens += refill;
+    // Leave the clock alone when nothing was refilled, so calls less than a
+    // millisecond apart do not round the refill away.
+    if (refill)
+        entry->refilled_ms = now;
+    if (entry->tokens < TOKEN_SCALE)
+        return false;
+    entry->tokens -= TOKEN_SCALE;
+    return true;
+}
+
+enum client_limit_result client_limit_accept(struct client_table *table, const struct server_settings *settings,
+                                             const struct sockaddr *addr, struct client_entry **client) {
+    *client = NULL;
+    struct client_key key;
+    if (!make_key(addr, settings, &key))
+        return CLIENT_LIMIT_OK;
+
+    time_t now = time(NULL);
+    struct client_entry *entry = find_entry(table, &key, now);
+    if (entry == NULL) {
+        ++table->stats.untracked;
+        return CLIENT_LIMIT_OK;
+    }
+    entry->last_seen = now;
+
+    if (settings->client_max_conns && entry->conns >= settings->client_max_conns) {
+        ++table->stats.conns_rejected;
+        entry->limited = true;
+        return CLIENT_LIMIT_CONNS;
+    }
+    if (settings->client_rate && !take_token(entry, settings)) {
+        ++table->stats.rate_limited;
+        entry->limited = true;
+        return CLIENT_LIMIT_RATE;
+    }
+    ++entry->conns;
+    *client = entry;
+    return CLIENT_LIMIT_OK;
+}
+
+// For requests after the first on a connection, which was paid for by
+// client_limit_accept.
+bool client_limit_request(struct client_table *table, const struct server_settings *settings,
+                          struct client_entry *client) {
+    if (settings->client_rate == 0 || take_token(client, settings))
+        return true;
+    ++table->stats.rate_limited;
+    client->limited = true;
+    return false;
+}
+
+void client_limit_release(struct client_entry *client) {
+    --client->conns;
+}
+
+// Logs how many requests and distinct clients were limited since the last
+// report. Nothing is logged for quiet intervals.
+void client_limit_report(struct client_table *table) {
+    time_t now = time(NULL);
+    if (now - table->reported < CLIENT_REPORT_INTERVAL)
+        return;
+    table->reported = now;
+
+    size_t clients = 0;
+    for (size_t i = 0; i <= table->mask; ++i) {
+        if (table->entries[i].limited) {
+            table->entries[i].limited = false;
+            ++clients;
+        }
+    }
+    struct client_limit_stats *stats = &table->stats;
+    if (clients == 0 && stats->untracked == table->reported_untracked)
+        return;
+    log_msg(LOG_INFO, "limited %zu clients in the last %ds, totals: %llu over connection cap, %llu over rate, "
+            "%llu untracked",
+            clients, CLIENT_REPORT_INTERVAL, (unsigned long long)stats->conns_rejected,
+            (unsigned long long)stats->rate_limited, (unsigned long long)stats->untracked);
+    table->reported_untracked = stats->untracked;
+}
@@ -0,0 +1,665 @@
+#include "server.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+enum option_type {
+    OPT_SIZE,
+    OPT_INT,
+    OPT_BOOL,
+    OPT_STRING,
+    OPT_LOG_LEVEL,
+    OPT_IO_BACKEND,
+    OPT_HUGE_PAGES,
+    OPT_LISTEN,
+    OPT_UPSTREAM,
+    OPT_PACE,
+    OPT_VHOST,
+};
+
+struct option {
+    const char *name;
+    enum option_type type;
+    size_t offset;
+    const char *help;
+};
+
+#define SETTING(field) offsetof(struct server_settings, field)
+
+static const struct option options[] = {
+    {"listen", OPT_LISTEN, 0, "listen address: host:port, [v6]:port or unix:/path, repeatable, with optional "
+                              "backlog=N v6only defer_accept=SECS fastopen=N tls"},
+    {"upstream", OPT_UPSTREAM, 0, "path prefix and backend host:port or unix:/path, repeatable"},
+    {"upstream_keepalive", OPT_SIZE, SETTING(upstream_keepalive),
+     "idle backend connections kept per upstream and worker"},
+    {"pace", OPT_PACE, 0, "path prefix and bytes per second its responses are sent at, 0 exempts it, repeatable"},
+    {"pace_rate", OPT_SIZE, SETTING(pace_rate), "bytes per second each connection is sent at, 0 disables"},
+    {"send_quantum", OPT_SIZE, SETTING(send_quantum),
+     "bytes a response sends before other connections get a turn, 0 sends until the socket is full"},
+    {"host", OPT_STRING, SETTING(host), "address of the default listener when no listen is given"},
+    {"port", OPT_INT, SETTING(port), "port of the default listener"},
+    {"listen_backlog", OPT_INT, SETTING(listen_backlog), "backlog of the default listener"},
+    {"static_dir", OPT_STRING, SETTING(static_dir), "directory files are served from"},
+    {"vhost", OPT_VHOST, 0, "host name, or *.domain, and its root, repeatable, with optional path_cache=N pace=RATE "
+                            "autoindex=on|off types=ext:type,..."},
+    {"capture", OPT_STRING, SETTING(capture),
+     "append request heads as received, cookies and all, with their arrival times to this file for replay"},
+    {"capture_max_size", OPT_SIZE, SETTING(capture_max_size), "size the capture file stops at, 0 is unlimited"},
+    {"asset_pack", OPT_STRING, SETTING(asset_pack), "pack built by asset_pack to serve instead of static_dir"},
+    {"process_count", OPT_SIZE, SETTING(process_count), "number of worker processes"},
+    {"io_backend", OPT_IO_BACKEND, SETTING(io_backend), "auto, select or io_uring"},
+    {"uring_buffers", OPT_SIZE, SETTING(uring_buffers),
+     "transfer buffers each worker registers with io_uring, 0 reads into pooled buffers"},
+    {"uri_length_limit", OPT_SIZE, SETTING(uri_length_limit), "longest accepted request uri"},
+    {"read_buf_size", OPT_SIZE, SETTING(read_buf_size), "file transfer buffer size"},
+    {"req_buf_size", OPT_SIZE, SETTING(req_buf_size), "initial request buffer, doubled as the head grows"},
+    {"req_size_limit", OPT_SIZE, SETTING(req_size_limit), "largest accepted request head"},
+    {"buffer_pool_size", OPT_SIZE, SETTING(buffer_pool_size), "idle request and transfer buffers kept per worker"},
+    {"io_threads", OPT_SIZE, SETTING(io_threads), "filesystem threads per worker, 0 makes file calls inline"},
+    {"arena_block_size", OPT_SIZE, SETTING(arena_block_size), "minimum per-connection arena block"},
+    {"arena_pool_blocks", OPT_SIZE, SETTING(arena_pool_blocks),
+     "arena blocks each worker preallocates in one region, 0 allocates them one by one"},
+    {"huge_pages", OPT_HUGE_PAGES, SETTING(huge_pages),
+     "back the arena pool and large cache tables with hugepages: off, thp or on for reserved ones"},
+    {"cpu_affinity", OPT_BOOL, SETTING(cpu_affinity),
+     "pin worker i to the i-th allowed cpu and steer connections received on a cpu to its worker"},
+    {"numa_local", OPT_BOOL, SETTING(numa_local), "keep each worker's pool and cache tables on its NUMA node"},
+    {"header_cache_size", OPT_SIZE, SETTING(header_cache_size), "response header cache entries per worker"},
+    {"mmap_max_file_size", OPT_SIZE, SETTING(mmap_max_file_size), "largest file served from a mapping, 0 disables"},
+    {"mmap_cache_size", OPT_SIZE, SETTING(mmap_cache_size), "total bytes mapped per worker"},
+    {"coalesce_min_size", OPT_SIZE, SETTING(coalesce_min_size),
+     "smallest uncached file read in by one worker while the others wait, 0 disables"},
+    {"coalesce_max_size", OPT_SIZE, SETTING(coalesce_max_size), "largest file read in ahead of sending"},
+    {"conn_timeout", OPT_INT, SETTING(conn_timeout), "seconds without progress before dropping a connection"},
+    {"autoindex", OPT_BOOL, SETTING(autoindex), "list directories without an index.html as html or json"},
+    {"dir_index_cache_size", OPT_SIZE, SETTING(dir_index_cache_size), "directory listings cached per worker"},
+    {"dir_index_max_age", OPT_INT, SETTING(dir_index_max_age),
+     "seconds before listed entries are stat'ed again, 0 only rescans changed directories"},
+    {"watch_static_dir", OPT_BOOL, SETTING(watch_static_dir),
+     "watch static_dir and the vhost roots with inotify and skip stat checks for cached paths"},
+    {"path_cache_size", OPT_SIZE, SETTING(path_cache_size), "resolved request paths cached per worker"},
+    {"client_max_conns", OPT_SIZE, SETTING(client_max_conns), "open connections per client and worker, 0 disables"},
+    {"client_rate", OPT_INT, SETTING(client_rate), "requests per second per client and worker, 0 disables"},
+    {"client_burst", OPT_INT, SETTING(client_burst), "requests a client may make at once, 0 means client_rate"},
+    {"client_prefix_v4", OPT_INT, SETTING(client_prefix_v4), "IPv4 prefix length clients are grouped by"},
+    {"client_prefix_v6", OPT_INT, SETTING(client_prefix_v6), "IPv6 prefix length clients are grouped by"},
+    {"client_table_size", OPT_SIZE, SETTING(client_table_size), "clients tracked per worker"},
+    {"shed_max_lag_ms", OPT_INT, SETTING(shed_max_lag_ms),
+     "event loop lag in ms past which a worker answers new connections with 503, 0 disables"},
+    {"shed_max_conns", OPT_SIZE, SETTING(shed_max_conns),
+     "open connections per worker past which new ones are answered with 503, 0 disables"},
+    {"shed_max_pending", OPT_SIZE, SETTING(shed_max_pending),
+     "response bytes a worker holds for sending past which new connections are answered with 503, 0 disables"},
+    {"shed_retry_after", OPT_INT, SETTING(shed_retry_after), "Retry-After seconds of the 503 sent when shedding"},
+    {"tls_cert", OPT_STRING, SETTING(tls_cert), "PEM certificate chain for tls listeners"},
+    {"tls_key", OPT_STRING, SETTING(tls_key), "PEM private key for tls listeners"},
+    {"tls_session_tickets", OPT_BOOL, SETTING(tls_session_tickets), "issue session tickets for resumption"},
+    {"tls_ktls", OPT_BOOL, SETTING(tls_ktls), "hand encryption to the kernel after the handshake when supported"},
+    {"http2", OPT_BOOL, SETTING(http2), "speak HTTP/2 by prior knowledge, h2c upgrade and ALPN on tls listeners"},
+    {"h2_max_streams", OPT_SIZE, SETTING(h2_max_streams), "concurrent streams per HTTP/2 connection"},
+    {"log_level", OPT_LOG_LEVEL, SETTING(log_level), "trace, info, warn, error or fatal"},
+    {"log_file", OPT_STRING, SETTING(log_filename), "append log lines to this file instead of stderr"},
+    {"log_to_stdout", OPT_BOOL, SETTING(log_to_stdout), "log to stdout instead of stderr"},
+};
+
+void default_settings(struct server_settings *settings) {
+    memset(settings, 0, sizeof(*settings));
+    settings->uri_length_limit = 4096;
+    settings->host = "127.0.0.1";
+    settings->port = 8000;
+    settings->process_count = 8;
+    settings->listen_backlog = 100;
+    settings->read_buf_size = 1 << 15;
+    settings->req_buf_size = 1 << 10;
+    settings->req_size_limit = 1 << 13;
+    settings->buffer_pool_size = 64;
+    settings->io_threads = 4;
+    settings->static_dir = ".";
+    settings->log_level = LOG_INFO;
+    settings->io_backend = IO_BACKEND_AUTO;
+    settings->uring_buffers = 64;
+    settings->arena_block_size = 1 << 16;
+    settings->header_cache_size = 1024;
+    settings->coalesce_min_size = 1 << 20;
+    settings->coalesce_max_size = 1 << 28;
+    settings->conn_timeout = 60;
+    settings->dir_index_cache_size = 64;
+    settings->dir_index_max_age = 30;
+    settings->watch_static_dir = true;
+    settings->path_cache_size = 1024;
+    settings->client_prefix_v4 = 32;
+    settings->client_prefix_v6 = 64;
+    settings->client_table_size = 4096;
+    settings->shed_retry_after = 2;
+    settings->tls_session_tickets = true;
+    settings->tls_ktls = true;
+    settings->http2 = true;
+    settings->h2_max_streams = 100;
+    settings->upstream_keepalive = 8;
+    settings->send_quantum = 1 << 18;
+    settings->capture_max_size = (size_t)1 << 30;
+}
+
+static char *owned_strdup(struct server_settings *settings, const char *str) {
+    char *copy = server_strdup(str);
+    settings->owned = lappend(settings->owned, copy);
+    return copy;
+}
+
+static bool parse_size(const char *value, size_t *out) {
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(value, &end, 10);
+    if (errno || end == value || *value == '-')
+        return false;
+    unsigned shift = 0;
+    switch (*end) {
+    case 'k':
+    case 'K': shift = 10; ++end; break;
+    case 'm':
+    case 'M': shift = 20; ++end; break;
+    case 'g':
+    case 'G': shift = 30; ++end; break;
+    }
+    if (*end != '\0' || n > (SIZE_MAX >> shift))
+        return false;
+    *out = (size_t)(n << shift);
+    return true;
+}
+
+static bool parse_int(const char *value, int *out) {
+    char *end;
+    errno = 0;
+    long n = strtol(value, &end, 10);
+    if (errno || end == value || *end != '\0' || n < INT_MIN || n > INT_MAX)
+        return false;
+    *out = (int)n;
+    return true;
+}
+
+static bool parse_bool(const char *value, bool *out) {
+    if (strcasecmp(value, "yes") == 0 || strcasecmp(value, "true") == 0 || strcasecmp(value, "on") == 0 ||
+        strcmp(value, "1") == 0) {
+        *out = true;
+        return true;
+    }
+    if (strcasecmp(value, "no") == 0 || strcasecmp(value, "false") == 0 || strcasecmp(value, "off") == 0 ||
+        strcmp(value, "0") == 0) {
+        *out = false;
+        return true;
+    }
+    return false;
+}
+
+static bool parse_log_level(const char *value, enum log_level *out) {
+    static const char *names[] = {"trace", "info", "warn", "error", "fatal"};
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+        if (strcasecmp(value, names[i]) == 0) {
+            *out = (enum log_level)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool parse_io_backend(const char *value, enum io_backend *out) {
+    if (strcasecmp(value, "auto") == 0)
+        *out = IO_BACKEND_AUTO;
+    else if (strcasecmp(value, "select") == 0)
+        *out = IO_BACKEND_SELECT;
+    else if (strcasecmp(value, "io_uring") == 0 || strcasecmp(value, "uring") == 0)
+        *out = IO_BACKEND_URING;
+    else
+        return false;
+    return true;
+}
+
+static bool parse_huge_pages(const char *value, enum huge_pages *out) {
+    if (strcasecmp(value, "off") == 0)
+        *out = HUGE_PAGES_OFF;
+    else if (strcasecmp(value, "thp") == 0 || strcasecmp(value, "transparent") == 0)
+        *out = HUGE_PAGES_THP;
+    else if (strcasecmp(value, "on") == 0)
+        *out = HUGE_PAGES_ON;
+    else
+        return false;
+    return true;
+}
+
+static bool parse_listen_address(struct server_settings *settings, char *addr, struct listen_settings *listener) {
+    if (strncmp(addr, "unix:", 5) == 0) {
+        listener->unix_path = owned_strdup(settings, addr + 5);
+        return listener->unix_path[0] != '\0';
+    }
+
+    char *port = strrchr(addr, ':');
+    if (port == NULL)
+        return false;
+    *port++ = '\0';
+    if (!parse_int(port, &listener->port))
+        return false;
+
+    size_t len = strlen(addr);
+    if (len >= 2 && addr[0] == '[' && addr[len - 1] == ']') {
+        addr[len - 1] = '\0';
+        ++addr;
+    }
+    listener->host = owned_strdup(settings, addr);
+    return true;
+}
+
+// Growable arrays filled while options are applied.
+struct option_capacity {
+    size_t listeners;
+    size_t upstreams;
+    size_t paces;
+    size_t vhosts;
+};
+
+// value is "address [backlog=N] [v6only] [defer_accept=N] [fastopen=N] [tls]"
+static bool parse_listen(struct server_settings *settings, const char *value, size_t *capacity) {
+    char buf[1024];
+    if (strlen(value) >= sizeof(buf))
+        return false;
+    strcpy(buf, value);
+
+    struct listen_settings listener = {0};
+    listener.backlog = 511;
+
+    char *saveptr;
+    char *tok = strtok_r(buf, " \t", &saveptr);
+    if (tok == NULL || !parse_listen_address(settings, tok, &listener))
+        return false;
+    while ((tok = strtok_r(NULL, " \t", &saveptr)) != NULL) {
+        char *eq = strchr(tok, '=');
+        if (eq)
+            *eq++ = '\0';
+        if (strcmp(tok, "v6only") == 0 && eq == NULL) {
+            listener.v6only = true;
+        } else if (strcmp(tok, "tls") == 0 && eq == NULL) {
+            listener.tls = true;
+        } else if (strcmp(tok, "backlog") == 0 && eq) {
+            if (!parse_int(eq, &listener.backlog))
+                return false;
+        } else if (strcmp(tok, "defer_accept") == 0 && eq) {
+            if (!parse_int(eq, &listener.defer_accept))
+                return false;
+        } else if (strcmp(tok, "fastopen") == 0 && eq) {
+            if (!parse_int(eq, &listener.fastopen))
+                return false;
+        } else {
+            return false;
+        }
+    }
+
+    if (settings->listener_count == *capacity) {
+        size_t new_capacity = *capacity ? *capacity * 2 : 4;
+        settings->listeners = server_realloc((void *)settings->listeners, *capacity * sizeof(listener),
+                                             new_capacity * sizeof(listener));
+        *capacity = new_capacity;
+    }
+    ((struct listen_settings *)settings->listeners)[settings->listener_count++] = listener;
+    return true;
+}
+
+// value is "prefix address", the address takes the listen forms
+static bool parse_upstream(struct server_settings *settings, const char *value, size_t *capacity) {
+    char buf[1024];
+    if (strlen(value) >= sizeof(buf))
+        return false;
+    strcpy(buf, value);
+
+    char *saveptr;
+    char *prefix = strtok_r(buf, " \t", &saveptr);
+    char *addr = strtok_r(NULL, " \t", &saveptr);
+    if (prefix == NULL || prefix[0] != '/' || addr == NULL || strtok_r(NULL, " \t", &saveptr) != NULL)
+        return false;
+    struct listen_settings address = {0};
+    if (!parse_listen_address(settings, addr, &address))
+        return false;
+
+    struct upstream_settings upstream = {
+        .prefix = owned_strdup(settings, prefix),
+        .host = address.host,
+        .port = address.port,
+        .unix_path = address.unix_path,
+    };
+    if (settings->upstream_count == *capacity) {
+        size_t new_capacity = *capacity ? *capacity * 2 : 4;
+        settings->upstreams = server_realloc((void *)settings->upstreams, *capacity * sizeof(upstream),
+                                             new_capacity * sizeof(upstream));
+        *capacity = new_capacity;
+    }
+    ((struct upstream_settings *)settings->upstreams)[settings->upstream_count++] = upstream;
+    return true;
+}
+
+// value is "prefix rate", the rate in bytes per second with the size suffixes
+static bool parse_pace(struct server_settings *settings, const char *value, size_t *capacity) {
+    char buf[1024];
+    if (strlen(value) >= sizeof(buf))
+        return false;
+    strcpy(buf, value);
+
+    char *saveptr;
+    char *prefix = strtok_r(buf, " \t", &saveptr);
+    char *rate = strtok_r(NULL, " \t", &saveptr);
+    if (prefix == NULL || prefix[0] != '/' || rate == NULL || strtok_r(NULL, " \t", &saveptr) != NULL)
+        return false;
+    struct pace_settings pace = {.prefix = NULL};
+    if (!parse_size(rate, &pace.rate))
+        return false;
+    pace.prefix = owned_strdup(settings, prefix);
+
+    if (settings->pace_count == *capacity) {
+        size_t new_capacity = *capacity ? *capacity * 2 : 4;
+        settings->paces =
+            server_realloc((void *)settings->paces, *capacity * sizeof(pace), new_capacity * sizeof(pace));
+        *capacity = new_capacity;
+    }
+    ((struct pace_settings *)settings->paces)[settings->pace_count++] = pace;
+    return true;
+}
+
+static bool parse_types(struct server_settings *settings, char *list, struct vhost_settings *vhost) {
+    size_t capacity = 0;
+    char *saveptr;
+    for (char *item = strtok_r(list, ",", &saveptr); item; item = strtok_r(NULL, ",", &saveptr)) {
+        char *type = strchr(item, ':');
+        if (type == NULL || type == item)
+            return false;
+        *type++ = '\0';
+        // Known types may carry a charset, which need not be repeated.
+        struct mime_override override = {.ct = HTTP_CT_COUNT};
+        for (int ct = 0; ct < HTTP_CT_COUNT; ++ct) {
+            const char *known = http_content_type_str((enum http_content_type)ct);
+            size_t known_len = strcspn(known, ";");
+            if (strcasecmp(known, type) == 0 ||
+                (strlen(type) == known_len && strncasecmp(known, type, known_len) == 0)) {
+                override.ct = (enum http_content_type)ct;
+                break;
+            }
+        }
+        if (override.ct == HTTP_CT_COUNT) {
+            log_msg(LOG_ERROR, "unknown content type %s, it has to be in mime.types", type);
+            return false;
+        }
+        for (char *c = item; *c; ++c)
+            *c = (char)tolower((unsigned char)*c);
+        override.ext = owned_strdup(settings, item);
+
+        if (vhost->type_count == capacity) {
+            size_t new_capacity = capacity ? capacity * 2 : 4;
+            vhost->types = server_realloc((void *)vhost->types, capacity * sizeof(override),
+                                          new_capacity * sizeof(override));
+            capacity = new_capacity;
+        }
+        ((struct mime_override *)vhost->types)[vhost->type_count++] = override;
+    }
+    if (vhost->types)
+        settings->owned = lappend(settings->owned, (void *)vhost->types);
+    return true;
+}
+
+// value is "name root [path_cache=N] [pace=RATE] [autoindex=on|off]
+// [types=ext:type,...]"
+static bool parse_vhost(struct server_settings *settings, const char *value, size_t *capacity) {
+    char buf[4096];
+    if (strlen(value) >= sizeof(buf))
+        return false;
+    strcpy(buf, value);
+
+    char *saveptr;
+    char *name = strtok_r(buf, " \t", &saveptr);
+    char *root = strtok_r(NULL, " \t", &saveptr);
+    if (name == NULL || root == NULL)
+        return false;
+    size_t name_len = strlen(name);
+    if (name_len && name[name_len - 1] == '.')
+        name[--name_len] = '\0';
+    if (name_len == 0 || strchr(name, ':') || strchr(name + 1, '*') || (name[0] == '*' && name[1] != '.'))
+        return false;
+    for (char *c = name; *c; ++c)
+        *c = (char)tolower((unsigned char)*c);
+
+    struct vhost_settings vhost = {.autoindex = -1};
+    char *tok;
+    while ((tok = strtok_r(NULL, " \t", &saveptr)) != NULL) {
+        char *eq = strchr(tok, '=');
+        if (eq == NULL)
+            return false;
+        *eq++ = '\0';
+        bool autoindex;
+        if (strcmp(tok, "path_cache") == 0) {
+            if (!parse_size(eq, &vhost.path_cache_size))
+                return false;
+        } else if (strcmp(tok, "pace") == 0) {
+            if (!parse_size(eq, &vhost.pace_rate))
+                return false;
+            vhost.pace_set = true;
+        } else if (strcmp(tok, "autoindex") == 0) {
+            if (!parse_bool(eq, &autoindex))
+                return false;
+            vhost.autoindex = autoindex;
+        } else if (strcmp(tok, "types") == 0) {
+            if (vhost.types || !parse_types(settings, eq, &vhost))
+                return false;
+        } else {
+            return false;
+        }
+    }
+    vhost.name = owned_strdup(settings, name);
+    vhost.root = owned_strdup(settings, root);
+
+    if (settings->vhost_count == *capacity) {
+        size_t new_capacity = *capacity ? *capacity * 2 : 4;
+        settings->vhosts =
+            server_realloc((void *)settings->vhosts, *capacity * sizeof(vhost), new_capacity * sizeof(vhost));
+        *capacity = new_capacity;
+    }
+    ((struct vhost_settings *)settings->vhosts)[settings->vhost_count++] = vhost;
+    return true;
+}
+
+static bool apply_option(struct server_settings *settings, const char *name, const char *value,
+                         struct option_capacity *capacity) {
+    const struct option *opt = NULL;
+    for (size_t i = 0; i < sizeof(options) / sizeof(options[0]); ++i) {
+        if (strcmp(options[i].name, name) == 0) {
+            opt = &options[i];
+            break;
+        }
+    }
+    if (opt == NULL) {
+        log_msg(LOG_FATAL, "unknown option %s", name);
+        return false;
+    }
+
+    void *field = (char *)settings + opt->offset;
+    bool ok = false;
+    switch (opt->type) {
+    case OPT_SIZE: ok = parse_size(value, field); break;
+    case OPT_INT: ok = parse_int(value, field); break;
+    case OPT_BOOL: ok = parse_bool(value, field); break;
+    case OPT_LOG_LEVEL: ok = parse_log_level(value, field); break;
+    case OPT_IO_BACKEND: ok = parse_io_backend(value, field); break;
+    case OPT_HUGE_PAGES: ok = parse_huge_pages(value, field); break;
+    case OPT_LISTEN: ok = parse_listen(settings, value, &capacity->listeners); break;
+    case OPT_UPSTREAM: ok = parse_upstream(settings, value, &capacity->upstreams); break;
+    case OPT_PACE: ok = parse_pace(settings, value, &capacity->paces); break;
+    case OPT_VHOST: ok = parse_vhost(settings, value, &capacity->vhosts); break;
+    case OPT_STRING:
+        *(const char **)field = owned_strdup(settings, value);
+        ok = true;
+        break;
+    }
+    if (!ok)
+        log_msg(LOG_FATAL, "invalid value for %s: %s", name, value);
+    return ok;
+}
+
+static char *trim(char *str) {
+    while (*str == ' ' || *str == '\t')
+        ++str;
+    size_t len = strlen(str);
+    while (len && (str[len - 1] == ' ' || str[len - 1] == '\t' || str[len - 1] == '\n' || str[len - 1] == '\r'))
+        str[--len] = '\0';
+    return str;
+}
+
+// Format is one "name = value" per line, '#' starts a comment.
+static bool load_config_file(struct server_settings *settings, const char *filename,
+                             struct option_capacity *capacity) {
+    FILE *f = fopen(filename, "r");
+    if (f == NULL) {
+        log_perror(LOG_FATAL, "failed to open config file %s", filename);
+        return false;
+    }
+
+    char line[1024];
+    int lineno = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), f)) {
+        ++lineno;
+        char *hash = strchr(line, '#');
+        if (hash)
+            *hash = '\0';
+        char *name = trim(line);
+        if (*name == '\0')
+            continue;
+
+        char *eq = strchr(name, '=');
+        if (eq == NULL) {
+            log_msg(LOG_FATAL, "%s:%d: expected name = value", filename, lineno);
+            ok = false;
+            break;
+        }
+        *eq = '\0';
+        name = trim(name);
+        char *value = trim(eq + 1);
+        if (!apply_option(settings, name, value, capacity)) {
+            log_msg(LOG_FATAL, "%s:%d: invalid config line", filename, lineno);
+            ok = false;
+        }
+    }
+    fclose(f);
+    return ok;
+}
+
+static void print_usage(const char *prog) {
+    printf("usage: %s [-c config] [--name=value ...]\n\n", prog);
+    printf("Options can be given in the config file as \"name = value\" lines and are\n"
+           "overridden by --name=value arguments. The config is reloaded on SIGHUP.\n\n");
+    for (size_t i = 0; i < sizeof(options) / sizeof(options[0]); ++i)
+        printf("  --%-20s %s\n", options[i].name, options[i].help);
+}
+
+static const char *config_path(int argc, char **argv) {
+    const char *path = NULL;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+            path = argv[++i];
+        else if (strncmp(argv[i], "--config=", 9) == 0)
+            path = argv[i] + 9;
+    }
+    return path;
+}
+
+enum load_settings_result load_settings(int argc, char **argv, struct server_settings *settings) {
+    default_settings(settings);
+    settings->argc = argc;
+    settings->argv = argv;
+    struct option_capacity capacity = {0};
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            print_usage(argv[0]);
+            return LOAD_SETTINGS_HELP;
+        }
+    }
+
+    const char *path = config_path(argc, argv);
+    bool ok = path == NULL || load_config_file(settings, path, &capacity);
+
+    for (int i = 1; ok && i < argc; ++i) {
+        if (strcmp(argv[i], "-c") == 0) {
+            ++i;
+            continue;
+        }
+        if (strncmp(argv[i], "--config=", 9) == 0)
+            continue;
+        if (strncmp(argv[i], "--", 2) != 0 || strchr(argv[i], '=') == NULL) {
+            log_msg(LOG_FATAL, "unexpected argument %s, see --help", argv[i]);
+            ok = false;
+            break;
+        }
+        char name[64];
+        const char *eq = strchr(argv[i], '=');
+        size_t name_len = eq - argv[i] - 2;
+        if (name_len >= sizeof(name)) {
+            log_msg(LOG_FATAL, "unknown option %s", argv[i]);
+            ok = false;
+            break;
+        }
+        memcpy(name, argv[i] + 2, name_len);
+        name[name_len] = '\0';
+        ok = apply_option(settings, name, eq + 1, &capacity);
+    }
+
+    if (settings->listeners)
+        settings->owned = lappend(settings->owned, (void *)settings->listeners);
+    if (settings->upstreams)
+        settings->owned = lappend(settings->owned, (void *)settings->upstreams);
+    if (settings->paces)
+        settings->owned = lappend(settings->owned, (void *)settings->paces);
+    if (settings->vhosts)
+        settings->owned = lappend(settings->owned, (void *)settings->vhosts);
+    if (!ok) {
+        free_settings(settings);
+        return LOAD_SETTINGS_ERROR;
+    }
+
+    // Files are looked up beneath the canonical root, so store it that way.
+    char *root = realpath(settings->static_dir, NULL);
+    if (root == NULL) {
+        log_perror(LOG_FATAL, "invalid static_dir %s", settings->static_dir);
+        free_settings(settings);
+        return LOAD_SETTINGS_ERROR;
+    }
+    settings->static_dir = owned_strdup(settings, root);
+    free(root);
+    for (size_t i = 0; i < settings->vhost_count; ++i) {
+        struct vhost_settings *vhost = (struct vhost_settings *)&settings->vhosts[i];
+        root = realpath(vhost->root, NULL);
+        if (root == NULL) {
+            log_perror(LOG_FATAL, "invalid root %s for vhost %s", vhost->root, vhost->name);
+            free_settings(settings);
+            return LOAD_SETTINGS_ERROR;
+        }
+        vhost->root = owned_strdup(settings, root);
+        free(root);
+    }
+    return LOAD_SETTINGS_OK;
+}
+
+void free_settings(struct server_settings *settings) {
+    foreach (lc, settings->owned) {
+        server_free(lfirst(lc));
+    }
+    list_free(settings->owned);
+    settings->owned = NIL;
+    settings->listeners = NULL;
+    settings->listener_count = 0;
+    settings->upstreams = NULL;
+    settings->upstream_count = 0;
+    settings->paces = NULL;
+    settings->pace_count = 0;
+    settings->vhosts = NULL;
+    settings->vhost_count = 0;
+}
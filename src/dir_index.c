@@ -0,0 +1,463 @@
+#include "server.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DIR_INDEX_PROBES 4
+
+struct dir_entry {
+    char *name;
+    ino_t ino;
+    bool is_dir;
+    size_t size;
+    time_t mtime;
+    uint64_t gen; // file generation read before the stat, when watched
+};
+
+// Scanned contents of one directory. Entries are sorted by name and keep the
+// stat results, so a rescan after the directory changed only has to stat the
+// names that are new.
+struct dir_index {
+    char *path;
+    uint64_t hash;
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    time_t restated; // when every entry was last stat'ed, 0 forces a full rescan
+    uint64_t gen;
+    struct dir_entry *entries;
+    size_t entry_count;
+
+    char *uri; // request path the rendered listings link from
+    struct dir_listing *rendered[DIR_LISTING_FORMAT_COUNT];
+};
+
+struct dir_index_cache {
+    size_t mask;
+    struct dir_index indexes[];
+};
+
+struct str_buf {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+static void *xrealloc(void *memory, size_t size) {
+    void *result = realloc(memory, size);
+    if (result == NULL) {
+        log_msg(LOG_FATAL, "OOM");
+        exit(EXIT_FAILURE);
+    }
+    return result;
+}
+
+static char *xstrdup(const char *str) {
+    size_t len = strlen(str);
+    char *copy = xrealloc(NULL, len + 1);
+    memcpy(copy, str, len + 1);
+    return copy;
+}
+
+static void buf_append(struct str_buf *buf, const char *data, size_t len) {
+    if (buf->len + len > buf->cap) {
+        size_t cap = buf->cap ? buf->cap : 4096;
+        while (cap < buf->len + len)
+            cap *= 2;
+        buf->data = xrealloc(buf->data, cap);
+        buf->cap = cap;
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+static void buf_puts(struct str_buf *buf, const char *str) {
+    buf_append(buf, str, strlen(str));
+}
+
+__attribute__((format(printf, 2, 3))) static void buf_printf(struct str_buf *buf, const char *fmt, ...) {
+    char tmp[256];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(tmp, sizeof(tmp), fmt, args);
+    va_end(args);
+    if (len > 0)
+        buf_append(buf, tmp, (size_t)len < sizeof(tmp) ? (size_t)len : sizeof(tmp) - 1);
+}
+
+static void buf_html_escape(struct str_buf *buf, const char *str) {
+    for (; *str; ++str) {
+        switch (*str) {
+        case '&': buf_puts(buf, "&amp;"); break;
+        case '<': buf_puts(buf, "&lt;"); break;
+        case '>': buf_puts(buf, "&gt;"); break;
+        case '"': buf_puts(buf, "&quot;"); break;
+        case '\'': buf_puts(buf, "&#39;"); break;
+        default: buf_append(buf, str, 1); break;
+        }
+    }
+}
+
+// Percent-encodes everything but unreserved characters, so the result is also
+// safe inside an HTML attribute.
+static void buf_uri_escape(struct str_buf *buf, const char *str) {
+    static const char hex[] = "0123456789ABCDEF";
+    for (; *str; ++str) {
+        unsigned char c = (unsigned char)*str;
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '.' ||
+            c == '_' || c == '~') {
+            buf_append(buf, str, 1);
+        } else {
+            char enc[3] = {'%', hex[c >> 4], hex[c & 15]};
+            buf_append(buf, enc, 3);
+        }
+    }
+}
+
+static void buf_json_escape(struct str_buf *buf, const char *str) {
+    for (; *str; ++str) {
+        unsigned char c = (unsigned char)*str;
+        if (c == '"' || c == '\\') {
+            char esc[2] = {'\\', (char)c};
+            buf_append(buf, esc, 2);
+        } else if (c < 0x20) {
+            buf_printf(buf, "\\u%04x", c);
+        } else {
+            buf_append(buf, str, 1);
+        }
+    }
+}
+
+static uint64_t path_hash(const char *path) {
+    uint64_t h = 14695981039346656037ull;
+    for (; *path; ++path) {
+        h ^= (unsigned char)*path;
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+static void free_entries(struct dir_entry *entries, size_t count) {
+    for (size_t i = 0; i < count; ++i)
+        free(entries[i].name);
+    free(entries);
+}
+
+static void free_listing(struct dir_listing *listing) {
+    free((char *)listing->head.data);
+    free((char *)listing->h2_head.data);
+    free(listing->body);
+    free(listing);
+}
+
+static void drop_rendered(struct dir_index *index) {
+    for (size_t i = 0; i < DIR_LISTING_FORMAT_COUNT; ++i) {
+        struct dir_listing *listing = index->rendered[i];
+        if (listing == NULL)
+            continue;
+        index->rendered[i] = NULL;
+        if (listing->refs == 0)
+            free_listing(listing);
+        else
+            listing->detached = true;
+    }
+}
+
+static void free_index(struct dir_index *index) {
+    drop_rendered(index);
+    free_entries(index->entries, index->entry_count);
+    free(index->path);
+    free(index->uri);
+    memset(index, 0, sizeof(*index));
+}
+
+static int compare_entries(const void *a, const void *b) {
+    return strcmp(((const struct dir_entry *)a)->name, ((const struct dir_entry *)b)->name);
+}
+
+static const struct dir_entry *find_entry(const struct dir_index *index, const char *name) {
+    struct dir_entry key = {0};
+    key.name = (char *)name;
+    return bsearch(&key, index->entries, index->entry_count, sizeof(key), compare_entries);
+}
+
+// Reads the directory again, opened beneath root. Unless restat_all is set,
+// names that are still present with the same inode keep their previous stat
+// results. With gens, entries whose generation moved are stat'ed again as
+// well.
+static bool scan_dir(struct dir_index *index, const struct static_root *root, bool restat_all,
+                     const struct fs_generations *gens) {
+    int fd = static_root_reopen(root, index->path);
+    DIR *dir = fd == -1 ? NULL : fdopendir(fd);
+    if (dir == NULL) {
+        log_perror(LOG_WARN, "failed to open directory %s", index->path);
+        if (fd != -1)
+            close(fd);
+        return false;
+    }
+    int dir_fd = dirfd(dir);
+
+    struct dir_entry *entries = NULL;
+    size_t count = 0, cap = 0;
+    size_t restated = 0;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        if (count == cap) {
+            cap = cap ? cap * 2 : 64;
+            entries = xrealloc(entries, cap * sizeof(*entries));
+        }
+        struct dir_entry *entry = &entries[count];
+
+        uint64_t gen = 0;
+        if (gens) {
+            char path[4096];
+            int len = snprintf(path, sizeof(path), "%s/%s", index->path, de->d_name);
+            if (len > 0 && (size_t)len < sizeof(path))
+                gen = fs_generation(gens, path, len);
+        }
+
+        const struct dir_entry *old = restat_all ? NULL : find_entry(index, de->d_name);
+        if (old && old->ino == de->d_ino && old->gen == gen) {
+            *entry = *old;
+            entry->name = xstrdup(old->name);
+            ++count;
+            continue;
+        }
+
+        // Symlinks are followed, dangling ones and entries removed since
+        // readdir are left out.
+        struct stat st;
+        if (fstatat(dir_fd, de->d_name, &st, 0) == -1)
+            continue;
+        entry->name = xstrdup(de->d_name);
+        entry->ino = de->d_ino;
+        entry->is_dir = S_ISDIR(st.st_mode);
+        entry->size = st.st_size;
+        entry->mtime = st.st_mtime;
+        entry->gen = gen;
+        ++count;
+        ++restated;
+    }
+    closedir(dir);
+
+    qsort(entries, count, sizeof(*entries), compare_entries);
+    free_entries(index->entries, index->entry_count);
+    index->entries = entries;
+    index->entry_count = count;
+    drop_rendered(index);
+    log_msg(LOG_TRACE, "scanned %s: %zu entries, %zu stat'ed", index->path, count, restated);
+    return true;
+}
+
+static void render_html(struct str_buf *body, const struct dir_index *index) {
+    buf_puts(body, "<!DOCTYPE html>\n<html>\n<head>\n<meta charset=\"utf-8\">\n<title>Index of ");
+    buf_html_escape(body, index->uri);
+    buf_puts(body, "</title>\n</head>\n<body>\n<h1>Index of ");
+    buf_html_escape(body, index->uri);
+    buf_puts(body, "</h1>\n<table>\n<tr><th>Name</th><th>Size</th><th>Last modified</th></tr>\n");
+    if (strcmp(index->uri, "/") != 0)
+        buf_puts(body, "<tr><td><a href=\"../\">../</a></td><td></td><td></td></tr>\n");
+
+    for (size_t i = 0; i < index->entry_count; ++i) {
+        const struct dir_entry *entry = &index->entries[i];
+        const char *slash = entry->is_dir ? "/" : "";
+        buf_puts(body, "<tr><td><a href=\"");
+        buf_uri_escape(body, entry->name);
+        buf_printf(body, "%s\">", slash);
+        buf_html_escape(body, entry->name);
+        buf_printf(body, "%s</a></td><td>", slash);
+        if (entry->is_dir)
+            buf_puts(body, "-");
+        else
+            buf_printf(body, "%zu", entry->size);
+
+        char date[64];
+        struct tm *tm = gmtime(&entry->mtime);
+        strftime(date, sizeof(date), "%Y-%m-%d %H:%M", tm);
+        buf_printf(body, "</td><td>%s</td></tr>\n", date);
+    }
+    buf_puts(body, "</table>\n</body>\n</html>\n");
+}
+
+static void render_json(struct str_buf *body, const struct dir_index *index) {
+    buf_puts(body, "{\"path\":\"");
+    buf_json_escape(body, index->uri);
+    buf_puts(body, "\",\"entries\":[");
+    for (size_t i = 0; i < index->entry_count; ++i) {
+        const struct dir_entry *entry = &index->entries[i];
+        buf_puts(body, i ? ",{\"name\":\"" : "{\"name\":\"");
+        buf_json_escape(body, entry->name);
+        buf_printf(body, "\",\"type\":\"%s\",\"size\":%zu,\"mtime\":%lld}", entry->is_dir ? "dir" : "file",
+                   entry->is_dir ? (size_t)0 : entry->size, (long long)entry->mtime);
+    }
+    buf_puts(body, "]}\n");
+}
+
+// Same layout as the header cache blocks: the Date value goes in at
+// date_offset when sending.
+static bool build_head(struct dir_listing *listing, enum http_content_type ct, time_t mtime) {
+    char last_modified[64];
+    http_format_date(last_modified, sizeof(last_modified), mtime);
+
+    size_t ct_len;
+    const char *ct_line = http_content_type_line(ct, &ct_len);
+
+    static const char prefix[] = "HTTP/1.1 200 OK\r\nDate: ";
+    char buffer[1024];
+    int len = snprintf(buffer, sizeof(buffer),
+                       "%s\r\nContent-Length: %zu\r\n%.*sLast-Modified: %s\r\nCache-Control: no-cache\r\n"
+                       "Connection: Close\r\n\r\n",
+                       prefix, listing->body_len, (int)ct_len, ct_line, last_modified);
+    if (len < 0 || (size_t)len >= sizeof(buffer))
+        return false;
+
+    char *data = xrealloc(NULL, len);
+    memcpy(data, buffer, len);
+    listing->head.data = data;
+    listing->head.len = len;
+    listing->head.date_offset = sizeof(prefix) - 1;
+
+    // HTTP/2 fields, with a placeholder date as in the header cache.
+    char length[32];
+    int length_len = snprintf(length, sizeof(length), "%zu", listing->body_len);
+    const char *ct_str = http_content_type_str(ct);
+    uint8_t h2_buffer[512];
+    struct hpack_buf buf = {h2_buffer, 0, sizeof(h2_buffer)};
+    bool ok = hpack_put_status(&buf, 200) && hpack_put_field(&buf, HPACK_DATE, last_modified, HTTP_DATE_LEN);
+    size_t date_offset = buf.len - HTTP_DATE_LEN;
+    ok = ok && hpack_put_field(&buf, HPACK_CONTENT_LENGTH, length, length_len) &&
+         hpack_put_field(&buf, HPACK_CONTENT_TYPE, ct_str, strlen(ct_str)) &&
+         hpack_put_field(&buf, HPACK_LAST_MODIFIED, last_modified, strlen(last_modified)) &&
+         hpack_put_field(&buf, HPACK_CACHE_CONTROL, "no-cache", 8);
+    if (!ok)
+        return false;
+    data = xrealloc(NULL, buf.len);
+    memcpy(data, h2_buffer, buf.len);
+    listing->h2_head.data = data;
+    listing->h2_head.len = buf.len;
+    listing->h2_head.date_offset = date_offset;
+    return true;
+}
+
+static struct dir_listing *render(const struct dir_index *index, enum dir_listing_format format) {
+    struct str_buf body = {0};
+    enum http_content_type ct;
+    switch (format) {
+    case DIR_LISTING_HTML:
+        render_html(&body, index);
+        ct = HTTP_CT_HTML;
+        break;
+    case DIR_LISTING_JSON:
+        render_json(&body, index);
+        ct = HTTP_CT_JSON;
+        break;
+    default: return NULL;
+    }
+
+    struct dir_listing *listing = xrealloc(NULL, sizeof(*listing));
+    memset(listing, 0, sizeof(*listing));
+    listing->body = body.data;
+    listing->body_len = body.len;
+    if (!build_head(listing, ct, index->mtime)) {
+        free_listing(listing);
+        return NULL;
+    }
+    return listing;
+}
+
+struct dir_index_cache *dir_index_cache_create(size_t size) {
+    size_t slots = DIR_INDEX_PROBES;
+    while (slots < size)
+        slots <<= 1;
+    struct dir_index_cache *cache = page_alloc(sizeof(*cache) + slots * sizeof(cache->indexes[0]), false);
+    cache->mask = slots - 1;
+    return cache;
+}
+
+static struct dir_index *lookup_index(struct dir_index_cache *cache, const char *path) {
+    uint64_t hash = path_hash(path);
+    size_t home = hash & cache->mask;
+
+    struct dir_index *free_slot = NULL;
+    for (size_t i = 0; i < DIR_INDEX_PROBES; ++i) {
+        struct dir_index *index = &cache->indexes[(home + i) & cache->mask];
+        if (index->path == NULL) {
+            if (free_slot == NULL)
+                free_slot = index;
+            continue;
+        }
+        if (index->hash == hash && strcmp(index->path, path) == 0)
+            return index;
+    }
+
+    struct dir_index *index = free_slot;
+    if (index == NULL) {
+        index = &cache->indexes[home];
+        free_index(index);
+    }
+    index->path = xstrdup(path);
+    index->hash = hash;
+    return index;
+}
+
+// gens is NULL when nobody watches the static directory. Then changes to
+// entries are only noticed through max_age.
+struct dir_listing *dir_index_get(struct dir_index_cache *cache, const struct fs_generations *gens,
+                                  const struct static_root *root, const char *path, const char *uri,
+                                  const struct file_info *info, enum dir_listing_format format, int max_age) {
+    if ((unsigned)format >= DIR_LISTING_FORMAT_COUNT)
+        return NULL;
+    struct dir_index *index = lookup_index(cache, path);
+    time_t now = time(NULL);
+    uint64_t gen = gens ? fs_generation(gens, path, strlen(path)) : 0;
+
+    bool replaced = index->dev != info->dev || index->ino != info->ino;
+    bool expired = index->restated == 0 || (!gens && max_age > 0 && now - index->restated >= max_age);
+    if (replaced || expired || index->mtime != info->mtime || index->gen != gen) {
+        bool restat_all = replaced || expired;
+        if (!scan_dir(index, root, restat_all, gens)) {
+            free_index(index);
+            return NULL;
+        }
+        index->dev = info->dev;
+        index->ino = info->ino;
+        index->mtime = info->mtime;
+        index->gen = gen;
+        if (restat_all)
+            index->restated = now;
+        // A change later in the same second as the scan would not move the
+        // directory mtime, so without a watcher such a scan is not trusted
+        // past this request.
+        if (!gens && info->mtime >= now)
+            index->restated = 0;
+    }
+
+    if (index->uri == NULL || strcmp(index->uri, uri) != 0) {
+        drop_rendered(index);
+        free(index->uri);
+        index->uri = xstrdup(uri);
+    }
+    if (index->rendered[format] == NULL) {
+        index->rendered[format] = render(index, format);
+        if (index->rendered[format] == NULL)
+            return NULL;
+    }
+    struct dir_listing *listing = index->rendered[format];
+    ++listing->refs;
+    return listing;
+}
+
+void dir_listing_release(struct dir_listing *listing) {
+    --listing->refs;
+    if (listing->refs == 0 && listing->detached)
+        free_listing(listing);
+}
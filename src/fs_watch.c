@@ -0,0 +1,299 @@
+#include "server.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FS_GEN_BUCKETS 4096 // must be a power of two
+
+// Shared between the master and all workers. The master bumps the bucket of
+// every path an event touches, or global when it cannot tell which paths are
+// affected. A path's generation is global plus its bucket, both only ever
+// grow, so any change to either shows up as a different value. seq counts all
+// bumps and is bumped first, which lets a worker tell whether an event raced
+// with a lookup.
+struct fs_generations {
+    uint64_t active;
+    uint64_t seq;
+    uint64_t global;
+    uint64_t buckets[FS_GEN_BUCKETS];
+};
+
+static uint64_t path_hash(const char *path, size_t len) {
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= (unsigned char)path[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+struct fs_generations *fs_generations_create(void) {
+    struct fs_generations *gens =
+        mmap(NULL, sizeof(*gens), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (gens == MAP_FAILED) {
+        log_perror(LOG_FATAL, "failed to map generation table");
+        return NULL;
+    }
+    return gens;
+}
+
+bool fs_generations_active(const struct fs_generations *gens) {
+    return gens && __atomic_load_n(&gens->active, __ATOMIC_ACQUIRE);
+}
+
+uint64_t fs_generation_seq(const struct fs_generations *gens) {
+    return __atomic_load_n(&gens->seq, __ATOMIC_SEQ_CST);
+}
+
+uint64_t fs_generation(const struct fs_generations *gens, const char *path, size_t len) {
+    uint64_t bucket = path_hash(path, len) & (FS_GEN_BUCKETS - 1);
+    return __atomic_load_n(&gens->global, __ATOMIC_SEQ_CST) + __atomic_load_n(&gens->buckets[bucket], __ATOMIC_SEQ_CST);
+}
+
+static void bump_path(struct fs_generations *gens, const char *path, size_t len) {
+    uint64_t bucket = path_hash(path, len) & (FS_GEN_BUCKETS - 1);
+    __atomic_add_fetch(&gens->seq, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&gens->buckets[bucket], 1, __ATOMIC_SEQ_CST);
+}
+
+void fs_generations_invalidate(struct fs_generations *gens) {
+    __atomic_add_fetch(&gens->seq, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&gens->global, 1, __ATOMIC_SEQ_CST);
+}
+
+#ifdef __linux__
+
+#include <sys/inotify.h>
+
+static void set_active(struct fs_generations *gens, bool active) {
+    fs_generations_invalidate(gens);
+    __atomic_store_n(&gens->active, active ? 1 : 0, __ATOMIC_RELEASE);
+}
+
+#define WATCH_MASK                                                                                            \
+    (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |          \
+     IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW)
+
+// Any of these can change what a path below the directory resolves to, so
+// they invalidate everything instead of only the touched name.
+#define NAMESPACE_EVENTS (IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+struct fs_watch {
+    int fd;
+    char **roots; // static_dir and the vhost roots
+    size_t root_count;
+    struct fs_generations *gens;
+    char **dirs; // watched directory path by watch descriptor
+    size_t dir_count;
+};
+
+static void forget_dirs(struct fs_watch *watch) {
+    for (size_t i = 0; i < watch->dir_count; ++i)
+        server_free(watch->dirs[i]);
+    free(watch->dirs);
+    watch->dirs = NULL;
+    watch->dir_count = 0;
+}
+
+static bool watch_dir(struct fs_watch *watch, const char *path) {
+    int wd = inotify_add_watch(watch->fd, path, WATCH_MASK);
+    if (wd == -1) {
+        log_perror(LOG_ERROR, "failed to watch %s", path);
+        return false;
+    }
+    if ((size_t)wd >= watch->dir_count) {
+        size_t count = watch->dir_count ? watch->dir_count : 64;
+        while (count <= (size_t)wd)
+            count *= 2;
+        char **dirs = realloc(watch->dirs, count * sizeof(*dirs));
+        if (dirs == NULL) {
+            log_msg(LOG_FATAL, "OOM");
+            exit(EXIT_FAILURE);
+        }
+        memset(dirs + watch->dir_count, 0, (count - watch->dir_count) * sizeof(*dirs));
+        watch->dirs = dirs;
+        watch->dir_count = count;
+    }
+    server_free(watch->dirs[wd]);
+    watch->dirs[wd] = server_strdup(path);
+    return true;
+}
+
+// Watches path and every directory below it. Symlinks are not followed, the
+// directories they lead to inside the tree are watched under their real path,
+// which is what file lookups hand out.
+static bool watch_tree(struct fs_watch *watch, const char *path) {
+    if (!watch_dir(watch, path))
+        return false;
+    DIR *dir = opendir(path);
+    if (dir == NULL)
+        return errno == ENOENT;
+
+    bool ok = true;
+    struct dirent *de;
+    while (ok && (de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        char child[4096];
+        if ((size_t)snprintf(child, sizeof(child), "%s/%s", path, de->d_name) >= sizeof(child))
+            continue;
+        bool is_dir = de->d_type == DT_DIR;
+        if (de->d_type == DT_UNKNOWN) {
+            struct stat st;
+            is_dir = lstat(child, &st) == 0 && S_ISDIR(st.st_mode);
+        }
+        if (is_dir)
+            ok = watch_tree(watch, child);
+    }
+    closedir(dir);
+    return ok;
+}
+
+static bool rewatch(struct fs_watch *watch) {
+    if (watch->fd != -1)
+        close(watch->fd);
+    forget_dirs(watch);
+    watch->fd = inotify_init1(IN_CLOEXEC);
+    if (watch->fd == -1) {
+        log_perror(LOG_ERROR, "inotify_init1 failed");
+        return false;
+    }
+    for (size_t i = 0; i < watch->root_count; ++i) {
+        if (!watch_tree(watch, watch->roots[i]))
+            return false;
+    }
+    return true;
+}
+
+// One watcher covers every root, the generations do not tell them apart.
+struct fs_watch *fs_watch_create(const char *const *roots, size_t count, struct fs_generations *gens) {
+    struct fs_watch *watch = calloc(1, sizeof(*watch));
+    char **copies = calloc(count, sizeof(*copies));
+    if (watch == NULL || copies == NULL) {
+        log_msg(LOG_FATAL, "OOM");
+        exit(EXIT_FAILURE);
+    }
+    watch->fd = -1;
+    watch->roots = copies;
+    watch->root_count = count;
+    for (size_t i = 0; i < count; ++i)
+        watch->roots[i] = server_strdup(roots[i]);
+    watch->gens = gens;
+    if (!rewatch(watch)) {
+        fs_watch_destroy(watch);
+        return NULL;
+    }
+    set_active(gens, true);
+    for (size_t i = 0; i < count; ++i)
+        log_msg(LOG_INFO, "watching %s for changes", roots[i]);
+    return watch;
+}
+
+void fs_watch_destroy(struct fs_watch *watch) {
+    set_active(watch->gens, false);
+    if (watch->fd != -1)
+        close(watch->fd);
+    forget_dirs(watch);
+    for (size_t i = 0; i < watch->root_count; ++i)
+        server_free(watch->roots[i]);
+    free(watch->roots);
+    free(watch);
+}
+
+// Returns false when the watcher fell behind for good and the workers have to
+// go back to checking the filesystem themselves.
+static bool handle_event(struct fs_watch *watch, const struct inotify_event *event, bool *rebuild) {
+    if (event->mask & IN_Q_OVERFLOW) {
+        log_msg(LOG_WARN, "inotify queue overflow, invalidating all cached paths");
+        fs_generations_invalidate(watch->gens);
+        return true;
+    }
+    if (event->wd < 0 || (size_t)event->wd >= watch->dir_count || watch->dirs[event->wd] == NULL)
+        return true;
+    if (event->mask & IN_IGNORED) {
+        server_free(watch->dirs[event->wd]);
+        watch->dirs[event->wd] = NULL;
+        return true;
+    }
+
+    const char *dir = watch->dirs[event->wd];
+    if ((event->mask & NAMESPACE_EVENTS) || (event->mask & (IN_ATTRIB | IN_ISDIR)) == (IN_ATTRIB | IN_ISDIR)) {
+        fs_generations_invalidate(watch->gens);
+        // Watches follow moved directories, so the paths recorded for the
+        // whole subtree are wrong after a directory rename.
+        if ((event->mask & (IN_MOVED_FROM | IN_MOVE_SELF)) && (event->mask & IN_ISDIR))
+            *rebuild = true;
+        if ((event->mask & IN_MOVED_TO) && (event->mask & IN_ISDIR) && !*rebuild) {
+            char path[4096];
+            if ((size_t)snprintf(path, sizeof(path), "%s/%s", dir, event->name) < sizeof(path))
+                return watch_tree(watch, path);
+        }
+        return true;
+    }
+
+    // Listings show the size and mtime of their entries, so the directory
+    // changes with every entry in it.
+    bump_path(watch->gens, dir, strlen(dir));
+    if (event->len == 0)
+        return true;
+    char path[4096];
+    int len = snprintf(path, sizeof(path), "%s/%s", dir, event->name);
+    if (len < 0 || (size_t)len >= sizeof(path))
+        return true;
+    bump_path(watch->gens, path, len);
+    if ((event->mask & IN_CREATE) && (event->mask & IN_ISDIR))
+        return watch_tree(watch, path);
+    return true;
+}
+
+bool fs_watch_process(struct fs_watch *watch) {
+    char buffer[1 << 16] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t nread = read(watch->fd, buffer, sizeof(buffer));
+    if (nread == -1) {
+        if (errno == EINTR)
+            return true;
+        log_perror(LOG_ERROR, "failed to read inotify events");
+        return false;
+    }
+
+    bool ok = true, rebuild = false;
+    for (char *p = buffer; ok && p < buffer + nread;) {
+        const struct inotify_event *event = (const struct inotify_event *)p;
+        ok = handle_event(watch, event, &rebuild);
+        p += sizeof(*event) + event->len;
+    }
+    if (ok && rebuild) {
+        log_msg(LOG_INFO, "directory moved, rebuilding watches");
+        ok = rewatch(watch);
+        fs_generations_invalidate(watch->gens);
+    }
+    if (!ok)
+        log_msg(LOG_WARN, "no longer watching %s%s, falling back to stat checks", watch->roots[0],
+                watch->root_count > 1 ? " and the vhost roots" : "");
+    return ok;
+}
+
+#else
+
+struct fs_watch *fs_watch_create(const char *const *roots, size_t count, struct fs_generations *gens) {
+    (void)roots, (void)count, (void)gens;
+    log_msg(LOG_WARN, "watching the static directory needs inotify");
+    return NULL;
+}
+
+void fs_watch_destroy(struct fs_watch *watch) {
+    (void)watch;
+}
+
+bool fs_watch_process(struct fs_watch *watch) {
+    (void)watch;
+    return false;
+}
+
+#endif
@@ -0,0 +1,945 @@
+#include "server.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN (sizeof(H2_PREFACE) - 1)
+#define H2_FRAME_HEADER_LEN 9
+#define H2_MAX_FRAME_SIZE 16384 // largest frame we accept, the protocol default
+#define H2_DEFAULT_WINDOW 65535
+#define H2_MAX_WINDOW 0x7fffffff
+#define H2_HEADER_TABLE_SIZE 4096
+#define H2_MAX_HEADER_LIST (1 << 16)
+#define H2_OUT_SIZE (1 << 16)
+// Kept free in the output buffer before handling a frame. One frame adds at
+// most a response head and a few small control frames.
+#define H2_OUT_RESERVE 2048
+#define H2_SCRATCH_BLOCK_SIZE 4096
+
+enum h2_frame_type {
+    H2_DATA = 0x0,
+    H2_HEADERS = 0x1,
+    H2_PRIORITY = 0x2,
+    H2_RST_STREAM = 0x3,
+    H2_SETTINGS = 0x4,
+    H2_PUSH_PROMISE = 0x5,
+    H2_PING = 0x6,
+    H2_GOAWAY = 0x7,
+    H2_WINDOW_UPDATE = 0x8,
+    H2_CONTINUATION = 0x9,
+};
+
+#define H2_FLAG_END_STREAM 0x1
+#define H2_FLAG_ACK 0x1
+#define H2_FLAG_END_HEADERS 0x4
+#define H2_FLAG_PADDED 0x8
+#define H2_FLAG_PRIORITY 0x20
+
+enum h2_setting {
+    H2_SETTINGS_HEADER_TABLE_SIZE = 0x1,
+    H2_SETTINGS_ENABLE_PUSH = 0x2,
+    H2_SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+    H2_SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+    H2_SETTINGS_MAX_FRAME_SIZE = 0x5,
+    H2_SETTINGS_MAX_HEADER_LIST_SIZE = 0x6,
+};
+
+enum h2_error {
+    H2_NO_ERROR = 0x0,
+    H2_PROTOCOL_ERROR = 0x1,
+    H2_INTERNAL_ERROR = 0x2,
+    H2_FLOW_CONTROL_ERROR = 0x3,
+    H2_STREAM_CLOSED = 0x5,
+    H2_FRAME_SIZE_ERROR = 0x6,
+    H2_REFUSED_STREAM = 0x7,
+    H2_COMPRESSION_ERROR = 0x9,
+    H2_ENHANCE_YOUR_CALM = 0xb,
+    H2_HTTP_1_1_REQUIRED = 0xd,
+};
+
+// A stream holds no request state once its response head is out, only the
+// body source, which is read the same way as for HTTP/1 connections. Files
+// are always read through a descriptor: frame payloads are copied into the
+// output buffer, and a copy from a mapping would SIGBUS on a truncated file.
+// The asset pack is the exception, it is replaced but never truncated.
+struct h2_stream {
+    uint32_t id; // 0 marks a free slot
+    bool remote_closed; // the client sent END_STREAM
+    int64_t window;
+    int file_fd;
+    struct dir_listing *listing;
+    const char *pack_body;
+    size_t body_cursor;
+    size_t body_size; // 0 once the body is queued, or when there is none
+};
+
+struct h2_conn {
+    struct hpack_decoder *decoder;
+    struct memory_arena scratch; // allocations while serving one request
+    size_t preface_seen;         // bytes of the client preface matched so far
+    uint32_t last_stream_id;
+    bool goaway;  // the client is leaving, no new streams
+    bool closing; // GOAWAY with an error queued, close once it is sent
+    int64_t window;
+    int64_t initial_window; // the client's initial stream window
+    size_t max_frame;       // the client's largest accepted frame
+
+    // Header block collected from HEADERS and CONTINUATION frames.
+    uint32_t header_stream; // 0 when no block is open
+    bool header_end_stream;
+    uint8_t *header_block;
+    size_t header_len;
+    size_t header_cap;
+
+    uint8_t *in;
+    size_t in_len;
+    size_t in_cap;
+    uint8_t out[H2_OUT_SIZE];
+    size_t out_len;
+    size_t out_cursor; // written up to here
+
+    struct client_entry *client; // the connection's, NULL when not tracked
+    size_t requests;             // streams opened so far
+
+    size_t next_stream; // where the next round of DATA frames starts
+    size_t active;
+    size_t max_streams;
+    struct h2_stream streams[];
+};
+
+static void *xrealloc(void *memory, size_t size) {
+    void *result = realloc(memory, size);
+    if (result == NULL) {
+        log_msg(LOG_FATAL, "OOM");
+        exit(EXIT_FAILURE);
+    }
+    return result;
+}
+
+static uint32_t read_u32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void write_u32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static size_t out_space(const struct h2_conn *h2) {
+    return H2_OUT_SIZE - h2->out_len;
+}
+
+// Appends a frame header and returns where its payload goes.
+static uint8_t *put_frame(struct h2_conn *h2, size_t len, uint8_t type, uint8_t flags, uint32_t stream_id) {
+    uint8_t *frame = h2->out + h2->out_len;
+    frame[0] = (uint8_t)(len >> 16);
+    frame[1] = (uint8_t)(len >> 8);
+    frame[2] = (uint8_t)len;
+    frame[3] = type;
+    frame[4] = flags;
+    write_u32(frame + 5, stream_id);
+    h2->out_len += H2_FRAME_HEADER_LEN + len;
+    return frame + H2_FRAME_HEADER_LEN;
+}
+
+static void put_rst_stream(struct h2_conn *h2, uint32_t stream_id, enum h2_error code) {
+    write_u32(put_frame(h2, 4, H2_RST_STREAM, 0, stream_id), code);
+}
+
+static void put_window_update(struct h2_conn *h2, uint32_t stream_id, uint32_t increment) {
+    write_u32(put_frame(h2, 4, H2_WINDOW_UPDATE, 0, stream_id), increment);
+}
+
+static void put_goaway(struct h2_conn *h2, enum h2_error code) {
+    uint8_t *payload = put_frame(h2, 8, H2_GOAWAY, 0, 0);
+    write_u32(payload, h2->last_stream_id);
+    write_u32(payload + 4, code);
+}
+
+static void put_settings(struct h2_conn *h2, const struct server_settings *settings) {
+    static const uint16_t ids[] = {H2_SETTINGS_MAX_CONCURRENT_STREAMS, H2_SETTINGS_MAX_HEADER_LIST_SIZE,
+                                   H2_SETTINGS_ENABLE_PUSH};
+    uint32_t values[] = {(uint32_t)settings->h2_max_streams, H2_MAX_HEADER_LIST, 0};
+    uint8_t *payload = put_frame(h2, 6 * 3, H2_SETTINGS, 0, 0);
+    for (size_t i = 0; i < 3; ++i) {
+        payload[i * 6] = (uint8_t)(ids[i] >> 8);
+        payload[i * 6 + 1] = (uint8_t)ids[i];
+        write_u32(payload + i * 6 + 2, values[i]);
+    }
+}
+
+// Copies a cached head into a HEADERS frame, with the current date.
+static void put_head(struct h2_conn *h2, struct worker *worker, uint32_t stream_id, const struct header_block *block,
+                     bool end_stream) {
+    uint8_t flags = H2_FLAG_END_HEADERS | (end_stream ? H2_FLAG_END_STREAM : 0);
+    uint8_t *payload = put_frame(h2, block->len, H2_HEADERS, flags, stream_id);
+    memcpy(payload, block->data, block->len);
+    memcpy(payload + block->date_offset, worker_date(worker), HTTP_DATE_LEN);
+}
+
+static void put_status_head(struct h2_conn *h2, struct worker *worker, uint32_t stream_id,
+                            enum http_status_code code) {
+    uint8_t buffer[64];
+    struct hpack_buf buf = {buffer, 0, sizeof(buffer)};
+    hpack_put_status(&buf, http_status_code_int(code));
+    hpack_put_field(&buf, HPACK_DATE, worker_date(worker), HTTP_DATE_LEN);
+    hpack_put_field(&buf, HPACK_CONTENT_LENGTH, "0", 1);
+    uint8_t *payload = put_frame(h2, buf.len, H2_HEADERS, H2_FLAG_END_HEADERS | H2_FLAG_END_STREAM, stream_id);
+    memcpy(payload, buffer, buf.len);
+}
+
+// The head has to fit the room kept free for one frame, a location too long
+// for it is answered as a target too long.
+static void put_redirect_head(struct h2_conn *h2, struct worker *worker, uint32_t stream_id, const char *location) {
+    uint8_t buffer[H2_OUT_RESERVE - H2_FRAME_HEADER_LEN];
+    struct hpack_buf buf = {buffer, 0, sizeof(buffer)};
+    hpack_put_status(&buf, http_status_code_int(HTTP_MOVED_PERMANENTLY));
+    hpack_put_field(&buf, HPACK_DATE, worker_date(worker), HTTP_DATE_LEN);
+    if (!hpack_put_field(&buf, HPACK_LOCATION, location, strlen(location)) ||
+        !hpack_put_field(&buf, HPACK_CONTENT_LENGTH, "0", 1)) {
+        put_status_head(h2, worker, stream_id, HTTP_URI_TOO_LONG);
+        return;
+    }
+    uint8_t *payload = put_frame(h2, buf.len, H2_HEADERS, H2_FLAG_END_HEADERS | H2_FLAG_END_STREAM, stream_id);
+    memcpy(payload, buffer, buf.len);
+}
+
+static bool conn_error(struct h2_conn *h2, enum h2_error code, const char *what) {
+    log_msg(LOG_INFO, "HTTP/2 connection error %d: %s", code, what);
+    put_goaway(h2, code);
+    h2->closing = true;
+    return false;
+}
+
+static struct h2_stream *find_stream(struct h2_conn *h2, uint32_t id) {
+    for (size_t i = 0; i < h2->max_streams; ++i) {
+        if (h2->streams[i].id == id)
+            return &h2->streams[i];
+    }
+    return NULL;
+}
+
+// Returns NULL when every slot is taken.
+static struct h2_stream *open_stream(struct h2_conn *h2, uint32_t id) {
+    struct h2_stream *stream = find_stream(h2, 0);
+    if (stream == NULL)
+        return NULL;
+    memset(stream, 0, sizeof(*stream));
+    stream->id = id;
+    stream->window = h2->initial_window;
+    stream->file_fd = -1;
+    ++h2->active;
+    return stream;
+}
+
+static void release_stream(struct h2_conn *h2, struct h2_stream *stream) {
+    if (stream->file_fd != -1)
+        close(stream->file_fd);
+    if (stream->listing)
+        dir_listing_release(stream->listing);
+    stream->id = 0;
+    --h2->active;
+}
+
+// The response is complete. A client still sending its request is told to
+// stop without an error.
+static void close_stream(struct h2_conn *h2, struct h2_stream *stream) {
+    if (!stream->remote_closed)
+        put_rst_stream(h2, stream->id, H2_NO_ERROR);
+    release_stream(h2, stream);
+}
+
+static enum h2_error apply_settings(struct h2_conn *h2, const uint8_t *payload, size_t len) {
+    for (size_t i = 0; i + 6 <= len; i += 6) {
+        uint16_t id = (uint16_t)(payload[i] << 8 | payload[i + 1]);
+        uint32_t value = read_u32(payload + i + 2);
+        switch (id) {
+        case H2_SETTINGS_ENABLE_PUSH:
+            if (value > 1)
+                return H2_PROTOCOL_ERROR;
+            break;
+        case H2_SETTINGS_INITIAL_WINDOW_SIZE: {
+            if (value > H2_MAX_WINDOW)
+                return H2_FLOW_CONTROL_ERROR;
+            int64_t delta = (int64_t)value - h2->initial_window;
+            h2->initial_window = value;
+            for (size_t j = 0; j < h2->max_streams; ++j) {
+                if (h2->streams[j].id)
+                    h2->streams[j].window += delta;
+            }
+            break;
+        }
+        case H2_SETTINGS_MAX_FRAME_SIZE:
+            if (value < H2_MAX_FRAME_SIZE || value > 0xffffff)
+                return H2_PROTOCOL_ERROR;
+            h2->max_frame = value;
+            break;
+        // Responses never index into the dynamic table and the server does
+        // not push, the rest has nothing to limit.
+        default: break;
+        }
+    }
+    return H2_NO_ERROR;
+}
+
+static enum http_status_code request_from_fields(struct worker *worker, const struct hpack_field *fields,
+                                                 size_t count, struct http_req *req, enum h2_error *reset) {
+    const struct hpack_field *method = NULL, *path = NULL, *authority = NULL;
+    req->accept_encoding = NULL;
+    req->accept_encoding_len = 0;
+    for (size_t i = 0; i < count; ++i) {
+        const struct hpack_field *field = &fields[i];
+        if (field->name_len == 7 && memcmp(field->name, ":method", 7) == 0) {
+            method = field;
+        } else if (field->name_len == 5 && memcmp(field->name, ":path", 5) == 0) {
+            path = field;
+        } else if ((field->name_len == 10 && memcmp(field->name, ":authority", 10) == 0) ||
+                   (field->name_len == 4 && memcmp(field->name, "host", 4) == 0 && authority == NULL)) {
+            authority = field;
+        } else if (field->name_len == 15 && memcmp(field->name, "accept-encoding", 15) == 0) {
+            req->accept_encoding = field->value;
+            req->accept_encoding_len = field->value_len;
+        }
+    }
+    *reset = H2_NO_ERROR;
+    if (method == NULL || path == NULL || path->value_len == 0) {
+        *reset = H2_PROTOCOL_ERROR;
+        return HTTP_BAD_REQUEST;
+    }
+    if (path->value_len > worker->settings->uri_length_limit)
+        return HTTP_URI_TOO_LONG;
+
+    char *uri = server_alloc(path->value_len + 1);
+    memcpy(uri, path->value, path->value_len);
+    uri[path->value_len] = '\0';
+    req->path = http_normalize_path(uri, path->value_len);
+    if (req->path == NULL)
+        return HTTP_BAD_REQUEST;
+    req->vhost = authority ? vhost_find(worker, authority->value, authority->value_len) : &worker->site;
+    // Upstreams are spoken to in HTTP/1.1, so their clients are sent there
+    // too rather than having streams translated.
+    if (upstream_find(worker->upstreams, req->path)) {
+        *reset = H2_HTTP_1_1_REQUIRED;
+        return HTTP_OK;
+    }
+
+    if (method->value_len == 3 && memcmp(method->value, "GET", 3) == 0)
+        req->method = HTTP_GET;
+    else if (method->value_len == 4 && memcmp(method->value, "HEAD", 4) == 0)
+        req->method = HTTP_HEAD;
+    else
+        return HTTP_METHOD_NOT_ALLOWED;
+    req->uri = uri;
+    req->version = HTTP_2;
+    return HTTP_OK;
+}
+
+static void serve_pack_stream(struct h2_conn *h2, struct worker *worker, struct h2_stream *stream,
+                              struct http_req *req) {
+    struct pack_file file;
+    enum http_status_code status = asset_pack_lookup(worker->pack, req, &file);
+    if (status != HTTP_OK) {
+        put_status_head(h2, worker, stream->id, status);
+        close_stream(h2, stream);
+        return;
+    }
+    bool empty = req->method == HTTP_HEAD || file.size == 0;
+    put_head(h2, worker, stream->id, file.h2_head, empty);
+    if (empty) {
+        close_stream(h2, stream);
+        return;
+    }
+    stream->pack_body = file.body;
+    stream->body_size = file.size;
+}
+
+// Queues the response head and sets up the body source. The lookup uses the
+// per-request scratch arena, nothing from it is kept.
+static void serve_stream(struct h2_conn *h2, struct worker *worker, struct h2_stream *stream, struct http_req *req) {
+    if (worker->pack && req->vhost->settings == NULL) {
+        serve_pack_stream(h2, worker, stream, req);
+        return;
+    }
+    const char *full_path;
+    struct file_info info;
+    struct dir_listing *listing = NULL;
+    int fd;
+    enum http_status_code status = lookup_file(req, worker, &full_path, &info, &listing, &fd);
+    if (status == HTTP_MOVED_PERMANENTLY) {
+        put_redirect_head(h2, worker, stream->id, dir_location(req));
+        close_stream(h2, stream);
+        return;
+    }
+    if (status != HTTP_OK) {
+        put_status_head(h2, worker, stream->id, status);
+        close_stream(h2, stream);
+        return;
+    }
+    bool head_only = req->method == HTTP_HEAD;
+
+    if (listing) {
+        bool empty = head_only || listing->body_len == 0;
+        put_head(h2, worker, stream->id, &listing->h2_head, empty);
+        if (empty) {
+            dir_listing_release(listing);
+            close_stream(h2, stream);
+            return;
+        }
+        stream->listing = listing;
+        stream->body_size = listing->body_len;
+        return;
+    }
+
+    const struct header_block *block = header_cache_get_h2(worker->header_cache, full_path, &info);
+    if (!block) {
+        if (fd != -1)
+            close(fd);
+        put_status_head(h2, worker, stream->id, HTTP_INTERNAL_SERVER_ERROR);
+        close_stream(h2, stream);
+        return;
+    }
+    if (head_only || info.size == 0) {
+        if (fd != -1)
+            close(fd);
+        put_head(h2, worker, stream->id, block, true);
+        close_stream(h2, stream);
+        return;
+    }
+    // Streams cannot be parked, so they neither wait for a file another
+    // worker is reading in nor hold others up reading it themselves.
+    if (fd == -1)
+        fd = static_root_reopen(req->vhost->root, full_path);
+    if (fd == -1) {
+        put_status_head(h2, worker, stream->id, errno_status(errno));
+        close_stream(h2, stream);
+        return;
+    }
+    put_head(h2, worker, stream->id, block, false);
+    stream->file_fd = fd;
+    stream->body_size = info.size;
+}
+
+static void start_request(struct h2_conn *h2, struct worker *worker, struct h2_stream *stream,
+                          const struct hpack_field *fields, size_t count) {
+    struct memory_arena *saved = g_memory_arena;
+    g_memory_arena = &h2->scratch;
+    struct http_req req;
+    enum h2_error reset;
+    enum http_status_code status = request_from_fields(worker, fields, count, &req, &reset);
+    if (reset != H2_NO_ERROR) {
+        put_rst_stream(h2, stream->id, reset);
+        release_stream(h2, stream);
+    } else if (status != HTTP_OK) {
+        put_status_head(h2, worker, stream->id, status);
+        close_stream(h2, stream);
+    } else {
+        serve_stream(h2, worker, stream, &req);
+    }
+    arena_clear(&h2->scratch);
+    g_memory_arena = saved;
+}
+
+static bool end_headers(struct h2_conn *h2, struct worker *worker) {
+    uint32_t id = h2->header_stream;
+    h2->header_stream = 0;
+    // Every block is decoded, even for refused streams, to keep the
+    // decoder's table in step with the client's.
+    const struct hpack_field *fields;
+    size_t count;
+    if (!hpack_decode(h2->decoder, h2->header_block, h2->header_len, &fields, &count))
+        return conn_error(h2, H2_COMPRESSION_ERROR, "invalid header block");
+
+    struct h2_stream *stream = find_stream(h2, id);
+    if (stream) {
+        // Trailers, which only end the request.
+        if (!h2->header_end_stream)
+            return conn_error(h2, H2_PROTOCOL_ERROR, "second header block without END_STREAM");
+        stream->remote_closed = true;
+        return true;
+    }
+    if (id <= h2->last_stream_id)
+        return conn_error(h2, H2_STREAM_CLOSED, "headers on a closed stream");
+    h2->last_stream_id = id;
+    if (h2->goaway)
+        return true;
+    stream = open_stream(h2, id);
+    if (stream == NULL) {
+        put_rst_stream(h2, id, H2_REFUSED_STREAM);
+        return true;
+    }
+    stream->remote_closed = h2->header_end_stream;
+    // Every stream is a request of its own and pays for it, except the first,
+    // paid for when the connection was accepted.
+    if (h2->requests++ && h2->client && !client_limit_request(worker->clients, worker->settings, h2->client)) {
+        put_status_head(h2, worker, id, HTTP_TOO_MANY_REQUESTS);
+        close_stream(h2, stream);
+        return true;
+    }
+    start_request(h2, worker, stream, fields, count);
+    return true;
+}
+
+static bool append_header_block(struct h2_conn *h2, const uint8_t *data, size_t len) {
+    if (h2->header_len + len > H2_MAX_HEADER_LIST)
+        return conn_error(h2, H2_ENHANCE_YOUR_CALM, "header block too large");
+    if (h2->header_len + len > h2->header_cap) {
+        h2->header_cap = h2->header_len + len;
+        h2->header_block = xrealloc(h2->header_block, h2->header_cap);
+    }
+    memcpy(h2->header_block + h2->header_len, data, len);
+    h2->header_len += len;
+    return true;
+}
+
+// Strips padding and, for HEADERS, the priority fields.
+static bool frame_content(uint8_t flags, bool priority, const uint8_t **payload, size_t *len) {
+    size_t pad = 0;
+    if (flags & H2_FLAG_PADDED) {
+        if (*len < 1)
+            return false;
+        pad = (*payload)[0];
+        ++*payload;
+        --*len;
+    }
+    if (priority && (flags & H2_FLAG_PRIORITY)) {
+        if (*len < 5)
+            return false;
+        *payload += 5;
+        *len -= 5;
+    }
+    if (pad > *len)
+        return false;
+    *len -= pad;
+    return true;
+}
+
+static bool handle_frame(struct h2_conn *h2, struct worker *worker, uint8_t type, uint8_t flags, uint32_t id,
+                         const uint8_t *payload, size_t len) {
+    if (h2->header_stream && (type != H2_CONTINUATION || id != h2->header_stream))
+        return conn_error(h2, H2_PROTOCOL_ERROR, "header block interrupted");
+
+    switch (type) {
+    case H2_HEADERS:
+        if (id == 0 || (id & 1) == 0)
+            return conn_error(h2, H2_PROTOCOL_ERROR, "headers on an invalid stream");
+        if (!frame_content(flags, true, &payload, &len))
+            return conn_error(h2, H2_PROTOCOL_ERROR, "invalid padding");
+        h2->header_stream = id;
+        h2->header_end_stream = (flags & H2_FLAG_END_STREAM) != 0;
+        h2->header_len = 0;
+        if (!append_header_block(h2, payload, len))
+            return false;
+        return (flags & H2_FLAG_END_HEADERS) ? end_headers(h2, worker) : true;
+
+    case H2_CONTINUATION:
+        if (h2->header_stream == 0)
+            return conn_error(h2, H2_PROTOCOL_ERROR, "unexpected continuation");
+        if (!append_header_block(h2, payload, len))
+            return false;
+        return (flags & H2_FLAG_END_HEADERS) ? end_headers(h2, worker) : true;
+
+    case H2_DATA: {
+        if (id == 0)
+            return conn_error(h2, H2_PROTOCOL_ERROR, "data on stream 0");
+        // Request bodies are discarded, and the connection window credited
+        // right away so they cannot stall other streams.
+        if (len)
+            put_window_update(h2, 0, (uint32_t)len);
+        struct h2_stream *stream = find_stream(h2, id);
+        if (stream == NULL) {
+            if (id > h2->last_stream_id)
+                return conn_error(h2, H2_PROTOCOL_ERROR, "data on an idle stream");
+            return true;
+        }
+        if (stream->remote_closed) {
+            put_rst_stream(h2, id, H2_STREAM_CLOSED);
+            release_stream(h2, stream);
+            return true;
+        }
+        if (flags & H2_FLAG_END_STREAM)
+            stream->remote_closed = true;
+        return true;
+    }
+
+    case H2_SETTINGS: {
+        if (id != 0)
+            return conn_error(h2, H2_PROTOCOL_ERROR, "settings on a stream");
+        if (flags & H2_FLAG_ACK)
+            return len == 0 ? true : conn_error(h2, H2_FRAME_SIZE_ERROR, "settings ack with payload");
+        if (len % 6 != 0)
+            return conn_error(h2, H2_FRAME_SIZE_ERROR, "settings length");
+        enum h2_error err = apply_settings(h2, payload, len);
+        if (err != H2_NO_ERROR)
+            return conn_error(h2, err, "invalid settings");
+        put_frame(h2, 0, H2_SETTINGS, H2_FLAG_ACK, 0);
+        return true;
+    }
+
+    case H2_WINDOW_UPDATE: {
+        if (len != 4)
+            return conn_error(h2, H2_FRAME_SIZE_ERROR, "window update length");
+        uint32_t increment = read_u32(payload) & H2_MAX_WINDOW;
+        if (id == 0) {
+            if (increment == 0)
+                return conn_error(h2, H2_PROTOCOL_ERROR, "zero window update");
+            if (h2->window + increment > H2_MAX_WINDOW)
+                return conn_error(h2, H2_FLOW_CONTROL_ERROR, "connection window overflow");
+            h2->window += increment;
+            return true;
+        }
+        struct h2_stream *stream = find_stream(h2, id);
+        if (stream == NULL)
+            return true;
+        if (increment == 0 || stream->window + increment > H2_MAX_WINDOW) {
+            put_rst_stream(h2, id, increment == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+            release_stream(h2, stream);
+            return true;
+        }
+        stream->window += increment;
+        return true;
+    }
+
+    case H2_RST_STREAM: {
+        if (len != 4)
+            return conn_error(h2, H2_FRAME_SIZE_ERROR, "rst_stream length");
+        if (id == 0 || id > h2->last_stream_id)
+            return conn_error(h2, H2_PROTOCOL_ERROR, "rst_stream on an idle stream");
+        struct h2_stream *stream = find_stream(h2, id);
+        if (stream)
+            release_stream(h2, stream);
+        return true;
+    }
+
+    case H2_PING:
+        if (len != 8)
+            return conn_error(h2, H2_FRAME_SIZE_ERROR, "ping length");
+        if (id != 0)
+            return conn_error(h2, H2_PROTOCOL_ERROR, "ping on a stream");
+        if ((flags & H2_FLAG_ACK) == 0)
+            memcpy(put_frame(h2, 8, H2_PING, H2_FLAG_ACK, 0), payload, 8);
+        return true;
+
+    case H2_GOAWAY:
+        if (id != 0 || len < 8)
+            return conn_error(h2, H2_PROTOCOL_ERROR, "invalid goaway");
+        h2->goaway = true;
+        return true;
+
+    case H2_PUSH_PROMISE: return conn_error(h2, H2_PROTOCOL_ERROR, "push from a client");
+
+    // Priorities are not used, streams are served round robin. Unknown
+    // frame types are ignored as required.
+    default: return true;
+    }
+}
+
+static bool parse_frames(struct h2_conn *h2, struct worker *worker) {
+    size_t pos = 0;
+    if (h2->preface_seen < H2_PREFACE_LEN) {
+        size_t n = H2_PREFACE_LEN - h2->preface_seen;
+        if (n > h2->in_len)
+            n = h2->in_len;
+        if (memcmp(h2->in, H2_PREFACE + h2->preface_seen, n) != 0) {
+            conn_error(h2, H2_PROTOCOL_ERROR, "invalid connection preface");
+            return true;
+        }
+        h2->preface_seen += n;
+        pos = n;
+    }
+
+    while (!h2->closing && h2->in_len - pos >= H2_FRAME_HEADER_LEN && out_space(h2) >= H2_OUT_RESERVE) {
+        const uint8_t *frame = h2->in + pos;
+        size_t len = (size_t)frame[0] << 16 | (size_t)frame[1] << 8 | frame[2];
+        if (len > H2_MAX_FRAME_SIZE) {
+            conn_error(h2, H2_FRAME_SIZE_ERROR, "frame too large");
+            break;
+        }
+        if (h2->in_len - pos < H2_FRAME_HEADER_LEN + len)
+            break;
+        uint32_t id = read_u32(frame + 5) & H2_MAX_WINDOW;
+        handle_frame(h2, worker, frame[3], frame[4], id, frame + H2_FRAME_HEADER_LEN, len);
+        pos += H2_FRAME_HEADER_LEN + len;
+    }
+
+    if (pos == 0)
+        return false;
+    memmove(h2->in, h2->in + pos, h2->in_len - pos);
+    h2->in_len -= pos;
+    return true;
+}
+
+// Gives every stream with body left and window to spare one DATA frame per
+// round, so that concurrent responses interleave instead of queueing behind
+// each other. Nothing is sent before the client preface: after an upgrade,
+// the client may still be reading the 101 response into a fixed buffer.
+static bool send_data(struct h2_conn *h2) {
+    if (h2->preface_seen < H2_PREFACE_LEN)
+        return false;
+    bool progress = false;
+    for (;;) {
+        bool sent = false;
+        size_t start = h2->next_stream;
+        for (size_t i = 0; i < h2->max_streams; ++i) {
+            if (h2->window <= 0 || out_space(h2) <= H2_OUT_RESERVE + H2_FRAME_HEADER_LEN)
+                return progress;
+            size_t index = (start + i) % h2->max_streams;
+            struct h2_stream *stream = &h2->streams[index];
+            if (stream->id == 0 || stream->body_size == 0 || stream->window <= 0)
+                continue;
+
+            size_t len = stream->body_size - stream->body_cursor;
+            size_t room = out_space(h2) - H2_OUT_RESERVE - H2_FRAME_HEADER_LEN;
+            if (len > room)
+                len = room;
+            if (len > h2->max_frame)
+                len = h2->max_frame;
+            if ((int64_t)len > h2->window)
+                len = (size_t)h2->window;
+            if ((int64_t)len > stream->window)
+                len = (size_t)stream->window;
+
+            uint8_t *payload = h2->out + h2->out_len + H2_FRAME_HEADER_LEN;
+            if (stream->listing) {
+                memcpy(payload, stream->listing->body + stream->body_cursor, len);
+            } else if (stream->pack_body) {
+                memcpy(payload, stream->pack_body + stream->body_cursor, len);
+            } else {
+                ssize_t nread = read(stream->file_fd, payload, len);
+                if (nread <= 0) {
+                    if (nread == 0)
+                        log_msg(LOG_WARN, "file shrank while sending");
+                    else
+                        log_perror(LOG_ERROR, "failed to read from file");
+                    put_rst_stream(h2, stream->id, H2_INTERNAL_ERROR);
+                    release_stream(h2, stream);
+                    continue;
+                }
+                len = (size_t)nread;
+            }
+
+            stream->body_cursor += len;
+            bool end = stream->body_cursor == stream->body_size;
+            put_frame(h2, len, H2_DATA, end ? H2_FLAG_END_STREAM : 0, stream->id);
+            h2->window -= (int64_t)len;
+            stream->window -= (int64_t)len;
+            if (end)
+                close_stream(h2, stream);
+            h2->next_stream = (index + 1) % h2->max_streams;
+            sent = progress = true;
+        }
+        if (!sent)
+            return progress;
+    }
+}
+
+enum flush_result {
+    FLUSH_DONE,
+    FLUSH_BLOCKED,
+    FLUSH_ERROR,
+};
+
+static enum flush_result flush_output(struct h2_conn *h2, struct active_connection *conn) {
+    while (h2->out_cursor < h2->out_len) {
+        ssize_t nwritten = conn_write_body(conn, h2->out + h2->out_cursor, h2->out_len - h2->out_cursor);
+        if (nwritten == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            memmove(h2->out, h2->out + h2->out_cursor, h2->out_len - h2->out_cursor);
+            h2->out_len -= h2->out_cursor;
+            h2->out_cursor = 0;
+            return FLUSH_BLOCKED;
+        }
+        if (nwritten == -1) {
+            log_perror(LOG_INFO, "failed to write to socket");
+            return FLUSH_ERROR;
+        }
+        h2->out_cursor += nwritten;
+    }
+    h2->out_len = 0;
+    h2->out_cursor = 0;
+    return FLUSH_DONE;
+}
+
+// Reads, handles frames, queues data and writes until nothing moves. Waits
+// for input while idle and for the socket while output is pending.
+enum connection_state h2_process(struct worker *worker, struct active_connection *conn) {
+    struct h2_conn *h2 = conn->h2;
+    for (;;) {
+        bool progress = false;
+        if (!h2->closing && h2->in_len < h2->in_cap) {
+            ssize_t nread = conn_read(conn, h2->in + h2->in_len, h2->in_cap - h2->in_len);
+            if (nread == 0)
+                return CONN_COMPLETE;
+            if (nread == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_perror(LOG_INFO, "read socket failed");
+                return CONN_ERR_UNRECOVERABLE;
+            }
+            if (nread > 0) {
+                h2->in_len += nread;
+                progress = true;
+            }
+        }
+        if (!h2->closing)
+            progress |= parse_frames(h2, worker);
+        if (!h2->closing)
+            progress |= send_data(h2);
+
+        // Draining output frees room for more frames, so go around again.
+        if (h2->out_len)
+            progress = true;
+        switch (flush_output(h2, conn)) {
+        case FLUSH_DONE: break;
+        case FLUSH_BLOCKED: return pacing_blocked(conn);
+        case FLUSH_ERROR: return CONN_ERR_UNRECOVERABLE;
+        }
+        if (h2->closing || (h2->goaway && h2->active == 0))
+            return CONN_COMPLETE;
+        if (!progress)
+            return CONN_WAITING;
+    }
+}
+
+// pending is the length of what was read before the connection became
+// HTTP/2, which the input buffer has to take in whole.
+static struct h2_conn *create_conn(struct worker *worker, struct active_connection *conn, size_t pending) {
+    if (!set_nonblocking(conn->sock_fd)) {
+        log_perror(LOG_ERROR, "failed to change socket to nonblocking mode");
+        return NULL;
+    }
+    size_t max_streams = worker->settings->h2_max_streams;
+    struct h2_conn *h2 = calloc(1, sizeof(*h2) + max_streams * sizeof(h2->streams[0]));
+    if (h2 == NULL) {
+        log_msg(LOG_FATAL, "OOM");
+        exit(EXIT_FAILURE);
+    }
+    h2->max_streams = max_streams;
+    h2->decoder = hpack_decoder_create(H2_HEADER_TABLE_SIZE, H2_MAX_HEADER_LIST);
+    h2->scratch.minimum_block_size = H2_SCRATCH_BLOCK_SIZE;
+    h2->window = H2_DEFAULT_WINDOW;
+    h2->initial_window = H2_DEFAULT_WINDOW;
+    h2->max_frame = H2_MAX_FRAME_SIZE;
+    h2->client = conn->client;
+    // Room for a whole frame, and for whatever came with the first read. The
+    // request buffer that read went into can be larger than both, and its
+    // size may have changed on reload since.
+    h2->in_cap = worker->settings->read_buf_size;
+    if (h2->in_cap < H2_FRAME_HEADER_LEN + H2_MAX_FRAME_SIZE)
+        h2->in_cap = H2_FRAME_HEADER_LEN + H2_MAX_FRAME_SIZE;
+    if (h2->in_cap < pending)
+        h2->in_cap = pending;
+    h2->in = xrealloc(NULL, h2->in_cap);
+    put_settings(h2, worker->settings);
+    // Streams of different routes share the socket, so only pace_rate applies
+    // unless the upgrading request already set a rate.
+    pacing_start(worker, conn, NULL);
+    conn->h2 = h2;
+    return h2;
+}
+
+// data is whatever was read before the connection was known to be HTTP/2,
+// starting with the client preface.
+enum connection_state h2_start(struct worker *worker, struct active_connection *conn, const char *data, size_t len) {
+    struct h2_conn *h2 = create_conn(worker, conn, len);
+    if (h2 == NULL)
+        return CONN_ERR_UNRECOVERABLE;
+    memcpy(h2->in, data, len);
+    h2->in_len = len;
+    return h2_process(worker, conn);
+}
+
+static int base64url_value(char c) {
+    if (c >= 'A' && c <= 'Z')
+        return c - 'A';
+    if (c >= 'a' && c <= 'z')
+        return c - 'a' + 26;
+    if (c >= '0' && c <= '9')
+        return c - '0' + 52;
+    if (c == '-')
+        return 62;
+    if (c == '_')
+        return 63;
+    return -1;
+}
+
+static bool base64url_decode(const char *src, size_t len, uint8_t *dst, size_t dst_cap, size_t *dst_len) {
+    uint32_t acc = 0;
+    int bits = 0;
+    size_t n = 0;
+    for (size_t i = 0; i < len && src[i] != '='; ++i) {
+        int v = base64url_value(src[i]);
+        if (v < 0)
+            return false;
+        acc = acc << 6 | (uint32_t)v;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            if (n == dst_cap)
+                return false;
+            dst[n++] = (uint8_t)(acc >> bits);
+        }
+    }
+    *dst_len = n;
+    return true;
+}
+
+// Continues an HTTP/1.1 request that asked for h2c. The request becomes
+// stream 1, already closed by the client, and its response is the first
+// thing sent after the server preface. settings is the base64url encoded
+// SETTINGS payload from the HTTP2-Settings header.
+enum connection_state h2_upgrade(struct worker *worker, struct active_connection *conn, struct http_req *req,
+                                 const char *settings, size_t settings_len, const char *data, size_t len) {
+    uint8_t payload[256];
+    size_t payload_len;
+    if (!base64url_decode(settings, settings_len, payload, sizeof(payload), &payload_len) || payload_len % 6 != 0) {
+        log_msg(LOG_WARN, "invalid HTTP2-Settings");
+        return error_response(HTTP_BAD_REQUEST, conn);
+    }
+
+    static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+    if (conn_write(conn, switching, sizeof(switching) - 1) != (ssize_t)sizeof(switching) - 1) {
+        log_perror(LOG_ERROR, "failed to write to socket");
+        return CONN_ERR_UNRECOVERABLE;
+    }
+    struct h2_conn *h2 = create_conn(worker, conn, len);
+    if (h2 == NULL)
+        return CONN_ERR_UNRECOVERABLE;
+    if (apply_settings(h2, payload, payload_len) != H2_NO_ERROR) {
+        conn_error(h2, H2_PROTOCOL_ERROR, "invalid upgrade settings");
+        return h2_process(worker, conn);
+    }
+
+    // The upgrading request is stream 1, and the connection's first.
+    h2->last_stream_id = 1;
+    h2->requests = 1;
+    struct h2_stream *stream = open_stream(h2, 1);
+    if (stream == NULL) {
+        put_rst_stream(h2, 1, H2_REFUSED_STREAM);
+    } else {
+        stream->remote_closed = true;
+        struct memory_arena *saved = g_memory_arena;
+        g_memory_arena = &h2->scratch;
+        serve_stream(h2, worker, stream, req);
+        arena_clear(&h2->scratch);
+        g_memory_arena = saved;
+    }
+
+    memcpy(h2->in, data, len);
+    h2->in_len = len;
+    return h2_process(worker, conn);
+}
+
+void h2_conn_free(struct h2_conn *h2) {
+    for (size_t i = 0; i < h2->max_streams; ++i) {
+        if (h2->streams[i].id)
+            release_stream(h2, &h2->streams[i]);
+    }
+    hpack_decoder_destroy(h2->decoder);
+    arena_clear(&h2->scratch);
+    free(h2->header_block);
+    free(h2->in);
+    free(h2);
+}
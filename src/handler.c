@@ -7,16 +7,20 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/errno.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
 enum read_req_data_result {
     READ_REQ_DATA_OK,
+    READ_REQ_DATA_AGAIN,
     READ_REQ_DATA_EMPTY,
     READ_REQ_DATA_TOO_LARGE,
+    READ_REQ_DATA_ERROR,
 };
 
 enum get_head_info_result {
@@ -26,25 +30,170 @@ enum get_head_info_result {
     HEAD_INFO_OUTSIDE_DIR,
 };
 
-static enum read_req_data_result read_req_data(struct worker *worker, struct active_connection *conn, char **req_data) {
-    size_t size = worker->settings->read_buf_size;
-    assert(conn->read_buf == NULL);
-    assert(conn->read_buf_size == 0);
-    conn->read_buf = server_alloc(size);
-    conn->read_buf_size = size;
+// TLS connections go through the session, except that sends use the socket
+// directly once the kernel took over encryption.
+ssize_t conn_read(struct active_connection *conn, void *buf, size_t len) {
+    if (conn->tls)
+        return tls_read(conn->tls, buf, len);
+    return read(conn->sock_fd, buf, len);
+}
+
+ssize_t conn_write(struct active_connection *conn, const void *buf, size_t len) {
+    if (conn->tls && !tls_ktls_send(conn->tls))
+        return tls_write(conn->tls, buf, len);
+    return write(conn->sock_fd, buf, len);
+}
+
+// What of len the connection's budget for the round and its pacer let it
+// write now.
+static size_t body_allowance(struct active_connection *conn, size_t len) {
+    if (len > conn->send_budget)
+        len = conn->send_budget;
+    if (len && conn->pacer)
+        len = pacing_allow(conn->pacer, len);
+    return len;
+}
+
+static void body_sent(struct active_connection *conn, size_t len) {
+    conn->send_budget -= len < conn->send_budget ? len : conn->send_budget;
+    if (conn->pacer)
+        pacing_sent(conn->pacer, len);
+}
 
-    ssize_t nread = read(conn->sock_fd, conn->read_buf, conn->read_buf_size - 1);
-    if (nread < 0) {
-        log_perror(LOG_ERROR, "read socket failed");
-        conn->state = CONN_ERR_RECOVERABLE;
-        abort_req();
+// Response bodies are written against the connection's budget for the
+// round and its pacer. Running out of either looks like a full socket to
+// the caller, pacing_blocked tells them apart.
+ssize_t conn_write_body(struct active_connection *conn, const void *buf, size_t len) {
+    if ((len = body_allowance(conn, len)) == 0) {
+        errno = EAGAIN;
+        return -1;
     }
-    if (nread == 0) {
-        return READ_REQ_DATA_EMPTY;
+    ssize_t nwritten = conn_write(conn, buf, len);
+    if (nwritten > 0)
+        body_sent(conn, nwritten);
+    return nwritten;
+}
+
+static ssize_t conn_writev(struct active_connection *conn, const struct iovec *iov, int iovcnt) {
+    if (!conn->tls || tls_ktls_send(conn->tls))
+        return writev(conn->sock_fd, iov, iovcnt);
+
+    // One record for the whole response head.
+    char buffer[4096];
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; ++i) {
+        if (len + iov[i].iov_len > sizeof(buffer)) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+        memcpy(buffer + len, iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
+    }
+    return tls_write(conn->tls, buffer, len);
+}
+
+// A completed ring call as a syscall would have returned it.
+static ssize_t ring_result(struct active_connection *conn) {
+    conn->ring_op = RING_NONE;
+    if (conn->ring_res >= 0)
+        return conn->ring_res;
+    errno = -conn->ring_res;
+    return -1;
+}
+
+static void release_req_buf(struct worker *worker, struct active_connection *conn) {
+    buffer_pool_put(worker->req_buffers, conn->req_buf, conn->req_buf_size);
+    conn->req_buf = NULL;
+    conn->req_len = 0;
+}
+
+void release_conn_buffers(struct worker *worker, struct active_connection *conn) {
+    if (conn->req_buf)
+        release_req_buf(worker, conn);
+    if (conn->read_buf && conn->read_buf_index >= 0) {
+        uring_buffer_put(worker->uring, conn->read_buf_index);
+        conn->read_buf = NULL;
+        conn->read_buf_index = -1;
+    } else if (conn->read_buf) {
+        buffer_pool_put(worker->transfer_buffers, conn->read_buf, conn->read_buf_size);
+        conn->read_buf = NULL;
+    }
+    free(conn->io_job);
+    conn->io_job = NULL;
+}
+
+// Makes room for the next read of the request head in a small pooled buffer
+// that doubles up to req_size_limit, so a connection only holds what its
+// client has sent. False once the head fills the limit.
+static bool req_buf_room(struct worker *worker, struct active_connection *conn) {
+    if (conn->req_buf == NULL) {
+        conn->req_buf = buffer_pool_get(worker->req_buffers);
+        conn->req_buf_size = buffer_pool_size(worker->req_buffers);
+        conn->req_len = 0;
+    }
+    if (conn->req_len + 1 == conn->req_buf_size) {
+        size_t limit = worker->settings->req_size_limit;
+        if (conn->req_buf_size >= limit)
+            return false;
+        size_t size = conn->req_buf_size * 2 < limit ? conn->req_buf_size * 2 : limit;
+        conn->req_buf = buffer_pool_grow(worker->req_buffers, conn->req_buf, conn->req_buf_size, size);
+        conn->req_buf_size = size;
+    }
+    return true;
+}
+
+// Has the ring receive the next part of a plaintext request head straight
+// into the request buffer, in place of a poll and the read after it. The
+// buffer is held while the connection idles. False when the ring cannot
+// take it, the connection is polled then.
+bool ring_recv(struct worker *worker, struct active_connection *conn) {
+    if (!req_buf_room(worker, conn))
+        return false;
+    size_t space = conn->req_buf_size - 1 - conn->req_len;
+    if (!uring_prep_recv(worker->uring, conn->sock_fd, conn->req_buf + conn->req_len, space,
+                         (uint64_t)(uintptr_t)conn))
+        return false;
+    conn->ring_op = RING_RECV;
+    return true;
+}
+
+// Plain sockets still block at this point and get one read per wakeup, or
+// what the ring received for them, a TLS session is drained since it may
+// hold records no poll reports.
+static enum read_req_data_result read_req_data(struct worker *worker, struct active_connection *conn, char **req_data,
+                                               size_t *req_len) {
+    for (;;) {
+        if (!req_buf_room(worker, conn))
+            return READ_REQ_DATA_TOO_LARGE;
+
+        size_t space = conn->req_buf_size - 1 - conn->req_len;
+        ssize_t nread = conn->ring_op == RING_RECV ? ring_result(conn)
+                                                   : conn_read(conn, conn->req_buf + conn->req_len, space);
+        if (nread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // Idle connections keep no buffer.
+            if (conn->req_len == 0)
+                release_req_buf(worker, conn);
+            return READ_REQ_DATA_AGAIN;
+        }
+        if (nread < 0) {
+            log_perror(LOG_ERROR, "read socket failed");
+            return READ_REQ_DATA_ERROR;
+        }
+        if (nread == 0) {
+            return READ_REQ_DATA_EMPTY;
+        }
+
+        size_t scan = conn->req_len > 3 ? conn->req_len - 3 : 0;
+        conn->req_len += nread;
+        conn->req_buf[conn->req_len] = '\0';
+        if (strstr(conn->req_buf + scan, "\r\n\r\n")) {
+            *req_data = conn->req_buf;
+            *req_len = conn->req_len;
+            return READ_REQ_DATA_OK;
+        }
+        if ((size_t)nread < space || conn->tls == NULL)
+            return READ_REQ_DATA_AGAIN;
     }
-    conn->read_buf[nread] = '\0';
-    *req_data = conn->read_buf;
-    return READ_REQ_DATA_OK;
 }
 
 static struct http_header *make_header(const char *name, const char *value) {
@@ -54,49 +203,204 @@ static struct http_header *make_header(const char *name, const char *value) {
     return header;
 }
 
-static void http_response_date(char *buf, size_t buf_len, struct tm *tm) {
-    static const char *days[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
-    static const char *months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
-    snprintf(buf, buf_len, "%s, %d %s %d %02d:%02d:%02d GMT", days[tm->tm_wday], tm->tm_mday, months[tm->tm_mon],
-             tm->tm_year + 1900, tm->tm_hour, tm->tm_min, tm->tm_sec);
-}
 static struct http_header *make_date_header(void) {
+    char buffer[64] = {0};
+    http_format_date(buffer, sizeof(buffer), time(NULL));
+    return make_header("Date", server_strdup(buffer));
+}
+
+const char *worker_date(struct worker *worker) {
     time_t now = time(NULL);
-    struct tm *t = gmtime(&now);
+    if (now != worker->date_time) {
+        http_format_date(worker->date, sizeof(worker->date), now);
+        worker->date_time = now;
+    }
+    return worker->date;
+}
 
-    char buffer[4096] = {0};
-    http_response_date(buffer, sizeof(buffer), t);
-    return make_header("Date", server_strdup(buffer));
+// Body writes go to the ring where it takes them, on plaintext sockets and
+// ones the kernel encrypts for. The connection waits in CONN_IO and comes
+// back for the result, which is returned here then. *submitted tells the
+// caller to wait.
+static ssize_t write_body(struct worker *worker, struct active_connection *conn, const char *data, size_t len,
+                          bool *submitted) {
+    *submitted = false;
+    if (conn->ring_op == RING_SEND) {
+        ssize_t nwritten = ring_result(conn);
+        if (nwritten > 0)
+            body_sent(conn, nwritten);
+        return nwritten;
+    }
+    if (worker->uring && (conn->tls == NULL || tls_ktls_send(conn->tls))) {
+        size_t allowed = body_allowance(conn, len);
+        if (allowed && uring_prep_send(worker->uring, conn->sock_fd, data, allowed, (uint64_t)(uintptr_t)conn)) {
+            conn->ring_op = RING_SEND;
+            *submitted = true;
+            return 0;
+        }
+    }
+    return conn_write_body(conn, data, len);
 }
 
-void process_request_write(struct active_connection *conn) {
+// Writes never touch a mapping from user space, so a file truncated under
+// us shows up as EFAULT from write() instead of SIGBUS.
+static enum connection_state write_memory(struct worker *worker, struct active_connection *conn, const char *data,
+                                          size_t size) {
+    while (conn->body_cursor < size) {
+        bool submitted;
+        ssize_t nwritten = write_body(worker, conn, data + conn->body_cursor, size - conn->body_cursor, &submitted);
+        if (submitted) {
+            return CONN_IO;
+        }
+        if (nwritten == -1 && (errno == EWOULDBLOCK || errno == EAGAIN)) {
+            return pacing_blocked(conn);
+        }
+        if (nwritten == -1 && errno == EFAULT && conn->mapping) {
+            log_msg(LOG_WARN, "file changed while sending from mapping");
+            conn->mapping->stale = true;
+            return CONN_ERR_UNRECOVERABLE;
+        }
+        if (nwritten == -1) {
+            log_perror(LOG_ERROR, "failed to write to socket");
+            return CONN_ERR_UNRECOVERABLE;
+        }
+        conn->body_cursor += nwritten;
+    }
+    return CONN_COMPLETE;
+}
+
+// Filesystem calls of one request on an I/O thread: the lookup and open of
+// the file, or one read of it while it is sent. Each connection keeps its job
+// until it closes. Only run_file_job touches it while it is queued, and
+// that never uses the arena or other event loop state. Lookups on the ring
+// keep their state here as well.
+struct file_job {
+    struct io_job job;
+    enum { FILE_JOB_LOOKUP, FILE_JOB_READ, FILE_JOB_READ_IN } op;
+    int fd;
+    int err;
+
+    struct http_req req;
+    struct static_root *root; // referenced while the job looks up or opens a path
+    bool autoindex;
+    uint64_t seq;
+    const char *cached_path; // from the path cache, NULL to resolve
+    char *resolved;
+    struct file_info info;
+    enum http_status_code status;
+
+    char *buf;
+    size_t size;
+    ssize_t nread;
+
+    struct inflight_table *inflight; // for a read in, the file is sent from fd afterwards
+    uint64_t key;
+    const char *full_path;
+
+    struct uring_statx stx;
+};
+
+static void run_file_job(struct io_job *io_job);
+
+static struct file_job *file_job(struct active_connection *conn) {
+    if (conn->io_job == NULL) {
+        struct file_job *job = calloc(1, sizeof(*job));
+        if (job == NULL) {
+            log_msg(LOG_FATAL, "OOM");
+            exit(EXIT_FAILURE);
+        }
+        job->job.run = run_file_job;
+        job->job.conn = conn;
+        conn->io_job = &job->job;
+    }
+    return (struct file_job *)conn->io_job;
+}
+
+static enum connection_state submit_read(struct worker *worker, struct active_connection *conn) {
+    struct file_job *job = file_job(conn);
+    job->op = FILE_JOB_READ;
+    job->fd = conn->file_fd;
+    job->buf = conn->read_buf;
+    job->size = conn->read_buf_size;
+    io_pool_submit(worker->io_pool, &job->job);
+    return CONN_IO;
+}
+
+// Sends what is left of a response head before its body. Heads are not
+// paced and not held to the round's budget.
+static enum connection_state write_head(struct active_connection *conn) {
+    while (conn->head_len) {
+        ssize_t nwritten = conn_write(conn, conn->head, conn->head_len);
+        if (nwritten == -1 && (errno == EWOULDBLOCK || errno == EAGAIN))
+            return CONN_SENDING;
+        if (nwritten == -1) {
+            log_perror(LOG_ERROR, "failed to write to socket");
+            return CONN_ERR_UNRECOVERABLE;
+        }
+        conn->head += nwritten;
+        conn->head_len -= nwritten;
+    }
+    return CONN_COMPLETE;
+}
+
+enum connection_state process_request_write(struct worker *worker, struct active_connection *conn) {
+    if (conn->head_len) {
+        enum connection_state state = write_head(conn);
+        if (state != CONN_COMPLETE || conn->head_only)
+            return state;
+    }
+    if (conn->mapping)
+        return write_memory(worker, conn, conn->mapping->data, conn->mapping->size);
+    if (conn->listing)
+        return write_memory(worker, conn, conn->listing->body, conn->listing->body_len);
+    if (conn->pack_body)
+        return write_memory(worker, conn, conn->pack_body, conn->pack_body_len);
+
     assert(conn->file_fd != -1);
+    // Only connections copying a file hold a transfer buffer, until they
+    // close. One registered with the ring is taken while there are any.
+    if (conn->read_buf == NULL) {
+        conn->read_buf_size = buffer_pool_size(worker->transfer_buffers);
+        if (worker->uring)
+            conn->read_buf = uring_buffer_get(worker->uring, &conn->read_buf_index);
+        if (conn->read_buf == NULL)
+            conn->read_buf = buffer_pool_get(worker->transfer_buffers);
+    }
     for (;;) {
         if (conn->read_buf_len == 0 || conn->read_buf_cursor == conn->read_buf_len) {
+            // At the file position, as a read would, offset -1 on the ring.
+            if (worker->uring && uring_prep_read(worker->uring, conn->file_fd, conn->read_buf, conn->read_buf_size,
+                                                 (uint64_t)-1, conn->read_buf_index, (uint64_t)(uintptr_t)conn)) {
+                conn->ring_op = RING_READ;
+                return CONN_IO;
+            }
+            if (worker->io_pool)
+                return submit_read(worker, conn);
             ssize_t nread = read(conn->file_fd, conn->read_buf, conn->read_buf_size);
             if (nread == 0) {
-                conn->state = CONN_COMPLETE;
-                break;
+                return CONN_COMPLETE;
             }
             if (nread == -1) {
                 log_perror(LOG_ERROR, "failed to read from file");
-                conn->state = CONN_ERR_UNRECOVERABLE;
-                abort_req();
+                return CONN_ERR_UNRECOVERABLE;
             }
             conn->read_buf_len = nread;
             conn->read_buf_cursor = 0;
         }
 
         assert(conn->read_buf_len > conn->read_buf_cursor);
-        ssize_t nwritten =
-            write(conn->sock_fd, conn->read_buf + conn->read_buf_cursor, conn->read_buf_len - conn->read_buf_cursor);
+        bool submitted;
+        ssize_t nwritten = write_body(worker, conn, conn->read_buf + conn->read_buf_cursor,
+                                      conn->read_buf_len - conn->read_buf_cursor, &submitted);
+        if (submitted) {
+            return CONN_IO;
+        }
         if (nwritten == -1 && (errno == EWOULDBLOCK || errno == EAGAIN)) {
-            break;
+            return pacing_blocked(conn);
         }
         if (nwritten == -1) {
             log_perror(LOG_ERROR, "failed to write to socket");
-            conn->state = CONN_ERR_UNRECOVERABLE;
-            abort_req();
+            return CONN_ERR_UNRECOVERABLE;
         }
         conn->read_buf_cursor += nwritten;
     }
@@ -109,7 +413,15 @@ bool set_nonblocking(int fd) {
     return fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
 }
 
-static void send_response(struct http_response *resp, struct active_connection *conn) {
+static enum connection_state start_file_write(struct worker *worker, struct active_connection *conn) {
+    if (!set_nonblocking(conn->sock_fd)) {
+        log_perror(LOG_ERROR, "failed to change socket to nonblocking mode");
+        return CONN_ERR_UNRECOVERABLE;
+    }
+    return process_request_write(worker, conn);
+}
+
+static enum connection_state send_response(struct http_response *resp, struct active_connection *conn) {
     char buffer[4096];
     int cursor = snprintf(buffer, sizeof(buffer), "HTTP/1.1 %d %s\r\n", http_status_code_int(resp->code),
                           http_status_code_str(resp->code));
@@ -123,179 +435,714 @@ static void send_response(struct http_response *resp, struct active_connection *
         cursor += c;
     }
 
-    ssize_t nwritten = write(conn->sock_fd, buffer, cursor);
+    ssize_t nwritten = conn_write(conn, buffer, cursor);
     if (nwritten == -1) {
         log_perror(LOG_ERROR, "failed to write to socket");
-        conn->state = CONN_ERR_UNRECOVERABLE;
-        abort_req();
+        return CONN_ERR_UNRECOVERABLE;
     }
 
     if (!resp->req || resp->req->method == HTTP_HEAD) {
-        conn->state = CONN_COMPLETE;
-        return;
-    }
-
-    if (!set_nonblocking(conn->sock_fd)) {
-        log_perror(LOG_ERROR, "failed to change socket to nonblocking mode");
-        conn->state = CONN_ERR_UNRECOVERABLE;
-        abort_req();
+        return CONN_COMPLETE;
     }
 
-    if (conn->file_fd != -1) {
-        conn->state = CONN_SENDING;
-        process_request_write(conn);
-    } else if (resp->body) {
-        if (write(conn->sock_fd, resp->body, resp->body_size) != (ssize_t)resp->body_size) {
+    if (resp->body) {
+        if (conn_write(conn, resp->body, resp->body_size) != (ssize_t)resp->body_size) {
             log_perror(LOG_ERROR, "failed to write to socket");
-            conn->state = CONN_ERR_UNRECOVERABLE;
-            abort_req();
+            return CONN_ERR_UNRECOVERABLE;
         }
-        conn->state = CONN_COMPLETE;
-    } else {
-        conn->state = CONN_COMPLETE;
     }
+    return CONN_COMPLETE;
 }
 
-void error_response(enum http_status_code code, struct active_connection *conn) {
+enum connection_state error_response(enum http_status_code code, struct active_connection *conn) {
     log_msg(LOG_INFO, "error response %d", http_status_code_int(code));
     struct http_response resp = {0};
     resp.req = NULL;
     resp.code = code;
     resp.headers = lappend(resp.headers, make_date_header());
     resp.headers = lappend(resp.headers, make_header("Content-Length", "0"));
-    send_response(&resp, conn);
+    return send_response(&resp, conn);
 }
 
-struct file_info {
-    size_t size;
-    enum http_content_type ct;
-};
+// Where a directory requested without its trailing slash is. The target as
+// sent keeps its encoding, the slash goes before the query.
+char *dir_location(const struct http_req *req) {
+    size_t len = strcspn(req->uri, "?");
+    return server_memfmt("%.*s/%s", (int)len, req->uri, req->uri + len);
+}
+
+static enum connection_state dir_redirect(struct http_req *req, struct active_connection *conn) {
+    log_msg(LOG_INFO, "redirect to %s/", req->path);
+    struct http_response resp = {0};
+    resp.req = NULL;
+    resp.code = HTTP_MOVED_PERMANENTLY;
+    resp.headers = lappend(resp.headers, make_date_header());
+    resp.headers = lappend(resp.headers, make_header("Location", dir_location(req)));
+    resp.headers = lappend(resp.headers, make_header("Content-Length", "0"));
+    return send_response(&resp, conn);
+}
 
-static bool get_file_info(const char *full_path, struct active_connection *conn, struct file_info *info) {
+// Answers a connection turned away at accept and closes it. Nothing is
+// allocated, and the socket is fresh, so the single write does not block.
+void reject_connection(struct worker *worker, int fd, enum http_status_code code, int retry_after) {
+    char buffer[256];
+    int len = snprintf(buffer, sizeof(buffer),
+                       "HTTP/1.1 %d %s\r\nDate: %s\r\nRetry-After: %d\r\nContent-Length: 0\r\n"
+                       "Connection: Close\r\n\r\n",
+                       http_status_code_int(code), http_status_code_str(code), worker_date(worker), retry_after);
+    if (send(fd, buffer, len, MSG_DONTWAIT) == -1)
+        log_perror(LOG_TRACE, "failed to send rejection");
+    close(fd);
+}
+
+enum http_status_code errno_status(int err) {
+    switch (err) {
+    case EACCES: return HTTP_FORBIDDEN;
+    case ENOTDIR:
+    case ENOENT: return HTTP_NOT_FOUND;
+    default: return HTTP_INTERNAL_SERVER_ERROR;
+    }
+}
+
+// Only regular files and directories are served.
+static enum http_status_code stat_file_info(const struct vhost_settings *site, const struct stat *st,
+                                            const char *full_path, struct file_info *info) {
+    if (!S_ISREG(st->st_mode) && !S_ISDIR(st->st_mode))
+        return HTTP_FORBIDDEN;
+
+    info->ct = vhost_content_type(site, full_path);
+    info->is_dir = S_ISDIR(st->st_mode);
+    info->size = st->st_size;
+    info->dev = st->st_dev;
+    info->ino = st->st_ino;
+    info->mtime = st->st_mtime;
+    return HTTP_OK;
+}
+
+static enum http_status_code get_file_info(const struct vhost_settings *site, int fd, const char *full_path,
+                                           struct file_info *info) {
     struct stat st;
-    if (stat(full_path, &st) < 0) {
-        int err = errno;
-        switch (err) {
-        case EACCES: error_response(HTTP_FORBIDDEN, conn); return false;
-        case ENOTDIR:
-        case ENOENT: error_response(HTTP_NOT_FOUND, conn); return false;
-        default: error_response(HTTP_INTERNAL_SERVER_ERROR, conn); return false;
-        }
+    if (fstat(fd, &st) < 0) {
+        return errno_status(errno);
     }
+    return stat_file_info(site, &st, full_path, info);
+}
 
-    info->ct = http_conten_type_from_filename(full_path);
-    info->size = st.st_size;
-    return true;
+static const char *arena_path(char *path) {
+    const char *copy = server_strdup(path);
+    free(path);
+    return copy;
 }
 
-static const char *resolve_path(const char *uri, struct worker *worker, struct active_connection *conn) {
-    if (strcmp(uri, "/") == 0 || strcmp(uri, "") == 0) {
-        uri = "index.html";
+static enum dir_listing_format listing_format(const char *uri) {
+    const char *query = strchr(uri, '?');
+    while (query) {
+        ++query;
+        size_t len = strcspn(query, "&");
+        if (len == 11 && memcmp(query, "format=json", 11) == 0)
+            return DIR_LISTING_JSON;
+        query = strchr(query, '&');
     }
-    
-    char path_buf[4096];
-    snprintf(path_buf, sizeof(path_buf), "%s/%s", worker->settings->static_dir, uri);
+    return DIR_LISTING_HTML;
+}
 
-    char *full_path = realpath(path_buf, NULL);
-    if (full_path == NULL) {
-        int err = errno;
-        switch (err) {
-        case EACCES: error_response(HTTP_FORBIDDEN, conn); return NULL;
-        case ENOTDIR:
-        case ENOENT: error_response(HTTP_NOT_FOUND, conn); return NULL;
-        default: error_response(HTTP_INTERNAL_SERVER_ERROR, conn); return NULL;
+static enum http_status_code get_listing(struct http_req *req, struct worker *worker, const char *full_path,
+                                         const struct file_info *info, struct dir_listing **listing) {
+    if (worker->dir_index == NULL)
+        worker->dir_index = dir_index_cache_create(worker->settings->dir_index_cache_size);
+
+    // Listings link to entries relative to the request path, so it has to end
+    // with a slash. Without one the client is sent to the path that has it.
+    if (req->path[strlen(req->path) - 1] != '/')
+        return HTTP_MOVED_PERMANENTLY;
+
+    const struct fs_generations *gens = fs_generations_active(worker->fs_gens) ? worker->fs_gens : NULL;
+    assert(*listing == NULL);
+    *listing = dir_index_get(worker->dir_index, gens, req->vhost->root, full_path, req->path, info,
+                             listing_format(req->uri),
+                             worker->settings->dir_index_max_age);
+    return *listing ? HTTP_OK : HTTP_INTERNAL_SERVER_ERROR;
+}
+
+// Opens the file a normalized request path names beneath the root, which
+// leaves the file open in fd. A directory is served through its index.html,
+// or as a listing when autoindex is on, with fd -1. Runs on I/O threads as
+// well, so full_path is malloc'ed rather than taken from the arena. site
+// overrides content types, NULL for static_dir.
+static enum http_status_code resolve_file(const struct static_root *root, const struct vhost_settings *site,
+                                          bool autoindex, const char *path, char **full_path, struct file_info *info,
+                                          int *fd) {
+    *fd = static_root_openat(root, path, full_path);
+    if (*fd == -1)
+        return errno_status(errno);
+    enum http_status_code status = get_file_info(site, *fd, *full_path, info);
+    if (status == HTTP_OK && !info->is_dir)
+        return HTTP_OK;
+    close(*fd);
+    *fd = -1;
+    if (status != HTTP_OK) {
+        free(*full_path);
+        return status;
+    }
+
+    size_t len = strlen(path);
+    char *index_path = malloc(len + sizeof("/index.html"));
+    if (index_path == NULL) {
+        log_msg(LOG_FATAL, "OOM");
+        exit(EXIT_FAILURE);
+    }
+    sprintf(index_path, "%s%sindex.html", path, path[len - 1] == '/' ? "" : "/");
+    char *index_full_path;
+    int index_fd = static_root_openat(root, index_path, &index_full_path);
+    free(index_path);
+    struct file_info index_info;
+    status = index_fd == -1 ? errno_status(errno) : get_file_info(site, index_fd, index_full_path, &index_info);
+    if (status == HTTP_OK && !index_info.is_dir) {
+        free(*full_path);
+        *full_path = index_full_path;
+        *info = index_info;
+        *fd = index_fd;
+        return HTTP_OK;
+    }
+    if (index_fd != -1) {
+        close(index_fd);
+        free(index_full_path);
+    }
+    bool missing = status == HTTP_OK || status == HTTP_NOT_FOUND;
+    if (missing && autoindex)
+        return HTTP_OK;
+    free(*full_path);
+    return missing ? HTTP_FORBIDDEN : status;
+}
+
+// While the static directory is watched, a request path seen before skips
+// the lookup entirely and fd is -1. Otherwise fd is the file opened while
+// resolving it. Directories come back as a listing.
+enum http_status_code lookup_file(struct http_req *req, struct worker *worker, const char **full_path,
+                                  struct file_info *info, struct dir_listing **listing, int *fd) {
+    *fd = -1;
+    struct vhost *vhost = req->vhost;
+    size_t path_len = strlen(req->path);
+    if (!path_cache_get(vhost->path_cache, worker->fs_gens, req->path, path_len, full_path, info)) {
+        uint64_t seq = fs_generation_seq(worker->fs_gens);
+        char *path;
+        enum http_status_code status = resolve_file(vhost->root, vhost->settings, vhost_autoindex(worker, vhost),
+                                                    req->path, &path, info, fd);
+        if (status != HTTP_OK)
+            return status;
+        *full_path = arena_path(path);
+        path_cache_put(vhost->path_cache, worker->fs_gens, seq, req->path, path_len, *full_path, info);
+    }
+    if (info->is_dir)
+        return get_listing(req, worker, *full_path, info, listing);
+    return HTTP_OK;
+}
+
+static enum connection_state send_header_block(const struct header_block *block, struct http_req *req,
+                                               struct worker *worker, struct active_connection *conn) {
+    struct iovec iov[3];
+    iov[0].iov_base = (void *)block->data;
+    iov[0].iov_len = block->date_offset;
+    iov[1].iov_base = (void *)worker_date(worker);
+    iov[1].iov_len = HTTP_DATE_LEN;
+    iov[2].iov_base = (void *)(block->data + block->date_offset);
+    iov[2].iov_len = block->len - block->date_offset;
+
+    size_t len = iov[0].iov_len + iov[1].iov_len + iov[2].iov_len;
+    ssize_t nwritten = conn_writev(conn, iov, 3);
+    if (nwritten == -1 && (errno == EWOULDBLOCK || errno == EAGAIN))
+        nwritten = 0;
+    if (nwritten == -1) {
+        log_perror(LOG_ERROR, "failed to write to socket");
+        return CONN_ERR_UNRECOVERABLE;
+    }
+
+    bool head_only = req->method == HTTP_HEAD ||
+                     (conn->file_fd == -1 && conn->mapping == NULL && conn->listing == NULL && conn->pack_body == NULL);
+    // TLS sockets are nonblocking by now and can be full already. The rest
+    // is copied, the cached block may be replaced before it goes out.
+    if ((size_t)nwritten < len) {
+        conn->head_len = len - nwritten;
+        conn->head = server_alloc(conn->head_len);
+        size_t copied = 0;
+        size_t skip = nwritten;
+        for (int i = 0; i < 3; ++i) {
+            if (skip >= iov[i].iov_len) {
+                skip -= iov[i].iov_len;
+                continue;
+            }
+            memcpy(conn->head + copied, (const char *)iov[i].iov_base + skip, iov[i].iov_len - skip);
+            copied += iov[i].iov_len - skip;
+            skip = 0;
+        }
+        conn->head_only = head_only;
+        if (!set_nonblocking(conn->sock_fd)) {
+            log_perror(LOG_ERROR, "failed to change socket to nonblocking mode");
+            return CONN_ERR_UNRECOVERABLE;
         }
+        return CONN_SENDING;
     }
-    if (strncmp(full_path, worker->settings->static_dir, strlen(worker->settings->static_dir)) != 0) {
-        log_msg(LOG_WARN, "attempt to access file outside of static directory");
-        error_response(HTTP_FORBIDDEN, conn);
-        free(full_path);
-        return NULL;
+    if (head_only)
+        return CONN_COMPLETE;
+    return start_file_write(worker, conn);
+}
+
+static enum connection_state serve_head_file(struct http_req *req, struct worker *worker,
+                                             struct active_connection *conn, const char *full_path,
+                                             const struct file_info *info) {
+    if (conn->listing)
+        return send_header_block(&conn->listing->head, req, worker, conn);
+
+    const struct header_block *block = header_cache_get(worker->header_cache, full_path, info);
+    if (!block)
+        return error_response(HTTP_INTERNAL_SERVER_ERROR, conn);
+    return send_header_block(block, req, worker, conn);
+}
+
+// fd is the file opened by the lookup, or -1 to open it here. It is
+// closed when the response is served otherwise.
+static enum connection_state send_file(struct http_req *req, struct worker *worker,
+                                       struct active_connection *conn, const char *full_path,
+                                       const struct file_info *info, int fd) {
+    const struct header_block *block = header_cache_get(worker->header_cache, full_path, info);
+    if (!block) {
+        if (fd != -1)
+            close(fd);
+        return error_response(HTTP_INTERNAL_SERVER_ERROR, conn);
+    }
+
+    // Encrypting in user space would read the mapping directly, where a
+    // truncated file raises SIGBUS instead of failing the send.
+    if (worker->mmap_cache && (conn->tls == NULL || tls_ktls_send(conn->tls))) {
+        conn->mapping = mmap_cache_get(worker->mmap_cache, req->vhost->root, full_path, info);
+        if (conn->mapping) {
+            if (fd != -1)
+                close(fd);
+            return send_header_block(block, req, worker, conn);
+        }
     }
 
-    size_t len = strlen(full_path);
-    char *str = arena_alloc(g_memory_arena, len + 1);
-    if (!str) {
-        free(full_path);
-        error_response(HTTP_INTERNAL_SERVER_ERROR, conn);
-        return NULL;
+    if (fd == -1)
+        fd = static_root_reopen(req->vhost->root, full_path);
+    if (fd == -1)
+        return error_response(errno_status(errno), conn);
+    assert(conn->file_fd == -1);
+    conn->file_fd = fd;
+
+    return send_header_block(block, req, worker, conn);
+}
+
+static bool coalesced(const struct server_settings *settings, const struct file_info *info) {
+    return settings->coalesce_min_size && info->size >= settings->coalesce_min_size &&
+           info->size <= settings->coalesce_max_size;
+}
+
+// The file is sent once the thread has read it in.
+static enum connection_state submit_read_in(struct http_req *req, struct worker *worker,
+                                            struct active_connection *conn, const char *full_path,
+                                            const struct file_info *info, int fd, uint64_t key) {
+    struct file_job *job = file_job(conn);
+    job->op = FILE_JOB_READ_IN;
+    job->req = *req;
+    job->full_path = full_path;
+    job->info = *info;
+    job->fd = fd;
+    job->inflight = worker->inflight;
+    job->key = key;
+    job->buf = buffer_pool_get(worker->transfer_buffers);
+    job->size = buffer_pool_size(worker->transfer_buffers);
+    io_pool_submit(worker->io_pool, &job->job);
+    return CONN_IO;
+}
+
+// A large file that is not in the page cache yet is read in by the first
+// worker to ask for it, on an I/O thread when there are any, while requests
+// in other workers are parked until it is instead of each reading it from
+// disk.
+static enum connection_state serve_get_file(struct http_req *req, struct worker *worker,
+                                            struct active_connection *conn, const char *full_path,
+                                            const struct file_info *info, int fd) {
+    if (conn->listing)
+        return send_header_block(&conn->listing->head, req, worker, conn);
+    if (!coalesced(worker->settings, info))
+        return send_file(req, worker, conn, full_path, info, fd);
+
+    if (fd == -1)
+        fd = static_root_reopen(req->vhost->root, full_path);
+    if (fd == -1)
+        return error_response(errno_status(errno), conn);
+    uint64_t key;
+    switch (inflight_claim(worker->inflight, fd, info, &key)) {
+    case INFLIGHT_CACHED: break;
+    case INFLIGHT_LOADING:
+        close(fd);
+        conn->inflight_key = key;
+        return CONN_PARKED;
+    case INFLIGHT_CLAIMED: {
+        if (worker->io_pool)
+            return submit_read_in(req, worker, conn, full_path, info, fd, key);
+        char *buf = buffer_pool_get(worker->transfer_buffers);
+        size_t size = buffer_pool_size(worker->transfer_buffers);
+        inflight_read_in(worker->inflight, key, fd, buf, size);
+        buffer_pool_put(worker->transfer_buffers, buf, size);
+        inflight_release(worker->inflight, key);
+        break;
     }
-    memcpy(str, full_path, len);
-    str[len] = '\0';
-    free(full_path);
-    return str;
+    }
+    return send_file(req, worker, conn, full_path, info, fd);
 }
 
-static void serve_head_request(struct http_req *req, struct worker *worker, struct active_connection *conn) {
-    const char *full_path = resolve_path(req->uri, worker, conn);
-    if (!full_path)
+static void run_file_job(struct io_job *io_job) {
+    struct file_job *job = (struct file_job *)io_job;
+    if (job->op == FILE_JOB_READ) {
+        job->nread = read(job->fd, job->buf, job->size);
+        job->err = errno;
+        return;
+    }
+    if (job->op == FILE_JOB_READ_IN) {
+        inflight_read_in(job->inflight, job->key, job->fd, job->buf, job->size);
         return;
+    }
 
-    struct file_info info;
-    if (!get_file_info(full_path, conn, &info))
+    job->fd = -1;
+    job->status = HTTP_OK;
+    if (job->cached_path == NULL) {
+        job->status =
+            resolve_file(job->root, job->req.vhost->settings, job->autoindex, job->req.path, &job->resolved,
+                         &job->info, &job->fd);
+        if (job->fd != -1 && job->req.method == HTTP_HEAD) {
+            close(job->fd);
+            job->fd = -1;
+        }
         return;
+    }
+    if (job->req.method == HTTP_GET && !job->info.is_dir) {
+        job->fd = static_root_reopen(job->root, job->cached_path);
+        job->err = errno;
+    }
+}
 
-    struct http_response resp = {0};
-    resp.req = req;
-    resp.code = HTTP_OK;
-    resp.headers = lappend(resp.headers, make_date_header());
-    resp.headers = lappend(resp.headers, make_header("Content-Length", server_memfmt("%zu", info.size)));
-    resp.headers = lappend(resp.headers, make_header("Content-Type", http_content_type_str(info.ct)));
-    resp.headers = lappend(resp.headers, make_header("Connection", "Close"));
-    send_response(&resp, conn);
+// The path cache is consulted here, so a hit only leaves the open to the
+// thread.
+static enum connection_state submit_lookup(struct http_req *req, struct worker *worker,
+                                           struct active_connection *conn) {
+    struct file_job *job = file_job(conn);
+    job->op = FILE_JOB_LOOKUP;
+    job->req = *req;
+    job->resolved = NULL;
+    // Cache entries may be replaced while the job runs, so the hit is copied.
+    const char *cached;
+    struct vhost *vhost = req->vhost;
+    // A reload may replace the settings and the root while the job runs.
+    job->root = static_root_ref(vhost->root);
+    if (path_cache_get(vhost->path_cache, worker->fs_gens, req->path, strlen(req->path), &cached, &job->info)) {
+        job->cached_path = server_strdup(cached);
+    } else {
+        job->cached_path = NULL;
+        job->seq = fs_generation_seq(worker->fs_gens);
+        job->autoindex = vhost_autoindex(worker, vhost);
+    }
+    io_pool_submit(worker->io_pool, &job->job);
+    return CONN_IO;
 }
 
-static void serve_get_request(struct http_req *req, struct worker *worker, struct active_connection *conn) {
-    const char *full_path = resolve_path(req->uri, worker, conn);
-    if (!full_path)
-        return;
+static enum connection_state finish_lookup(struct file_job *job, struct worker *worker,
+                                           struct active_connection *conn) {
+    struct http_req *req = &job->req;
+    const char *full_path = job->cached_path;
+    static_root_release(job->root);
+    job->root = NULL;
+    if (full_path == NULL) {
+        if (job->status != HTTP_OK)
+            return error_response(job->status, conn);
+        full_path = arena_path(job->resolved);
+        job->resolved = NULL;
+        path_cache_put(req->vhost->path_cache, worker->fs_gens, job->seq, req->path, strlen(req->path), full_path,
+                       &job->info);
+    }
+    if (job->info.is_dir) {
+        enum http_status_code status = get_listing(req, worker, full_path, &job->info, &conn->listing);
+        if (status == HTTP_MOVED_PERMANENTLY)
+            return dir_redirect(req, conn);
+        if (status != HTTP_OK)
+            return error_response(status, conn);
+    }
+    if (req->method == HTTP_HEAD)
+        return serve_head_file(req, worker, conn, full_path, &job->info);
+    if (job->fd == -1 && !job->info.is_dir)
+        return error_response(errno_status(job->err), conn);
+    return serve_get_file(req, worker, conn, full_path, &job->info, job->fd);
+}
+
+static enum connection_state lookup_file_request(struct http_req *req, struct worker *worker,
+                                                 struct active_connection *conn);
 
+// The ring opens the file beneath the root, and stats it as well when the
+// path cache has no entry for it. Anything more, a directory's index.html
+// or listing, is left to the other lookup. False when the ring cannot take
+// the open.
+static bool ring_lookup(struct http_req *req, struct worker *worker, struct active_connection *conn) {
+    struct vhost *vhost = req->vhost;
+    const char *cached;
     struct file_info info;
-    if (!get_file_info(full_path, conn, &info))
-        return;
+    bool hit = path_cache_get(vhost->path_cache, worker->fs_gens, req->path, strlen(req->path), &cached, &info);
+    // Nothing to open.
+    if (hit && (req->method == HTTP_HEAD || info.is_dir))
+        return false;
+
+    struct file_job *job = file_job(conn);
+    job->req = *req;
+    job->fd = -1;
+    const char *rel = job->req.path;
+    if (hit) {
+        // The cache may reuse the entry before the ring reads the path.
+        job->cached_path = server_strdup(cached);
+        job->info = info;
+        if ((rel = static_root_relative(vhost->root, job->cached_path)) == NULL)
+            return false;
+    } else {
+        job->cached_path = NULL;
+        job->seq = fs_generation_seq(worker->fs_gens);
+    }
+    if (!static_root_ring_open(vhost->root, worker->uring, rel, (uint64_t)(uintptr_t)conn))
+        return false;
+    // A reload may replace the settings and the root before it completes.
+    job->root = static_root_ref(vhost->root);
+    conn->ring_op = RING_OPEN;
+    return true;
+}
+
+static enum connection_state finish_ring_stat(struct file_job *job, struct worker *worker,
+                                              struct active_connection *conn, enum http_status_code status,
+                                              const struct stat *st) {
+    struct http_req *req = &job->req;
+    char *path = NULL;
+    if (status == HTTP_OK) {
+        path = static_root_ring_path(job->root, job->fd, req->path);
+        status = stat_file_info(req->vhost->settings, st, path, &job->info);
+    }
+    static_root_release(job->root);
+    job->root = NULL;
+    if (status != HTTP_OK || job->info.is_dir || req->method == HTTP_HEAD) {
+        close(job->fd);
+        job->fd = -1;
+    }
+    if (status != HTTP_OK) {
+        free(path);
+        return error_response(status, conn);
+    }
+    if (job->info.is_dir) {
+        free(path);
+        return lookup_file_request(req, worker, conn);
+    }
+
+    const char *full_path = arena_path(path);
+    path_cache_put(req->vhost->path_cache, worker->fs_gens, job->seq, req->path, strlen(req->path), full_path,
+                   &job->info);
+    if (req->method == HTTP_HEAD)
+        return serve_head_file(req, worker, conn, full_path, &job->info);
+    return serve_get_file(req, worker, conn, full_path, &job->info, job->fd);
+}
+
+static enum connection_state finish_ring_open(struct file_job *job, struct worker *worker,
+                                              struct active_connection *conn) {
+    conn->ring_op = RING_NONE;
+    int fd = static_root_ring_opened(conn->ring_res);
+    if (fd == -1 || job->cached_path) {
+        enum http_status_code status = fd == -1 ? errno_status(errno) : HTTP_OK;
+        static_root_release(job->root);
+        job->root = NULL;
+        if (status != HTTP_OK)
+            return error_response(status, conn);
+        return serve_get_file(&job->req, worker, conn, job->cached_path, &job->info, fd);
+    }
+    job->fd = fd;
+    if (uring_prep_statx(worker->uring, fd, &job->stx, (uint64_t)(uintptr_t)conn)) {
+        conn->ring_op = RING_STATX;
+        return CONN_IO;
+    }
+    struct stat st;
+    enum http_status_code status = fstat(fd, &st) == 0 ? HTTP_OK : errno_status(errno);
+    return finish_ring_stat(job, worker, conn, status, &st);
+}
 
-    int fd = open(full_path, O_RDONLY);
-    if (fd == -1) {
-        int err = errno;
-        switch (err) {
-        case EACCES: error_response(HTTP_FORBIDDEN, conn); return;
-        case ENOTDIR:
-        case ENOENT: error_response(HTTP_NOT_FOUND, conn); return;
-        default: error_response(HTTP_INTERNAL_SERVER_ERROR, conn); return;
+// A call the ring made for the connection completed.
+static enum connection_state finish_ring(struct worker *worker, struct active_connection *conn) {
+    struct file_job *job = (struct file_job *)conn->io_job;
+    switch (conn->ring_op) {
+    case RING_OPEN: return finish_ring_open(job, worker, conn);
+    case RING_STATX: {
+        struct stat st;
+        enum http_status_code status = ring_result(conn) == -1 ? errno_status(errno) : HTTP_OK;
+        if (status == HTTP_OK)
+            uring_statx_stat(&job->stx, &st);
+        return finish_ring_stat(job, worker, conn, status, &st);
+    }
+    case RING_READ: {
+        ssize_t nread = ring_result(conn);
+        if (nread == -1) {
+            log_perror(LOG_ERROR, "failed to read from file");
+            return CONN_ERR_UNRECOVERABLE;
         }
+        if (nread == 0)
+            return CONN_COMPLETE;
+        conn->read_buf_len = nread;
+        conn->read_buf_cursor = 0;
+        return process_request_write(worker, conn);
     }
-    assert(conn->file_fd == -1);
-    conn->file_fd = fd;
+    case RING_SEND: return process_request_write(worker, conn);
+    case RING_RECV:
+    case RING_NONE: break;
+    }
+    __builtin_unreachable();
+}
 
-    struct http_response resp = {0};
-    resp.req = req;
-    resp.code = HTTP_OK;
-    resp.headers = lappend(resp.headers, make_date_header());
-    resp.headers = lappend(resp.headers, make_header("Content-Length", server_memfmt("%zu", info.size)));
-    resp.headers = lappend(resp.headers, make_header("Content-Type", http_content_type_str(info.ct)));
-    resp.headers = lappend(resp.headers, make_header("Connection", "Close"));
-    resp.body_size = info.size;
-    send_response(&resp, conn);
+enum connection_state finish_io(struct worker *worker, struct active_connection *conn) {
+    if (conn->ring_op != RING_NONE)
+        return finish_ring(worker, conn);
+    struct file_job *job = (struct file_job *)conn->io_job;
+    if (job->op == FILE_JOB_LOOKUP)
+        return finish_lookup(job, worker, conn);
+    if (job->op == FILE_JOB_READ_IN) {
+        buffer_pool_put(worker->transfer_buffers, job->buf, job->size);
+        job->buf = NULL;
+        inflight_release(worker->inflight, job->key);
+        return send_file(&job->req, worker, conn, job->full_path, &job->info, job->fd);
+    }
+
+    if (job->nread == -1) {
+        errno = job->err;
+        log_perror(LOG_ERROR, "failed to read from file");
+        return CONN_ERR_UNRECOVERABLE;
+    }
+    if (job->nread == 0)
+        return CONN_COMPLETE;
+    conn->read_buf_len = job->nread;
+    conn->read_buf_cursor = 0;
+    return process_request_write(worker, conn);
+}
+
+static enum connection_state lookup_file_request(struct http_req *req, struct worker *worker,
+                                                 struct active_connection *conn) {
+    if (worker->io_pool)
+        return submit_lookup(req, worker, conn);
+
+    const char *full_path;
+    struct file_info info;
+    int fd;
+    enum http_status_code status = lookup_file(req, worker, &full_path, &info, &conn->listing, &fd);
+    if (status == HTTP_MOVED_PERMANENTLY)
+        return dir_redirect(req, conn);
+    if (status != HTTP_OK)
+        return error_response(status, conn);
+    if (req->method == HTTP_HEAD) {
+        if (fd != -1)
+            close(fd);
+        return serve_head_file(req, worker, conn, full_path, &info);
+    }
+    return serve_get_file(req, worker, conn, full_path, &info, fd);
+}
+
+static enum connection_state serve_file_request(struct http_req *req, struct worker *worker,
+                                                struct active_connection *conn) {
+    if (worker->uring && ring_lookup(req, worker, conn))
+        return CONN_IO;
+    return lookup_file_request(req, worker, conn);
 }
 
-static void serve_request(struct http_req *req, struct worker *worker, struct active_connection *conn) {
+// Everything comes from the mapping, there is nothing to look up on disk or
+// hand to the I/O threads.
+static enum connection_state serve_pack_request(struct http_req *req, struct worker *worker,
+                                                struct active_connection *conn) {
+    struct pack_file file;
+    enum http_status_code status = asset_pack_lookup(worker->pack, req, &file);
+    if (status != HTTP_OK)
+        return error_response(status, conn);
+    conn->pack_body = file.body;
+    conn->pack_body_len = file.size;
+    return send_header_block(file.head, req, worker, conn);
+}
+
+static enum connection_state serve_request(struct http_req *req, struct worker *worker,
+                                           struct active_connection *conn) {
     switch (req->method) {
-    case HTTP_GET: serve_get_request(req, worker, conn); break;
-    case HTTP_HEAD: serve_head_request(req, worker, conn); break;
+    case HTTP_GET:
+    case HTTP_HEAD:
+        // The pack stands in for static_dir, vhosts serve their own roots.
+        if (worker->pack && req->vhost->settings == NULL)
+            return serve_pack_request(req, worker, conn);
+        return serve_file_request(req, worker, conn);
+    case HTTP_OTHER: return error_response(HTTP_METHOD_NOT_ALLOWED, conn);
     }
+    __builtin_unreachable();
+}
+
+enum connection_state process_handshake(struct worker *worker, struct active_connection *conn) {
+    switch (tls_handshake(conn->tls)) {
+    case 0: return CONN_HANDSHAKE;
+    case 1: break;
+    default: return CONN_COMPLETE;
+    }
+    // The request often arrives together with the end of the handshake and
+    // may already sit in the session buffer, where no poll would report it.
+    if (tls_alpn_h2(conn->tls))
+        return h2_start(worker, conn, NULL, 0);
+    return process_request(worker, conn);
+}
+
+static bool is_h2_preface(const char *data, size_t len) {
+    static const char preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+    return memcmp(data, preface, len < sizeof(preface) - 1 ? len : sizeof(preface) - 1) == 0;
+}
+
+static bool has_token(const char *list, size_t len, const char *token) {
+    size_t token_len = strlen(token);
+    const char *end = list + len;
+    while (list < end) {
+        while (list < end && (*list == ' ' || *list == ','))
+            ++list;
+        const char *item = list;
+        while (list < end && *list != ' ' && *list != ',')
+            ++list;
+        if ((size_t)(list - item) == token_len && strncasecmp(item, token, token_len) == 0)
+            return true;
+    }
+    return false;
+}
+
+// Whether an HTTP/1.1 request asks to continue in cleartext HTTP/2, in which
+// case settings points at its HTTP2-Settings value.
+static bool wants_h2_upgrade(struct worker *worker, struct active_connection *conn, struct http_req *req,
+                             const char *req_data, const char **settings, size_t *settings_len) {
+    if (!worker->settings->http2 || conn->tls || req->version != HTTP_11)
+        return false;
+    size_t upgrade_len;
+    const char *upgrade = http_find_header(req_data, "Upgrade", &upgrade_len);
+    *settings = http_find_header(req_data, "HTTP2-Settings", settings_len);
+    return upgrade && *settings && has_token(upgrade, upgrade_len, "h2c");
 }
 
-void process_request(struct worker *worker, struct active_connection *conn) {
+enum connection_state process_request(struct worker *worker, struct active_connection *conn) {
     char *req_data = NULL;
-    enum read_req_data_result read_result = read_req_data(worker, conn, &req_data);
+    size_t req_len = 0;
+    enum read_req_data_result read_result = read_req_data(worker, conn, &req_data, &req_len);
     switch (read_result) {
     case READ_REQ_DATA_OK: break;
-    case READ_REQ_DATA_EMPTY: return;
+    case READ_REQ_DATA_AGAIN: return CONN_WAITING;
+    case READ_REQ_DATA_EMPTY: return CONN_COMPLETE;
+    case READ_REQ_DATA_ERROR: return CONN_ERR_RECOVERABLE;
     case READ_REQ_DATA_TOO_LARGE:
         log_msg(LOG_WARN, "request too large");
-        error_response(HTTP_BAD_REQUEST, conn);
-        break;
+        return error_response(HTTP_BAD_REQUEST, conn);
+    }
+    // HTTP/2 copies what it needs, the connection may stay open for long.
+    if (worker->settings->http2 && is_h2_preface(req_data, req_len)) {
+        enum connection_state state = h2_start(worker, conn, req_data, req_len);
+        release_req_buf(worker, conn);
+        return state;
     }
+    if (worker->capture)
+        capture_request(worker->capture, req_data, conn->tls != NULL);
 
     struct http_req req;
     enum parse_http_req_result parse_result = parse_http_req(worker, req_data, &req);
@@ -303,21 +1150,48 @@ void process_request(struct worker *worker, struct active_connection *conn) {
     case PARSE_HTTP_OK: break;
     case PARSE_HTTP_INVALID_SYNTAX:
         log_msg(LOG_WARN, "invalid request syntax %s", req_data);
-        error_response(HTTP_BAD_REQUEST, conn);
-        return;
+        return error_response(HTTP_BAD_REQUEST, conn);
     case PARSE_HTTP_INVALID_VERSION:
         log_msg(LOG_WARN, "invalid request version");
-        error_response(HTTP_VERSION_NO_SUPPORTED, conn);
-        return;
+        return error_response(HTTP_VERSION_NO_SUPPORTED, conn);
     case PARSE_HTTP_URI_TOO_LONG:
         log_msg(LOG_WARN, "uri too long");
-        error_response(HTTP_URI_TOO_LONG, conn);
-        return;
+        return error_response(HTTP_URI_TOO_LONG, conn);
     case PARSE_HTTP_INVALID_METHOD:
         log_msg(LOG_WARN, "invalid method");
-        error_response(HTTP_METHOD_NOT_ALLOWED, conn);
-        return;
+        return error_response(HTTP_METHOD_NOT_ALLOWED, conn);
     }
 
-    serve_request(&req, worker, conn);
+    // Proxied responses are paced too where the kernel takes the rate.
+    pacing_start(worker, conn, &req);
+
+    // The forwarded request is copied, the rest streams from the socket.
+    struct upstream *upstream = upstream_find(worker->upstreams, req.path);
+    if (upstream) {
+        enum connection_state state = proxy_start(worker, conn, upstream, &req, req_data, req_len);
+        release_req_buf(worker, conn);
+        return state;
+    }
+
+    const char *h2_settings;
+    size_t h2_settings_len;
+    if (wants_h2_upgrade(worker, conn, &req, req_data, &h2_settings, &h2_settings_len)) {
+        // Whatever followed the request head is already HTTP/2.
+        const char *head_end = strstr(req_data, "\r\n\r\n");
+        size_t used = head_end ? (size_t)(head_end + 4 - req_data) : req_len;
+        enum connection_state state =
+            h2_upgrade(worker, conn, &req, h2_settings, h2_settings_len, req_data + used, req_len - used);
+        release_req_buf(worker, conn);
+        return state;
+    }
+    return serve_request(&req, worker, conn);
+}
+
+// A parked request still has its head in the request buffer and is served
+// from the start, the file may have changed in the meantime.
+enum connection_state resume_request(struct worker *worker, struct active_connection *conn) {
+    struct http_req req;
+    if (parse_http_req(worker, conn->req_buf, &req) != PARSE_HTTP_OK)
+        return CONN_ERR_RECOVERABLE;
+    return serve_request(&req, worker, conn);
 }
@@ -0,0 +1,180 @@
+#include "server.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HEADER_CACHE_PROBES 4
+
+struct header_cache_entry {
+    char *path;
+    uint64_t hash;
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    size_t size;
+    enum http_content_type ct; // vhosts sharing a root may type it differently
+    struct header_block block;
+    struct header_block h2_block;
+};
+
+struct header_cache {
+    size_t mask;
+    struct header_cache_entry entries[];
+};
+
+static uint64_t path_hash(const char *path) {
+    uint64_t h = 14695981039346656037ull;
+    for (; *path; ++path) {
+        h ^= (unsigned char)*path;
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+static void free_entry(struct header_cache_entry *entry) {
+    free(entry->path);
+    free((char *)entry->block.data);
+    free((char *)entry->h2_block.data);
+    memset(entry, 0, sizeof(*entry));
+}
+
+static bool entry_matches(const struct header_cache_entry *entry, const struct file_info *info) {
+    return entry->dev == info->dev && entry->ino == info->ino && entry->mtime == info->mtime &&
+           entry->size == info->size && entry->ct == info->ct;
+}
+
+// The same fields HPACK encoded for HTTP/2, Date first so that its value
+// sits at a fixed date_offset. It is filled with a placeholder here.
+static bool build_h2_block(struct header_block *block, const struct file_info *info, const char *last_modified) {
+    char length[32], etag[64];
+    int length_len = snprintf(length, sizeof(length), "%zu", info->size);
+    int etag_len = snprintf(etag, sizeof(etag), "\"%llx-%llx-%zx\"", (unsigned long long)info->ino,
+                            (unsigned long long)info->mtime, info->size);
+    const char *ct = http_content_type_str(info->ct);
+
+    uint8_t buffer[1024];
+    struct hpack_buf buf = {buffer, 0, sizeof(buffer)};
+    bool ok = hpack_put_status(&buf, 200) && hpack_put_field(&buf, HPACK_DATE, last_modified, HTTP_DATE_LEN);
+    size_t date_offset = buf.len - HTTP_DATE_LEN;
+    ok = ok && hpack_put_field(&buf, HPACK_CONTENT_LENGTH, length, length_len) &&
+         hpack_put_field(&buf, HPACK_CONTENT_TYPE, ct, strlen(ct)) &&
+         hpack_put_field(&buf, HPACK_LAST_MODIFIED, last_modified, strlen(last_modified)) &&
+         hpack_put_field(&buf, HPACK_ETAG, etag, etag_len);
+    if (!ok)
+        return false;
+
+    char *data = malloc(buf.len);
+    if (data == NULL)
+        return false;
+    memcpy(data, buffer, buf.len);
+    free((char *)block->data);
+    block->data = data;
+    block->len = buf.len;
+    block->date_offset = date_offset;
+    return true;
+}
+
+// The block is laid out so that the Date value is the only part that changes
+// between requests: everything before date_offset ends with "Date: " and the
+// rest starts with the CRLF terminating the Date line.
+static bool build_block(struct header_cache_entry *entry, const struct file_info *info) {
+    char last_modified[64];
+    http_format_date(last_modified, sizeof(last_modified), info->mtime);
+    if (!build_h2_block(&entry->h2_block, info, last_modified))
+        return false;
+
+    size_t ct_len;
+    const char *ct_line = http_content_type_line(info->ct, &ct_len);
+
+    static const char prefix[] = "HTTP/1.1 200 OK\r\nDate: ";
+    char buffer[1024];
+    int len = snprintf(buffer, sizeof(buffer),
+                       "%s\r\nContent-Length: %zu\r\n%.*sLast-Modified: %s\r\nETag: \"%llx-%llx-%zx\"\r\n"
+                       "Connection: Close\r\n\r\n",
+                       prefix, info->size, (int)ct_len, ct_line, last_modified, (unsigned long long)info->ino,
+                       (unsigned long long)info->mtime, info->size);
+    if (len < 0 || (size_t)len >= sizeof(buffer))
+        return false;
+
+    char *data = malloc(len);
+    if (data == NULL)
+        return false;
+    memcpy(data, buffer, len);
+
+    free((char *)entry->block.data);
+    entry->block.data = data;
+    entry->block.len = len;
+    entry->block.date_offset = sizeof(prefix) - 1;
+    entry->dev = info->dev;
+    entry->ino = info->ino;
+    entry->mtime = info->mtime;
+    entry->size = info->size;
+    entry->ct = info->ct;
+    return true;
+}
+
+struct header_cache *header_cache_create(size_t size) {
+    size_t slots = HEADER_CACHE_PROBES;
+    while (slots < size)
+        slots <<= 1;
+    struct header_cache *cache = page_alloc(sizeof(*cache) + slots * sizeof(cache->entries[0]), false);
+    cache->mask = slots - 1;
+    return cache;
+}
+
+static struct header_cache_entry *lookup(struct header_cache *cache, const char *path,
+                                         const struct file_info *info) {
+    uint64_t hash = path_hash(path);
+    size_t home = hash & cache->mask;
+
+    struct header_cache_entry *free_slot = NULL;
+    for (size_t i = 0; i < HEADER_CACHE_PROBES; ++i) {
+        struct header_cache_entry *entry = &cache->entries[(home + i) & cache->mask];
+        if (entry->path == NULL) {
+            if (free_slot == NULL)
+                free_slot = entry;
+            continue;
+        }
+        if (entry->hash != hash || strcmp(entry->path, path) != 0)
+            continue;
+
+        if (entry_matches(entry, info))
+            return entry;
+        if (!build_block(entry, info)) {
+            free_entry(entry);
+            return NULL;
+        }
+        return entry;
+    }
+
+    // Miss with a full probe window evicts the entry at the home slot.
+    struct header_cache_entry *entry = free_slot;
+    if (entry == NULL) {
+        entry = &cache->entries[home];
+        free_entry(entry);
+    }
+    size_t path_len = strlen(path);
+    entry->path = malloc(path_len + 1);
+    if (entry->path == NULL)
+        return NULL;
+    memcpy(entry->path, path, path_len + 1);
+    entry->hash = hash;
+    if (!build_block(entry, info)) {
+        free_entry(entry);
+        return NULL;
+    }
+    return entry;
+}
+
+const struct header_block *header_cache_get(struct header_cache *cache, const char *path,
+                                            const struct file_info *info) {
+    struct header_cache_entry *entry = lookup(cache, path, info);
+    return entry ? &entry->block : NULL;
+}
+
+const struct header_block *header_cache_get_h2(struct header_cache *cache, const char *path,
+                                               const struct file_info *info) {
+    struct header_cache_entry *entry = lookup(cache, path, info);
+    return entry ? &entry->h2_block : NULL;
+}
@@ -0,0 +1,434 @@
+#include "server.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define HPACK_STATIC_COUNT 61
+#define HPACK_ENTRY_OVERHEAD 32 // added to name and value length when sizing table entries
+
+static const struct {
+    const char *name;
+    const char *value;
+} static_table[HPACK_STATIC_COUNT] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+// Code lengths of the HPACK Huffman code (RFC 7541, appendix B), indexed by
+// symbol, 256 being EOS. The code is canonical, so the codes themselves follow
+// from the lengths.
+static const uint8_t huffman_lengths[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 30, 28, 28, 28,
+    28, 28, 28, 28, 28, 28, 6,  10, 10, 12, 13, 6,  8,  11, 10, 10, 8,  11, 8,  6,  6,  6,  5,  5,  5,  6,
+    6,  6,  6,  6,  6,  6,  7,  8,  15, 6,  12, 10, 13, 6,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,
+    7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  8,  7,  8,  13, 19, 13, 14, 6,  15, 5,  6,  5,  6,  5,  6,  6,
+    6,  5,  7,  7,  6,  6,  6,  5,  6,  7,  6,  5,  5,  6,  7,  7,  7,  7,  7,  15, 11, 14, 13, 28, 20, 22,
+    20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23, 24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23,
+    22, 23, 23, 24, 22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23, 21, 21, 22, 21, 23, 22,
+    23, 23, 20, 22, 22, 22, 23, 22, 22, 23, 26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27, 20, 24, 20, 21, 22, 21, 21, 23, 22, 22,
+    25, 25, 24, 24, 26, 23, 26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26, 30,
+};
+
+#define HUFFMAN_MAX_LEN 30
+#define HUFFMAN_EOS 256
+
+// Canonical decoding tables, built on first use: the codes of one length
+// are consecutive, starting at first[len], and belong to the symbols
+// symbols[start[len]] onwards.
+static struct {
+    bool ready;
+    uint32_t first[HUFFMAN_MAX_LEN + 1];
+    uint16_t start[HUFFMAN_MAX_LEN + 1];
+    uint16_t count[HUFFMAN_MAX_LEN + 1];
+    uint16_t symbols[257];
+} huffman;
+
+static void huffman_init(void) {
+    uint16_t n = 0;
+    uint32_t code = 0;
+    for (int len = 1; len <= HUFFMAN_MAX_LEN; ++len) {
+        huffman.first[len] = code;
+        huffman.start[len] = n;
+        for (int sym = 0; sym < 257; ++sym) {
+            if (huffman_lengths[sym] == len)
+                huffman.symbols[n++] = (uint16_t)sym;
+        }
+        huffman.count[len] = n - huffman.start[len];
+        code = (code + huffman.count[len]) << 1;
+    }
+    huffman.ready = true;
+}
+
+// dst has room for len * 8 / 5 bytes, the shortest code being 5 bits.
+static bool huffman_decode(const uint8_t *src, size_t len, char *dst, size_t *dst_len) {
+    if (!huffman.ready)
+        huffman_init();
+    uint32_t code = 0;
+    int bits = 0;
+    size_t n = 0;
+    for (size_t i = 0; i < len; ++i) {
+        for (int bit = 7; bit >= 0; --bit) {
+            code = (code << 1) | ((src[i] >> bit) & 1);
+            ++bits;
+            if (code >= huffman.first[bits] && code - huffman.first[bits] < huffman.count[bits]) {
+                uint16_t sym = huffman.symbols[huffman.start[bits] + code - huffman.first[bits]];
+                if (sym == HUFFMAN_EOS)
+                    return false;
+                dst[n++] = (char)sym;
+                code = 0;
+                bits = 0;
+            } else if (bits == HUFFMAN_MAX_LEN) {
+                return false;
+            }
+        }
+    }
+    // The last byte is padded with the most significant bits of EOS, all ones.
+    if (bits > 7 || code != (1u << bits) - 1)
+        return false;
+    *dst_len = n;
+    return true;
+}
+
+struct hpack_entry {
+    char *data; // name followed by value
+    size_t name_len;
+    size_t value_len;
+};
+
+struct hpack_decoder {
+    // Dynamic table as a ring, entries[head] being the newest entry.
+    struct hpack_entry *entries;
+    size_t slots;
+    size_t head;
+    size_t count;
+    size_t size;       // sum of entry sizes as defined by HPACK
+    size_t max_size;   // current limit, lowered by the encoder through size updates
+    size_t limit;      // the table size we allow the encoder
+    size_t list_limit; // largest decoded header list accepted
+
+    // Fields of the last decoded block. Huffman decoded strings live in
+    // storage, which is sized for the whole block up front so that pointers
+    // into it stay valid. Entries evicted while decoding a block may still be
+    // referenced by its fields, they are freed when the next block starts.
+    struct hpack_field *fields;
+    size_t field_count;
+    size_t field_cap;
+    char *storage;
+    size_t storage_len;
+    size_t storage_cap;
+    char **evicted;
+    size_t evicted_count;
+    size_t evicted_cap;
+};
+
+static void *xrealloc(void *memory, size_t size) {
+    void *result = realloc(memory, size);
+    if (result == NULL) {
+        log_msg(LOG_FATAL, "OOM");
+        exit(EXIT_FAILURE);
+    }
+    return result;
+}
+
+struct hpack_decoder *hpack_decoder_create(size_t table_size, size_t list_limit) {
+    struct hpack_decoder *dec = calloc(1, sizeof(*dec));
+    if (dec == NULL) {
+        log_msg(LOG_FATAL, "OOM");
+        exit(EXIT_FAILURE);
+    }
+    dec->slots = table_size / HPACK_ENTRY_OVERHEAD + 1;
+    dec->entries = xrealloc(NULL, dec->slots * sizeof(*dec->entries));
+    dec->max_size = table_size;
+    dec->limit = table_size;
+    dec->list_limit = list_limit;
+    return dec;
+}
+
+static void release_evicted(struct hpack_decoder *dec) {
+    for (size_t i = 0; i < dec->evicted_count; ++i)
+        free(dec->evicted[i]);
+    dec->evicted_count = 0;
+}
+
+void hpack_decoder_destroy(struct hpack_decoder *dec) {
+    release_evicted(dec);
+    for (size_t i = 0; i < dec->count; ++i)
+        free(dec->entries[(dec->head + dec->slots - i) % dec->slots].data);
+    free(dec->entries);
+    free(dec->fields);
+    free(dec->storage);
+    free(dec->evicted);
+    free(dec);
+}
+
+static void evict_oldest(struct hpack_decoder *dec) {
+    struct hpack_entry *entry = &dec->entries[(dec->head + dec->slots - (dec->count - 1)) % dec->slots];
+    if (dec->evicted_count == dec->evicted_cap) {
+        dec->evicted_cap = dec->evicted_cap ? dec->evicted_cap * 2 : 16;
+        dec->evicted = xrealloc(dec->evicted, dec->evicted_cap * sizeof(*dec->evicted));
+    }
+    dec->evicted[dec->evicted_count++] = entry->data;
+    dec->size -= entry->name_len + entry->value_len + HPACK_ENTRY_OVERHEAD;
+    --dec->count;
+}
+
+static void insert(struct hpack_decoder *dec, const struct hpack_field *field) {
+    size_t size = field->name_len + field->value_len + HPACK_ENTRY_OVERHEAD;
+    while (dec->count && dec->size + size > dec->max_size)
+        evict_oldest(dec);
+    // An entry larger than the table just empties it.
+    if (size > dec->max_size)
+        return;
+
+    char *data = xrealloc(NULL, field->name_len + field->value_len);
+    memcpy(data, field->name, field->name_len);
+    memcpy(data + field->name_len, field->value, field->value_len);
+    dec->head = (dec->head + 1) % dec->slots;
+    dec->entries[dec->head] = (struct hpack_entry){data, field->name_len, field->value_len};
+    ++dec->count;
+    dec->size += size;
+}
+
+static bool lookup(const struct hpack_decoder *dec, size_t index, struct hpack_field *field) {
+    if (index == 0)
+        return false;
+    if (index <= HPACK_STATIC_COUNT) {
+        field->name = static_table[index - 1].name;
+        field->name_len = strlen(field->name);
+        field->value = static_table[index - 1].value;
+        field->value_len = strlen(field->value);
+        return true;
+    }
+    index -= HPACK_STATIC_COUNT + 1;
+    if (index >= dec->count)
+        return false;
+    const struct hpack_entry *entry = &dec->entries[(dec->head + dec->slots - index) % dec->slots];
+    field->name = entry->data;
+    field->name_len = entry->name_len;
+    field->value = entry->data + entry->name_len;
+    field->value_len = entry->value_len;
+    return true;
+}
+
+static bool decode_int(const uint8_t **pos, const uint8_t *end, int prefix, size_t *value) {
+    size_t max = (1u << prefix) - 1;
+    size_t v = **pos & max;
+    ++*pos;
+    if (v < max) {
+        *value = v;
+        return true;
+    }
+    for (int shift = 0;; shift += 7) {
+        // Anything past 28 bits is larger than any size we would accept.
+        if (*pos == end || shift > 21)
+            return false;
+        uint8_t b = *(*pos)++;
+        v += (size_t)(b & 0x7f) << shift;
+        if ((b & 0x80) == 0)
+            break;
+    }
+    *value = v;
+    return true;
+}
+
+// Plain strings point into the block, Huffman coded ones are decoded into
+// storage.
+static bool decode_str(struct hpack_decoder *dec, const uint8_t **pos, const uint8_t *end, const char **str,
+                       size_t *len) {
+    if (*pos == end)
+        return false;
+    bool coded = (**pos & 0x80) != 0;
+    size_t n;
+    if (!decode_int(pos, end, 7, &n) || (size_t)(end - *pos) < n)
+        return false;
+    if (!coded) {
+        *str = (const char *)*pos;
+        *len = n;
+    } else {
+        char *dst = dec->storage + dec->storage_len;
+        if (!huffman_decode(*pos, n, dst, len))
+            return false;
+        dec->storage_len += *len;
+        *str = dst;
+    }
+    *pos += n;
+    return true;
+}
+
+static bool decode_literal(struct hpack_decoder *dec, const uint8_t **pos, const uint8_t *end, int prefix,
+                           struct hpack_field *field) {
+    size_t index;
+    if (!decode_int(pos, end, prefix, &index))
+        return false;
+    if (index == 0) {
+        if (!decode_str(dec, pos, end, &field->name, &field->name_len))
+            return false;
+    } else if (!lookup(dec, index, field)) {
+        return false;
+    }
+    return decode_str(dec, pos, end, &field->value, &field->value_len);
+}
+
+static bool set_max_size(struct hpack_decoder *dec, size_t size) {
+    if (size > dec->limit)
+        return false;
+    dec->max_size = size;
+    while (dec->count && dec->size > dec->max_size)
+        evict_oldest(dec);
+    return true;
+}
+
+// Decodes a complete header block. The fields stay valid until the next call.
+bool hpack_decode(struct hpack_decoder *dec, const uint8_t *block, size_t len, const struct hpack_field **fields,
+                  size_t *count) {
+    release_evicted(dec);
+    dec->field_count = 0;
+    dec->storage_len = 0;
+    if (dec->storage_cap < len * 8 / 5 + 1) {
+        dec->storage_cap = len * 8 / 5 + 1;
+        dec->storage = xrealloc(dec->storage, dec->storage_cap);
+    }
+
+    size_t list_size = 0;
+    const uint8_t *pos = block, *end = block + len;
+    while (pos < end) {
+        struct hpack_field field;
+        uint8_t b = *pos;
+        if (b & 0x80) {
+            size_t index;
+            if (!decode_int(&pos, end, 7, &index) || !lookup(dec, index, &field))
+                return false;
+        } else if (b & 0x40) {
+            if (!decode_literal(dec, &pos, end, 6, &field))
+                return false;
+            insert(dec, &field);
+        } else if (b & 0x20) {
+            size_t size;
+            if (!decode_int(&pos, end, 5, &size) || !set_max_size(dec, size))
+                return false;
+            continue;
+        } else {
+            // Without indexing or never indexed, the same to a decoder.
+            if (!decode_literal(dec, &pos, end, 4, &field))
+                return false;
+        }
+
+        list_size += field.name_len + field.value_len + HPACK_ENTRY_OVERHEAD;
+        if (list_size > dec->list_limit)
+            return false;
+        if (dec->field_count == dec->field_cap) {
+            dec->field_cap = dec->field_cap ? dec->field_cap * 2 : 32;
+            dec->fields = xrealloc(dec->fields, dec->field_cap * sizeof(*dec->fields));
+        }
+        dec->fields[dec->field_count++] = field;
+    }
+    *fields = dec->fields;
+    *count = dec->field_count;
+    return true;
+}
+
+static bool put_bytes(struct hpack_buf *buf, const void *data, size_t len) {
+    if (buf->cap - buf->len < len)
+        return false;
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    return true;
+}
+
+static bool put_int(struct hpack_buf *buf, uint8_t first, int prefix, size_t value) {
+    size_t max = (1u << prefix) - 1;
+    uint8_t bytes[8];
+    size_t n = 0;
+    if (value < max) {
+        bytes[n++] = first | (uint8_t)value;
+        return put_bytes(buf, bytes, n);
+    }
+    bytes[n++] = first | (uint8_t)max;
+    value -= max;
+    while (value >= 0x80 && n < sizeof(bytes) - 1) {
+        bytes[n++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    bytes[n++] = (uint8_t)value;
+    return put_bytes(buf, bytes, n);
+}
+
+// Responses only ever use the static table, indexed where it has the whole
+// field and as literals without indexing otherwise, so the encoder needs no
+// state and a peer's table size does not matter.
+bool hpack_put_status(struct hpack_buf *buf, int status) {
+    static const int indexed[] = {200, 204, 206, 304, 400, 404, 500};
+    for (size_t i = 0; i < sizeof(indexed) / sizeof(indexed[0]); ++i) {
+        if (indexed[i] == status)
+            return put_int(buf, 0x80, 7, HPACK_STATUS_200 + i);
+    }
+    char value[4];
+    value[0] = (char)('0' + status / 100 % 10);
+    value[1] = (char)('0' + status / 10 % 10);
+    value[2] = (char)('0' + status % 10);
+    return hpack_put_field(buf, HPACK_STATUS_200, value, 3);
+}
+
+bool hpack_put_field(struct hpack_buf *buf, enum hpack_static_index name, const char *value, size_t len) {
+    return put_int(buf, 0x00, 4, name) && put_int(buf, 0x00, 7, len) && put_bytes(buf, value, len);
+}
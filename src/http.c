@@ -1,6 +1,9 @@
 #include "server.h"
+#include "mime_hash.h"
 
+#include <stdio.h>
 #include <string.h>
+#include <strings.h>
 
 static bool parse_http_method(const char *start, const char *end, enum http_method *method) {
     size_t len = end - start;
@@ -12,7 +15,84 @@ static bool parse_http_method(const char *start, const char *end, enum http_meth
         *method = HTTP_HEAD;
         return true;
     }
-    return false;
+    for (const char *c = start; c < end; ++c) {
+        if (*c < 'A' || *c > 'Z')
+            return false;
+    }
+    *method = HTTP_OTHER;
+    return len > 0;
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+// Drops the segment just written if it is "." or "..", the latter together
+// with the one before it. The root is never left.
+static void close_segment(char *out, size_t *len) {
+    size_t start = *len;
+    while (out[start - 1] != '/')
+        --start;
+    size_t seg_len = *len - start;
+    if (seg_len == 1 && out[start] == '.') {
+        *len = start;
+    } else if (seg_len == 2 && out[start] == '.' && out[start + 1] == '.') {
+        *len = start;
+        if (*len > 1) {
+            --*len;
+            while (out[*len - 1] != '/')
+                --*len;
+        }
+    }
+}
+
+// Turns a request target into the path it names, in one pass: an absolute
+// form's scheme and authority and anything from '?' or '#' are cut, percent
+// escapes decoded, repeated slashes merged and dot segments removed, decoded
+// ones included. The result starts with '/' and keeps a trailing slash. Fails
+// on malformed escapes and on NUL.
+char *http_normalize_path(const char *target, size_t len) {
+    const char *end = target + len;
+    size_t scheme = 0;
+    if (len >= 7 && strncasecmp(target, "http://", 7) == 0)
+        scheme = 7;
+    else if (len >= 8 && strncasecmp(target, "https://", 8) == 0)
+        scheme = 8;
+    if (scheme) {
+        const char *path = memchr(target + scheme, '/', len - scheme);
+        target = path ? path : end;
+    }
+
+    char *out = server_alloc(len + 2);
+    size_t out_len = 0;
+    out[out_len++] = '/';
+    for (const char *p = target; p < end && *p != '?' && *p != '#';) {
+        char c = *p++;
+        if (c == '%') {
+            int hi = p < end ? hex_value(p[0]) : -1;
+            int lo = p + 1 < end ? hex_value(p[1]) : -1;
+            if (hi < 0 || lo < 0 || (hi == 0 && lo == 0))
+                return NULL;
+            c = (char)(hi << 4 | lo);
+            p += 2;
+        }
+        if (c == '/') {
+            close_segment(out, &out_len);
+            if (out[out_len - 1] != '/')
+                out[out_len++] = '/';
+        } else {
+            out[out_len++] = c;
+        }
+    }
+    close_segment(out, &out_len);
+    out[out_len] = '\0';
+    return out;
 }
 
 enum parse_http_req_result parse_http_req(struct worker *worker, const char *str, struct http_req *req) {
@@ -45,6 +125,9 @@ enum parse_http_req_result parse_http_req(struct worker *worker, const char *str
     req->uri = uri_str;
     memcpy(uri_str, uri, uri_len);
     uri_str[uri_len] = '\0';
+    req->path = http_normalize_path(uri, uri_len);
+    if (req->path == NULL)
+        return PARSE_HTTP_INVALID_SYNTAX;
 
     skip_spaces = strspn(method_end, " ");
     if (skip_spaces == 0)
@@ -61,72 +144,65 @@ enum parse_http_req_result parse_http_req(struct worker *worker, const char *str
         return PARSE_HTTP_INVALID_VERSION;
     }
 
+    req->accept_encoding = http_find_header(str, "Accept-Encoding", &req->accept_encoding_len);
+    size_t host_len = 0;
+    const char *host = http_find_header(str, "Host", &host_len);
+    req->vhost = vhost_find(worker, host, host_len);
     return PARSE_HTTP_OK;
 }
 
-const char *http_content_type_str(enum http_content_type type) {
-    switch (type) {
-    case HTTP_CT_BIN: return "application/octet-stream";
-    case HTTP_CT_BMP: return "image/bmp";
-    case HTTP_CT_CSS: return "text/css";
-    case HTTP_CT_CSV: return "text/csv";
-    case HTTP_CT_GIF: return "image/gif";
-    case HTTP_CT_HTML: return "text/html";
-    case HTTP_CT_JPEG: return "image/jpeg";
-    case HTTP_CT_JS: return "text/javascript";
-    case HTTP_CT_JSON: return "application/json";
-    case HTTP_CT_MP3: return "audio/mpeg";
-    case HTTP_CT_MP4: return "video/mp4";
-    case HTTP_CT_OTF: return "font/otf";
-    case HTTP_CT_PNG: return "image/png";
-    case HTTP_CT_PDF: return "application/pdf";
-    case HTTP_CT_SVG: return "image/svg+xml";
-    case HTTP_CT_TTF: return "font/ttf";
-    case HTTP_CT_TXT: return "text/plain";
+// Finds a header of the request head in str, which starts with the request
+// line. Returns the value without surrounding whitespace, or NULL.
+const char *http_find_header(const char *str, const char *name, size_t *len) {
+    size_t name_len = strlen(name);
+    const char *line = strstr(str, "\r\n");
+    while (line) {
+        line += 2;
+        const char *line_end = strstr(line, "\r\n");
+        if (line_end == NULL || line_end == line)
+            return NULL;
+        if ((size_t)(line_end - line) > name_len && line[name_len] == ':' && strncasecmp(line, name, name_len) == 0) {
+            const char *value = line + name_len + 1;
+            while (value < line_end && (*value == ' ' || *value == '\t'))
+                ++value;
+            const char *value_end = line_end;
+            while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t'))
+                --value_end;
+            *len = value_end - value;
+            return value;
+        }
+        line = line_end;
     }
-    __builtin_unreachable();
+    return NULL;
+}
+
+const char *http_content_type_str(enum http_content_type type) {
+    return mime_type_strs[type];
+}
+
+const char *http_content_type_line(enum http_content_type type, size_t *len) {
+    *len = mime_header_lines[type].len;
+    return mime_header_lines[type].line;
 }
 
 enum http_content_type http_conten_type_from_ext(const char *ext) {
     if (ext == NULL)
         return HTTP_CT_BIN;
 
-    if (strcmp(ext, "bin") == 0)
+    char lower[MIME_EXT_MAX];
+    size_t len = 0;
+    for (; ext[len]; ++len) {
+        if (len == MIME_EXT_MAX)
+            return HTTP_CT_BIN;
+        lower[len] = mime_lower(ext[len]);
+    }
+    if (len == 0)
+        return HTTP_CT_BIN;
+
+    const struct mime_slot *slot = &mime_slots[mime_hash(lower, len, mime_hash_seed) & mime_hash_mask];
+    if (slot->len != len || memcmp(slot->ext, lower, len) != 0)
         return HTTP_CT_BIN;
-    if (strcmp(ext, "bmp") == 0)
-        return HTTP_CT_BMP;
-    if (strcmp(ext, "css") == 0)
-        return HTTP_CT_CSS;
-    if (strcmp(ext, "csv") == 0)
-        return HTTP_CT_CSV;
-    if (strcmp(ext, "gif") == 0)
-        return HTTP_CT_GIF;
-    if (strcmp(ext, "html") == 0 || strcmp(ext, "htm") == 0)
-        return HTTP_CT_HTML;
-    if (strcmp(ext, "jpeg") == 0 || strcmp(ext, "jpg") == 0)
-        return HTTP_CT_JPEG;
-    if (strcmp(ext, "js") == 0 || strcmp(ext, "mjs") == 0)
-        return HTTP_CT_JS;
-    if (strcmp(ext, "json") == 0)
-        return HTTP_CT_JSON;
-    if (strcmp(ext, "mp3") == 0)
-        return HTTP_CT_MP3;
-    if (strcmp(ext, "mp4") == 0)
-        return HTTP_CT_MP4;
-    if (strcmp(ext, "otf") == 0)
-        return HTTP_CT_OTF;
-    if (strcmp(ext, "png") == 0)
-        return HTTP_CT_PNG;
-    if (strcmp(ext, "pdf") == 0)
-        return HTTP_CT_PDF;
-    if (strcmp(ext, "svg") == 0)
-        return HTTP_CT_SVG;
-    if (strcmp(ext, "ttf") == 0)
-        return HTTP_CT_TTF;
-    if (strcmp(ext, "txt") == 0)
-        return HTTP_CT_TXT;
-
-    return HTTP_CT_BIN;
+    return slot->type;
 }
 
 enum http_content_type http_conten_type_from_filename(const char *name) {
@@ -139,12 +215,17 @@ enum http_content_type http_conten_type_from_filename(const char *name) {
 const char *http_status_code_str(enum http_status_code code) {
     switch (code) {
     case HTTP_OK: return "OK";
+    case HTTP_MOVED_PERMANENTLY: return "Moved Permanently";
     case HTTP_BAD_REQUEST: return "Bad Request";
     case HTTP_FORBIDDEN: return "Forbidden";
     case HTTP_NOT_FOUND: return "Not Found";
     case HTTP_METHOD_NOT_ALLOWED: return "Method Not Allowed";
+    case HTTP_LENGTH_REQUIRED: return "Length Required";
     case HTTP_URI_TOO_LONG: return "URI Too Long";
+    case HTTP_TOO_MANY_REQUESTS: return "Too Many Requests";
     case HTTP_INTERNAL_SERVER_ERROR: return "Internal Server Error";
+    case HTTP_BAD_GATEWAY: return "Bad Gateway";
+    case HTTP_SERVICE_UNAVAILABLE: return "Service Unavailable";
     case HTTP_VERSION_NO_SUPPORTED: return "Version Not Supported";
     }
     __builtin_unreachable();
@@ -154,6 +235,7 @@ const char *http_method_str(enum http_method method) {
     switch (method) {
     case HTTP_GET: return "GET";
     case HTTP_HEAD: return "HEAD";
+    case HTTP_OTHER: return "OTHER";
     }
     __builtin_unreachable();
 }
@@ -161,13 +243,26 @@ const char *http_method_str(enum http_method method) {
 int http_status_code_int(enum http_status_code code) {
     switch (code) {
     case HTTP_OK: return 200;
+    case HTTP_MOVED_PERMANENTLY: return 301;
     case HTTP_BAD_REQUEST: return 400;
     case HTTP_FORBIDDEN: return 403;
     case HTTP_NOT_FOUND: return 404;
     case HTTP_METHOD_NOT_ALLOWED: return 405;
+    case HTTP_LENGTH_REQUIRED: return 411;
     case HTTP_URI_TOO_LONG: return 514;
+    case HTTP_TOO_MANY_REQUESTS: return 429;
     case HTTP_INTERNAL_SERVER_ERROR: return 500;
+    case HTTP_BAD_GATEWAY: return 502;
+    case HTTP_SERVICE_UNAVAILABLE: return 503;
     case HTTP_VERSION_NO_SUPPORTED: return 505;
     }
     __builtin_unreachable();
 }
+
+void http_format_date(char *buf, size_t buf_len, time_t t) {
+    static const char *days[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+    static const char *months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+    struct tm *tm = gmtime(&t);
+    snprintf(buf, buf_len, "%s, %02d %s %d %02d:%02d:%02d GMT", days[tm->tm_wday], tm->tm_mday, months[tm->tm_mon],
+             tm->tm_year + 1900, tm->tm_hour, tm->tm_min, tm->tm_sec);
+}
@@ -0,0 +1,158 @@
+#include "server.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define INFLIGHT_SLOTS 256 // must be a power of two
+#define INFLIGHT_PROBES 8
+#define INFLIGHT_MAX_WAIT 5 // seconds without progress before a load is presumed abandoned
+
+struct inflight_slot {
+    uint64_t key; // 0 when free
+    int64_t started;
+};
+
+// Shared between all workers. A slot holds a file some worker is reading
+// into the page cache, everyone else asking for it waits until the slot is
+// cleared. The reader stamps the slot again as it goes, so a slow disk does
+// not hand the file to a second reader. A worker that dies mid-load leaves
+// its slot behind, which is taken over once it is INFLIGHT_MAX_WAIT old.
+struct inflight_table {
+    struct inflight_slot slots[INFLIGHT_SLOTS];
+};
+
+// Any change to the file gives a different key, so a replaced file is
+// loaded anew rather than waiting for the old one.
+static uint64_t file_key(const struct file_info *info) {
+    uint64_t h = ((uint64_t)info->dev * 0x9e3779b97f4a7c15ull) ^ ((uint64_t)info->ino * 0xc2b2ae3d27d4eb4full);
+    h ^= ((uint64_t)info->mtime * 0x165667b19e3779f9ull) ^ (uint64_t)info->size;
+    h ^= h >> 29;
+    return h ? h : 1;
+}
+
+struct inflight_table *inflight_table_create(void) {
+    struct inflight_table *table =
+        mmap(NULL, sizeof(*table), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (table == MAP_FAILED) {
+        log_perror(LOG_FATAL, "failed to map in-flight table");
+        return NULL;
+    }
+    return table;
+}
+
+static bool fresh(const struct inflight_slot *slot, time_t now) {
+    return now - __atomic_load_n(&slot->started, __ATOMIC_ACQUIRE) < INFLIGHT_MAX_WAIT;
+}
+
+// Returns the slot to load into, or NULL when another worker is loading the
+// file already or the table is full.
+static struct inflight_slot *claim(struct inflight_table *table, uint64_t key, bool *loading) {
+    time_t now = time(NULL);
+    size_t home = key & (INFLIGHT_SLOTS - 1);
+    struct inflight_slot *reusable = NULL;
+    for (size_t i = 0; i < INFLIGHT_PROBES; ++i) {
+        struct inflight_slot *slot = &table->slots[(home + i) & (INFLIGHT_SLOTS - 1)];
+        uint64_t held = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+        if (held == key && fresh(slot, now)) {
+            *loading = true;
+            return NULL;
+        }
+        if (reusable == NULL && (held == 0 || !fresh(slot, now)))
+            reusable = slot;
+    }
+    *loading = false;
+    if (reusable == NULL)
+        return NULL;
+
+    uint64_t held = __atomic_load_n(&reusable->key, __ATOMIC_ACQUIRE);
+    if (held != 0 && fresh(reusable, now))
+        return NULL;
+    __atomic_store_n(&reusable->started, (int64_t)now, __ATOMIC_RELEASE);
+    if (!__atomic_compare_exchange_n(&reusable->key, &held, key, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return NULL;
+    return reusable;
+}
+
+static struct inflight_slot *find(struct inflight_table *table, uint64_t key) {
+    size_t home = key & (INFLIGHT_SLOTS - 1);
+    for (size_t i = 0; i < INFLIGHT_PROBES; ++i) {
+        struct inflight_slot *slot = &table->slots[(home + i) & (INFLIGHT_SLOTS - 1)];
+        if (__atomic_load_n(&slot->key, __ATOMIC_ACQUIRE) == key)
+            return slot;
+    }
+    return NULL;
+}
+
+bool inflight_pending(struct inflight_table *table, uint64_t key) {
+    struct inflight_slot *slot = find(table, key);
+    return slot && fresh(slot, time(NULL));
+}
+
+#ifdef __linux__
+
+// Asks for the first and the last byte without blocking on the disk. Kernels
+// that cannot tell report the file as cached, which turns coalescing off.
+static bool is_cached(int fd, size_t size) {
+    char c;
+    struct iovec iov = {&c, 1};
+    off_t offsets[2] = {0, (off_t)size - 1};
+    for (size_t i = 0; i < 2; ++i) {
+        if (preadv2(fd, &iov, 1, offsets[i], RWF_NOWAIT) == -1 && errno == EAGAIN)
+            return false;
+    }
+    return true;
+}
+
+#else
+
+static bool is_cached(int fd, size_t size) {
+    (void)fd, (void)size;
+    return true;
+}
+
+#endif
+
+// A full table, or a slot just taken over, has the file read alongside
+// whoever else reads it, as if it was cached.
+enum inflight_result inflight_claim(struct inflight_table *table, int fd, const struct file_info *info,
+                                    uint64_t *key) {
+    if (is_cached(fd, info->size))
+        return INFLIGHT_CACHED;
+    *key = file_key(info);
+    bool loading;
+    if (claim(table, *key, &loading))
+        return INFLIGHT_CLAIMED;
+    return loading ? INFLIGHT_LOADING : INFLIGHT_CACHED;
+}
+
+// Runs on an I/O thread, or inline without them. The file offset is left
+// where it was, fd goes on to be sent from.
+void inflight_read_in(struct inflight_table *table, uint64_t key, int fd, char *buf, size_t size) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    time_t stamped = time(NULL);
+    off_t offset = 0;
+    ssize_t n;
+    while ((n = pread(fd, buf, size, offset)) > 0) {
+        offset += n;
+        time_t now = time(NULL);
+        if (now == stamped)
+            continue;
+        stamped = now;
+        struct inflight_slot *slot = find(table, key);
+        if (slot)
+            __atomic_store_n(&slot->started, (int64_t)now, __ATOMIC_RELEASE);
+    }
+    if (n == -1)
+        log_perror(LOG_WARN, "failed to read file in");
+}
+
+void inflight_release(struct inflight_table *table, uint64_t key) {
+    struct inflight_slot *slot = find(table, key);
+    if (slot)
+        __atomic_store_n(&slot->key, 0, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,162 @@
+#include "server.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define IO_REPORT_INTERVAL 60 // seconds between pool summaries
+
+struct io_pool_stats {
+    uint64_t jobs;
+    uint64_t wait_ns; // queued until a thread took it
+    uint64_t run_ns;
+    uint64_t max_ns; // queued until done
+    size_t peak_depth;
+};
+
+// Per worker. Jobs queue up for the pool's threads, finished ones are handed
+// back through the done list, and a byte on the pipe wakes the event loop.
+// Everything below the lock is shared with the threads.
+struct io_pool {
+    int pipe[2];
+    size_t thread_count;
+    time_t reported;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct io_job *queue_head;
+    struct io_job *queue_tail;
+    size_t depth;
+    struct io_job *done;
+    bool notified; // a byte is in the pipe
+    struct io_pool_stats stats;
+    pthread_t threads[];
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void *io_thread(void *arg) {
+    struct io_pool *pool = arg;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->queue_head == NULL)
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        struct io_job *job = pool->queue_head;
+        pool->queue_head = job->next;
+        if (pool->queue_head == NULL)
+            pool->queue_tail = NULL;
+        --pool->depth;
+        pthread_mutex_unlock(&pool->lock);
+
+        uint64_t started = now_ns();
+        job->run(job);
+        uint64_t finished = now_ns();
+
+        pthread_mutex_lock(&pool->lock);
+        struct io_pool_stats *stats = &pool->stats;
+        ++stats->jobs;
+        stats->wait_ns += started - job->queued_ns;
+        stats->run_ns += finished - started;
+        if (finished - job->queued_ns > stats->max_ns)
+            stats->max_ns = finished - job->queued_ns;
+        job->next = pool->done;
+        pool->done = job;
+        if (!pool->notified) {
+            pool->notified = true;
+            if (write(pool->pipe[1], "", 1) == -1 && errno != EAGAIN)
+                log_perror(LOG_ERROR, "failed to notify event loop");
+        }
+    }
+    return NULL;
+}
+
+// Signals stay with the event loop thread, the I/O threads block them all.
+struct io_pool *io_pool_create(size_t threads) {
+    struct io_pool *pool = calloc(1, sizeof(*pool) + threads * sizeof(pool->threads[0]));
+    if (pool == NULL) {
+        log_msg(LOG_FATAL, "OOM");
+        exit(EXIT_FAILURE);
+    }
+    if (pipe(pool->pipe) == -1 || !set_nonblocking(pool->pipe[0]) || !set_nonblocking(pool->pipe[1])) {
+        log_perror(LOG_FATAL, "failed to create io pool pipe");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    pool->reported = time(NULL);
+
+    sigset_t all, saved;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &saved);
+    for (size_t i = 0; i < threads; ++i) {
+        int err = pthread_create(&pool->threads[i], NULL, io_thread, pool);
+        if (err != 0) {
+            errno = err;
+            log_perror(LOG_FATAL, "failed to start io thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    pool->thread_count = threads;
+    return pool;
+}
+
+int io_pool_fd(const struct io_pool *pool) {
+    return pool->pipe[0];
+}
+
+void io_pool_submit(struct io_pool *pool, struct io_job *job) {
+    job->next = NULL;
+    job->queued_ns = now_ns();
+    pthread_mutex_lock(&pool->lock);
+    if (pool->queue_tail)
+        pool->queue_tail->next = job;
+    else
+        pool->queue_head = job;
+    pool->queue_tail = job;
+    if (++pool->depth > pool->stats.peak_depth)
+        pool->stats.peak_depth = pool->depth;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Returns the jobs finished since the last call, linked through next.
+struct io_job *io_pool_completed(struct io_pool *pool) {
+    char drain[64];
+    while (read(pool->pipe[0], drain, sizeof(drain)) > 0)
+        ;
+    pthread_mutex_lock(&pool->lock);
+    struct io_job *done = pool->done;
+    pool->done = NULL;
+    pool->notified = false;
+    pthread_mutex_unlock(&pool->lock);
+    return done;
+}
+
+void io_pool_report(struct io_pool *pool) {
+    time_t now = time(NULL);
+    if (now - pool->reported < IO_REPORT_INTERVAL)
+        return;
+    pool->reported = now;
+
+    pthread_mutex_lock(&pool->lock);
+    struct io_pool_stats stats = pool->stats;
+    memset(&pool->stats, 0, sizeof(pool->stats));
+    pool->stats.peak_depth = pool->depth;
+    pthread_mutex_unlock(&pool->lock);
+    if (stats.jobs == 0)
+        return;
+    log_msg(LOG_INFO, "io pool: %llu jobs on %zu threads, %.3fms queued and %.3fms running on average, %.3fms at most, "
+            "peak queue %zu in the last %ds",
+            (unsigned long long)stats.jobs, pool->thread_count, (double)stats.wait_ns / (double)stats.jobs / 1e6,
+            (double)stats.run_ns / (double)stats.jobs / 1e6, (double)stats.max_ns / 1e6, stats.peak_depth,
+            IO_REPORT_INTERVAL);
+}
@@ -0,0 +1,18 @@
+#ifndef LOG_H
+#define LOG_H
+
+// Implemented in server.c. Kept apart from server.h for code built without
+// the rest of the server, like tools/page_bench.c.
+
+enum log_level {
+    LOG_TRACE,
+    LOG_INFO,
+    LOG_WARN,
+    LOG_ERROR,
+    LOG_FATAL
+};
+
+__attribute__((format(printf, 2, 3))) void log_msg(enum log_level level, const char *fmt, ...);
+__attribute__((format(printf, 2, 3))) void log_perror(enum log_level level, const char *fmt, ...);
+
+#endif
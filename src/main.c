@@ -1,7 +1,13 @@
 #include "server.h"
 
-int main(void) {
-    struct server_settings settings = {4096, "127.0.0.1", 8000,    8,
-                                       100,  1 << 15,     1 << 10, "/Users/holod/study/BMSTU/sem7_cn_cw"};
-    run_server(&settings);
+#include <stdlib.h>
+
+int main(int argc, char **argv) {
+    struct server_settings settings;
+    switch (load_settings(argc, argv, &settings)) {
+    case LOAD_SETTINGS_OK: break;
+    case LOAD_SETTINGS_HELP: return EXIT_SUCCESS;
+    case LOAD_SETTINGS_ERROR: return EXIT_FAILURE;
+    }
+    return run_server(&settings) ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -6,10 +6,57 @@
 #include <stdlib.h>
 #include <string.h>
 
+// Blocks of the size connection arenas start with, carved out of one region
+// per worker so that they share a few huge pages and are reused without
+// malloc. Slots are handed out in order before freed ones are reused, so
+// pages are only touched once they are needed.
+struct block_pool {
+    char *base;
+    char *end;
+    char *unused;
+    size_t slot_size;
+    struct memory_arena_block *free_list; // linked through next
+};
+
+static struct block_pool g_block_pool;
+
+void arena_pool_init(size_t block_size, size_t count) {
+    struct block_pool *pool = &g_block_pool;
+    pool->slot_size = (block_size + sizeof(struct memory_arena_block) + 63) & ~(size_t)63;
+    pool->base = page_alloc(pool->slot_size * count, false);
+    pool->end = pool->base + pool->slot_size * count;
+    pool->unused = pool->base;
+    pool->free_list = NULL;
+}
+
+static struct memory_arena_block *pool_get(size_t size) {
+    struct block_pool *pool = &g_block_pool;
+    if (size > pool->slot_size)
+        return NULL;
+    struct memory_arena_block *block = pool->free_list;
+    if (block) {
+        pool->free_list = block->next;
+    } else if (pool->unused < pool->end) {
+        block = (struct memory_arena_block *)pool->unused;
+        pool->unused += pool->slot_size;
+    }
+    return block;
+}
+
+static bool pool_put(struct memory_arena_block *block) {
+    struct block_pool *pool = &g_block_pool;
+    if ((char *)block < pool->base || (char *)block >= pool->end)
+        return false;
+    block->next = pool->free_list;
+    pool->free_list = block;
+    return true;
+}
+
 static void free_last_block(struct memory_arena *arena) {
     struct memory_arena_block *block = arena->current_block;
     arena->current_block = block->next;
-    free(block);
+    if (!pool_put(block))
+        free(block);
 }
 
 void arena_clear(struct memory_arena *arena) {
@@ -49,11 +96,15 @@ void *arena_alloc(struct memory_arena *arena, size_t size_init) {
                 block_size = arena->minimum_block_size;
             }
 
-            struct memory_arena_block *new_block = calloc(1, block_size + sizeof(struct memory_arena_block));
+            struct memory_arena_block *new_block = pool_get(block_size + sizeof(struct memory_arena_block));
+            if (new_block == NULL) {
+                new_block = calloc(1, block_size + sizeof(struct memory_arena_block));
+            }
             if (new_block == NULL) {
                 return NULL;
             }
             new_block->size = block_size;
+            new_block->used = 0;
             new_block->next = arena->current_block;
             new_block->base = (char *)(new_block + 1);
             arena->current_block = new_block;
@@ -0,0 +1,48 @@
+#ifndef MIME_HASH_H
+#define MIME_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Shared between tools/mime_gen.c and the server so that the generated table
+// and the lookup always agree on the hash function.
+
+#define MIME_EXT_MAX 15
+
+struct mime_slot {
+    char ext[MIME_EXT_MAX + 1]; // lowercase, not NUL terminated when full
+    uint8_t len;                // 0 marks an empty slot
+    uint8_t type;
+};
+
+struct mime_header_line {
+    const char *line; // "Content-Type: ...\r\n"
+    size_t len;
+};
+
+// Defined in the generated mime_types.c.
+extern const uint32_t mime_hash_seed;
+extern const uint32_t mime_hash_mask;
+extern const char *const mime_type_strs[];
+extern const struct mime_header_line mime_header_lines[];
+extern const struct mime_slot mime_slots[];
+
+static inline char mime_lower(char c) {
+    return (c >= 'A' && c <= 'Z') ? (char)(c - 'A' + 'a') : c;
+}
+
+// FNV-1a over already lowercased input, perturbed by seed and finalized so that
+// the low bits used for the slot index depend on the whole key.
+static inline uint32_t mime_hash(const char *s, size_t len, uint32_t seed) {
+    uint32_t h = 2166136261u ^ seed;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    h ^= h >> 15;
+    h *= 0x2c1b3c6du;
+    h ^= h >> 12;
+    return h;
+}
+
+#endif
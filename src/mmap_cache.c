@@ -0,0 +1,150 @@
+#include "server.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MMAP_CACHE_SIZE 1024 // must be a power of two
+#define MMAP_CACHE_PROBES 4
+
+struct mmap_cache {
+    size_t max_file_size;
+    size_t max_total_size;
+    size_t total_size;
+    size_t clock_hand;
+    struct mmap_entry *entries[MMAP_CACHE_SIZE];
+};
+
+static size_t file_hash(dev_t dev, ino_t ino) {
+    uint64_t h = ((uint64_t)dev * 0x9e3779b97f4a7c15ull) ^ ((uint64_t)ino * 0xc2b2ae3d27d4eb4full);
+    return (size_t)(h ^ (h >> 29));
+}
+
+static void unmap_entry(struct mmap_entry *entry) {
+    munmap(entry->data, entry->size);
+    free(entry);
+}
+
+static void detach_slot(struct mmap_cache *cache, size_t slot) {
+    struct mmap_entry *entry = cache->entries[slot];
+    cache->entries[slot] = NULL;
+    cache->total_size -= entry->size;
+    if (entry->refs == 0)
+        unmap_entry(entry);
+    else
+        entry->detached = true;
+}
+
+// Evicts unreferenced entries in clock order until size more bytes fit.
+static bool make_room(struct mmap_cache *cache, size_t size) {
+    for (size_t i = 0; i < MMAP_CACHE_SIZE && cache->total_size + size > cache->max_total_size; ++i) {
+        size_t slot = cache->clock_hand;
+        cache->clock_hand = (cache->clock_hand + 1) & (MMAP_CACHE_SIZE - 1);
+        struct mmap_entry *entry = cache->entries[slot];
+        if (entry && entry->refs == 0)
+            detach_slot(cache, slot);
+    }
+    return cache->total_size + size <= cache->max_total_size;
+}
+
+static struct mmap_entry *map_file(const struct static_root *root, const char *path, const struct file_info *info) {
+    int fd = static_root_reopen(root, path);
+    if (fd == -1)
+        return NULL;
+
+    // The file may have been replaced between stat and open.
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_dev != info->dev || st.st_ino != info->ino || st.st_mtime != info->mtime ||
+        (size_t)st.st_size != info->size) {
+        close(fd);
+        return NULL;
+    }
+
+    void *data = mmap(NULL, info->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        log_perror(LOG_WARN, "mmap failed");
+        return NULL;
+    }
+    madvise(data, info->size, MADV_SEQUENTIAL);
+    madvise(data, info->size, MADV_WILLNEED);
+
+    struct mmap_entry *entry = calloc(1, sizeof(*entry));
+    if (entry == NULL) {
+        munmap(data, info->size);
+        return NULL;
+    }
+    entry->dev = info->dev;
+    entry->ino = info->ino;
+    entry->mtime = info->mtime;
+    entry->size = info->size;
+    entry->data = data;
+    return entry;
+}
+
+struct mmap_cache *mmap_cache_create(size_t max_file_size, size_t max_total_size) {
+    struct mmap_cache *cache = calloc(1, sizeof(*cache));
+    if (cache == NULL) {
+        log_msg(LOG_FATAL, "OOM");
+        exit(EXIT_FAILURE);
+    }
+    cache->max_file_size = max_file_size;
+    cache->max_total_size = max_total_size;
+    return cache;
+}
+
+struct mmap_entry *mmap_cache_get(struct mmap_cache *cache, const struct static_root *root, const char *path,
+                                  const struct file_info *info) {
+    if (info->size == 0 || info->size > cache->max_file_size || info->size > cache->max_total_size)
+        return NULL;
+
+    size_t home = file_hash(info->dev, info->ino) & (MMAP_CACHE_SIZE - 1);
+    ssize_t free_slot = -1;
+    for (size_t i = 0; i < MMAP_CACHE_PROBES; ++i) {
+        size_t slot = (home + i) & (MMAP_CACHE_SIZE - 1);
+        struct mmap_entry *entry = cache->entries[slot];
+        if (entry == NULL) {
+            if (free_slot == -1)
+                free_slot = slot;
+            continue;
+        }
+        if (entry->dev != info->dev || entry->ino != info->ino)
+            continue;
+
+        if (!entry->stale && entry->mtime == info->mtime && entry->size == info->size) {
+            ++entry->refs;
+            return entry;
+        }
+        // The file changed since it was mapped. Connections still sending
+        // from the old mapping keep it alive until they release it.
+        detach_slot(cache, slot);
+        if (free_slot == -1)
+            free_slot = slot;
+    }
+
+    if (free_slot == -1) {
+        if (cache->entries[home]->refs != 0)
+            return NULL;
+        detach_slot(cache, home);
+        free_slot = home;
+    }
+    if (!make_room(cache, info->size))
+        return NULL;
+
+    struct mmap_entry *entry = map_file(root, path, info);
+    if (entry == NULL)
+        return NULL;
+    cache->entries[free_slot] = entry;
+    cache->total_size += entry->size;
+    entry->refs = 1;
+    return entry;
+}
+
+void mmap_cache_release(struct mmap_entry *entry) {
+    --entry->refs;
+    if (entry->refs == 0 && entry->detached)
+        unmap_entry(entry);
+}
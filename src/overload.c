@@ -0,0 +1,217 @@
+#include "server.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/sockios.h>
+#endif
+
+#define OVERLOAD_REPORT_INTERVAL 60 // seconds between summaries
+#define SHED_RESUME_PERCENT 75      // of each limit, all signals must be under it to stop shedding
+#define LAG_ROUNDS 4                // event loop rounds the lag is averaged over
+
+// Per worker, created once a shed limit first applies. The loop lag is how
+// long a round of the event loop spends before it waits again, which is how
+// long a connection that became ready meanwhile goes unnoticed.
+struct overload {
+    bool shedding;
+    uint64_t woke_ns;  // when the wait of the current round returned
+    uint64_t done_ns;  // when the last round ended
+    uint64_t lag_ns;   // averaged over rounds
+    size_t conns;      // open, with the ones admitted this round
+    size_t pending;    // response bytes waiting to be sent, as of the last round
+    uint64_t since_ns; // the current episode started
+    uint64_t episodes;
+    uint64_t shed;
+    uint64_t shed_episode;
+    time_t reported;
+    uint64_t reported_shed;
+    // Built once. A 5xx response needs no Date, RFC 9110 section 6.6.1, so
+    // nothing in it changes from one connection to the next.
+    int retry_after;
+    int response_len;
+    char response[128];
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+struct overload *overload_create(void) {
+    struct overload *overload = calloc(1, sizeof(*overload));
+    if (overload == NULL) {
+        log_msg(LOG_FATAL, "OOM");
+        exit(EXIT_FAILURE);
+    }
+    overload->woke_ns = overload->done_ns = now_ns();
+    overload->reported = time(NULL);
+    overload->retry_after = -1;
+    return overload;
+}
+
+static bool over(uint64_t value, uint64_t limit) {
+    return limit && value > limit;
+}
+
+static bool under_resume(uint64_t value, uint64_t limit) {
+    return limit == 0 || value * 100 <= limit * SHED_RESUME_PERCENT;
+}
+
+static void start_shedding(struct overload *overload, const char *reason) {
+    overload->shedding = true;
+    overload->since_ns = now_ns();
+    overload->shed_episode = 0;
+    ++overload->episodes;
+    log_msg(LOG_WARN, "overloaded by %s, answering new connections with 503", reason);
+}
+
+// Past shed_max_conns the connection is refused here, the other signals
+// only change between rounds.
+bool overload_admit(struct overload *overload, const struct server_settings *settings) {
+    if (!overload->shedding && over(overload->conns + 1, settings->shed_max_conns)) {
+        char reason[64];
+        snprintf(reason, sizeof(reason), "%zu open connections", overload->conns);
+        start_shedding(overload, reason);
+    }
+    if (overload->shedding)
+        return false;
+    ++overload->conns;
+    return true;
+}
+
+// Nothing is allocated and nothing is looked up. Whatever of the request
+// has arrived is read off first, closing over unread data resets the
+// connection and can take the 503 with it.
+void overload_shed(struct overload *overload, const struct server_settings *settings, int fd, bool tls) {
+    ++overload->shed;
+    ++overload->shed_episode;
+    // A plaintext answer means nothing to a TLS client.
+    if (tls) {
+        close(fd);
+        return;
+    }
+    if (overload->retry_after != settings->shed_retry_after) {
+        overload->retry_after = settings->shed_retry_after;
+        overload->response_len =
+            snprintf(overload->response, sizeof(overload->response),
+                     "HTTP/1.1 %d %s\r\nRetry-After: %d\r\nContent-Length: 0\r\nConnection: Close\r\n\r\n",
+                     http_status_code_int(HTTP_SERVICE_UNAVAILABLE), http_status_code_str(HTTP_SERVICE_UNAVAILABLE),
+                     overload->retry_after);
+    }
+    char discard[1024];
+    size_t drained = 0;
+    ssize_t nread;
+    while (drained < settings->req_size_limit && (nread = recv(fd, discard, sizeof(discard), MSG_DONTWAIT)) > 0)
+        drained += (size_t)nread;
+    if (send(fd, overload->response, overload->response_len, MSG_DONTWAIT) == -1)
+        log_perror(LOG_TRACE, "failed to send 503");
+    close(fd);
+}
+
+// Starts or stops shedding by the signals of the last round.
+static void check_limits(struct overload *overload, const struct server_settings *settings, uint64_t now) {
+    uint64_t lag_ms = overload->lag_ns / 1000000;
+    uint64_t max_lag = settings->shed_max_lag_ms > 0 ? (uint64_t)settings->shed_max_lag_ms : 0;
+    if (!overload->shedding) {
+        char reason[64];
+        if (over(lag_ms, max_lag))
+            snprintf(reason, sizeof(reason), "%llu ms event loop lag", (unsigned long long)lag_ms);
+        else if (over(overload->conns, settings->shed_max_conns))
+            snprintf(reason, sizeof(reason), "%zu open connections", overload->conns);
+        else if (over(overload->pending, settings->shed_max_pending))
+            snprintf(reason, sizeof(reason), "%zu bytes pending", overload->pending);
+        else
+            return;
+        start_shedding(overload, reason);
+    } else if (under_resume(lag_ms, max_lag) && under_resume(overload->conns, settings->shed_max_conns) &&
+               under_resume(overload->pending, settings->shed_max_pending)) {
+        overload->shedding = false;
+        log_msg(LOG_INFO, "load back under limits after %.1f s, %llu connections shed",
+                (double)(now - overload->since_ns) / 1e9, (unsigned long long)overload->shed_episode);
+    }
+}
+
+// Called as the wait of a round returns, before its connections are
+// accepted. A loop that sat idle for longer than the lag limit has caught
+// up, whatever its last rounds took.
+void overload_woke(struct overload *overload, const struct server_settings *settings) {
+    uint64_t now = now_ns();
+    if (overload->lag_ns && now - overload->done_ns > (uint64_t)settings->shed_max_lag_ms * 1000000ull) {
+        overload->lag_ns = 0;
+        if (overload->shedding)
+            check_limits(overload, settings, now);
+    }
+    overload->woke_ns = now;
+}
+
+// Bytes written to the socket that the peer has not taken yet.
+static size_t queued_bytes(int fd) {
+    int queued = 0;
+#if defined(SIOCOUTQ)
+    if (ioctl(fd, SIOCOUTQ, &queued) == -1)
+        queued = 0;
+#elif defined(SO_NWRITE)
+    socklen_t len = sizeof(queued);
+    if (getsockopt(fd, SOL_SOCKET, SO_NWRITE, &queued, &len) == -1)
+        queued = 0;
+#else
+    (void)fd;
+#endif
+    return queued > 0 ? (size_t)queued : 0;
+}
+
+// What a connection still has to get out to a slow peer: its send queue,
+// and the rest of a mapped, listed or packed body or of a file read.
+static size_t pending_bytes(const struct active_connection *conn) {
+    if (conn->state != CONN_SENDING && conn->state != CONN_PACED && conn->h2 == NULL)
+        return 0;
+    size_t pending = queued_bytes(conn->sock_fd);
+    if (conn->h2 || conn->proxy)
+        return pending;
+    if (conn->mapping)
+        return pending + conn->mapping->size - conn->body_cursor;
+    if (conn->listing)
+        return pending + conn->listing->body_len - conn->body_cursor;
+    if (conn->pack_body)
+        return pending + conn->pack_body_len - conn->body_cursor;
+    return pending + conn->read_buf_len - conn->read_buf_cursor;
+}
+
+// Called at the end of every round of the event loop with the connections
+// it keeps.
+void overload_update(struct overload *overload, const struct server_settings *settings, List *conns) {
+    uint64_t now = now_ns();
+    uint64_t busy = now - overload->woke_ns;
+    overload->done_ns = now;
+    overload->lag_ns = (overload->lag_ns * (LAG_ROUNDS - 1) + busy) / LAG_ROUNDS;
+    overload->conns = (size_t)list_length(conns);
+    // A call per sending connection, only made when the limit is set.
+    overload->pending = 0;
+    if (settings->shed_max_pending) {
+        foreach (lc, conns)
+            overload->pending += pending_bytes(lfirst(lc));
+    }
+    check_limits(overload, settings, now);
+}
+
+void overload_report(struct overload *overload) {
+    time_t now = time(NULL);
+    if (now - overload->reported < OVERLOAD_REPORT_INTERVAL)
+        return;
+    overload->reported = now;
+    if (overload->shed == overload->reported_shed)
+        return;
+    overload->reported_shed = overload->shed;
+    log_msg(LOG_INFO, "load shedding totals: %llu connections shed over %llu episodes%s, lag %llu ms, %zu open "
+            "connections, %zu bytes pending",
+            (unsigned long long)overload->shed, (unsigned long long)overload->episodes,
+            overload->shedding ? ", shedding" : "", (unsigned long long)(overload->lag_ns / 1000000), overload->conns,
+            overload->pending);
+}
@@ -0,0 +1,182 @@
+#include "server.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#define PACING_REPORT_INTERVAL 60 // seconds between summaries
+#define PACE_BURST_MS 10          // most the user space pacer lets out at once, in time at the rate
+#define PACE_MIN_BURST 4096
+
+struct pacing_stats {
+    uint64_t kernel_bytes;    // sent on sockets the kernel paces
+    uint64_t paced_bytes;     // sent through the user space pacer
+    uint64_t throttled_bytes; // of those, sent after the pacer held the connection back
+    uint64_t waits;
+};
+
+// Per worker, created once a pacing rate first applies.
+struct pacing {
+    time_t reported;
+    uint64_t reported_bytes;
+    struct pacing_stats stats;
+};
+
+// Per paced connection, in its arena. Where the kernel takes the rate the
+// pacer only counts. Otherwise it is a token bucket that lets a write out
+// whenever it holds any tokens and then goes into debt for it. A write is
+// never cut shorter than the burst, so a TLS write that has to be retried
+// is offered no less than the first time.
+struct pacer {
+    struct pacing *pacing;
+    bool kernel;
+    bool held;    // since the last write went out
+    bool waiting; // for tokens rather than the socket
+    uint64_t rate; // bytes per second
+    size_t burst;
+    int64_t tokens;
+    uint64_t refilled_ns;
+    uint64_t due_ns;
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// The longest pace prefix of the path sets the rate, then the pace of the
+// request's vhost, then pace_rate. req is NULL where only the connection is
+// known.
+static uint64_t pace_rate(const struct server_settings *settings, const struct http_req *req) {
+    uint64_t rate = settings->pace_rate;
+    if (req && req->vhost->settings && req->vhost->settings->pace_set)
+        rate = req->vhost->settings->pace_rate;
+    size_t best = 0;
+    for (size_t i = 0; req && i < settings->pace_count; ++i) {
+        const struct pace_settings *pace = &settings->paces[i];
+        size_t len = strlen(pace->prefix);
+        if (len > best && strncmp(req->path, pace->prefix, len) == 0) {
+            best = len;
+            rate = pace->rate;
+        }
+    }
+    return rate;
+}
+
+// TCP paces by itself since Linux 4.13, and through the fq qdisc where that
+// is installed. Other sockets accept the option and ignore it.
+static bool kernel_pace(int fd, uint64_t rate) {
+#if defined(SO_MAX_PACING_RATE) && defined(SO_DOMAIN)
+    int domain;
+    socklen_t len = sizeof(domain);
+    if (getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &len) == -1 || (domain != AF_INET && domain != AF_INET6))
+        return false;
+    unsigned int value = rate > UINT_MAX ? UINT_MAX : (unsigned int)rate;
+    if (setsockopt(fd, SOL_SOCKET, SO_MAX_PACING_RATE, &value, sizeof(value)) == 0)
+        return true;
+    log_perror(LOG_INFO, "failed to set pacing rate, pacing in user space");
+#else
+    (void)fd;
+    (void)rate;
+#endif
+    return false;
+}
+
+// Applies once per connection, to the first request on it.
+void pacing_start(struct worker *worker, struct active_connection *conn, const struct http_req *req) {
+    if (conn->pacer)
+        return;
+    uint64_t rate = pace_rate(worker->settings, req);
+    if (rate == 0)
+        return;
+    if (worker->pacing == NULL) {
+        worker->pacing = calloc(1, sizeof(*worker->pacing));
+        if (worker->pacing == NULL) {
+            log_msg(LOG_FATAL, "OOM");
+            exit(EXIT_FAILURE);
+        }
+        worker->pacing->reported = time(NULL);
+    }
+
+    struct pacer *pacer = server_alloc(sizeof(*pacer));
+    memset(pacer, 0, sizeof(*pacer));
+    pacer->pacing = worker->pacing;
+    pacer->kernel = kernel_pace(conn->sock_fd, rate);
+    pacer->rate = rate;
+    pacer->burst = rate * PACE_BURST_MS / 1000;
+    if (pacer->burst < PACE_MIN_BURST)
+        pacer->burst = PACE_MIN_BURST;
+    pacer->tokens = (int64_t)pacer->burst;
+    pacer->refilled_ns = now_ns();
+    conn->pacer = pacer;
+}
+
+// How much of len may be written now, 0 to wait until pacing_due.
+size_t pacing_allow(struct pacer *pacer, size_t len) {
+    pacer->waiting = false;
+    if (pacer->kernel)
+        return len;
+
+    uint64_t now = now_ns();
+    uint64_t elapsed = now - pacer->refilled_ns;
+    if (elapsed > 1000000000ull)
+        elapsed = 1000000000ull;
+    pacer->tokens += (int64_t)(elapsed * pacer->rate / 1000000000ull);
+    pacer->refilled_ns = now;
+    if (pacer->tokens > (int64_t)pacer->burst)
+        pacer->tokens = (int64_t)pacer->burst;
+
+    if (pacer->tokens <= 0) {
+        pacer->due_ns = now + (uint64_t)-pacer->tokens * 1000000000ull / pacer->rate + 1;
+        pacer->waiting = true;
+        if (!pacer->held) {
+            pacer->held = true;
+            ++pacer->pacing->stats.waits;
+        }
+        return 0;
+    }
+    return len < pacer->burst ? len : pacer->burst;
+}
+
+void pacing_sent(struct pacer *pacer, size_t len) {
+    struct pacing_stats *stats = &pacer->pacing->stats;
+    if (pacer->kernel) {
+        stats->kernel_bytes += len;
+        return;
+    }
+    pacer->tokens -= (int64_t)len;
+    stats->paced_bytes += len;
+    if (pacer->held)
+        stats->throttled_bytes += len;
+    pacer->held = false;
+}
+
+bool pacing_due(const struct pacer *pacer) {
+    return now_ns() >= pacer->due_ns;
+}
+
+// What a connection whose body write could not go on waits for: its pacer,
+// or room in the socket.
+enum connection_state pacing_blocked(const struct active_connection *conn) {
+    return conn->pacer && conn->pacer->waiting ? CONN_PACED : CONN_SENDING;
+}
+
+void pacing_report(struct pacing *pacing) {
+    time_t now = time(NULL);
+    if (now - pacing->reported < PACING_REPORT_INTERVAL)
+        return;
+    pacing->reported = now;
+
+    const struct pacing_stats *stats = &pacing->stats;
+    uint64_t bytes = stats->kernel_bytes + stats->paced_bytes;
+    if (bytes == pacing->reported_bytes)
+        return;
+    pacing->reported_bytes = bytes;
+    log_msg(LOG_INFO, "pacing totals: %llu bytes paced by the kernel, %llu by the pacer, %llu of them throttled "
+            "over %llu waits",
+            (unsigned long long)stats->kernel_bytes, (unsigned long long)stats->paced_bytes,
+            (unsigned long long)stats->throttled_bytes, (unsigned long long)stats->waits);
+}
@@ -0,0 +1,55 @@
+#ifndef PACK_FORMAT_H
+#define PACK_FORMAT_H
+
+#include <stdint.h>
+
+// Layout of asset pack files, shared between tools/asset_pack.c and the
+// server. Packs are written in the byte order of the host that builds them
+// and only ever replaced by renaming a new file over the old one.
+//
+//   header | entries, sorted by path | string table | contents
+//
+// Contents of a page or more start on a page boundary, smaller ones are
+// packed back to back.
+
+#define PACK_MAGIC "SRVPACK"
+#define PACK_VERSION 1
+#define PACK_PAGE 4096
+#define PACK_ETAG_LEN 16 // hex digits of the content hash
+
+enum pack_variant {
+    PACK_IDENTITY,
+    PACK_BR, // from a precompressed .br sibling
+    PACK_GZIP,
+    PACK_VARIANTS
+};
+
+struct pack_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_size; // catches packs from a different layout or byte order
+    uint64_t entry_count;
+    uint64_t entries; // file offsets
+    uint64_t strings;
+    uint64_t strings_size;
+    uint64_t size; // of the whole file
+};
+
+struct pack_blob {
+    uint64_t offset; // 0 when the variant is absent
+    uint64_t length;
+};
+
+// Strings are offsets into the string table and NUL terminated. A directory
+// with an index.html is listed under its path with and without the trailing
+// slash, sharing the contents of the index.
+struct pack_entry {
+    uint64_t path;
+    uint64_t path_len;
+    uint64_t content_type; // the full header value
+    uint64_t etag;         // PACK_ETAG_LEN hex digits, unquoted
+    int64_t mtime;
+    struct pack_blob blobs[PACK_VARIANTS];
+};
+
+#endif
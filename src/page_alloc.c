@@ -0,0 +1,155 @@
+#include "log.h"
+#include "page_alloc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#define HUGE_PAGE_DEFAULT (2u << 20)
+#define MPOL_PREFERRED_MODE 1 // MPOL_PREFERRED, without needing the libnuma headers
+#define NUMA_MASK_WORDS 16    // longs of nodes numa_local can bind to
+
+// Per worker process, set up for the node the worker starts on before it
+// allocates what it keeps, so that memory only the worker touches lands next
+// to the CPU that touches it.
+static struct {
+    enum huge_pages mode;
+    int node; // -1 leaves placement to the kernel
+    size_t huge_size;
+    bool bind_failed; // warned once
+    size_t hugetlb_bytes;
+    size_t thp_bytes;
+    size_t small_bytes;
+} g_pages = {HUGE_PAGES_OFF, -1, HUGE_PAGE_DEFAULT, false, 0, 0, 0};
+
+static size_t huge_page_size(void) {
+    size_t size = HUGE_PAGE_DEFAULT;
+    FILE *f = fopen("/proc/meminfo", "r");
+    if (f == NULL)
+        return size;
+    char line[128];
+    unsigned long kb;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "Hugepagesize: %lu kB", &kb) == 1 && kb) {
+            size = (size_t)kb << 10;
+            break;
+        }
+    }
+    fclose(f);
+    return size;
+}
+
+static int current_node(void) {
+#ifdef SYS_getcpu
+    unsigned cpu, node;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0)
+        return (int)node;
+#endif
+    return -1;
+}
+
+void page_alloc_init(enum huge_pages mode, bool numa_local) {
+    g_pages.mode = mode;
+    g_pages.huge_size = huge_page_size();
+    g_pages.node = numa_local ? current_node() : -1;
+    g_pages.hugetlb_bytes = g_pages.thp_bytes = g_pages.small_bytes = 0;
+}
+
+// Preferred rather than bound, a full node spills over instead of failing.
+static void bind_node(void *mem, size_t len) {
+#ifdef SYS_mbind
+    unsigned long mask[NUMA_MASK_WORDS] = {0};
+    if (g_pages.node < 0 || (size_t)g_pages.node >= sizeof(mask) * 8)
+        return;
+    mask[g_pages.node / (8 * sizeof(long))] |= 1ul << (g_pages.node % (8 * sizeof(long)));
+    // The kernel reads one bit less than maxnode says.
+    if (syscall(SYS_mbind, mem, len, MPOL_PREFERRED_MODE, mask, sizeof(mask) * 8 + 1, 0) == -1 &&
+        !g_pages.bind_failed) {
+        log_perror(LOG_WARN, "failed to bind memory to NUMA node %d", g_pages.node);
+        g_pages.bind_failed = true;
+    }
+#else
+    (void)mem;
+    (void)len;
+#endif
+}
+
+static bool huge(size_t size) {
+    return g_pages.mode != HUGE_PAGES_OFF && size >= g_pages.huge_size;
+}
+
+static size_t mapped_len(size_t size) {
+    return huge(size) ? (size + g_pages.huge_size - 1) & ~(g_pages.huge_size - 1) : size;
+}
+
+// Transparent hugepages only back aligned stretches, so the mapping is made
+// one huge page larger and trimmed to the boundary.
+static void *map_aligned(size_t len, int flags) {
+    size_t align = g_pages.huge_size;
+    char *mem = mmap(NULL, len + align, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (mem == MAP_FAILED)
+        return mem;
+    size_t head = (align - ((size_t)mem & (align - 1))) & (align - 1);
+    if (head)
+        munmap(mem, head);
+    munmap(mem + head + len, align - head);
+    return mem + head;
+}
+
+// Zeroed, page aligned memory for tables and pools that are set up once and
+// kept. Regions of at least a huge page go on huge pages as huge_pages says:
+// reserved hugetlb pages where there are any left, transparent ones
+// otherwise. Exits when there is no memory at all.
+void *page_alloc(size_t size, bool shared) {
+    int flags = (shared ? MAP_SHARED : MAP_PRIVATE) | MAP_ANONYMOUS;
+    size_t len = mapped_len(size);
+    void *mem = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (huge(size) && g_pages.mode == HUGE_PAGES_ON) {
+        mem = mmap(NULL, len, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+        if (mem == MAP_FAILED)
+            log_perror(LOG_WARN, "no hugetlb pages for %zu KiB, trying transparent hugepages", len >> 10);
+        else
+            g_pages.hugetlb_bytes += len;
+    }
+#endif
+    if (mem == MAP_FAILED && huge(size)) {
+        mem = map_aligned(len, flags);
+#ifdef MADV_HUGEPAGE
+        if (mem != MAP_FAILED && madvise(mem, len, MADV_HUGEPAGE) == -1)
+            log_perror(LOG_WARN, "transparent hugepages unavailable");
+#endif
+        if (mem != MAP_FAILED)
+            g_pages.thp_bytes += len;
+    } else if (mem == MAP_FAILED) {
+        mem = mmap(NULL, len, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (mem != MAP_FAILED)
+            g_pages.small_bytes += len;
+    }
+    if (mem == MAP_FAILED) {
+        log_msg(LOG_FATAL, "OOM");
+        exit(EXIT_FAILURE);
+    }
+    bind_node(mem, len);
+    return mem;
+}
+
+void page_free(void *mem, size_t size) {
+    munmap(mem, mapped_len(size));
+}
+
+void page_alloc_report(void) {
+    if (g_pages.mode == HUGE_PAGES_OFF && g_pages.node < 0)
+        return;
+    char node[48] = "";
+    if (g_pages.node >= 0)
+        snprintf(node, sizeof(node), ", preferring NUMA node %d", g_pages.node);
+    log_msg(LOG_INFO, "memory: %zu KiB on hugetlb pages, %zu KiB advised for transparent hugepages, %zu KiB on small "
+            "pages%s",
+            g_pages.hugetlb_bytes >> 10, g_pages.thp_bytes >> 10, g_pages.small_bytes >> 10, node);
+}
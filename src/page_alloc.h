@@ -0,0 +1,18 @@
+#ifndef PAGE_ALLOC_H
+#define PAGE_ALLOC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+enum huge_pages {
+    HUGE_PAGES_OFF,
+    HUGE_PAGES_THP, // madvise transparent hugepages
+    HUGE_PAGES_ON,  // reserved hugetlb pages, transparent ones once they run out
+};
+
+void page_alloc_init(enum huge_pages mode, bool numa_local);
+__attribute__((returns_nonnull)) void *page_alloc(size_t size, bool shared);
+void page_free(void *mem, size_t size);
+void page_alloc_report(void);
+
+#endif
@@ -0,0 +1,126 @@
+#include "server.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define PATH_CACHE_PROBES 4
+
+// Maps a request path to what resolve_file made of it. An
+// entry is only trusted while the generation of its file is unchanged, so it
+// is never used without a watcher publishing changes.
+struct path_cache_entry {
+    char *uri;
+    size_t uri_len;
+    uint64_t hash;
+    char *full_path;
+    size_t full_path_len;
+    uint64_t gen;
+    struct file_info info;
+};
+
+struct path_cache {
+    size_t mask;
+    struct path_cache_entry entries[];
+};
+
+static uint64_t uri_hash(const char *uri, size_t len) {
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= (unsigned char)uri[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+static void free_entry(struct path_cache_entry *entry) {
+    free(entry->uri);
+    free(entry->full_path);
+    memset(entry, 0, sizeof(*entry));
+}
+
+static char *copy_str(const char *str, size_t len) {
+    char *copy = malloc(len + 1);
+    if (copy == NULL)
+        return NULL;
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+struct path_cache *path_cache_create(size_t size) {
+    size_t slots = PATH_CACHE_PROBES;
+    while (slots < size)
+        slots <<= 1;
+    struct path_cache *cache = page_alloc(sizeof(*cache) + slots * sizeof(cache->entries[0]), false);
+    cache->mask = slots - 1;
+    return cache;
+}
+
+void path_cache_clear(struct path_cache *cache) {
+    for (size_t i = 0; i <= cache->mask; ++i) {
+        if (cache->entries[i].uri)
+            free_entry(&cache->entries[i]);
+    }
+}
+
+bool path_cache_get(struct path_cache *cache, const struct fs_generations *gens, const char *uri, size_t uri_len,
+                    const char **full_path, struct file_info *info) {
+    if (!fs_generations_active(gens))
+        return false;
+
+    uint64_t hash = uri_hash(uri, uri_len);
+    size_t home = hash & cache->mask;
+    for (size_t i = 0; i < PATH_CACHE_PROBES; ++i) {
+        struct path_cache_entry *entry = &cache->entries[(home + i) & cache->mask];
+        if (entry->uri == NULL || entry->hash != hash || entry->uri_len != uri_len ||
+            memcmp(entry->uri, uri, uri_len) != 0)
+            continue;
+        if (entry->gen != fs_generation(gens, entry->full_path, entry->full_path_len)) {
+            free_entry(entry);
+            return false;
+        }
+        *full_path = entry->full_path;
+        *info = entry->info;
+        return true;
+    }
+    return false;
+}
+
+// seq is the generation sequence read before the path was resolved. If
+// anything changed since, the result may already be outdated and is dropped.
+void path_cache_put(struct path_cache *cache, const struct fs_generations *gens, uint64_t seq, const char *uri,
+                    size_t uri_len, const char *full_path, const struct file_info *info) {
+    if (!fs_generations_active(gens))
+        return;
+    size_t full_path_len = strlen(full_path);
+    uint64_t gen = fs_generation(gens, full_path, full_path_len);
+    if (fs_generation_seq(gens) != seq)
+        return;
+
+    uint64_t hash = uri_hash(uri, uri_len);
+    size_t home = hash & cache->mask;
+    struct path_cache_entry *entry = NULL;
+    for (size_t i = 0; i < PATH_CACHE_PROBES && entry == NULL; ++i) {
+        struct path_cache_entry *slot = &cache->entries[(home + i) & cache->mask];
+        if (slot->uri == NULL ||
+            (slot->hash == hash && slot->uri_len == uri_len && memcmp(slot->uri, uri, uri_len) == 0))
+            entry = slot;
+    }
+    // A full probe window evicts the entry at the home slot.
+    if (entry == NULL)
+        entry = &cache->entries[home];
+    if (entry->uri)
+        free_entry(entry);
+
+    entry->uri = copy_str(uri, uri_len);
+    entry->full_path = copy_str(full_path, full_path_len);
+    if (entry->uri == NULL || entry->full_path == NULL) {
+        free_entry(entry);
+        return;
+    }
+    entry->uri_len = uri_len;
+    entry->hash = hash;
+    entry->full_path_len = full_path_len;
+    entry->gen = gen;
+    entry->info = *info;
+}
@@ -15,7 +15,7 @@
  */
 #include "pg_list.h"
 #include "server.h"
-#include <_stdlib.h>
+#include <stdlib.h>
 #include <assert.h>
 #include <setjmp.h>
 
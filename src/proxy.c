@@ -0,0 +1,730 @@
+#include "server.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define PROXY_CHUNK (1 << 16) // most moved per splice, the default pipe capacity
+#define PROXY_LINE_MAX 256    // longest chunk size or trailer line
+
+struct upstream {
+    const struct upstream_settings *settings;
+    size_t prefix_len;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    bool resolved;
+    size_t idle_count;
+    int *idle; // keep-alive connections, most recently used last
+};
+
+// Per worker, so nothing is shared and no locking is needed.
+struct upstream_pool {
+    size_t count;
+    size_t keepalive;
+    struct upstream upstreams[];
+};
+
+enum proxy_phase {
+    PROXY_CONNECT,
+    PROXY_SEND_HEAD, // request head and whatever body came with it
+    PROXY_SEND_BODY,
+    PROXY_READ_HEAD,
+    PROXY_WRITE_HEAD,
+    PROXY_BODY, // a length or close delimited body, or one chunk
+    PROXY_CHUNK_LINE,
+    PROXY_WRITE_LINE,
+};
+
+enum proxy_framing {
+    FRAMING_NONE,
+    FRAMING_INFO, // 1xx, the final response follows
+    FRAMING_LENGTH,
+    FRAMING_CHUNKED,
+    FRAMING_CLOSE,
+};
+
+enum pump_result {
+    PUMP_DONE,
+    PUMP_WAIT,
+    PUMP_EOF,
+    PUMP_ERROR,
+};
+
+struct proxy_conn {
+    struct upstream *upstream;
+    enum proxy_phase phase;
+    int fd;
+    bool reused;
+    bool retryable; // the whole request is still at hand
+    bool head_only;
+    bool started; // the client got part of the response
+    enum proxy_framing framing;
+    bool keepalive;
+    bool trailers;
+    bool last_line; // the empty line that ends the trailers
+    int pipe[2]; // -1 until a splice needs it
+    size_t piped;
+    char *buf; // transfer buffer, holds the response head and user space copies
+    size_t buf_size;
+    size_t buf_len;
+    size_t buf_cursor;
+    const char *out; // request head, response head or chunk line being written
+    size_t out_len;
+    size_t out_cursor;
+    const char *request;
+    size_t request_len;
+    uint64_t left; // request body from the client, or response body to forward
+    char line[PROXY_LINE_MAX];
+    size_t line_len;
+    int wait_fd;
+    short wait_events;
+};
+
+static bool resolve_upstream(struct upstream *upstream) {
+    const struct upstream_settings *settings = upstream->settings;
+    memset(&upstream->addr, 0, sizeof(upstream->addr));
+    if (settings->unix_path) {
+        struct sockaddr_un *un = (struct sockaddr_un *)&upstream->addr;
+        if (strlen(settings->unix_path) >= sizeof(un->sun_path)) {
+            log_msg(LOG_ERROR, "upstream socket path too long: %s", settings->unix_path);
+            return false;
+        }
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, settings->unix_path);
+        upstream->addr_len = sizeof(*un);
+        return true;
+    }
+
+    char port[16];
+    snprintf(port, sizeof(port), "%d", settings->port);
+    struct addrinfo hints = {0};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *res;
+    int err = getaddrinfo(settings->host, port, &hints, &res);
+    if (err != 0) {
+        log_msg(LOG_ERROR, "failed to resolve upstream %s:%d: %s", settings->host, settings->port, gai_strerror(err));
+        return false;
+    }
+    memcpy(&upstream->addr, res->ai_addr, res->ai_addrlen);
+    upstream->addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return true;
+}
+
+// Backends that cannot be resolved answer 502 until the next restart.
+struct upstream_pool *upstream_pool_create(const struct server_settings *settings) {
+    struct upstream_pool *pool = calloc(1, sizeof(*pool) + settings->upstream_count * sizeof(pool->upstreams[0]));
+    if (pool == NULL) {
+        log_msg(LOG_FATAL, "OOM");
+        exit(EXIT_FAILURE);
+    }
+    pool->count = settings->upstream_count;
+    pool->keepalive = settings->upstream_keepalive;
+    for (size_t i = 0; i < pool->count; ++i) {
+        struct upstream *upstream = &pool->upstreams[i];
+        upstream->settings = &settings->upstreams[i];
+        upstream->prefix_len = strlen(upstream->settings->prefix);
+        upstream->resolved = resolve_upstream(upstream);
+        upstream->idle = calloc(pool->keepalive ? pool->keepalive : 1, sizeof(*upstream->idle));
+        if (upstream->idle == NULL) {
+            log_msg(LOG_FATAL, "OOM");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return pool;
+}
+
+// The longest prefix of the path wins.
+struct upstream *upstream_find(struct upstream_pool *pool, const char *uri) {
+    if (pool == NULL)
+        return NULL;
+    size_t path_len = strcspn(uri, "?");
+    struct upstream *best = NULL;
+    for (size_t i = 0; i < pool->count; ++i) {
+        struct upstream *upstream = &pool->upstreams[i];
+        if (upstream->prefix_len <= path_len && memcmp(uri, upstream->settings->prefix, upstream->prefix_len) == 0 &&
+            (best == NULL || upstream->prefix_len > best->prefix_len))
+            best = upstream;
+    }
+    return best;
+}
+
+// Pooled connections the backend closed, or that have unasked bytes
+// waiting, are dropped here. A close racing with the request is caught by
+// the retry in fail().
+static int take_idle(struct upstream *upstream) {
+    while (upstream->idle_count) {
+        int fd = upstream->idle[--upstream->idle_count];
+        char c;
+        ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return fd;
+        close(fd);
+    }
+    return -1;
+}
+
+static enum pump_result wait_for(struct proxy_conn *p, int fd, short events) {
+    p->wait_fd = fd;
+    p->wait_events = events;
+    return PUMP_WAIT;
+}
+
+// A TLS session may need the other direction to make progress, except for
+// writes the kernel encrypts.
+static enum pump_result wait_client(struct active_connection *conn, struct proxy_conn *p, short events) {
+    bool session = conn->tls && !(events == POLLOUT && tls_ktls_send(conn->tls));
+    short want = session ? tls_poll_events(conn->tls) : 0;
+    return wait_for(p, conn->sock_fd, want ? want : events);
+}
+
+static enum pump_result connect_upstream(struct proxy_conn *p, bool fresh) {
+    p->fd = fresh ? -1 : take_idle(p->upstream);
+    p->reused = p->fd != -1;
+    if (p->reused) {
+        p->phase = PROXY_SEND_HEAD;
+        return PUMP_DONE;
+    }
+
+    p->fd = socket(p->upstream->addr.ss_family, SOCK_STREAM, 0);
+    if (p->fd == -1 || !set_nonblocking(p->fd)) {
+        log_perror(LOG_ERROR, "failed to create upstream socket");
+        return PUMP_ERROR;
+    }
+    if (p->upstream->addr.ss_family != AF_UNIX) {
+        int opt = 1;
+        setsockopt(p->fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    }
+    if (connect(p->fd, (struct sockaddr *)&p->upstream->addr, p->upstream->addr_len) == 0) {
+        p->phase = PROXY_SEND_HEAD;
+        return PUMP_DONE;
+    }
+    if (errno != EINPROGRESS) {
+        log_perror(LOG_WARN, "failed to connect to upstream %s", p->upstream->settings->prefix);
+        return PUMP_ERROR;
+    }
+    p->phase = PROXY_CONNECT;
+    return wait_for(p, p->fd, POLLOUT);
+}
+
+static enum pump_result finish_connect(struct proxy_conn *p) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(p->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+        err = errno;
+    if (err != 0) {
+        errno = err;
+        log_perror(LOG_WARN, "failed to connect to upstream %s", p->upstream->settings->prefix);
+        return PUMP_ERROR;
+    }
+    p->phase = PROXY_SEND_HEAD;
+    return PUMP_DONE;
+}
+
+static enum pump_result write_out(struct active_connection *conn, struct proxy_conn *p, bool to_upstream) {
+    while (p->out_cursor < p->out_len) {
+        const char *data = p->out + p->out_cursor;
+        size_t len = p->out_len - p->out_cursor;
+        ssize_t n = to_upstream ? write(p->fd, data, len) : conn_write(conn, data, len);
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return to_upstream ? wait_for(p, p->fd, POLLOUT) : wait_client(conn, p, POLLOUT);
+        if (n == -1)
+            return PUMP_ERROR;
+        p->out_cursor += n;
+        if (!to_upstream)
+            p->started = true;
+    }
+    return PUMP_DONE;
+}
+
+static void set_out(struct proxy_conn *p, const char *data, size_t len) {
+    p->out = data;
+    p->out_len = len;
+    p->out_cursor = 0;
+}
+
+// Moves up to p->left bytes from one side to the other. Sockets on both ends
+// are spliced through a pipe, so the payload stays in the kernel; a client
+// whose TLS is encrypted in user space is copied through the buffer.
+static enum pump_result pump(struct active_connection *conn, struct proxy_conn *p, bool to_upstream) {
+    int in_fd = to_upstream ? conn->sock_fd : p->fd;
+    int out_fd = to_upstream ? p->fd : conn->sock_fd;
+#ifdef __linux__
+    bool spliced = conn->tls == NULL || (!to_upstream && tls_ktls_send(conn->tls));
+    if (spliced && p->pipe[0] == -1 && pipe(p->pipe) == -1) {
+        log_perror(LOG_ERROR, "failed to create pipe");
+        return PUMP_ERROR;
+    }
+#else
+    bool spliced = false;
+#endif
+
+    for (;;) {
+        size_t pending = spliced ? p->piped : p->buf_len - p->buf_cursor;
+        if (pending) {
+            ssize_t n;
+#ifdef __linux__
+            if (spliced)
+                n = splice(p->pipe[0], NULL, out_fd, NULL, pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            else
+#endif
+                n = to_upstream ? write(out_fd, p->buf + p->buf_cursor, pending)
+                                : conn_write(conn, p->buf + p->buf_cursor, pending);
+            if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return to_upstream ? wait_for(p, out_fd, POLLOUT) : wait_client(conn, p, POLLOUT);
+            if (n <= 0)
+                return PUMP_ERROR;
+            if (spliced)
+                p->piped -= n;
+            else
+                p->buf_cursor += n;
+            if (!to_upstream)
+                p->started = true;
+            continue;
+        }
+        if (p->left == 0)
+            return PUMP_DONE;
+
+        size_t len = p->left < PROXY_CHUNK ? (size_t)p->left : PROXY_CHUNK;
+        ssize_t n;
+#ifdef __linux__
+        if (spliced) {
+            n = splice(in_fd, NULL, p->pipe[1], NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        } else
+#endif
+        {
+            if (len > p->buf_size)
+                len = p->buf_size;
+            n = to_upstream ? conn_read(conn, p->buf, len) : read(in_fd, p->buf, len);
+        }
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return to_upstream ? wait_client(conn, p, POLLIN) : wait_for(p, in_fd, POLLIN);
+        if (n == -1)
+            return PUMP_ERROR;
+        if (n == 0)
+            return PUMP_EOF;
+        if (spliced) {
+            p->piped = n;
+        } else {
+            p->buf_len = n;
+            p->buf_cursor = 0;
+        }
+        p->left -= n;
+    }
+}
+
+// Reads from the upstream through the first occurrence of delim. Bytes are
+// peeked first and only those up to delim are consumed, so the body behind
+// can still be spliced, and a partial read still drains the socket.
+static enum pump_result read_until(struct proxy_conn *p, char *buf, size_t size, size_t *len, const char *delim) {
+    size_t delim_len = strlen(delim);
+    for (;;) {
+        if (*len + 1 >= size)
+            return PUMP_ERROR;
+        ssize_t n = recv(p->fd, buf + *len, size - 1 - *len, MSG_PEEK);
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return wait_for(p, p->fd, POLLIN);
+        if (n == -1)
+            return PUMP_ERROR;
+        if (n == 0)
+            return PUMP_EOF;
+
+        size_t scan = *len >= delim_len ? *len - (delim_len - 1) : 0;
+        size_t end = *len + n;
+        size_t take = n;
+        bool found = false;
+        for (size_t i = scan; i + delim_len <= end; ++i) {
+            if (memcmp(buf + i, delim, delim_len) == 0) {
+                take = i + delim_len - *len;
+                found = true;
+                break;
+            }
+        }
+        if (recv(p->fd, buf + *len, take, 0) != (ssize_t)take)
+            return PUMP_ERROR;
+        *len += take;
+        buf[*len] = '\0';
+        if (found)
+            return PUMP_DONE;
+    }
+}
+
+static bool parse_length(const char *value, size_t len, uint64_t *out) {
+    if (len == 0 || len > 19)
+        return false;
+    uint64_t n = 0;
+    for (size_t i = 0; i < len; ++i) {
+        if (value[i] < '0' || value[i] > '9')
+            return false;
+        n = n * 10 + (uint64_t)(value[i] - '0');
+    }
+    *out = n;
+    return true;
+}
+
+static bool ends_with_token(const char *value, size_t len, const char *token) {
+    size_t token_len = strlen(token);
+    if (len < token_len || strncasecmp(value + len - token_len, token, token_len) != 0)
+        return false;
+    return len == token_len || value[len - token_len - 1] == ' ' || value[len - token_len - 1] == ',';
+}
+
+static bool has_token(const char *value, size_t len, const char *token) {
+    size_t token_len = strlen(token);
+    for (size_t i = 0; i + token_len <= len; ++i) {
+        if (strncasecmp(value + i, token, token_len) == 0 && (i == 0 || value[i - 1] == ' ' || value[i - 1] == ',') &&
+            (i + token_len == len || value[i + token_len] == ' ' || value[i + token_len] == ','))
+            return true;
+    }
+    return false;
+}
+
+// Decides how the response ends from its head in p->buf.
+static bool parse_response_head(struct proxy_conn *p) {
+    const char *head = p->buf;
+    if (p->buf_len < 12 || memcmp(head, "HTTP/1.", 7) != 0 || head[8] != ' ')
+        return false;
+    int status = 0;
+    for (size_t i = 9; i < 12; ++i) {
+        if (head[i] < '0' || head[i] > '9')
+            return false;
+        status = status * 10 + (head[i] - '0');
+    }
+    if (status == 101) {
+        log_msg(LOG_WARN, "upstream %s switched protocols, which is not proxied", p->upstream->settings->prefix);
+        return false;
+    }
+
+    size_t len;
+    const char *connection = http_find_header(head, "Connection", &len);
+    bool close = connection ? has_token(connection, len, "close") : head[7] == '0';
+    const char *encoding = http_find_header(head, "Transfer-Encoding", &len);
+    const char *length;
+    if (status < 200) {
+        p->framing = FRAMING_INFO;
+    } else if (p->head_only || status == 204 || status == 304) {
+        p->framing = FRAMING_NONE;
+    } else if (encoding) {
+        if (!ends_with_token(encoding, len, "chunked"))
+            close = true;
+        p->framing = close ? FRAMING_CLOSE : FRAMING_CHUNKED;
+        p->left = UINT64_MAX;
+    } else if ((length = http_find_header(head, "Content-Length", &len)) != NULL) {
+        if (!parse_length(length, len, &p->left))
+            return false;
+        p->framing = p->left ? FRAMING_LENGTH : FRAMING_NONE;
+    } else {
+        p->framing = FRAMING_CLOSE;
+        p->left = UINT64_MAX;
+    }
+    p->keepalive = !close && p->framing != FRAMING_CLOSE;
+    return true;
+}
+
+static bool is_hop_by_hop(const char *line, size_t len) {
+    static const char *names[] = {"Connection", "Keep-Alive", "Proxy-Connection", "Expect", "Upgrade", "TE"};
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+        size_t name_len = strlen(names[i]);
+        if (len > name_len && line[name_len] == ':' && strncasecmp(line, names[i], name_len) == 0)
+            return true;
+    }
+    return false;
+}
+
+// Copies a head without the headers that only concern one connection, so
+// each side is kept alive on its own terms. Returns the copied length.
+static size_t copy_end_to_end(char *out, const char *head, size_t head_len) {
+    const char *line_end = strstr(head, "\r\n");
+    size_t n = line_end + 2 - head;
+    memcpy(out, head, n);
+    const char *line = line_end + 2;
+    while (line < head + head_len) {
+        line_end = strstr(line, "\r\n");
+        size_t line_len = line_end + 2 - line;
+        if (!is_hop_by_hop(line, line_len)) {
+            memcpy(out + n, line, line_len);
+            n += line_len;
+        }
+        line = line_end + 2;
+    }
+    return n;
+}
+
+static void expect_head(struct proxy_conn *p) {
+    p->buf_len = 0;
+    p->buf_cursor = 0;
+    p->phase = PROXY_READ_HEAD;
+}
+
+static void expect_chunk_line(struct proxy_conn *p) {
+    p->line_len = 0;
+    p->phase = PROXY_CHUNK_LINE;
+}
+
+static enum pump_result read_response_head(struct proxy_conn *p) {
+    enum pump_result result = read_until(p, p->buf, p->buf_size, &p->buf_len, "\r\n\r\n");
+    if (result == PUMP_ERROR && p->buf_len + 1 >= p->buf_size)
+        log_msg(LOG_WARN, "upstream %s response head too large", p->upstream->settings->prefix);
+    if (result != PUMP_DONE)
+        return result;
+    if (!parse_response_head(p)) {
+        log_msg(LOG_WARN, "invalid response head from upstream %s", p->upstream->settings->prefix);
+        return PUMP_ERROR;
+    }
+    if (p->framing == FRAMING_INFO) {
+        set_out(p, p->buf, p->buf_len);
+    } else {
+        // The client connection closes after this response, whatever the
+        // backend connection does.
+        static const char closing[] = "Connection: Close\r\n\r\n";
+        char *head = server_alloc(p->buf_len + sizeof(closing));
+        size_t n = copy_end_to_end(head, p->buf, p->buf_len) - 2;
+        memcpy(head + n, closing, sizeof(closing) - 1);
+        set_out(p, head, n + sizeof(closing) - 1);
+    }
+    p->phase = PROXY_WRITE_HEAD;
+    return PUMP_DONE;
+}
+
+// Chunk size lines and trailers are forwarded as they are, only the chunk
+// data in between is spliced.
+static enum pump_result read_chunk_line(struct proxy_conn *p) {
+    enum pump_result result = read_until(p, p->line, sizeof(p->line), &p->line_len, "\n");
+    if (result != PUMP_DONE)
+        return result;
+    if (p->trailers) {
+        p->last_line = p->line[0] == '\r' || p->line[0] == '\n';
+    } else {
+        char *end;
+        errno = 0;
+        unsigned long long size = strtoull(p->line, &end, 16);
+        if (end == p->line || errno || size > UINT64_MAX - 2)
+            return PUMP_ERROR;
+        if (size == 0)
+            p->trailers = true;
+        else
+            p->left = size + 2; // data and its CRLF
+    }
+    set_out(p, p->line, p->line_len);
+    p->phase = PROXY_WRITE_LINE;
+    return PUMP_DONE;
+}
+
+static void release_upstream(struct upstream_pool *pool, struct proxy_conn *p) {
+    struct upstream *upstream = p->upstream;
+    if (p->keepalive && upstream->idle_count < pool->keepalive) {
+        upstream->idle[upstream->idle_count++] = p->fd;
+    } else {
+        close(p->fd);
+    }
+    p->fd = -1;
+}
+
+// Advances the exchange by one phase. finished is set once the response is
+// complete.
+static enum pump_result step(struct active_connection *conn, struct proxy_conn *p, bool *finished) {
+    enum pump_result result;
+    switch (p->phase) {
+    case PROXY_CONNECT: return finish_connect(p);
+
+    case PROXY_SEND_HEAD:
+        result = write_out(conn, p, true);
+        if (result == PUMP_DONE && p->left)
+            p->phase = PROXY_SEND_BODY;
+        else if (result == PUMP_DONE)
+            expect_head(p);
+        return result;
+
+    case PROXY_SEND_BODY:
+        result = pump(conn, p, true);
+        if (result == PUMP_DONE)
+            expect_head(p);
+        return result == PUMP_EOF ? PUMP_ERROR : result;
+
+    case PROXY_READ_HEAD: return read_response_head(p);
+
+    case PROXY_WRITE_HEAD:
+        result = write_out(conn, p, false);
+        if (result != PUMP_DONE)
+            return result;
+        p->buf_len = 0;
+        p->buf_cursor = 0;
+        switch (p->framing) {
+        case FRAMING_INFO: expect_head(p); break;
+        case FRAMING_NONE: *finished = true; break;
+        case FRAMING_LENGTH:
+        case FRAMING_CLOSE: p->phase = PROXY_BODY; break;
+        case FRAMING_CHUNKED: expect_chunk_line(p); break;
+        }
+        return PUMP_DONE;
+
+    case PROXY_BODY:
+        result = pump(conn, p, false);
+        if (result == PUMP_EOF && p->framing == FRAMING_CLOSE) {
+            *finished = true;
+            return PUMP_DONE;
+        }
+        if (result == PUMP_DONE) {
+            if (p->framing == FRAMING_CHUNKED)
+                expect_chunk_line(p);
+            else
+                *finished = true;
+        }
+        return result;
+
+    case PROXY_CHUNK_LINE: return read_chunk_line(p);
+
+    case PROXY_WRITE_LINE:
+        result = write_out(conn, p, false);
+        if (result != PUMP_DONE)
+            return result;
+        if (p->last_line)
+            *finished = true;
+        else if (p->trailers)
+            expect_chunk_line(p);
+        else
+            p->phase = PROXY_BODY;
+        return PUMP_DONE;
+    }
+    __builtin_unreachable();
+}
+
+// A pooled connection the backend closed just before the request is
+// replaced once, as long as nothing of the request body was consumed.
+static enum connection_state fail(struct worker *worker, struct active_connection *conn, struct proxy_conn *p) {
+    if (p->reused && p->retryable && p->phase <= PROXY_READ_HEAD && p->buf_len == 0) {
+        close(p->fd);
+        set_out(p, p->request, p->request_len);
+        switch (connect_upstream(p, true)) {
+        case PUMP_WAIT: return CONN_SENDING;
+        case PUMP_ERROR: break;
+        default: return proxy_process(worker, conn);
+        }
+    }
+    p->keepalive = false;
+    if (p->started) {
+        log_msg(LOG_WARN, "upstream %s response aborted", p->upstream->settings->prefix);
+        return CONN_COMPLETE;
+    }
+    return error_response(HTTP_BAD_GATEWAY, conn);
+}
+
+enum connection_state proxy_process(struct worker *worker, struct active_connection *conn) {
+    struct proxy_conn *p = conn->proxy;
+    for (;;) {
+        bool finished = false;
+        enum pump_result result = step(conn, p, &finished);
+        if (finished) {
+            release_upstream(worker->upstreams, p);
+            return CONN_COMPLETE;
+        }
+        switch (result) {
+        case PUMP_DONE: break;
+        case PUMP_WAIT: return CONN_SENDING;
+        case PUMP_EOF:
+        case PUMP_ERROR: return fail(worker, conn, p);
+        }
+    }
+}
+
+// The request head as the backend sees it, followed by the body bytes that
+// came with it.
+static char *forwarded_request(const char *head, size_t head_len, const char *body, size_t body_len, size_t *len) {
+    char *out = server_alloc(head_len + body_len);
+    size_t n = copy_end_to_end(out, head, head_len);
+    memcpy(out + n, body, body_len);
+    *len = n + body_len;
+    return out;
+}
+
+enum connection_state proxy_start(struct worker *worker, struct active_connection *conn, struct upstream *upstream,
+                                  struct http_req *req, const char *req_data, size_t req_len) {
+    size_t len;
+    if (http_find_header(req_data, "Transfer-Encoding", &len))
+        return error_response(HTTP_LENGTH_REQUIRED, conn);
+    uint64_t body_len = 0;
+    const char *length = http_find_header(req_data, "Content-Length", &len);
+    if (length && !parse_length(length, len, &body_len))
+        return error_response(HTTP_BAD_REQUEST, conn);
+    if (!upstream->resolved)
+        return error_response(HTTP_BAD_GATEWAY, conn);
+    if (!set_nonblocking(conn->sock_fd)) {
+        log_perror(LOG_ERROR, "failed to change socket to nonblocking mode");
+        return CONN_ERR_UNRECOVERABLE;
+    }
+
+    struct proxy_conn *p = calloc(1, sizeof(*p));
+    if (p == NULL) {
+        log_msg(LOG_FATAL, "OOM");
+        exit(EXIT_FAILURE);
+    }
+    p->upstream = upstream;
+    p->fd = -1;
+    p->pipe[0] = p->pipe[1] = -1;
+    p->head_only = req->method == HTTP_HEAD;
+    p->buf = buffer_pool_get(worker->transfer_buffers);
+    p->buf_size = buffer_pool_size(worker->transfer_buffers);
+    conn->proxy = p;
+
+    // Anything past the declared body would be a pipelined request, which is
+    // not served.
+    size_t head_len = strstr(req_data, "\r\n\r\n") + 4 - req_data;
+    size_t extra = req_len - head_len;
+    if (extra > body_len)
+        extra = (size_t)body_len;
+    p->request = forwarded_request(req_data, head_len, req_data + head_len, extra, &p->request_len);
+    p->left = body_len - extra;
+    p->retryable = p->left == 0;
+    set_out(p, p->request, p->request_len);
+
+    // The backend never sees the Expect header, so the go-ahead comes from
+    // here.
+    const char *expect = http_find_header(req_data, "Expect", &len);
+    if (expect && p->left && len == 12 && strncasecmp(expect, "100-continue", 12) == 0) {
+        static const char go_ahead[] = "HTTP/1.1 100 Continue\r\n\r\n";
+        if (conn_write(conn, go_ahead, sizeof(go_ahead) - 1) != (ssize_t)sizeof(go_ahead) - 1) {
+            log_perror(LOG_INFO, "failed to write to socket");
+            return CONN_ERR_UNRECOVERABLE;
+        }
+    }
+
+    switch (connect_upstream(p, false)) {
+    case PUMP_WAIT: return CONN_SENDING;
+    case PUMP_ERROR: return error_response(HTTP_BAD_GATEWAY, conn);
+    default: return proxy_process(worker, conn);
+    }
+}
+
+int proxy_poll_fd(const struct proxy_conn *p, short *events) {
+    *events = p->wait_events;
+    return p->wait_fd;
+}
+
+// Wakes a connection stuck on its backend once it timed out.
+void proxy_shutdown(struct proxy_conn *p) {
+    p->keepalive = false;
+    if (p->fd != -1)
+        shutdown(p->fd, SHUT_RDWR);
+}
+
+void proxy_conn_free(struct worker *worker, struct proxy_conn *p) {
+    if (p->fd != -1)
+        close(p->fd);
+    if (p->pipe[0] != -1) {
+        close(p->pipe[0]);
+        close(p->pipe[1]);
+    }
+    buffer_pool_put(worker->transfer_buffers, p->buf, p->buf_size);
+    free(p);
+}
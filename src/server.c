@@ -4,9 +4,11 @@
 #include <arpa/inet.h>
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <netdb.h>
 #include <netinet/tcp.h>
-#include <setjmp.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -17,17 +19,41 @@
 #include <sys/select.h>
 #include <sys/signal.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#define SEND_QUANTUM_MIN 4096 // below a page per round, the polling costs more than the sending
+
 struct memory_arena *g_memory_arena = NULL;
-jmp_buf *g_err_jmpbuf = NULL;
+
+static enum log_level g_log_level = LOG_TRACE;
+static int g_log_fd = STDERR_FILENO;
+static volatile sig_atomic_t g_reload_requested = 0;
+
+struct listener {
+    int fd;
+    const struct listen_settings *settings;
+    char name[128];
+    int *worker_fds; // one per worker under cpu_affinity, the worker's becomes fd after the fork
+};
 
 struct master_state {
     const struct server_settings *settings;
-    int sock_fd;
+    struct listen_settings default_listener;
+    size_t listener_count;
+    struct listener *listeners;
     size_t pid_count;
     pid_t *pids;
+    struct server_settings *reloaded;
+    struct fs_generations *fs_gens;
+    struct inflight_table *inflight;
+    struct fs_watch *watch;
+    struct tls_context *tls;
+    struct asset_pack *pack;
+    int *cpus; // per worker, NULL without cpu_affinity
+    bool steer;
+    int capture_fd; // -1 without capture
 };
 
 static bool validate_settings(const struct server_settings *settings) {
@@ -39,60 +65,494 @@ static bool validate_settings(const struct server_settings *settings) {
         log_msg(LOG_FATAL, "invalid uri length limit (most be nonzero)");
         return false;
     }
-    if (settings->listen_backlog == 0) {
+    if (settings->listener_count == 0 && settings->listen_backlog == 0) {
         log_msg(LOG_FATAL, "listen backlog size too small");
         return false;
     }
+    for (size_t i = 0; i < settings->listener_count; ++i) {
+        const struct listen_settings *listener = &settings->listeners[i];
+        if (listener->backlog <= 0) {
+            log_msg(LOG_FATAL, "listen backlog size too small for listener %zu", i);
+            return false;
+        }
+        if (listener->unix_path == NULL && (listener->host == NULL || listener->port <= 0 || listener->port > 65535)) {
+            log_msg(LOG_FATAL, "listener %zu needs either a unix path or a host and port", i);
+            return false;
+        }
+    }
+    if (settings->read_buf_size < 2) {
+        log_msg(LOG_FATAL, "read buffer size too small");
+        return false;
+    }
+    if (settings->req_buf_size < 2 || settings->req_size_limit < settings->req_buf_size) {
+        log_msg(LOG_FATAL, "request buffer size must be at least 2 and at most req_size_limit");
+        return false;
+    }
+    if (settings->arena_block_size == 0 || settings->header_cache_size == 0) {
+        log_msg(LOG_FATAL, "arena block size and header cache size must be nonzero");
+        return false;
+    }
+    if (settings->dir_index_cache_size == 0 || settings->dir_index_max_age < 0 || settings->path_cache_size == 0) {
+        log_msg(LOG_FATAL, "invalid directory index settings");
+        return false;
+    }
+    if (settings->client_rate < 0 || settings->client_burst < 0 || settings->client_prefix_v4 < 0 ||
+        settings->client_prefix_v4 > 32 || settings->client_prefix_v6 < 0 || settings->client_prefix_v6 > 128 ||
+        settings->client_table_size == 0) {
+        log_msg(LOG_FATAL, "invalid client limit settings");
+        return false;
+    }
+    bool tls = false;
+    for (size_t i = 0; i < settings->listener_count; ++i)
+        tls |= settings->listeners[i].tls;
+    if (tls && (settings->tls_cert == NULL || settings->tls_key == NULL)) {
+        log_msg(LOG_FATAL, "tls listeners need tls_cert and tls_key");
+        return false;
+    }
+    if (settings->h2_max_streams == 0 || settings->h2_max_streams > UINT32_MAX) {
+        log_msg(LOG_FATAL, "invalid h2_max_streams %zu", settings->h2_max_streams);
+        return false;
+    }
+    if (settings->conn_timeout < 0) {
+        log_msg(LOG_FATAL, "invalid connection timeout %d", settings->conn_timeout);
+        return false;
+    }
+    if (settings->static_dir == NULL) {
+        log_msg(LOG_FATAL, "static directory not set");
+        return false;
+    }
+    if (settings->mmap_max_file_size && settings->mmap_cache_size < settings->mmap_max_file_size) {
+        log_msg(LOG_FATAL, "mmap cache size smaller than mmap max file size");
+        return false;
+    }
+    if (settings->coalesce_min_size && settings->coalesce_max_size < settings->coalesce_min_size) {
+        log_msg(LOG_FATAL, "coalesce max size smaller than coalesce min size");
+        return false;
+    }
+    if (settings->send_quantum && settings->send_quantum < SEND_QUANTUM_MIN) {
+        log_msg(LOG_FATAL, "send quantum must be 0 or at least %d", SEND_QUANTUM_MIN);
+        return false;
+    }
+    for (size_t i = 0; i < settings->vhost_count; ++i) {
+        for (size_t j = 0; j < i; ++j) {
+            if (strcmp(settings->vhosts[i].name, settings->vhosts[j].name) == 0) {
+                log_msg(LOG_FATAL, "vhost %s is configured twice", settings->vhosts[i].name);
+                return false;
+            }
+        }
+    }
+    for (size_t i = 0; i < settings->upstream_count; ++i) {
+        const struct upstream_settings *upstream = &settings->upstreams[i];
+        if (upstream->unix_path == NULL && (upstream->host == NULL || upstream->port <= 0 || upstream->port > 65535)) {
+            log_msg(LOG_FATAL, "upstream %s needs either a unix path or a host and port", upstream->prefix);
+            return false;
+        }
+    }
 
     return true;
 }
 
-static bool init_socket(const struct server_settings *settings, int *sock_fd_p) {
-    int sock_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock_fd == -1) {
-        log_perror(LOG_FATAL, "failed to create socket");
-        return false;
+static bool resolve_listen_address(const struct listen_settings *settings, struct sockaddr_storage *addr,
+                                   socklen_t *addr_len, char *name, size_t name_len) {
+    memset(addr, 0, sizeof(*addr));
+    if (settings->unix_path) {
+        struct sockaddr_un *un = (struct sockaddr_un *)addr;
+        if (strlen(settings->unix_path) >= sizeof(un->sun_path)) {
+            log_msg(LOG_FATAL, "unix socket path too long: %s", settings->unix_path);
+            return false;
+        }
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, settings->unix_path);
+        *addr_len = sizeof(*un);
+        snprintf(name, name_len, "unix:%s", settings->unix_path);
+        return true;
     }
-    if (!set_nonblocking(sock_fd)) {
-        log_perror(LOG_FATAL, "failed to set socket nonblocking");
-        close(sock_fd);
+
+    char port[16];
+    snprintf(port, sizeof(port), "%d", settings->port);
+    struct addrinfo hints = {0};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICHOST | AI_NUMERICSERV;
+    struct addrinfo *res;
+    int err = getaddrinfo(settings->host, port, &hints, &res);
+    if (err != 0) {
+        log_msg(LOG_FATAL, "invalid listen address %s: %s", settings->host, gai_strerror(err));
         return false;
     }
+    memcpy(addr, res->ai_addr, res->ai_addrlen);
+    *addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+
+    if (addr->ss_family == AF_INET6)
+        snprintf(name, name_len, "[%s]:%d", settings->host, settings->port);
+    else
+        snprintf(name, name_len, "%s:%d", settings->host, settings->port);
+    return true;
+}
+
+static bool set_listen_options(int sock_fd, int family, const struct listen_settings *settings) {
+    if (family == AF_UNIX)
+        return true;
 
     int opt = 1;
     if (setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
         log_perror(LOG_FATAL, "setsockopt error");
-        close(sock_fd);
         return false;
     }
     if (setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) {
         log_perror(LOG_FATAL, "setsockopt error");
-        close(sock_fd);
         return false;
     }
+    if (family == AF_INET6) {
+        opt = settings->v6only;
+        if (setsockopt(sock_fd, IPPROTO_IPV6, IPV6_V6ONLY, &opt, sizeof(opt))) {
+            log_perror(LOG_FATAL, "failed to set IPV6_V6ONLY");
+            return false;
+        }
+    }
+    if (settings->defer_accept) {
+#ifdef TCP_DEFER_ACCEPT
+        opt = settings->defer_accept;
+        if (setsockopt(sock_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &opt, sizeof(opt)))
+            log_perror(LOG_WARN, "failed to set TCP_DEFER_ACCEPT");
+#else
+        log_msg(LOG_WARN, "TCP_DEFER_ACCEPT is not supported on this platform");
+#endif
+    }
+    if (settings->fastopen) {
+#ifdef TCP_FASTOPEN
+        opt = settings->fastopen;
+        if (setsockopt(sock_fd, IPPROTO_TCP, TCP_FASTOPEN, &opt, sizeof(opt)))
+            log_perror(LOG_WARN, "failed to set TCP_FASTOPEN");
+#else
+        log_msg(LOG_WARN, "TCP_FASTOPEN is not supported on this platform");
+#endif
+    }
+    return true;
+}
 
-    struct sockaddr_in addr;
-    addr.sin_family = AF_INET;
-    addr.sin_len = sizeof(addr);
-    addr.sin_port = htons(settings->port);
-    addr.sin_addr.s_addr = inet_addr(settings->host);
-    if (bind(sock_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
-        log_perror(LOG_FATAL, "failed to bind socket to address");
+// A bound and listening socket, -1 on failure. cpu is the CPU of the worker
+// that accepts on it, -1 when all workers share it.
+static int open_socket(const struct listener *listener, const struct sockaddr_storage *addr, socklen_t addr_len,
+                       int cpu) {
+    const struct listen_settings *settings = listener->settings;
+    int sock_fd = socket(addr->ss_family, SOCK_STREAM, 0);
+    if (sock_fd == -1) {
+        log_perror(LOG_FATAL, "failed to create socket");
+        return -1;
+    }
+    if (!set_nonblocking(sock_fd)) {
+        log_perror(LOG_FATAL, "failed to set socket nonblocking");
         close(sock_fd);
-        return false;
+        return -1;
     }
-    if (listen(sock_fd, settings->listen_backlog) == -1) {
+    if (!set_listen_options(sock_fd, addr->ss_family, settings)) {
+        close(sock_fd);
+        return -1;
+    }
+    if (cpu != -1)
+        affinity_set_incoming_cpu(sock_fd, cpu);
+
+    if (settings->unix_path)
+        unlink(settings->unix_path);
+    if (bind(sock_fd, (const struct sockaddr *)addr, addr_len) == -1) {
+        log_perror(LOG_FATAL, "failed to bind socket to address %s", listener->name);
+        close(sock_fd);
+        return -1;
+    }
+    if (listen(sock_fd, settings->backlog) == -1) {
         log_perror(LOG_FATAL, "listen failed");
         close(sock_fd);
+        return -1;
+    }
+    return sock_fd;
+}
+
+// Under cpu_affinity every worker gets its own TCP socket. They join the
+// reuseport group in worker order, which is what the steering program's
+// result indexes.
+static bool init_socket(struct listener *listener, const struct master_state *state) {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    if (!resolve_listen_address(listener->settings, &addr, &addr_len, listener->name, sizeof(listener->name)))
+        return false;
+    if (state->cpus == NULL || addr.ss_family == AF_UNIX) {
+        listener->fd = open_socket(listener, &addr, addr_len, -1);
+        return listener->fd != -1;
+    }
+
+    size_t workers = state->settings->process_count;
+    listener->worker_fds = malloc(workers * sizeof(*listener->worker_fds));
+    if (listener->worker_fds == NULL) {
+        log_msg(LOG_FATAL, "failed to allocate memory");
+        return false;
+    }
+    for (size_t i = 0; i < workers; ++i)
+        listener->worker_fds[i] = -1;
+    for (size_t i = 0; i < workers; ++i) {
+        listener->worker_fds[i] = open_socket(listener, &addr, addr_len, state->cpus[i]);
+        if (listener->worker_fds[i] == -1)
+            return false;
+    }
+    if (state->steer)
+        affinity_steer(listener->worker_fds[0], state->cpus, workers);
+    return true;
+}
+
+static void close_listeners(struct master_state *state) {
+    for (size_t i = 0; i < state->listener_count; ++i) {
+        struct listener *listener = &state->listeners[i];
+        if (listener->fd != -1)
+            close(listener->fd);
+        for (size_t j = 0; listener->worker_fds && j < state->settings->process_count; ++j) {
+            if (listener->worker_fds[j] != -1)
+                close(listener->worker_fds[j]);
+        }
+        free(listener->worker_fds);
+    }
+    free(state->listeners);
+}
+
+static bool init_listeners(const struct server_settings *settings, struct master_state *state) {
+    const struct listen_settings *configs = settings->listeners;
+    state->listener_count = settings->listener_count;
+    if (state->listener_count == 0) {
+        state->default_listener.host = settings->host;
+        state->default_listener.port = settings->port;
+        state->default_listener.backlog = settings->listen_backlog;
+        configs = &state->default_listener;
+        state->listener_count = 1;
+    }
+
+    state->listeners = calloc(state->listener_count, sizeof(*state->listeners));
+    if (state->listeners == NULL) {
+        log_msg(LOG_FATAL, "failed to allocate memory");
+        return false;
+    }
+    for (size_t i = 0; i < state->listener_count; ++i) {
+        state->listeners[i].fd = -1;
+        state->listeners[i].settings = &configs[i];
+    }
+    for (size_t i = 0; i < state->listener_count; ++i) {
+        if (!init_socket(&state->listeners[i], state)) {
+            close_listeners(state);
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool init_logging(const struct server_settings *settings) {
+    int fd = settings->log_to_stdout ? STDOUT_FILENO : STDERR_FILENO;
+    if (settings->log_filename) {
+        fd = open(settings->log_filename, O_WRONLY | O_APPEND | O_CREAT, 0644);
+        if (fd == -1) {
+            log_perror(LOG_FATAL, "failed to open log file %s", settings->log_filename);
+            return false;
+        }
+    }
+    if (g_log_fd != STDOUT_FILENO && g_log_fd != STDERR_FILENO)
+        close(g_log_fd);
+    g_log_fd = fd;
+    g_log_level = settings->log_level;
+    return true;
+}
+
+static void handle_sighup(int sig) {
+    (void)sig;
+    g_reload_requested = 1;
+}
+
+static bool init_signals(void) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sigemptyset(&sa.sa_mask);
+    // No SA_RESTART, so a blocked select or io_uring_enter returns and the
+    // loop gets to look at the reload flag.
+    sa.sa_handler = handle_sighup;
+    if (sigaction(SIGHUP, &sa, NULL) == -1) {
+        log_perror(LOG_FATAL, "failed to install SIGHUP handler");
+        return false;
+    }
+    sa.sa_handler = SIG_IGN;
+    if (sigaction(SIGPIPE, &sa, NULL) == -1) {
+        log_perror(LOG_FATAL, "failed to ignore SIGPIPE");
+        return false;
+    }
+    return true;
+}
+
+static bool same_str(const char *a, const char *b) {
+    return (a == NULL || b == NULL) ? a == b : strcmp(a, b) == 0;
+}
+
+static bool same_listeners(const struct server_settings *a, const struct server_settings *b) {
+    if (a->listener_count != b->listener_count)
+        return false;
+    if (a->listener_count == 0)
+        return same_str(a->host, b->host) && a->port == b->port && a->listen_backlog == b->listen_backlog;
+    for (size_t i = 0; i < a->listener_count; ++i) {
+        const struct listen_settings *x = &a->listeners[i];
+        const struct listen_settings *y = &b->listeners[i];
+        if (!same_str(x->host, y->host) || x->port != y->port || !same_str(x->unix_path, y->unix_path) ||
+            x->backlog != y->backlog || x->v6only != y->v6only || x->defer_accept != y->defer_accept ||
+            x->fastopen != y->fastopen || x->tls != y->tls)
+            return false;
+    }
+    return true;
+}
+
+static bool same_upstreams(const struct server_settings *a, const struct server_settings *b) {
+    if (a->upstream_count != b->upstream_count)
+        return false;
+    for (size_t i = 0; i < a->upstream_count; ++i) {
+        const struct upstream_settings *x = &a->upstreams[i];
+        const struct upstream_settings *y = &b->upstreams[i];
+        if (!same_str(x->prefix, y->prefix) || !same_str(x->host, y->host) || x->port != y->port ||
+            !same_str(x->unix_path, y->unix_path))
+            return false;
+    }
+    return true;
+}
+
+static bool same_vhosts(const struct server_settings *a, const struct server_settings *b) {
+    if (a->vhost_count != b->vhost_count)
         return false;
+    for (size_t i = 0; i < a->vhost_count; ++i) {
+        const struct vhost_settings *x = &a->vhosts[i];
+        const struct vhost_settings *y = &b->vhosts[i];
+        if (!same_str(x->name, y->name) || !same_str(x->root, y->root) || x->type_count != y->type_count ||
+            x->path_cache_size != y->path_cache_size || x->pace_rate != y->pace_rate || x->pace_set != y->pace_set ||
+            x->autoindex != y->autoindex)
+            return false;
+        for (size_t j = 0; j < x->type_count; ++j) {
+            if (!same_str(x->types[j].ext, y->types[j].ext) || x->types[j].ct != y->types[j].ct)
+                return false;
+        }
     }
-    *sock_fd_p = sock_fd;
     return true;
 }
 
-// static bool init_logging(struct master_state *state) {
-//     const struct server_settings *settings = state->settings;
-// }
+// Settings that shape sockets, processes or per-worker structures keep their
+// current values, everything else takes effect on the next request.
+static void keep_restart_only_settings(const struct server_settings *current, struct server_settings *fresh) {
+    if (!same_listeners(current, fresh))
+        log_msg(LOG_WARN, "listener changes require a restart");
+    fresh->listeners = current->listeners;
+    fresh->listener_count = current->listener_count;
+    fresh->host = current->host;
+    fresh->port = current->port;
+    fresh->listen_backlog = current->listen_backlog;
+
+    if (fresh->process_count != current->process_count)
+        log_msg(LOG_WARN, "process_count changes require a restart");
+    fresh->process_count = current->process_count;
+    if (fresh->io_backend != current->io_backend || fresh->uring_buffers != current->uring_buffers)
+        log_msg(LOG_WARN, "io_backend changes require a restart");
+    fresh->io_backend = current->io_backend;
+    fresh->uring_buffers = current->uring_buffers;
+    if (fresh->mmap_max_file_size != current->mmap_max_file_size ||
+        fresh->mmap_cache_size != current->mmap_cache_size || fresh->header_cache_size != current->header_cache_size ||
+        fresh->dir_index_cache_size != current->dir_index_cache_size ||
+        fresh->path_cache_size != current->path_cache_size || fresh->client_table_size != current->client_table_size)
+        log_msg(LOG_WARN, "cache size changes require a restart");
+    fresh->mmap_max_file_size = current->mmap_max_file_size;
+    fresh->mmap_cache_size = current->mmap_cache_size;
+    fresh->header_cache_size = current->header_cache_size;
+    fresh->dir_index_cache_size = current->dir_index_cache_size;
+    fresh->path_cache_size = current->path_cache_size;
+    fresh->client_table_size = current->client_table_size;
+
+    // Pooled buffers all have the size their pool started with.
+    if (fresh->read_buf_size != current->read_buf_size || fresh->req_buf_size != current->req_buf_size ||
+        fresh->buffer_pool_size != current->buffer_pool_size)
+        log_msg(LOG_WARN, "buffer size changes require a restart");
+    fresh->read_buf_size = current->read_buf_size;
+    fresh->req_buf_size = current->req_buf_size;
+    fresh->buffer_pool_size = current->buffer_pool_size;
+    if (fresh->io_threads != current->io_threads)
+        log_msg(LOG_WARN, "io_threads changes require a restart");
+    fresh->io_threads = current->io_threads;
+    if (fresh->arena_pool_blocks != current->arena_pool_blocks || fresh->huge_pages != current->huge_pages ||
+        fresh->numa_local != current->numa_local)
+        log_msg(LOG_WARN, "memory placement changes require a restart");
+    fresh->arena_pool_blocks = current->arena_pool_blocks;
+    fresh->huge_pages = current->huge_pages;
+    fresh->numa_local = current->numa_local;
+    if (!same_str(fresh->capture, current->capture) || fresh->capture_max_size != current->capture_max_size)
+        log_msg(LOG_WARN, "capture changes require a restart");
+    fresh->capture = current->capture;
+    fresh->capture_max_size = current->capture_max_size;
+    if (fresh->cpu_affinity != current->cpu_affinity)
+        log_msg(LOG_WARN, "cpu_affinity changes require a restart");
+    fresh->cpu_affinity = current->cpu_affinity;
+    if (fresh->req_size_limit < fresh->req_buf_size)
+        fresh->req_size_limit = fresh->req_buf_size;
+
+    if (!same_str(fresh->tls_cert, current->tls_cert) || !same_str(fresh->tls_key, current->tls_key) ||
+        fresh->tls_session_tickets != current->tls_session_tickets || fresh->tls_ktls != current->tls_ktls)
+        log_msg(LOG_WARN, "tls changes require a restart");
+    fresh->tls_cert = current->tls_cert;
+    fresh->tls_key = current->tls_key;
+    fresh->tls_session_tickets = current->tls_session_tickets;
+    fresh->tls_ktls = current->tls_ktls;
+
+    // The TLS context offers h2 through ALPN or not, so the switch stays
+    // as started for every listener.
+    if (fresh->http2 != current->http2)
+        log_msg(LOG_WARN, "http2 changes require a restart");
+    fresh->http2 = current->http2;
+
+    // Workers resolve and pool backend connections when they start.
+    if (!same_upstreams(current, fresh) || fresh->upstream_keepalive != current->upstream_keepalive)
+        log_msg(LOG_WARN, "upstream changes require a restart");
+    fresh->upstreams = current->upstreams;
+    fresh->upstream_count = current->upstream_count;
+    fresh->upstream_keepalive = current->upstream_keepalive;
+
+    // Workers open the roots and size the caches of their sites when they
+    // start.
+    if (!same_vhosts(current, fresh))
+        log_msg(LOG_WARN, "vhost changes require a restart");
+    fresh->vhosts = current->vhosts;
+    fresh->vhost_count = current->vhost_count;
+
+    // The master maps the pack once for all workers.
+    if (!same_str(fresh->asset_pack, current->asset_pack))
+        log_msg(LOG_WARN, "asset_pack changes require a restart");
+    fresh->asset_pack = current->asset_pack;
+}
+
+// Returns the new settings, or NULL if the config is invalid and the current
+// settings stay in effect. previous is the last reloaded copy, freed on success.
+// Restart-only settings are taken from current, which has to be the startup
+// copy: the reloaded one is freed while its strings are still referenced.
+static struct server_settings *reload_settings(const struct server_settings *current,
+                                               struct server_settings *previous) {
+    struct server_settings *fresh = server_alloc(sizeof(*fresh));
+    if (load_settings(current->argc, current->argv, fresh) != LOAD_SETTINGS_OK) {
+        log_msg(LOG_ERROR, "failed to reload config, keeping current settings");
+        server_free(fresh);
+        return NULL;
+    }
+    if (!validate_settings(fresh)) {
+        log_msg(LOG_ERROR, "reloaded config is invalid, keeping current settings");
+        free_settings(fresh);
+        server_free(fresh);
+        return NULL;
+    }
+    keep_restart_only_settings(current, fresh);
+    if (!init_logging(fresh))
+        log_msg(LOG_ERROR, "keeping previous log destination");
+
+    if (previous) {
+        free_settings(previous);
+        server_free(previous);
+    }
+    log_msg(LOG_INFO, "reloaded settings");
+    return fresh;
+}
 
 static bool init_master(const struct server_settings *settings, struct master_state *state) {
     state->settings = settings;
@@ -105,10 +565,73 @@ static bool init_master(const struct server_settings *settings, struct master_st
     for (size_t i = 0; i < settings->process_count; ++i)
         state->pids[i] = -1;
 
-    if (!init_socket(settings, &state->sock_fd)) {
+    if (settings->cpu_affinity) {
+        size_t cpu_count;
+        state->cpus = malloc(settings->process_count * sizeof(*state->cpus));
+        if (state->cpus == NULL) {
+            log_msg(LOG_FATAL, "failed to allocate memory");
+            free(state->pids);
+            return false;
+        }
+        if (!affinity_assign(settings->process_count, state->cpus, &cpu_count)) {
+            log_msg(LOG_WARN, "running workers unpinned");
+            free(state->cpus);
+            state->cpus = NULL;
+        } else if (cpu_count < settings->process_count) {
+            log_msg(LOG_WARN, "%zu workers share %zu cpus, connections are not steered", settings->process_count,
+                    cpu_count);
+        } else {
+            state->steer = true;
+        }
+    }
+
+    if (!init_listeners(settings, state)) {
         free(state->pids);
+        free(state->cpus);
         return false;
     }
+    state->fs_gens = fs_generations_create();
+    state->inflight = inflight_table_create();
+    if (state->fs_gens == NULL || state->inflight == NULL) {
+        close_listeners(state);
+        free(state->pids);
+        free(state->cpus);
+        return false;
+    }
+
+    for (size_t i = 0; i < state->listener_count; ++i) {
+        if (!state->listeners[i].settings->tls)
+            continue;
+        state->tls = tls_context_create(settings);
+        if (state->tls == NULL) {
+            close_listeners(state);
+            free(state->pids);
+            free(state->cpus);
+            return false;
+        }
+        break;
+    }
+
+    state->capture_fd = -1;
+    if (settings->capture) {
+        state->capture_fd = capture_open(settings->capture);
+        if (state->capture_fd == -1) {
+            close_listeners(state);
+            free(state->pids);
+            free(state->cpus);
+            return false;
+        }
+    }
+
+    if (settings->asset_pack) {
+        state->pack = asset_pack_open(settings->asset_pack);
+        if (state->pack == NULL) {
+            close_listeners(state);
+            free(state->pids);
+            free(state->cpus);
+            return false;
+        }
+    }
     return true;
 }
 
@@ -126,26 +649,157 @@ static void kill_workers(struct master_state *state) {
     }
 }
 
-static void conn_loop(struct worker *worker, struct master_state *master) {
+static struct active_connection *new_connection(struct worker *worker, int fd) {
+    struct active_connection *conn = server_alloc(sizeof(*conn));
+    memset(conn, 0, sizeof(*conn));
+    conn->sock_fd = fd;
+    conn->state = CONN_WAITING;
+    conn->file_fd = -1;
+    conn->read_buf_index = -1;
+    conn->arena.minimum_block_size = worker->settings->arena_block_size;
+    conn->last_active = time(NULL);
+    return conn;
+}
+
+// Applies the per-client limits before anything is allocated for the
+// connection. addr is NULL when the accept did not report it.
+static void add_connection(struct worker *worker, const struct listener *listener, int fd,
+                           const struct sockaddr *addr, List **new_conns) {
+    const struct server_settings *settings = worker->settings;
+    struct client_entry *client = NULL;
+    if (worker->locality && listener->worker_fds)
+        locality_accept(worker->locality, fd);
+    if (settings->shed_max_lag_ms || settings->shed_max_conns || settings->shed_max_pending) {
+        if (worker->overload == NULL)
+            worker->overload = overload_create();
+        if (!overload_admit(worker->overload, settings)) {
+            overload_shed(worker->overload, settings, fd, listener->settings->tls);
+            return;
+        }
+    }
+    if (settings->client_max_conns || settings->client_rate) {
+        if (worker->clients == NULL)
+            worker->clients = client_table_create(settings->client_table_size);
+        struct sockaddr_storage peer;
+        socklen_t peer_len = sizeof(peer);
+        if (addr == NULL && getpeername(fd, (struct sockaddr *)&peer, &peer_len) == 0)
+            addr = (struct sockaddr *)&peer;
+        switch (addr ? client_limit_accept(worker->clients, settings, addr, &client) : CLIENT_LIMIT_OK) {
+        case CLIENT_LIMIT_OK: break;
+        case CLIENT_LIMIT_CONNS: close(fd); return;
+        case CLIENT_LIMIT_RATE:
+            // A plaintext answer means nothing to a TLS client.
+            if (listener->settings->tls)
+                close(fd);
+            else
+                reject_connection(worker, fd, HTTP_TOO_MANY_REQUESTS, 1);
+            if (client)
+                client_limit_release(client);
+            return;
+        }
+    }
+
+    struct tls_conn *tls = NULL;
+    if (listener->settings->tls) {
+        if (!set_nonblocking(fd) || (tls = tls_conn_create(worker->tls, fd)) == NULL) {
+            log_perror(LOG_ERROR, "failed to set up TLS connection");
+            close(fd);
+            if (client)
+                client_limit_release(client);
+            return;
+        }
+    }
+    struct active_connection *conn = new_connection(worker, fd);
+    conn->client = client;
+    conn->tls = tls;
+    if (tls)
+        conn->state = CONN_HANDSHAKE;
+    *new_conns = lappend(*new_conns, conn);
+}
+
+// Poll events for a connection. A TLS session can need the other direction
+// than the state implies, e.g. a read that has to send an alert. HTTP/2
+// connections always read, since flow control updates and new requests
+// arrive while responses are being sent.
+static short poll_events(const struct active_connection *conn) {
+    short want = conn->tls ? tls_poll_events(conn->tls) : 0;
+
+    if (conn->h2)
+        return POLLIN | want | (conn->state == CONN_SENDING ? POLLOUT : 0);
+    if (want)
+        return want;
+    return conn->state == CONN_SENDING ? POLLOUT : POLLIN;
+}
+
+// Proxied connections wait on whichever side their exchange is stuck on.
+static int poll_fd(const struct active_connection *conn, short *events) {
+    if (conn->proxy)
+        return proxy_poll_fd(conn->proxy, events);
+    *events = poll_events(conn);
+    return conn->sock_fd;
+}
+
+#define PARK_POLL_MS 5 // how often parked connections check on their file
+
+// Whether the loop has work due once a second even without any events.
+static bool second_tick(struct worker *worker) {
+    if (worker->settings->conn_timeout && worker->active_conns != NIL)
+        return true;
+    return worker->capture && capture_pending(worker->capture);
+}
+
+static void wait_select(struct worker *worker, struct master_state *master, List **new_conns) {
     fd_set read_fset, write_fset;
     FD_ZERO(&read_fset);
     FD_ZERO(&write_fset);
-    FD_SET(master->sock_fd, &read_fset);
-    int max_fd = master->sock_fd;
+    int max_fd = -1;
+    bool parked = false;
+    for (size_t i = 0; i < master->listener_count; ++i) {
+        int fd = master->listeners[i].fd;
+        FD_SET(fd, &read_fset);
+        if (fd > max_fd)
+            max_fd = fd;
+    }
+    if (worker->io_pool) {
+        int fd = io_pool_fd(worker->io_pool);
+        FD_SET(fd, &read_fset);
+        if (fd > max_fd)
+            max_fd = fd;
+    }
     foreach (lc, worker->active_conns) {
         struct active_connection *conn = lfirst(lc);
+        short events;
+        int fd = poll_fd(conn, &events);
         switch (conn->state) {
-        case CONN_WAITING: FD_SET(conn->sock_fd, &read_fset); break;
-        case CONN_SENDING: FD_SET(conn->sock_fd, &write_fset); break;
+        case CONN_HANDSHAKE:
+        case CONN_WAITING:
+        case CONN_SENDING:
+            if (events & POLLIN)
+                FD_SET(fd, &read_fset);
+            if (events & POLLOUT)
+                FD_SET(fd, &write_fset);
+            break;
+        case CONN_PARKED:
+        case CONN_PACED: parked = true; break;
+        case CONN_IO: break;
         case CONN_COMPLETE:
         case CONN_ERR_UNRECOVERABLE:
         case CONN_ERR_RECOVERABLE: assert(0); break;
         }
-        if (conn->sock_fd > max_fd)
-            max_fd = conn->sock_fd;
+        if (fd > max_fd)
+            max_fd = fd;
     }
 
-    int ret = select(max_fd + 1, &read_fset, &write_fset, NULL, NULL);
+    // Wake up once a second while connections can time out or captured heads
+    // wait to be written, and often while some wait for a file another worker
+    // reads in.
+    struct timeval tick = {1, 0};
+    if (parked)
+        tick = (struct timeval){0, PARK_POLL_MS * 1000};
+    bool need_tick = parked || second_tick(worker);
+    int ret = select(max_fd + 1, &read_fset, &write_fset, NULL, need_tick ? &tick : NULL);
+    if (worker->overload)
+        overload_woke(worker->overload, worker->settings);
     if (ret == -1 && errno == EINTR) {
         return;
     }
@@ -154,51 +808,267 @@ static void conn_loop(struct worker *worker, struct master_state *master) {
         exit(EXIT_FAILURE);
     }
 
-    List *new_conns = NIL;
-    if (FD_ISSET(master->sock_fd, &read_fset)) {
-        socklen_t addrlen;
-        struct sockaddr_in client_addr;
-        int fd = accept(master->sock_fd, (struct sockaddr *)&client_addr, &addrlen);
-        if (fd == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    for (size_t i = 0; i < master->listener_count; ++i) {
+        int listen_fd = master->listeners[i].fd;
+        if (!FD_ISSET(listen_fd, &read_fset))
+            continue;
+        struct sockaddr_storage client_addr;
+        socklen_t addrlen = sizeof(client_addr);
+        int fd = accept(listen_fd, (struct sockaddr *)&client_addr, &addrlen);
+        if (fd == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED)) {
         } else if (fd == -1) {
             log_perror(LOG_FATAL, "accept failed");
             exit(EXIT_FAILURE);
         } else {
-            struct active_connection *conn = server_alloc(sizeof(*conn));
-            memset(conn, 0, sizeof(*conn));
-            conn->sock_fd = fd;
-            conn->state = CONN_WAITING;
-            conn->file_fd = -1;
-            new_conns = lappend(new_conns, conn);
+            add_connection(worker, &master->listeners[i], fd, (struct sockaddr *)&client_addr, new_conns);
         }
     }
 
     foreach (lc, worker->active_conns) {
         struct active_connection *conn = lfirst(lc);
+        short events;
+        int fd = poll_fd(conn, &events);
+        conn->ready = ((events & POLLIN) && FD_ISSET(fd, &read_fset)) || ((events & POLLOUT) && FD_ISSET(fd, &write_fset));
+    }
+}
 
-        switch (conn->state) {
-        case CONN_WAITING: {
-            if (!FD_ISSET(conn->sock_fd, &read_fset)) {
-                new_conns = lappend(new_conns, conn);
-                continue;
+// Connection polls and the calls the ring makes for a connection use the
+// connection pointer as user data. Allocations are aligned, so accepts are
+// told apart by the low bit and carry the listener index in the remaining
+// bits.
+#define URING_ACCEPT_TAG(index) (((uint64_t)(index) << 1) | 1)
+#define URING_IS_ACCEPT(user_data) (((user_data) & 1) != 0)
+#define URING_ACCEPT_INDEX(user_data) ((size_t)((user_data) >> 1))
+#define URING_TIMEOUT_TAG 2
+#define URING_PARK_TAG 4
+#define URING_IO_TAG 6
+#define URING_CLOSE_TAG 8
+
+// Closes go out with the next submission on the ring, the descriptor stays
+// taken until then.
+static void close_fd(struct worker *worker, int fd) {
+    if (worker->uring == NULL || !uring_prep_close(worker->uring, fd, URING_CLOSE_TAG))
+        close(fd);
+}
+
+static void wait_uring(struct worker *worker, struct master_state *master, List **new_conns) {
+    for (size_t i = 0; i < master->listener_count; ++i) {
+        if (worker->accept_armed[i])
+            continue;
+        if (!uring_prep_accept(worker->uring, master->listeners[i].fd, worker->accept_multishot,
+                               URING_ACCEPT_TAG(i))) {
+            log_msg(LOG_FATAL, "io_uring submission queue full");
+            exit(EXIT_FAILURE);
+        }
+        worker->accept_armed[i] = true;
+    }
+    if (worker->io_pool && !worker->io_armed) {
+        if (!uring_prep_poll(worker->uring, io_pool_fd(worker->io_pool), POLLIN, URING_IO_TAG)) {
+            log_msg(LOG_FATAL, "io_uring submission queue full");
+            exit(EXIT_FAILURE);
+        }
+        worker->io_armed = true;
+    }
+    bool parked = false;
+    foreach (lc, worker->active_conns) {
+        struct active_connection *conn = lfirst(lc);
+        parked |= conn->state == CONN_PARKED || conn->state == CONN_PACED;
+        if (conn->polling || conn->state == CONN_PARKED || conn->state == CONN_PACED || conn->state == CONN_IO)
+            continue;
+        if (conn->state == CONN_WAITING && !conn->tls && !conn->h2 && !conn->proxy && ring_recv(worker, conn)) {
+            conn->polling = true;
+            continue;
+        }
+        short events;
+        int fd = poll_fd(conn, &events);
+        if (!uring_prep_poll(worker->uring, fd, events, (uint64_t)(uintptr_t)conn)) {
+            log_msg(LOG_FATAL, "io_uring submission queue full");
+            exit(EXIT_FAILURE);
+        }
+        conn->polling = true;
+    }
+    // The ring keeps a single timespec, so at most one timeout goes out per
+    // submission. The short one comes first, the other follows on its wakeup.
+    bool timer_prepared = false;
+    if (parked && !worker->park_timer_armed) {
+        if (!uring_prep_timeout(worker->uring, PARK_POLL_MS, URING_PARK_TAG)) {
+            log_msg(LOG_FATAL, "io_uring submission queue full");
+            exit(EXIT_FAILURE);
+        }
+        worker->park_timer_armed = true;
+        timer_prepared = true;
+    }
+    if (!timer_prepared && !worker->timeout_armed && second_tick(worker)) {
+        if (!uring_prep_timeout(worker->uring, 1000, URING_TIMEOUT_TAG)) {
+            log_msg(LOG_FATAL, "io_uring submission queue full");
+            exit(EXIT_FAILURE);
+        }
+        worker->timeout_armed = true;
+    }
+
+    bool submitted = uring_submit_and_wait(worker->uring);
+    if (worker->overload)
+        overload_woke(worker->overload, worker->settings);
+    if (!submitted) {
+        if (errno == EINTR)
+            return;
+        log_perror(LOG_FATAL, "io_uring_enter failed");
+        exit(EXIT_FAILURE);
+    }
+
+    struct uring_cqe cqe;
+    while (uring_next_cqe(worker->uring, &cqe)) {
+        if (cqe.user_data == URING_TIMEOUT_TAG) {
+            worker->timeout_armed = false;
+            continue;
+        }
+        if (cqe.user_data == URING_PARK_TAG) {
+            worker->park_timer_armed = false;
+            continue;
+        }
+        if (cqe.user_data == URING_IO_TAG) {
+            worker->io_armed = false;
+            continue;
+        }
+        if (cqe.user_data == URING_CLOSE_TAG) {
+            if (cqe.res < 0) {
+                errno = -cqe.res;
+                log_perror(LOG_WARN, "close failed");
             }
+            continue;
+        }
+        if (!URING_IS_ACCEPT(cqe.user_data)) {
+            struct active_connection *conn = (struct active_connection *)(uintptr_t)cqe.user_data;
+            conn->polling = false;
+            conn->ring_res = cqe.res;
+            conn->ready = true;
+            continue;
+        }
+
+        if (!cqe.more)
+            worker->accept_armed[URING_ACCEPT_INDEX(cqe.user_data)] = false;
+        if (cqe.res >= 0) {
+            add_connection(worker, &master->listeners[URING_ACCEPT_INDEX(cqe.user_data)], cqe.res, NULL, new_conns);
+        } else if (cqe.res == -EINVAL && worker->accept_multishot) {
+            log_msg(LOG_INFO, "multishot accept not supported, falling back to single shot");
+            worker->accept_multishot = false;
+        } else if (cqe.res != -EAGAIN && cqe.res != -EINTR && cqe.res != -ECONNABORTED) {
+            errno = -cqe.res;
+            log_perror(LOG_FATAL, "accept failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+// Timed out connections are shut down rather than closed, so that the event
+// backend reports them ready and they are torn down on the normal path.
+static void expire_connections(struct worker *worker) {
+    time_t now = time(NULL);
+    foreach (lc, worker->active_conns) {
+        struct active_connection *conn = lfirst(lc);
+        if (conn->timed_out || now - conn->last_active < worker->settings->conn_timeout)
+            continue;
+        log_msg(LOG_INFO, "connection timed out");
+        shutdown(conn->sock_fd, SHUT_RDWR);
+        if (conn->proxy)
+            proxy_shutdown(conn->proxy);
+        conn->timed_out = true;
+    }
+}
+
+// Parked connections are not polled, they are ready once the file they wait
+// for is read in or its load was abandoned. Paced ones are ready once their
+// pacer lets them send again.
+static void wake_parked(struct worker *worker) {
+    foreach (lc, worker->active_conns) {
+        struct active_connection *conn = lfirst(lc);
+        if (conn->state == CONN_PARKED && !inflight_pending(worker->inflight, conn->inflight_key))
+            conn->ready = true;
+        else if (conn->state == CONN_PACED && pacing_due(conn->pacer))
+            conn->ready = true;
+    }
+}
+
+// Connections whose filesystem call finished carry on where they left off.
+static void complete_io(struct worker *worker) {
+    for (struct io_job *job = io_pool_completed(worker->io_pool); job; job = job->next)
+        job->conn->ready = true;
+}
+
+static void conn_loop(struct worker *worker, struct master_state *master) {
+    List *new_conns = NIL;
+    if (worker->uring)
+        wait_uring(worker, master, &new_conns);
+    else
+        wait_select(worker, master, &new_conns);
+    wake_parked(worker);
+    if (worker->io_pool)
+        complete_io(worker);
 
+    // Responses already under way go after everything else that is ready,
+    // and each sends at most send_quantum per round. A bulk download then
+    // takes turns with the others instead of delaying the first bytes of
+    // every response behind it. One that runs out of budget still has a
+    // writable socket and is polled ready again right away.
+    List *round = NIL;
+    foreach (lc, worker->active_conns) {
+        struct active_connection *conn = lfirst(lc);
+        if (!conn->ready || (conn->state != CONN_SENDING && conn->state != CONN_PACED))
+            round = lappend(round, conn);
+    }
+    foreach (lc, worker->active_conns) {
+        struct active_connection *conn = lfirst(lc);
+        if (conn->ready && (conn->state == CONN_SENDING || conn->state == CONN_PACED))
+            round = lappend(round, conn);
+    }
+    size_t quantum = worker->settings->send_quantum ? worker->settings->send_quantum : SIZE_MAX;
+
+    foreach (lc, round) {
+        struct active_connection *conn = lfirst(lc);
+
+        if (!conn->ready) {
+            new_conns = lappend(new_conns, conn);
+            continue;
+        }
+        conn->ready = false;
+        conn->last_active = time(NULL);
+        conn->send_budget = quantum;
+
+        switch (conn->state) {
+        case CONN_HANDSHAKE: {
             g_memory_arena = &conn->arena;
-            if (setjmp(worker->req_jmpbuf) == 0) {
-                process_request(worker, conn);
-            }
+            conn->state = process_handshake(worker, conn);
             g_memory_arena = NULL;
             break;
         }
-        case CONN_SENDING: {
-            if (!FD_ISSET(conn->sock_fd, &write_fset)) {
-                new_conns = lappend(new_conns, conn);
-                continue;
-            }
+        case CONN_WAITING: {
             g_memory_arena = &conn->arena;
-            if (setjmp(worker->req_jmpbuf) == 0) {
-                process_request_write(conn);
-            }
+            if (conn->proxy)
+                conn->state = proxy_process(worker, conn);
+            else
+                conn->state = conn->h2 ? h2_process(worker, conn) : process_request(worker, conn);
+            g_memory_arena = NULL;
+            break;
+        }
+        case CONN_PARKED: {
+            g_memory_arena = &conn->arena;
+            conn->state = resume_request(worker, conn);
+            g_memory_arena = NULL;
+            break;
+        }
+        case CONN_IO: {
+            g_memory_arena = &conn->arena;
+            conn->state = finish_io(worker, conn);
+            g_memory_arena = NULL;
+            break;
+        }
+        case CONN_SENDING:
+        case CONN_PACED: {
+            g_memory_arena = &conn->arena;
+            if (conn->proxy)
+                conn->state = proxy_process(worker, conn);
+            else
+                conn->state = conn->h2 ? h2_process(worker, conn) : process_request_write(worker, conn);
             g_memory_arena = NULL;
             break;
         }
@@ -208,8 +1078,12 @@ static void conn_loop(struct worker *worker, struct master_state *master) {
         }
 
         switch (conn->state) {
-        case CONN_WAITING: assert(0); break;
+        case CONN_HANDSHAKE:
+        case CONN_WAITING:
         case CONN_SENDING:
+        case CONN_PARKED:
+        case CONN_PACED:
+        case CONN_IO:
             assert(g_memory_arena == NULL);
             new_conns = lappend(new_conns, conn);
             break;
@@ -217,17 +1091,28 @@ static void conn_loop(struct worker *worker, struct master_state *master) {
         complete:
             assert(g_memory_arena == NULL);
             if (conn->file_fd != -1)
-                close(conn->file_fd);
-            close(conn->sock_fd);
+                close_fd(worker, conn->file_fd);
+            if (conn->mapping)
+                mmap_cache_release(conn->mapping);
+            if (conn->listing)
+                dir_listing_release(conn->listing);
+            if (conn->client)
+                client_limit_release(conn->client);
+            if (conn->h2)
+                h2_conn_free(conn->h2);
+            if (conn->proxy)
+                proxy_conn_free(worker, conn->proxy);
+            release_conn_buffers(worker, conn);
+            if (conn->tls)
+                tls_conn_free(conn->tls);
+            close_fd(worker, conn->sock_fd);
             arena_clear(&conn->arena);
             server_free(conn);
             break;
         }
         case CONN_ERR_RECOVERABLE: {
             g_memory_arena = &conn->arena;
-            if (setjmp(worker->req_jmpbuf) == 0) {
-                error_response(HTTP_INTERNAL_SERVER_ERROR, conn);
-            }
+            error_response(HTTP_INTERNAL_SERVER_ERROR, conn);
             g_memory_arena = NULL;
             goto complete;
         }
@@ -237,23 +1122,147 @@ static void conn_loop(struct worker *worker, struct master_state *master) {
         }
     }
     list_free(worker->active_conns);
+    list_free(round);
     worker->active_conns = new_conns;
+
+    if (worker->settings->conn_timeout)
+        expire_connections(worker);
+    if (worker->clients)
+        client_limit_report(worker->clients);
+    if (worker->pacing)
+        pacing_report(worker->pacing);
+    if (worker->locality)
+        locality_report(worker->locality);
+    if (worker->capture)
+        capture_flush(worker->capture, false);
+    if (worker->overload) {
+        overload_update(worker->overload, worker->settings, worker->active_conns);
+        overload_report(worker->overload);
+    }
+    buffer_pool_report(worker->req_buffers);
+    buffer_pool_report(worker->transfer_buffers);
+    if (worker->io_pool)
+        io_pool_report(worker->io_pool);
+}
+
+// Takes over the listening sockets of worker index, leaving the others to
+// the master.
+static void take_worker_sockets(struct master_state *master, size_t index) {
+    for (size_t i = 0; i < master->listener_count; ++i) {
+        struct listener *listener = &master->listeners[i];
+        if (listener->worker_fds == NULL)
+            continue;
+        for (size_t j = 0; j < master->settings->process_count; ++j) {
+            if (j != index)
+                close(listener->worker_fds[j]);
+        }
+        listener->fd = listener->worker_fds[index];
+    }
 }
 
-__attribute__((noreturn)) static void run_child(struct master_state *master) {
+__attribute__((noreturn)) static void run_child(struct master_state *master, size_t index) {
     struct worker worker = {0};
     worker.settings = master->settings;
+    take_worker_sockets(master, index);
+    if (master->cpus && affinity_pin(master->cpus[index]))
+        worker.locality = locality_create(master->cpus[index]);
+    // Before anything the worker keeps is allocated, so that it is placed
+    // on the node the worker runs on.
+    page_alloc_init(worker.settings->huge_pages, worker.settings->numa_local);
+    if (worker.settings->arena_pool_blocks)
+        arena_pool_init(worker.settings->arena_block_size, worker.settings->arena_pool_blocks);
+    worker.header_cache = header_cache_create(worker.settings->header_cache_size);
+    worker.site.path_cache = path_cache_create(worker.settings->path_cache_size);
+    worker.req_buffers =
+        buffer_pool_create("request", worker.settings->req_buf_size, worker.settings->buffer_pool_size);
+    worker.transfer_buffers =
+        buffer_pool_create("transfer", worker.settings->read_buf_size, worker.settings->buffer_pool_size);
+    worker.fs_gens = master->fs_gens;
+    worker.inflight = master->inflight;
+    worker.tls = master->tls;
+    worker.pack = master->pack;
+    worker.site.root = static_root_open(worker.settings->static_dir);
+    if (worker.site.root == NULL)
+        exit(EXIT_FAILURE);
+    if (worker.settings->vhost_count)
+        worker.vhosts = vhost_table_create(worker.settings);
+    if (worker.settings->upstream_count)
+        worker.upstreams = upstream_pool_create(worker.settings);
+    if (worker.settings->io_threads)
+        worker.io_pool = io_pool_create(worker.settings->io_threads);
+    if (master->capture_fd != -1)
+        worker.capture = capture_create(master->capture_fd, worker.settings->capture_max_size);
+    if (worker.settings->mmap_max_file_size)
+        worker.mmap_cache = mmap_cache_create(worker.settings->mmap_max_file_size, worker.settings->mmap_cache_size);
 
     g_memory_arena = NULL;
-    g_err_jmpbuf = &worker.req_jmpbuf;
+    page_alloc_report();
 
-    log_msg(LOG_INFO, "accepting connections on address %s:%d", worker.settings->host, worker.settings->port);
+    if (worker.settings->io_backend != IO_BACKEND_SELECT) {
+        worker.uring = uring_create(256);
+        worker.accept_multishot = true;
+        if (worker.uring) {
+            log_msg(LOG_INFO, "using io_uring event loop");
+            // Registered pages count against RLIMIT_MEMLOCK on most kernels.
+            if (worker.settings->uring_buffers &&
+                !uring_register_buffers(worker.uring, worker.settings->uring_buffers, worker.settings->read_buf_size))
+                log_perror(LOG_INFO, "could not register io_uring buffers, reading into pooled ones");
+        } else if (worker.settings->io_backend == IO_BACKEND_URING) {
+            log_perror(LOG_WARN, "io_uring unavailable, falling back to select");
+        }
+    }
+
+    worker.accept_armed = calloc(master->listener_count, sizeof(*worker.accept_armed));
+    if (worker.accept_armed == NULL) {
+        log_msg(LOG_FATAL, "OOM");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t i = 0; i < master->listener_count; ++i)
+        log_msg(LOG_INFO, "accepting connections on address %s%s", master->listeners[i].name,
+                master->listeners[i].settings->tls ? " (tls)" : "");
 
     for (;;) {
         conn_loop(&worker, master);
+        if (g_reload_requested) {
+            g_reload_requested = 0;
+            struct server_settings *fresh = reload_settings(master->settings, worker.reloaded);
+            if (fresh) {
+                worker.settings = fresh;
+                worker.reloaded = fresh;
+                // static_dir may have changed under the cached request paths.
+                path_cache_clear(worker.site.path_cache);
+                if (strcmp(fresh->static_dir, static_root_path(worker.site.root)) != 0) {
+                    // Lookups still queued keep the old root open.
+                    struct static_root *root = static_root_open(fresh->static_dir);
+                    if (root) {
+                        static_root_release(worker.site.root);
+                        worker.site.root = root;
+                    }
+                }
+            }
+        }
     }
 }
 
+// Starts, stops or retargets the watcher to match the settings. The watcher
+// runs in the master after the workers are forked, so they do not inherit
+// the inotify descriptor.
+static void update_watch(struct master_state *state, const struct server_settings *settings) {
+    if (state->watch) {
+        fs_watch_destroy(state->watch);
+        state->watch = NULL;
+    }
+    if (!settings->watch_static_dir)
+        return;
+    const char **roots = server_alloc((settings->vhost_count + 1) * sizeof(*roots));
+    roots[0] = settings->static_dir;
+    for (size_t i = 0; i < settings->vhost_count; ++i)
+        roots[i + 1] = settings->vhosts[i].root;
+    state->watch = fs_watch_create(roots, settings->vhost_count + 1, state->fs_gens);
+    server_free(roots);
+}
+
 static bool run_master(struct master_state *state) {
     log_msg(LOG_INFO, "creating %zu workers", state->settings->process_count);
     for (size_t i = 0; i < state->settings->process_count; ++i) {
@@ -264,14 +1273,32 @@ static bool run_master(struct master_state *state) {
             return false;
         }
         if (pid == 0) {
-            run_child(state);
+            run_child(state, i);
         } else {
             log_msg(LOG_INFO, "created worker with pid %d", pid);
             state->pids[i] = pid;
         }
     }
+    update_watch(state, state->settings);
     for (;;) {
-        sleep(100);
+        // Both block until a signal arrives, the watcher also returns after
+        // publishing a batch of events.
+        if (state->watch == NULL) {
+            sleep(100);
+        } else if (!fs_watch_process(state->watch)) {
+            fs_watch_destroy(state->watch);
+            state->watch = NULL;
+        }
+        if (!g_reload_requested)
+            continue;
+        g_reload_requested = 0;
+        struct server_settings *fresh = reload_settings(state->settings, state->reloaded);
+        if (fresh == NULL)
+            continue;
+        state->reloaded = fresh;
+        update_watch(state, fresh);
+        for (size_t i = 0; i < state->pid_count; ++i)
+            kill(state->pids[i], SIGHUP);
     }
     return true;
 }
@@ -280,6 +1307,8 @@ bool run_server(const struct server_settings *settings) {
     log_msg(LOG_INFO, "initializing master");
     if (!validate_settings(settings))
         return false;
+    if (!init_logging(settings) || !init_signals())
+        return false;
 
     log_msg(LOG_INFO, "validated settings");
     struct master_state state = {0};
@@ -290,10 +1319,6 @@ bool run_server(const struct server_settings *settings) {
     return run_master(&state);
 }
 
-__attribute__((noreturn)) void abort_req(void) {
-    longjmp(*g_err_jmpbuf, 1);
-}
-
 static const char *log_level_str(enum log_level level) {
     switch (level) {
     case LOG_TRACE: return "trace";
@@ -317,24 +1342,32 @@ static char *csstrerror(char *buf, size_t buf_size, int err) {
 }
 
 __attribute__((format(printf, 2, 3))) void log_msg(enum log_level level, const char *fmt, ...) {
+    if (level < g_log_level)
+        return;
+
     char msg[4096];
     va_list args;
     va_start(args, fmt);
     vsnprintf(msg, sizeof(msg), fmt, args);
     va_end(args);
 
+    // I/O threads log too.
     time_t now = time(NULL);
-    struct tm *tm = localtime(&now);
+    struct tm tm_buf;
+    struct tm *tm = localtime_r(&now, &tm_buf);
 
     char buffer[4096];
     int len =
         snprintf(buffer, sizeof(buffer), "%d %d.%d.%d %02d:%02d:%02d [%s]: %s\n", getpid(), tm->tm_mday, tm->tm_mon + 1,
                  tm->tm_year + 1900, tm->tm_hour, tm->tm_min, tm->tm_sec, log_level_str(level), msg);
-    write(STDERR_FILENO, buffer, len);
+    write(g_log_fd, buffer, len);
 }
 
 __attribute__((format(printf, 2, 3))) void log_perror(enum log_level level, const char *fmt, ...) {
     int err = errno;
+    if (level < g_log_level)
+        return;
+
     char err_buf[4096];
     char *err_str = csstrerror(err_buf, sizeof(err_buf), err);
 
@@ -345,11 +1378,12 @@ __attribute__((format(printf, 2, 3))) void log_perror(enum log_level level, cons
     va_end(args);
 
     time_t now = time(NULL);
-    struct tm *tm = localtime(&now);
+    struct tm tm_buf;
+    struct tm *tm = localtime_r(&now, &tm_buf);
 
     char buffer[4096];
     int len =
         snprintf(buffer, sizeof(buffer), "%d %d.%d.%d %02d:%02d:%02d [%s]: %s: %s\n", getpid(), tm->tm_mday, tm->tm_mon,
                  tm->tm_year + 1900, tm->tm_hour, tm->tm_min, tm->tm_sec, log_level_str(level), msg, err_str);
-    write(STDERR_FILENO, buffer, len);
+    write(g_log_fd, buffer, len);
 }
@@ -1,53 +1,47 @@
 #ifndef SERVER_H
 #define SERVER_H
 
-#include <setjmp.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
 
+#include "log.h"
+#include "mime_types.h"
+#include "page_alloc.h"
 #include "pg_list.h"
 
 enum http_version {
     HTTP_10,
-    HTTP_11
-};
-
-enum http_content_type {
-    HTTP_CT_BIN,  // application/octet-stream
-    HTTP_CT_BMP,  // image/bmp
-    HTTP_CT_CSS,  // text/css
-    HTTP_CT_CSV,  // text/csv
-    HTTP_CT_GIF,  // image/gif
-    HTTP_CT_HTML, // text/html
-    HTTP_CT_JPEG, // image/jpeg
-    HTTP_CT_JS,   // text/javascript
-    HTTP_CT_JSON, // application/json
-    HTTP_CT_MP3,  // audio/mpeg
-    HTTP_CT_MP4,  // video/mp4
-    HTTP_CT_OTF,  // font/otf
-    HTTP_CT_PNG,  // image/png
-    HTTP_CT_PDF,  // application/pdf
-    HTTP_CT_SVG,  // image/svg+xml
-    HTTP_CT_TTF,  // font/ttf
-    HTTP_CT_TXT,  // text/plain
+    HTTP_11,
+    HTTP_2
 };
 
 enum http_method {
     HTTP_GET,
-    HTTP_HEAD
+    HTTP_HEAD,
+    HTTP_OTHER, // any other token, only upstreams take it
 };
 
 enum http_status_code {
     HTTP_OK, // 200
 
+    HTTP_MOVED_PERMANENTLY, // 301
+
     HTTP_BAD_REQUEST,        // 400
     HTTP_FORBIDDEN,          // 403
     HTTP_NOT_FOUND,          // 404
     HTTP_METHOD_NOT_ALLOWED, // 405
+    HTTP_LENGTH_REQUIRED,    // 411
     HTTP_URI_TOO_LONG,       // 414
+    HTTP_TOO_MANY_REQUESTS,  // 429
 
     HTTP_INTERNAL_SERVER_ERROR, // 500
+    HTTP_BAD_GATEWAY,           // 502
+    HTTP_SERVICE_UNAVAILABLE,   // 503
     HTTP_VERSION_NO_SUPPORTED,  // 505
 };
 
@@ -58,8 +52,12 @@ struct http_header {
 
 struct http_req {
     enum http_method method;
-    const char *uri;
+    const char *uri;  // request target as sent, for the query and upstreams
+    const char *path; // decoded and normalized, files and routes go by this
     enum http_version version;
+    const char *accept_encoding; // NULL when not sent
+    size_t accept_encoding_len;
+    struct vhost *vhost; // picked by Host, never NULL
 };
 
 struct http_response {
@@ -70,14 +68,53 @@ struct http_response {
     char *body;
 };
 
-enum log_level {
-    LOG_TRACE,
-    LOG_INFO,
-    LOG_WARN,
-    LOG_ERROR,
-    LOG_FATAL
+struct file_info {
+    size_t size;
+    enum http_content_type ct;
+    bool is_dir;
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+};
+
+// Preformatted response head for a file. The Date value is not stored and has
+// to be inserted at date_offset when sending.
+struct header_block {
+    const char *data;
+    size_t len;
+    size_t date_offset;
+};
+
+// Read-only mapping of a whole file shared by the connections sending it.
+struct mmap_entry {
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    size_t size;
+    void *data;
+    int refs;
+    bool detached; // no longer in the cache, unmapped on last release
+    bool stale;    // a send faulted on the mapping, drop it on next lookup
+};
+
+enum dir_listing_format {
+    DIR_LISTING_HTML,
+    DIR_LISTING_JSON,
+    DIR_LISTING_FORMAT_COUNT
+};
+
+// Rendered directory listing shared by the connections sending it.
+struct dir_listing {
+    struct header_block head;
+    struct header_block h2_head;
+    char *body;
+    size_t body_len;
+    int refs;
+    bool detached; // no longer in the cache, freed on last release
 };
 
+#define HTTP_DATE_LEN 29 // "Sun, 06 Nov 1994 08:49:37 GMT"
+
 struct memory_arena_block {
     size_t size;
     size_t used;
@@ -98,77 +135,589 @@ enum parse_http_req_result {
     PARSE_HTTP_INVALID_METHOD,
 };
 
+enum io_backend {
+    IO_BACKEND_AUTO, // io_uring when the kernel supports it, select otherwise
+    IO_BACKEND_SELECT,
+    IO_BACKEND_URING,
+};
+
+// One listening socket. Either host/port (IPv4 or IPv6 literal) or
+// unix_path is used.
+struct listen_settings {
+    const char *host;
+    int port;
+    const char *unix_path;
+    int backlog;
+    bool v6only;
+    int defer_accept; // TCP_DEFER_ACCEPT timeout in seconds, 0 disables
+    int fastopen;     // TCP_FASTOPEN queue length, 0 disables
+    bool tls;
+};
+
+// Responses to requests whose path starts with prefix are sent at no more
+// than rate bytes per second, 0 exempts them from pace_rate.
+struct pace_settings {
+    const char *prefix;
+    size_t rate;
+};
+
+// Files served under this extension get ct instead of the type mime.types
+// gives them.
+struct mime_override {
+    const char *ext; // lowercase, without the dot
+    enum http_content_type ct;
+};
+
+// Requests whose Host is name are served from root instead of static_dir.
+// A name starting with "*." takes every host below the rest of it.
+struct vhost_settings {
+    const char *name; // lowercase, without port or trailing dot
+    const char *root; // canonical
+    const struct mime_override *types;
+    size_t type_count;
+    size_t path_cache_size; // 0 takes path_cache_size
+    size_t pace_rate;
+    bool pace_set;  // pace_rate replaces the server's
+    int autoindex;  // -1 follows the server's
+};
+
+// Requests whose path starts with prefix are forwarded to the backend at
+// host/port or unix_path instead of being served from static_dir.
+struct upstream_settings {
+    const char *prefix;
+    const char *host;
+    int port;
+    const char *unix_path;
+};
+
 struct server_settings {
     size_t uri_length_limit;
     const char *host;
     int port;
     size_t process_count;
     int listen_backlog;
-    size_t read_buf_size;
+    size_t read_buf_size;    // file transfer buffers, borrowed while sending
+    size_t req_buf_size;     // first request buffer, grown up to req_size_limit
     size_t req_size_limit;
+    size_t buffer_pool_size; // idle buffers each worker keeps per pool
+    size_t io_threads;       // per worker for filesystem calls, 0 makes them in the event loop
     const char *static_dir;
+    const char *asset_pack; // serve from this pack instead of static_dir
     enum log_level log_level;
     const char *log_filename;
     bool log_to_stdout;
+    enum io_backend io_backend;
+    size_t uring_buffers; // transfer buffers each worker registers with its ring, 0 reads into pooled ones
+    size_t mmap_max_file_size; // 0 disables serving from mappings
+    size_t mmap_cache_size;
+    size_t coalesce_min_size; // cold files this large are read in by one worker at a time, 0 disables
+    size_t coalesce_max_size;
+    // When empty, a single listener is made from host, port and listen_backlog.
+    const struct listen_settings *listeners;
+    size_t listener_count;
+    size_t arena_block_size;
+    size_t arena_pool_blocks;    // arena blocks each worker carves from one region, 0 takes them from malloc
+    enum huge_pages huge_pages;  // for the arena pool and cache tables of at least a huge page
+    bool numa_local;             // prefer the NUMA node a worker starts on for its pool and tables
+    bool cpu_affinity;           // pin workers to CPUs and steer connections to the worker on their CPU
+    size_t header_cache_size;
+    int conn_timeout; // seconds without progress before a connection is dropped, 0 disables
+    bool autoindex;   // list directories that have no index.html
+    bool watch_static_dir;   // trust cached paths until inotify reports a change
+    size_t path_cache_size;
+    // Per-client limits, enforced by every worker on its own connections.
+    size_t client_max_conns; // concurrent connections per client, 0 disables
+    int client_rate;         // requests per second per client, 0 disables
+    int client_burst;        // requests allowed at once, 0 means client_rate
+    int client_prefix_v4;    // clients are grouped by address prefix
+    int client_prefix_v6;
+    size_t client_table_size;
+    // Load shedding, per worker. Past any limit new connections are answered
+    // with a 503 until all are back under SHED_RESUME_PERCENT of theirs.
+    int shed_max_lag_ms;     // event loop lag, 0 disables
+    size_t shed_max_conns;   // open connections, 0 disables
+    size_t shed_max_pending; // response bytes held for sending, 0 disables
+    int shed_retry_after;    // seconds shed clients are told to wait
+    const char *tls_cert; // PEM certificate chain for tls listeners
+    const char *tls_key;
+    bool tls_session_tickets;
+    bool tls_ktls; // let the kernel encrypt after the handshake when it can
+    bool http2;    // prior knowledge and Upgrade on plaintext listeners, ALPN on tls listeners
+    size_t h2_max_streams; // concurrent streams per HTTP/2 connection
+    size_t dir_index_cache_size;
+    int dir_index_max_age; // seconds before listed entries are stat'ed again, 0 only rescans on directory changes
+    const struct upstream_settings *upstreams;
+    size_t upstream_count;
+    size_t upstream_keepalive; // idle backend connections kept per upstream and worker
+    size_t send_quantum;       // bytes a connection sends per event loop round, 0 disables
+    size_t pace_rate;          // bytes per second per connection, 0 disables
+    const struct pace_settings *paces;
+    size_t pace_count;
+    const struct vhost_settings *vhosts;
+    size_t vhost_count;
+    const char *capture;     // file request heads are appended to for replay, NULL disables
+    size_t capture_max_size; // the file is not grown past this, 0 is unlimited
+
+    // Command line the settings were loaded from, used to reload on SIGHUP.
+    int argc;
+    char **argv;
+    List *owned; // allocations released by free_settings
+};
+
+enum load_settings_result {
+    LOAD_SETTINGS_OK,
+    LOAD_SETTINGS_ERROR,
+    LOAD_SETTINGS_HELP,
 };
 
 enum connection_state {
+    CONN_HANDSHAKE,
     CONN_WAITING,
     CONN_SENDING,
+    CONN_PARKED, // waiting for another worker to read the file in
+    CONN_IO,     // waiting for a filesystem call on an I/O thread, or a call on the ring
+    CONN_PACED,  // sending, held back by its pacer
     CONN_COMPLETE,
     CONN_ERR_RECOVERABLE,
     CONN_ERR_UNRECOVERABLE
 };
 
+// Calls the worker's ring makes for a connection. The connection is in
+// CONN_IO meanwhile, except that RING_RECV stands in for the poll of a
+// waiting one.
+enum ring_op {
+    RING_NONE,
+    RING_RECV,
+    RING_OPEN,
+    RING_STATX,
+    RING_READ,
+    RING_SEND,
+};
+
+// Work for the worker's I/O threads. run is called on a thread and must not
+// touch the arena or anything else the event loop owns.
+struct io_job {
+    void (*run)(struct io_job *job);
+    struct active_connection *conn;
+    struct io_job *next;
+    uint64_t queued_ns;
+};
+
 struct active_connection {
     enum connection_state state;
+    bool ready;
+    bool polling;
+    bool timed_out;
+    time_t last_active;
     struct memory_arena arena;
     int sock_fd;
+    struct tls_conn *tls;     // NULL on plaintext listeners
+    struct h2_conn *h2;       // set once the connection speaks HTTP/2
+    struct proxy_conn *proxy; // set while the request is forwarded to an upstream
 
     int file_fd;
-    size_t read_buf_size;
+    struct client_entry *client; // NULL when not tracked
+    struct mmap_entry *mapping;
+    struct dir_listing *listing;
+    const char *pack_body; // in the asset pack mapping
+    size_t pack_body_len;
+    size_t body_cursor;    // progress through mapping, listing or pack body
+    char *head;            // rest of a response head the socket did not take, in the arena
+    size_t head_len;
+    bool head_only;        // nothing follows that head
+    size_t send_budget;    // body bytes left to send this round
+    struct pacer *pacer;   // NULL unless a pacing rate applies
+    uint64_t inflight_key; // file a parked connection waits for
+    struct io_job *io_job; // kept until the connection closes
+    char *req_buf;         // request head read so far, from the worker's request pool
+    size_t req_buf_size;
+    size_t req_len;
+    size_t read_buf_size; // file copy buffer from the worker's transfer pool
     size_t read_buf_len;
     size_t read_buf_cursor;
     char *read_buf;
+    int read_buf_index;   // registered with the ring instead, -1 otherwise
+    int ring_res;         // result of the last ring operation, see ring_op
+    enum ring_op ring_op; // in flight on the worker's ring or completed, RING_NONE otherwise
+};
+
+// A site files are served from, per worker.
+struct vhost {
+    const struct vhost_settings *settings; // NULL for static_dir
+    struct static_root *root;
+    struct path_cache *path_cache;
 };
 
 struct worker {
     List *active_conns;
 
     const struct server_settings *settings;
+    struct header_cache *header_cache;
+    struct mmap_cache *mmap_cache;
+    struct dir_index_cache *dir_index; // created on first listing
+    struct fs_generations *fs_gens;    // shared with the master
+    struct inflight_table *inflight;   // shared with the master and other workers
+    struct client_table *clients; // created when limits are first enabled
+    struct tls_context *tls;      // shared by all tls listeners
+    struct buffer_pool *req_buffers;
+    struct buffer_pool *transfer_buffers;
+    struct upstream_pool *upstreams; // NULL without upstreams
+    struct io_pool *io_pool;         // NULL without io_threads
+    struct asset_pack *pack;         // inherited from the master, NULL without asset_pack
+    struct vhost site;               // static_dir, for hosts without a vhost of their own
+    struct vhost_table *vhosts;      // NULL without vhosts
+    struct pacing *pacing;           // created once a pacing rate first applies
+    struct locality *locality;       // NULL unless pinned by cpu_affinity
+    struct capture *capture;         // NULL without capture
+    struct overload *overload;       // created once a shed limit first applies
+
+    struct uring *uring;
+    bool *accept_armed; // per listener
+    bool accept_multishot;
+    bool timeout_armed;
+    bool park_timer_armed;
+    bool io_armed;
+    struct server_settings *reloaded; // settings loaded on SIGHUP, owned by the worker
 
-    jmp_buf req_jmpbuf;
+    time_t date_time;
+    char date[HTTP_DATE_LEN + 1];
 };
 
-extern jmp_buf *g_err_jmpbuf;
 extern struct memory_arena *g_memory_arena;
 
 //
 // server.c
 //
 bool run_server(const struct server_settings *settings);
-__attribute__((noreturn)) void abort_req(void);
-__attribute__((format(printf, 2, 3))) void log_msg(enum log_level level, const char *fmt, ...);
-__attribute__((format(printf, 2, 3))) void log_perror(enum log_level level, const char *fmt, ...);
+
+//
+// config.c
+//
+void default_settings(struct server_settings *settings);
+enum load_settings_result load_settings(int argc, char **argv, struct server_settings *settings);
+void free_settings(struct server_settings *settings);
 
 //
 // handler.c
 //
-void process_request_write(struct active_connection *conn);
-void process_request(struct worker *worker, struct active_connection *conn);
-void error_response(enum http_status_code code, struct active_connection *conn);
+enum connection_state process_handshake(struct worker *worker, struct active_connection *conn);
+enum connection_state process_request_write(struct worker *worker, struct active_connection *conn);
+void release_conn_buffers(struct worker *worker, struct active_connection *conn);
+enum connection_state process_request(struct worker *worker, struct active_connection *conn);
+enum connection_state resume_request(struct worker *worker, struct active_connection *conn);
+enum connection_state finish_io(struct worker *worker, struct active_connection *conn);
+bool ring_recv(struct worker *worker, struct active_connection *conn);
+enum connection_state error_response(enum http_status_code code, struct active_connection *conn);
+char *dir_location(const struct http_req *req);
+void reject_connection(struct worker *worker, int fd, enum http_status_code code, int retry_after);
 bool set_nonblocking(int fd);
+ssize_t conn_read(struct active_connection *conn, void *buf, size_t len);
+ssize_t conn_write(struct active_connection *conn, const void *buf, size_t len);
+ssize_t conn_write_body(struct active_connection *conn, const void *buf, size_t len);
+const char *worker_date(struct worker *worker);
+enum http_status_code errno_status(int err);
+enum http_status_code lookup_file(struct http_req *req, struct worker *worker, const char **full_path,
+                                  struct file_info *info, struct dir_listing **listing, int *fd);
 
 //
 // http.c
 //
 enum parse_http_req_result parse_http_req(struct worker *worker, const char *str, struct http_req *req);
+char *http_normalize_path(const char *target, size_t len);
+const char *http_find_header(const char *str, const char *name, size_t *len);
 enum http_content_type http_conten_type_from_ext(const char *ext);
 enum http_content_type http_conten_type_from_filename(const char *name);
 const char *http_content_type_str(enum http_content_type type);
+const char *http_content_type_line(enum http_content_type type, size_t *len);
 const char *http_status_code_str(enum http_status_code code);
 int http_status_code_int(enum http_status_code code);
 const char *http_method_str(enum http_method method);
+void http_format_date(char *buf, size_t buf_len, time_t t);
+
+//
+// header_cache.c
+//
+struct header_cache *header_cache_create(size_t size);
+const struct header_block *header_cache_get(struct header_cache *cache, const char *path,
+                                            const struct file_info *info);
+const struct header_block *header_cache_get_h2(struct header_cache *cache, const char *path,
+                                               const struct file_info *info);
+
+//
+// mmap_cache.c
+//
+struct mmap_cache *mmap_cache_create(size_t max_file_size, size_t max_total_size);
+struct mmap_entry *mmap_cache_get(struct mmap_cache *cache, const struct static_root *root, const char *path,
+                                  const struct file_info *info);
+void mmap_cache_release(struct mmap_entry *entry);
+
+//
+// dir_index.c
+//
+struct dir_index_cache *dir_index_cache_create(size_t size);
+struct dir_listing *dir_index_get(struct dir_index_cache *cache, const struct fs_generations *gens,
+                                  const struct static_root *root, const char *path, const char *uri,
+                                  const struct file_info *info, enum dir_listing_format format, int max_age);
+void dir_listing_release(struct dir_listing *listing);
+
+//
+// fs_watch.c
+//
+struct fs_generations *fs_generations_create(void);
+bool fs_generations_active(const struct fs_generations *gens);
+uint64_t fs_generation_seq(const struct fs_generations *gens);
+uint64_t fs_generation(const struct fs_generations *gens, const char *path, size_t len);
+void fs_generations_invalidate(struct fs_generations *gens);
+struct fs_watch *fs_watch_create(const char *const *roots, size_t count, struct fs_generations *gens);
+void fs_watch_destroy(struct fs_watch *watch);
+bool fs_watch_process(struct fs_watch *watch);
+
+//
+// inflight.c
+//
+enum inflight_result {
+    INFLIGHT_CACHED,  // in the page cache already, or no way to tell
+    INFLIGHT_CLAIMED, // for the caller to read in and release
+    INFLIGHT_LOADING, // another worker is reading it in
+};
+
+struct inflight_table *inflight_table_create(void);
+enum inflight_result inflight_claim(struct inflight_table *table, int fd, const struct file_info *info,
+                                    uint64_t *key);
+void inflight_read_in(struct inflight_table *table, uint64_t key, int fd, char *buf, size_t size);
+void inflight_release(struct inflight_table *table, uint64_t key);
+bool inflight_pending(struct inflight_table *table, uint64_t key);
+
+//
+// asset_pack.c
+//
+// Response heads and body of one pack entry, in the variant the request
+// accepts.
+struct pack_file {
+    const struct header_block *head;
+    const struct header_block *h2_head;
+    const char *body;
+    size_t size;
+};
+
+struct asset_pack *asset_pack_open(const char *path);
+enum http_status_code asset_pack_lookup(struct asset_pack *pack, const struct http_req *req,
+                                        struct pack_file *file);
+
+//
+// static_root.c
+//
+struct static_root *static_root_open(const char *dir);
+struct static_root *static_root_ref(struct static_root *root);
+void static_root_release(struct static_root *root);
+const char *static_root_path(const struct static_root *root);
+int static_root_openat(const struct static_root *root, const char *path, char **real_path);
+int static_root_reopen(const struct static_root *root, const char *full_path);
+const char *static_root_relative(const struct static_root *root, const char *full_path);
+bool static_root_ring_open(const struct static_root *root, struct uring *ring, const char *rel,
+                           uint64_t user_data);
+int static_root_ring_opened(int res);
+char *static_root_ring_path(const struct static_root *root, int fd, const char *rel);
+
+//
+// path_cache.c
+//
+struct path_cache *path_cache_create(size_t size);
+void path_cache_clear(struct path_cache *cache);
+bool path_cache_get(struct path_cache *cache, const struct fs_generations *gens, const char *uri, size_t uri_len,
+                    const char **full_path, struct file_info *info);
+void path_cache_put(struct path_cache *cache, const struct fs_generations *gens, uint64_t seq, const char *uri,
+                    size_t uri_len, const char *full_path, const struct file_info *info);
+
+//
+// vhost.c
+//
+struct vhost_table *vhost_table_create(const struct server_settings *settings);
+struct vhost *vhost_find(struct worker *worker, const char *host, size_t len);
+bool vhost_autoindex(const struct worker *worker, const struct vhost *vhost);
+enum http_content_type vhost_content_type(const struct vhost_settings *settings, const char *path);
+
+//
+// pacing.c
+//
+void pacing_start(struct worker *worker, struct active_connection *conn, const struct http_req *req);
+size_t pacing_allow(struct pacer *pacer, size_t len);
+void pacing_sent(struct pacer *pacer, size_t len);
+bool pacing_due(const struct pacer *pacer);
+enum connection_state pacing_blocked(const struct active_connection *conn);
+void pacing_report(struct pacing *pacing);
+
+//
+// client_limit.c
+//
+enum client_limit_result {
+    CLIENT_LIMIT_OK,
+    CLIENT_LIMIT_CONNS, // too many open connections
+    CLIENT_LIMIT_RATE,  // out of request tokens
+};
+
+struct client_table *client_table_create(size_t size);
+enum client_limit_result client_limit_accept(struct client_table *table, const struct server_settings *settings,
+                                             const struct sockaddr *addr, struct client_entry **client);
+bool client_limit_request(struct client_table *table, const struct server_settings *settings,
+                          struct client_entry *client);
+void client_limit_release(struct client_entry *client);
+void client_limit_report(struct client_table *table);
+
+//
+// io_pool.c
+//
+struct io_pool *io_pool_create(size_t threads);
+int io_pool_fd(const struct io_pool *pool);
+void io_pool_submit(struct io_pool *pool, struct io_job *job);
+struct io_job *io_pool_completed(struct io_pool *pool);
+void io_pool_report(struct io_pool *pool);
+
+//
+// buffer_pool.c
+//
+struct buffer_pool *buffer_pool_create(const char *name, size_t size, size_t max_free);
+size_t buffer_pool_size(const struct buffer_pool *pool);
+char *buffer_pool_get(struct buffer_pool *pool);
+char *buffer_pool_grow(struct buffer_pool *pool, char *buf, size_t old_size, size_t new_size);
+void buffer_pool_put(struct buffer_pool *pool, char *buf, size_t size);
+void buffer_pool_report(struct buffer_pool *pool);
+
+//
+// proxy.c
+//
+struct upstream_pool *upstream_pool_create(const struct server_settings *settings);
+struct upstream *upstream_find(struct upstream_pool *pool, const char *uri);
+enum connection_state proxy_start(struct worker *worker, struct active_connection *conn, struct upstream *upstream,
+                                  struct http_req *req, const char *req_data, size_t req_len);
+enum connection_state proxy_process(struct worker *worker, struct active_connection *conn);
+int proxy_poll_fd(const struct proxy_conn *proxy, short *events);
+void proxy_shutdown(struct proxy_conn *proxy);
+void proxy_conn_free(struct worker *worker, struct proxy_conn *proxy);
+
+//
+// tls.c
+//
+struct tls_context *tls_context_create(const struct server_settings *settings);
+struct tls_conn *tls_conn_create(struct tls_context *context, int fd);
+void tls_conn_free(struct tls_conn *conn);
+int tls_handshake(struct tls_conn *conn); // 1 when done, 0 to retry, -1 on failure
+ssize_t tls_read(struct tls_conn *conn, void *buf, size_t len);
+ssize_t tls_write(struct tls_conn *conn, const void *buf, size_t len);
+bool tls_ktls_send(const struct tls_conn *conn);
+bool tls_alpn_h2(const struct tls_conn *conn);
+short tls_poll_events(const struct tls_conn *conn);
+
+//
+// hpack.c
+//
+// Static table indexes of the fields responses are made of.
+enum hpack_static_index {
+    HPACK_STATUS_200 = 8,
+    HPACK_CACHE_CONTROL = 24,
+    HPACK_CONTENT_ENCODING = 26,
+    HPACK_CONTENT_LENGTH = 28,
+    HPACK_CONTENT_TYPE = 31,
+    HPACK_DATE = 33,
+    HPACK_ETAG = 34,
+    HPACK_LAST_MODIFIED = 44,
+    HPACK_LOCATION = 46,
+    HPACK_RETRY_AFTER = 53,
+    HPACK_VARY = 59,
+};
+
+struct hpack_field {
+    const char *name;
+    size_t name_len;
+    const char *value;
+    size_t value_len;
+};
+
+struct hpack_buf {
+    uint8_t *data;
+    size_t len;
+    size_t cap;
+};
+
+struct hpack_decoder *hpack_decoder_create(size_t table_size, size_t list_limit);
+void hpack_decoder_destroy(struct hpack_decoder *dec);
+bool hpack_decode(struct hpack_decoder *dec, const uint8_t *block, size_t len, const struct hpack_field **fields,
+                  size_t *count);
+bool hpack_put_status(struct hpack_buf *buf, int status);
+bool hpack_put_field(struct hpack_buf *buf, enum hpack_static_index name, const char *value, size_t len);
+
+//
+// h2.c
+//
+enum connection_state h2_start(struct worker *worker, struct active_connection *conn, const char *data, size_t len);
+enum connection_state h2_upgrade(struct worker *worker, struct active_connection *conn, struct http_req *req,
+                                 const char *settings, size_t settings_len, const char *data, size_t len);
+enum connection_state h2_process(struct worker *worker, struct active_connection *conn);
+void h2_conn_free(struct h2_conn *h2);
+
+//
+// uring.c
+//
+struct uring_cqe {
+    uint64_t user_data;
+    int32_t res;
+    bool more;
+};
+
+// Room for the kernel's struct statx, which not every libc declares.
+struct uring_statx {
+    uint64_t data[32];
+};
+
+struct uring *uring_create(unsigned entries);
+void uring_destroy(struct uring *ring);
+bool uring_prep_poll(struct uring *ring, int fd, short events, uint64_t user_data);
+bool uring_prep_accept(struct uring *ring, int fd, bool multishot, uint64_t user_data);
+bool uring_register_buffers(struct uring *ring, size_t count, size_t size);
+char *uring_buffer_get(struct uring *ring, int *index);
+void uring_buffer_put(struct uring *ring, int index);
+bool uring_prep_recv(struct uring *ring, int fd, void *buf, size_t len, uint64_t user_data);
+bool uring_prep_send(struct uring *ring, int fd, const void *buf, size_t len, uint64_t user_data);
+bool uring_prep_read(struct uring *ring, int fd, void *buf, size_t len, uint64_t offset, int buf_index,
+                     uint64_t user_data);
+bool uring_prep_openat2(struct uring *ring, int dirfd, const char *path, int flags, uint64_t resolve,
+                        uint64_t user_data);
+bool uring_prep_statx(struct uring *ring, int fd, struct uring_statx *buf, uint64_t user_data);
+void uring_statx_stat(const struct uring_statx *buf, struct stat *st);
+bool uring_prep_close(struct uring *ring, int fd, uint64_t user_data);
+bool uring_prep_timeout(struct uring *ring, unsigned ms, uint64_t user_data);
+bool uring_submit_and_wait(struct uring *ring);
+bool uring_next_cqe(struct uring *ring, struct uring_cqe *cqe);
+
+//
+// capture.c
+//
+int capture_open(const char *path);
+struct capture *capture_create(int fd, size_t max_size);
+void capture_request(struct capture *capture, const char *req_data, bool tls);
+void capture_flush(struct capture *capture, bool force);
+bool capture_pending(const struct capture *capture);
+
+//
+// overload.c
+//
+struct overload *overload_create(void);
+bool overload_admit(struct overload *overload, const struct server_settings *settings);
+void overload_shed(struct overload *overload, const struct server_settings *settings, int fd, bool tls);
+void overload_woke(struct overload *overload, const struct server_settings *settings);
+void overload_update(struct overload *overload, const struct server_settings *settings, List *conns);
+void overload_report(struct overload *overload);
+
+//
+// affinity.c
+//
+bool affinity_assign(size_t workers, int *cpus, size_t *cpu_count);
+bool affinity_pin(int cpu);
+void affinity_set_incoming_cpu(int fd, int cpu);
+bool affinity_steer(int fd, const int *cpus, size_t count);
+struct locality *locality_create(int cpu);
+void locality_accept(struct locality *locality, int fd);
+void locality_report(struct locality *locality);
 
 //
 // memory.c
@@ -176,6 +725,7 @@ const char *http_method_str(enum http_method method);
 __attribute__((malloc)) void *arena_alloc(struct memory_arena *arena, size_t size);
 void *arena_realloc(struct memory_arena *arena, void *memory, size_t old_size, size_t new_size);
 void arena_clear(struct memory_arena *arena);
+void arena_pool_init(size_t block_size, size_t count);
 
 __attribute__((malloc, returns_nonnull)) void *server_alloc(size_t size);
 __attribute__((returns_nonnull)) void *server_realloc(void *memory, size_t old_size, size_t size);
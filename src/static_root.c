@@ -0,0 +1,255 @@
+#include "server.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#ifdef SYS_openat2
+#include <linux/openat2.h>
+#endif
+
+// The static directory, held open so that files are looked up relative to
+// it. Shared by the worker and the lookups queued on its I/O threads, the
+// last one to let go closes it. Only the event loop counts references.
+struct static_root {
+    int fd;
+    char *path; // canonical, as config stores static_dir
+    size_t path_len;
+    int refs;
+};
+
+struct static_root *static_root_open(const char *dir) {
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        log_perror(LOG_ERROR, "failed to open static_dir %s", dir);
+        return NULL;
+    }
+    struct static_root *root = calloc(1, sizeof(*root));
+    if (root == NULL) {
+        log_msg(LOG_FATAL, "OOM");
+        exit(EXIT_FAILURE);
+    }
+    root->fd = fd;
+    root->path = strdup(dir);
+    if (root->path == NULL) {
+        log_msg(LOG_FATAL, "OOM");
+        exit(EXIT_FAILURE);
+    }
+    root->path_len = strlen(dir);
+    root->refs = 1;
+    return root;
+}
+
+struct static_root *static_root_ref(struct static_root *root) {
+    ++root->refs;
+    return root;
+}
+
+void static_root_release(struct static_root *root) {
+    if (--root->refs)
+        return;
+    close(root->fd);
+    free(root->path);
+    free(root);
+}
+
+const char *static_root_path(const struct static_root *root) {
+    return root->path;
+}
+
+// The root followed by rel without its trailing slash.
+static char *join(const struct static_root *root, const char *rel, size_t len) {
+    while (len && rel[len - 1] == '/')
+        --len;
+    char *path = malloc(root->path_len + len + 2);
+    if (path == NULL) {
+        log_msg(LOG_FATAL, "OOM");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(path, root->path, root->path_len);
+    size_t cursor = root->path_len;
+    if (len) {
+        path[cursor++] = '/';
+        memcpy(path + cursor, rel, len);
+        cursor += len;
+    }
+    path[cursor] = '\0';
+    return path;
+}
+
+static void escaped(void) {
+    log_msg(LOG_WARN, "attempt to access file outside of static directory");
+    errno = EACCES;
+}
+
+// Without openat2, realpath resolves the symlinks a normalized path may still
+// contain, and the result has to be the root or below it. real_path may be
+// NULL where the caller has no use for it.
+static int open_resolved(const struct static_root *root, const char *rel, size_t len, char **real_path) {
+    char *joined = join(root, rel, len);
+    char *resolved = realpath(joined, NULL);
+    free(joined);
+    if (resolved == NULL)
+        return -1;
+    if (strncmp(resolved, root->path, root->path_len) != 0 ||
+        (resolved[root->path_len] != '/' && resolved[root->path_len] != '\0')) {
+        free(resolved);
+        escaped();
+        return -1;
+    }
+    int fd = open(resolved, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+    if (fd == -1 || real_path == NULL) {
+        free(resolved);
+        return fd;
+    }
+    *real_path = resolved;
+    return fd;
+}
+
+#ifdef SYS_openat2
+
+static int openat2_missing; // ENOSYS once, realpath from then on
+
+// A fifo must not block the lookup, regular files do not care.
+#define BENEATH_FLAGS (O_RDONLY | O_CLOEXEC | O_NONBLOCK)
+#define BENEATH_RESOLVE (RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS)
+
+// The canonical path comes from the descriptor, so it matches the paths the
+// watcher reports changes under.
+static char *fd_path(const struct static_root *root, int fd, const char *rel, size_t len) {
+    char buf[PATH_MAX];
+    char link[64];
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+    ssize_t n = readlink(link, buf, sizeof(buf) - 1);
+    if (n <= 0)
+        return join(root, rel, len);
+    buf[n] = '\0';
+    char *path = strdup(buf);
+    if (path == NULL) {
+        log_msg(LOG_FATAL, "OOM");
+        exit(EXIT_FAILURE);
+    }
+    return path;
+}
+
+// The kernel refuses anything that resolves outside the root, symlinks and
+// ".." included, in a single call.
+static int open_beneath(const struct static_root *root, const char *rel, size_t len, char **real_path) {
+    char buf[PATH_MAX];
+    if (__atomic_load_n(&openat2_missing, __ATOMIC_RELAXED) || len >= sizeof(buf))
+        return open_resolved(root, rel, len, real_path);
+    memcpy(buf, len ? rel : ".", len ? len : 1);
+    buf[len ? len : 1] = '\0';
+
+    struct open_how how = {0};
+    how.flags = BENEATH_FLAGS;
+    how.resolve = BENEATH_RESOLVE;
+    int fd = (int)syscall(SYS_openat2, root->fd, buf, &how, sizeof(how));
+    if (fd == -1 && errno == ENOSYS) {
+        __atomic_store_n(&openat2_missing, 1, __ATOMIC_RELAXED);
+        return open_resolved(root, rel, len, real_path);
+    }
+    if (fd == -1) {
+        if (errno == EXDEV)
+            escaped();
+        return -1;
+    }
+    if (real_path)
+        *real_path = fd_path(root, fd, rel, len);
+    return fd;
+}
+
+// The same open as a submission on the ring, for rel of the request path or
+// of a path static_root_relative returned. rel has to stay put until the
+// ring is entered. False when the ring or the kernel cannot make it.
+bool static_root_ring_open(const struct static_root *root, struct uring *ring, const char *rel,
+                           uint64_t user_data) {
+    while (*rel == '/')
+        ++rel;
+    if (__atomic_load_n(&openat2_missing, __ATOMIC_RELAXED) || strlen(rel) >= PATH_MAX)
+        return false;
+    return uring_prep_openat2(ring, root->fd, *rel ? rel : ".", BENEATH_FLAGS, BENEATH_RESOLVE, user_data);
+}
+
+// Turns the result of that submission into a descriptor, or -1 with errno
+// set like the open made directly would.
+int static_root_ring_opened(int res) {
+    if (res >= 0)
+        return res;
+    errno = -res;
+    if (errno == EXDEV)
+        escaped();
+    return -1;
+}
+
+// The canonical path of a file the ring opened beneath the root.
+char *static_root_ring_path(const struct static_root *root, int fd, const char *rel) {
+    while (*rel == '/')
+        ++rel;
+    return fd_path(root, fd, rel, strlen(rel));
+}
+
+#else
+
+static int open_beneath(const struct static_root *root, const char *rel, size_t len, char **real_path) {
+    return open_resolved(root, rel, len, real_path);
+}
+
+bool static_root_ring_open(const struct static_root *root, struct uring *ring, const char *rel,
+                           uint64_t user_data) {
+    (void)root, (void)ring, (void)rel, (void)user_data;
+    return false;
+}
+
+int static_root_ring_opened(int res) {
+    errno = -res;
+    return -1;
+}
+
+char *static_root_ring_path(const struct static_root *root, int fd, const char *rel) {
+    (void)root, (void)fd, (void)rel;
+    return NULL;
+}
+
+#endif
+
+// path is a normalized request path. Returns the open file and its
+// canonical path, malloc'ed since this runs on I/O threads as well, or -1
+// with errno set. Leaving the root fails with EACCES.
+int static_root_openat(const struct static_root *root, const char *path, char **real_path) {
+    while (*path == '/')
+        ++path;
+    return open_beneath(root, path, strlen(path), real_path);
+}
+
+// Opens again a canonical path an earlier lookup beneath the root returned,
+// a path cache hit or a file being mapped or read in. The open goes through
+// the root as well, a directory swapped for a symlink since leads nowhere.
+int static_root_reopen(const struct static_root *root, const char *full_path) {
+    const char *rel = static_root_relative(root, full_path);
+    if (rel == NULL) {
+        escaped();
+        return -1;
+    }
+    return open_beneath(root, rel, strlen(rel), NULL);
+}
+
+// full_path below the root, without leading slashes, or NULL when it is
+// not below it.
+const char *static_root_relative(const struct static_root *root, const char *full_path) {
+    if (strncmp(full_path, root->path, root->path_len) != 0)
+        return NULL;
+    const char *rel = full_path + root->path_len;
+    if (*rel != '/' && *rel != '\0' && root->path[root->path_len - 1] != '/')
+        return NULL;
+    while (*rel == '/')
+        ++rel;
+    return rel;
+}
@@ -0,0 +1,247 @@
+#include "server.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_TLS
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+struct tls_context {
+    SSL_CTX *ctx;
+};
+
+struct tls_conn {
+    SSL *ssl;
+    short want; // poll events the last operation blocked on, 0 if it did not
+    bool ktls_send;
+};
+
+static void log_tls_errors(enum log_level level, const char *what) {
+    char buf[256];
+    unsigned long err = ERR_get_error();
+    if (err == 0) {
+        log_msg(level, "%s", what);
+        return;
+    }
+    for (; err != 0; err = ERR_get_error()) {
+        ERR_error_string_n(err, buf, sizeof(buf));
+        log_msg(level, "%s: %s", what, buf);
+    }
+}
+
+// Protocols in order of preference, as ALPN wire format.
+static const unsigned char alpn_h2[] = "\x02h2\x08http/1.1";
+static const unsigned char alpn_http1[] = "\x08http/1.1";
+
+static int select_alpn(SSL *ssl, const unsigned char **out, unsigned char *out_len, const unsigned char *in,
+                       unsigned int in_len, void *arg) {
+    (void)ssl;
+    const unsigned char *protos = arg;
+    unsigned int protos_len = protos == alpn_h2 ? sizeof(alpn_h2) - 1 : sizeof(alpn_http1) - 1;
+    unsigned char *selected;
+    if (SSL_select_next_proto(&selected, out_len, protos, protos_len, in, in_len) != OPENSSL_NPN_NEGOTIATED)
+        return SSL_TLSEXT_ERR_NOACK;
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+struct tls_context *tls_context_create(const struct server_settings *settings) {
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if (ctx == NULL) {
+        log_tls_errors(LOG_FATAL, "failed to create TLS context");
+        return NULL;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    if (SSL_CTX_use_certificate_chain_file(ctx, settings->tls_cert) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, settings->tls_key, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1) {
+        log_tls_errors(LOG_FATAL, "failed to load TLS certificate or key");
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+
+    // Writes behave like write() on a nonblocking socket: they may complete
+    // partially, and a blocked one is retried from the connection's cursor,
+    // which need not be the same address.
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                              SSL_MODE_RELEASE_BUFFERS);
+    SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF | SSL_OP_CIPHER_SERVER_PREFERENCE);
+
+    // Resumption relies on session tickets only. The workers are forked
+    // after this and inherit the ticket keys, so a ticket issued by one
+    // worker resumes on any other, where a server-side session cache would
+    // be private to each process.
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    if (!settings->tls_session_tickets) {
+        SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+        SSL_CTX_set_num_tickets(ctx, 0);
+    }
+
+    SSL_CTX_set_alpn_select_cb(ctx, select_alpn, (void *)(settings->http2 ? alpn_h2 : alpn_http1));
+
+#ifdef SSL_OP_ENABLE_KTLS
+    if (settings->tls_ktls)
+        SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#else
+    if (settings->tls_ktls)
+        log_msg(LOG_INFO, "OpenSSL was built without kTLS, encrypting in user space");
+#endif
+
+    struct tls_context *context = calloc(1, sizeof(*context));
+    if (context == NULL) {
+        log_msg(LOG_FATAL, "OOM");
+        exit(EXIT_FAILURE);
+    }
+    context->ctx = ctx;
+    return context;
+}
+
+struct tls_conn *tls_conn_create(struct tls_context *context, int fd) {
+    struct tls_conn *conn = calloc(1, sizeof(*conn));
+    if (conn == NULL) {
+        log_msg(LOG_FATAL, "OOM");
+        exit(EXIT_FAILURE);
+    }
+    conn->ssl = SSL_new(context->ctx);
+    if (conn->ssl == NULL || SSL_set_fd(conn->ssl, fd) != 1) {
+        log_tls_errors(LOG_ERROR, "failed to set up TLS connection");
+        SSL_free(conn->ssl);
+        free(conn);
+        return NULL;
+    }
+    SSL_set_accept_state(conn->ssl);
+    return conn;
+}
+
+void tls_conn_free(struct tls_conn *conn) {
+    // Best effort close_notify, the socket is closed right after.
+    if (SSL_is_init_finished(conn->ssl))
+        SSL_shutdown(conn->ssl);
+    SSL_free(conn->ssl);
+    ERR_clear_error();
+    free(conn);
+}
+
+// Maps a failed SSL call to read/write conventions: -1 with EAGAIN when it
+// would block, 0 on a clean close.
+static ssize_t io_result(struct tls_conn *conn, int ret) {
+    if (ret > 0) {
+        conn->want = 0;
+        return ret;
+    }
+    switch (SSL_get_error(conn->ssl, ret)) {
+    case SSL_ERROR_WANT_READ:
+        conn->want = POLLIN;
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_WANT_WRITE:
+        conn->want = POLLOUT;
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_ZERO_RETURN: return 0;
+    case SSL_ERROR_SYSCALL:
+        ERR_clear_error();
+        if (errno == 0)
+            errno = ECONNRESET;
+        return -1;
+    default:
+        log_tls_errors(LOG_INFO, "TLS error");
+        errno = EPROTO;
+        return -1;
+    }
+}
+
+int tls_handshake(struct tls_conn *conn) {
+    errno = 0;
+    ssize_t ret = io_result(conn, SSL_do_handshake(conn->ssl));
+    if (ret == -1 && errno == EAGAIN)
+        return 0;
+    if (ret <= 0)
+        return -1;
+
+    conn->ktls_send = BIO_get_ktls_send(SSL_get_wbio(conn->ssl)) != 0;
+    log_msg(LOG_TRACE, "TLS handshake done: %s, %s, %s", SSL_get_version(conn->ssl),
+            SSL_session_reused(conn->ssl) ? "resumed" : "full", conn->ktls_send ? "kTLS" : "user space");
+    return 1;
+}
+
+ssize_t tls_read(struct tls_conn *conn, void *buf, size_t len) {
+    errno = 0;
+    return io_result(conn, SSL_read(conn->ssl, buf, len > INT_MAX ? INT_MAX : (int)len));
+}
+
+ssize_t tls_write(struct tls_conn *conn, const void *buf, size_t len) {
+    errno = 0;
+    return io_result(conn, SSL_write(conn->ssl, buf, len > INT_MAX ? INT_MAX : (int)len));
+}
+
+bool tls_ktls_send(const struct tls_conn *conn) {
+    return conn->ktls_send;
+}
+
+bool tls_alpn_h2(const struct tls_conn *conn) {
+    const unsigned char *proto;
+    unsigned int len;
+    SSL_get0_alpn_selected(conn->ssl, &proto, &len);
+    return len == 2 && memcmp(proto, "h2", 2) == 0;
+}
+
+short tls_poll_events(const struct tls_conn *conn) {
+    return conn->want;
+}
+
+#else
+
+struct tls_context *tls_context_create(const struct server_settings *settings) {
+    (void)settings;
+    log_msg(LOG_FATAL, "built without TLS support");
+    return NULL;
+}
+
+struct tls_conn *tls_conn_create(struct tls_context *context, int fd) {
+    (void)context, (void)fd;
+    return NULL;
+}
+
+void tls_conn_free(struct tls_conn *conn) {
+    (void)conn;
+}
+
+int tls_handshake(struct tls_conn *conn) {
+    (void)conn;
+    return -1;
+}
+
+ssize_t tls_read(struct tls_conn *conn, void *buf, size_t len) {
+    (void)conn, (void)buf, (void)len;
+    errno = EINVAL;
+    return -1;
+}
+
+ssize_t tls_write(struct tls_conn *conn, const void *buf, size_t len) {
+    (void)conn, (void)buf, (void)len;
+    errno = EINVAL;
+    return -1;
+}
+
+bool tls_ktls_send(const struct tls_conn *conn) {
+    (void)conn;
+    return false;
+}
+
+bool tls_alpn_h2(const struct tls_conn *conn) {
+    (void)conn;
+    return false;
+}
+
+short tls_poll_events(const struct tls_conn *conn) {
+    (void)conn;
+    return 0;
+}
+
+#endif
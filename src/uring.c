@@ -0,0 +1,521 @@
+#include "server.h"
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifdef SYS_openat2
+#include <linux/openat2.h>
+#endif
+
+#ifndef IORING_ACCEPT_MULTISHOT
+#define IORING_ACCEPT_MULTISHOT (1U << 0)
+#endif
+
+typedef char uring_statx_fits[sizeof(struct statx) <= sizeof(struct uring_statx) ? 1 : -1];
+
+// Minimal raw-syscall io_uring wrapper, so that liburing is not a build
+// dependency. Only what the event loop needs is implemented.
+struct uring {
+    int fd;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned sq_pending;
+    struct io_uring_sqe *sqes;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ptr;
+    size_t sq_len;
+    void *cq_ptr;
+    size_t cq_len;
+    size_t sqes_len;
+
+    struct __kernel_timespec timeout;
+
+    // Opcodes the kernel reported, the file and socket calls fall back to
+    // plain syscalls without them.
+    unsigned char supported[IORING_OP_LAST];
+#ifdef SYS_openat2
+    struct open_how *hows; // per submission entry, read by the kernel when it is submitted
+#endif
+
+    // Transfer buffers registered with the kernel, so that reads into them
+    // skip pinning the pages each time.
+    char *buffers;
+    size_t buffer_size;
+    size_t buffer_count;
+    int *free_buffers;
+    size_t free_count;
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// Kernels before 5.6 have no probe, and none of the opcodes asked about.
+static void probe_ops(struct uring *ring) {
+    size_t len = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, len);
+    if (probe == NULL) {
+        log_msg(LOG_FATAL, "OOM");
+        exit(EXIT_FAILURE);
+    }
+    if (sys_io_uring_register(ring->fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0) {
+        for (unsigned i = 0; i < probe->ops_len && i < IORING_OP_LAST; ++i)
+            ring->supported[i] = (probe->ops[i].flags & IO_URING_OP_SUPPORTED) != 0;
+    }
+    free(probe);
+}
+
+static void unmap_rings(struct uring *ring) {
+    if (ring->sqes && ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_ptr && ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr)
+        munmap(ring->cq_ptr, ring->cq_len);
+    if (ring->sq_ptr && ring->sq_ptr != MAP_FAILED)
+        munmap(ring->sq_ptr, ring->sq_len);
+}
+
+struct uring *uring_create(unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = sys_io_uring_setup(entries, &params);
+    if (fd < 0)
+        return NULL;
+
+    struct uring *ring = calloc(1, sizeof(*ring));
+    if (ring == NULL) {
+        close(fd);
+        return NULL;
+    }
+    ring->fd = fd;
+
+    ring->sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_len > ring->sq_len)
+            ring->sq_len = ring->cq_len;
+        ring->cq_len = ring->sq_len;
+    }
+
+    ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED)
+        goto fail;
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ring->cq_ptr =
+            mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED)
+            goto fail;
+    }
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        goto fail;
+
+    char *sq = ring->sq_ptr;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+
+    char *cq = ring->cq_ptr;
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+#ifdef SYS_openat2
+    ring->hows = calloc(params.sq_entries, sizeof(*ring->hows));
+    if (ring->hows == NULL) {
+        log_msg(LOG_FATAL, "OOM");
+        exit(EXIT_FAILURE);
+    }
+#endif
+    probe_ops(ring);
+    return ring;
+
+fail:
+    unmap_rings(ring);
+    close(fd);
+    free(ring);
+    return NULL;
+}
+
+void uring_destroy(struct uring *ring) {
+    unmap_rings(ring);
+    close(ring->fd);
+    if (ring->buffers)
+        munmap(ring->buffers, ring->buffer_size * ring->buffer_count);
+    free(ring->free_buffers);
+#ifdef SYS_openat2
+    free(ring->hows);
+#endif
+    free(ring);
+}
+
+bool uring_register_buffers(struct uring *ring, size_t count, size_t size) {
+    struct iovec *iov = calloc(count, sizeof(*iov));
+    ring->free_buffers = calloc(count, sizeof(*ring->free_buffers));
+    if (iov == NULL || ring->free_buffers == NULL) {
+        log_msg(LOG_FATAL, "OOM");
+        exit(EXIT_FAILURE);
+    }
+    ring->buffers = mmap(NULL, count * size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buffers == MAP_FAILED) {
+        ring->buffers = NULL;
+        free(iov);
+        return false;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        iov[i].iov_base = ring->buffers + i * size;
+        iov[i].iov_len = size;
+    }
+    bool registered = sys_io_uring_register(ring->fd, IORING_REGISTER_BUFFERS, iov, (unsigned)count) == 0;
+    free(iov);
+    if (!registered) {
+        munmap(ring->buffers, count * size);
+        ring->buffers = NULL;
+        return false;
+    }
+    ring->buffer_size = size;
+    ring->buffer_count = count;
+    for (size_t i = 0; i < count; ++i)
+        ring->free_buffers[i] = (int)(count - 1 - i);
+    ring->free_count = count;
+    return true;
+}
+
+char *uring_buffer_get(struct uring *ring, int *index) {
+    if (ring->free_count == 0)
+        return NULL;
+    *index = ring->free_buffers[--ring->free_count];
+    return ring->buffers + (size_t)*index * ring->buffer_size;
+}
+
+void uring_buffer_put(struct uring *ring, int index) {
+    ring->free_buffers[ring->free_count++] = index;
+}
+
+static bool uring_flush(struct uring *ring, unsigned min_complete) {
+    unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+    while (ring->sq_pending || min_complete) {
+        int ret = sys_io_uring_enter(ring->fd, ring->sq_pending, min_complete, flags);
+        if (ret < 0) {
+            if (errno == EINTR && min_complete)
+                return false;
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                continue;
+            return false;
+        }
+        ring->sq_pending = (unsigned)ret >= ring->sq_pending ? 0 : ring->sq_pending - (unsigned)ret;
+        min_complete = 0;
+        flags = 0;
+    }
+    return true;
+}
+
+static struct io_uring_sqe *get_sqe(struct uring *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *ring->sq_tail;
+    if (tail - head >= ring->sq_entries) {
+        if (!uring_flush(ring, 0))
+            return NULL;
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (tail - head >= ring->sq_entries)
+            return NULL;
+    }
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    return sqe;
+}
+
+static void commit_sqe(struct uring *ring) {
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + 1, __ATOMIC_RELEASE);
+    ++ring->sq_pending;
+}
+
+bool uring_prep_poll(struct uring *ring, int fd, short events, uint64_t user_data) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (sqe == NULL)
+        return false;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll_events = (unsigned short)events;
+    sqe->user_data = user_data;
+    commit_sqe(ring);
+    return true;
+}
+
+bool uring_prep_accept(struct uring *ring, int fd, bool multishot, uint64_t user_data) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (sqe == NULL)
+        return false;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    if (multishot)
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = user_data;
+    commit_sqe(ring);
+    return true;
+}
+
+bool uring_prep_timeout(struct uring *ring, unsigned ms, uint64_t user_data) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (sqe == NULL)
+        return false;
+    // The kernel reads the timespec at submission, which happens before the
+    // caller can prepare another timeout.
+    ring->timeout.tv_sec = ms / 1000;
+    ring->timeout.tv_nsec = (long long)(ms % 1000) * 1000000;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)&ring->timeout;
+    sqe->len = 1;
+    sqe->user_data = user_data;
+    commit_sqe(ring);
+    return true;
+}
+
+static struct io_uring_sqe *get_supported_sqe(struct uring *ring, unsigned char opcode) {
+    if (!ring->supported[opcode])
+        return NULL;
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (sqe)
+        sqe->opcode = opcode;
+    return sqe;
+}
+
+bool uring_prep_recv(struct uring *ring, int fd, void *buf, size_t len, uint64_t user_data) {
+    struct io_uring_sqe *sqe = get_supported_sqe(ring, IORING_OP_RECV);
+    if (sqe == NULL)
+        return false;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = (unsigned)len;
+    sqe->user_data = user_data;
+    commit_sqe(ring);
+    return true;
+}
+
+bool uring_prep_send(struct uring *ring, int fd, const void *buf, size_t len, uint64_t user_data) {
+    struct io_uring_sqe *sqe = get_supported_sqe(ring, IORING_OP_SEND);
+    if (sqe == NULL)
+        return false;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = (unsigned)len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = user_data;
+    commit_sqe(ring);
+    return true;
+}
+
+// buf_index is the registered buffer buf lies in, or -1.
+bool uring_prep_read(struct uring *ring, int fd, void *buf, size_t len, uint64_t offset, int buf_index,
+                     uint64_t user_data) {
+    struct io_uring_sqe *sqe = get_supported_sqe(ring, buf_index >= 0 ? IORING_OP_READ_FIXED : IORING_OP_READ);
+    if (sqe == NULL)
+        return false;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = (unsigned)len;
+    sqe->off = offset;
+    if (buf_index >= 0)
+        sqe->buf_index = (unsigned short)buf_index;
+    sqe->user_data = user_data;
+    commit_sqe(ring);
+    return true;
+}
+
+bool uring_prep_openat2(struct uring *ring, int dirfd, const char *path, int flags, uint64_t resolve,
+                        uint64_t user_data) {
+#ifdef SYS_openat2
+    struct io_uring_sqe *sqe = get_supported_sqe(ring, IORING_OP_OPENAT2);
+    if (sqe == NULL)
+        return false;
+    struct open_how *how = &ring->hows[sqe - ring->sqes];
+    memset(how, 0, sizeof(*how));
+    how->flags = (uint64_t)flags;
+    how->resolve = resolve;
+    sqe->fd = dirfd;
+    sqe->addr = (uint64_t)(uintptr_t)path;
+    sqe->len = sizeof(*how);
+    sqe->off = (uint64_t)(uintptr_t)how;
+    sqe->user_data = user_data;
+    commit_sqe(ring);
+    return true;
+#else
+    (void)ring, (void)dirfd, (void)path, (void)flags, (void)resolve, (void)user_data;
+    return false;
+#endif
+}
+
+bool uring_prep_statx(struct uring *ring, int fd, struct uring_statx *buf, uint64_t user_data) {
+    struct io_uring_sqe *sqe = get_supported_sqe(ring, IORING_OP_STATX);
+    if (sqe == NULL)
+        return false;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)"";
+    sqe->len = STATX_BASIC_STATS;
+    sqe->off = (uint64_t)(uintptr_t)buf;
+    sqe->statx_flags = AT_EMPTY_PATH;
+    sqe->user_data = user_data;
+    commit_sqe(ring);
+    return true;
+}
+
+void uring_statx_stat(const struct uring_statx *buf, struct stat *st) {
+    const struct statx *stx = (const struct statx *)buf;
+    memset(st, 0, sizeof(*st));
+    st->st_mode = stx->stx_mode;
+    st->st_size = (off_t)stx->stx_size;
+    st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+    st->st_ino = stx->stx_ino;
+    st->st_mtime = stx->stx_mtime.tv_sec;
+}
+
+bool uring_prep_close(struct uring *ring, int fd, uint64_t user_data) {
+    struct io_uring_sqe *sqe = get_supported_sqe(ring, IORING_OP_CLOSE);
+    if (sqe == NULL)
+        return false;
+    sqe->fd = fd;
+    sqe->user_data = user_data;
+    commit_sqe(ring);
+    return true;
+}
+
+bool uring_submit_and_wait(struct uring *ring) {
+    return uring_flush(ring, 1);
+}
+
+bool uring_next_cqe(struct uring *ring, struct uring_cqe *cqe) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return false;
+    const struct io_uring_cqe *src = &ring->cqes[head & *ring->cq_mask];
+    cqe->user_data = src->user_data;
+    cqe->res = src->res;
+    cqe->more = (src->flags & IORING_CQE_F_MORE) != 0;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+#else
+
+struct uring *uring_create(unsigned entries) {
+    (void)entries;
+    return NULL;
+}
+
+void uring_destroy(struct uring *ring) {
+    (void)ring;
+}
+
+bool uring_prep_poll(struct uring *ring, int fd, short events, uint64_t user_data) {
+    (void)ring, (void)fd, (void)events, (void)user_data;
+    return false;
+}
+
+bool uring_prep_accept(struct uring *ring, int fd, bool multishot, uint64_t user_data) {
+    (void)ring, (void)fd, (void)multishot, (void)user_data;
+    return false;
+}
+
+bool uring_prep_timeout(struct uring *ring, unsigned ms, uint64_t user_data) {
+    (void)ring, (void)ms, (void)user_data;
+    return false;
+}
+
+bool uring_register_buffers(struct uring *ring, size_t count, size_t size) {
+    (void)ring, (void)count, (void)size;
+    return false;
+}
+
+char *uring_buffer_get(struct uring *ring, int *index) {
+    (void)ring, (void)index;
+    return NULL;
+}
+
+void uring_buffer_put(struct uring *ring, int index) {
+    (void)ring, (void)index;
+}
+
+bool uring_prep_recv(struct uring *ring, int fd, void *buf, size_t len, uint64_t user_data) {
+    (void)ring, (void)fd, (void)buf, (void)len, (void)user_data;
+    return false;
+}
+
+bool uring_prep_send(struct uring *ring, int fd, const void *buf, size_t len, uint64_t user_data) {
+    (void)ring, (void)fd, (void)buf, (void)len, (void)user_data;
+    return false;
+}
+
+bool uring_prep_read(struct uring *ring, int fd, void *buf, size_t len, uint64_t offset, int buf_index,
+                     uint64_t user_data) {
+    (void)ring, (void)fd, (void)buf, (void)len, (void)offset, (void)buf_index, (void)user_data;
+    return false;
+}
+
+bool uring_prep_openat2(struct uring *ring, int dirfd, const char *path, int flags, uint64_t resolve,
+                        uint64_t user_data) {
+    (void)ring, (void)dirfd, (void)path, (void)flags, (void)resolve, (void)user_data;
+    return false;
+}
+
+bool uring_prep_statx(struct uring *ring, int fd, struct uring_statx *buf, uint64_t user_data) {
+    (void)ring, (void)fd, (void)buf, (void)user_data;
+    return false;
+}
+
+void uring_statx_stat(const struct uring_statx *buf, struct stat *st) {
+    (void)buf, (void)st;
+}
+
+bool uring_prep_close(struct uring *ring, int fd, uint64_t user_data) {
+    (void)ring, (void)fd, (void)user_data;
+    return false;
+}
+
+bool uring_submit_and_wait(struct uring *ring) {
+    (void)ring;
+    return false;
+}
+
+bool uring_next_cqe(struct uring *ring, struct uring_cqe *cqe) {
+    (void)ring, (void)cqe;
+    return false;
+}
+
+#endif
@@ -0,0 +1,131 @@
+#include "server.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define VHOST_NAME_MAX 253
+
+struct vhost_slot {
+    const char *name; // NULL marks a free slot
+    size_t len;
+    bool wildcard; // name is what follows the "*."
+    struct vhost *vhost;
+};
+
+// Per worker, built at start from the vhost settings, which only change on
+// restart. A host is looked up by its name, then by every suffix after a
+// dot among the wildcards, so a lookup costs a few probes however many
+// sites there are.
+struct vhost_table {
+    size_t mask;
+    struct vhost *vhosts;
+    struct vhost_slot slots[];
+};
+
+static uint64_t name_hash(const char *name, size_t len, bool wildcard) {
+    uint64_t h = wildcard ? 1099511628211ull : 14695981039346656037ull;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= (unsigned char)name[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+// The slot holding name, or the free slot it would go in.
+static struct vhost_slot *find_slot(struct vhost_table *table, const char *name, size_t len, bool wildcard) {
+    size_t i = name_hash(name, len, wildcard) & table->mask;
+    for (;; i = (i + 1) & table->mask) {
+        struct vhost_slot *slot = &table->slots[i];
+        if (slot->name == NULL ||
+            (slot->wildcard == wildcard && slot->len == len && memcmp(slot->name, name, len) == 0))
+            return slot;
+    }
+}
+
+struct vhost_table *vhost_table_create(const struct server_settings *settings) {
+    size_t slots = 8;
+    while (slots < settings->vhost_count * 2)
+        slots <<= 1;
+    struct vhost_table *table = calloc(1, sizeof(*table) + slots * sizeof(table->slots[0]));
+    struct vhost *vhosts = calloc(settings->vhost_count, sizeof(*vhosts));
+    if (table == NULL || vhosts == NULL) {
+        log_msg(LOG_FATAL, "OOM");
+        exit(EXIT_FAILURE);
+    }
+    table->mask = slots - 1;
+    table->vhosts = vhosts;
+
+    for (size_t i = 0; i < settings->vhost_count; ++i) {
+        const struct vhost_settings *vs = &settings->vhosts[i];
+        struct vhost *vhost = &vhosts[i];
+        vhost->settings = vs;
+        vhost->root = static_root_open(vs->root);
+        if (vhost->root == NULL)
+            exit(EXIT_FAILURE);
+        vhost->path_cache = path_cache_create(vs->path_cache_size ? vs->path_cache_size : settings->path_cache_size);
+
+        bool wildcard = strncmp(vs->name, "*.", 2) == 0;
+        const char *name = wildcard ? vs->name + 2 : vs->name;
+        struct vhost_slot *slot = find_slot(table, name, strlen(name), wildcard);
+        slot->name = name;
+        slot->len = strlen(name);
+        slot->wildcard = wildcard;
+        slot->vhost = vhost;
+    }
+    return table;
+}
+
+// host is the Host header or :authority as sent. Names are matched without
+// the port and a trailing dot, ignoring case. The most specific wildcard
+// wins, and anything unmatched goes to static_dir.
+struct vhost *vhost_find(struct worker *worker, const char *host, size_t len) {
+    if (worker->vhosts == NULL || host == NULL)
+        return &worker->site;
+    const char *end = host + len;
+    if (len && host[0] == '[') {
+        const char *bracket = memchr(host, ']', len);
+        if (bracket)
+            end = bracket + 1;
+    } else {
+        const char *colon = memchr(host, ':', len);
+        if (colon)
+            end = colon;
+    }
+    if (end > host && end[-1] == '.')
+        --end;
+    len = end - host;
+    if (len == 0 || len > VHOST_NAME_MAX)
+        return &worker->site;
+
+    char name[VHOST_NAME_MAX];
+    for (size_t i = 0; i < len; ++i)
+        name[i] = host[i] >= 'A' && host[i] <= 'Z' ? host[i] - 'A' + 'a' : host[i];
+    struct vhost_slot *slot = find_slot(worker->vhosts, name, len, false);
+    if (slot->name)
+        return slot->vhost;
+    for (const char *dot = memchr(name, '.', len); dot; dot = memchr(dot + 1, '.', name + len - dot - 1)) {
+        slot = find_slot(worker->vhosts, dot + 1, name + len - dot - 1, true);
+        if (slot->name)
+            return slot->vhost;
+    }
+    return &worker->site;
+}
+
+bool vhost_autoindex(const struct worker *worker, const struct vhost *vhost) {
+    if (vhost->settings && vhost->settings->autoindex != -1)
+        return vhost->settings->autoindex;
+    return worker->settings->autoindex;
+}
+
+// Only reads the settings, so it is safe on I/O threads.
+enum http_content_type vhost_content_type(const struct vhost_settings *settings, const char *path) {
+    const char *ext = strrchr(path, '.');
+    if (settings && ext && strchr(ext, '/') == NULL) {
+        for (size_t i = 0; i < settings->type_count; ++i) {
+            if (strcasecmp(settings->types[i].ext, ext + 1) == 0)
+                return settings->types[i].ct;
+        }
+    }
+    return http_conten_type_from_filename(path);
+}
@@ -0,0 +1,389 @@
+// Packs a static directory into a single file for the server's asset_pack
+// setting.
+//
+// Every regular file becomes an entry under its path relative to the
+// directory. A foo.br or foo.gz next to foo is stored as a precompressed
+// variant of foo instead, and a directory's index.html is listed under the
+// directory path as well. The pack is written next to the output and renamed
+// into place, so a running server keeps its mapping of the old one.
+//
+// usage: asset_pack <dir> <out.pack>
+
+#include "mime_hash.h"
+#include "mime_types.h"
+#include "pack_format.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct file {
+    char *path; // as served, starting with '/'
+    char *source;
+    uint64_t size;
+    int64_t mtime;
+    uint64_t offset; // in the pack
+    uint64_t etag;   // string table offset
+    enum http_content_type ct;
+};
+
+// One entry of the index. Aliases point at the same file as the index.html
+// they stand for.
+struct item {
+    char *path;
+    size_t file;
+    size_t variants[PACK_VARIANTS]; // file indexes, SIZE_MAX when absent
+};
+
+static struct file *files;
+static size_t file_count, file_cap;
+static struct item *items;
+static size_t item_count, item_cap;
+
+static void *xrealloc(void *memory, size_t size) {
+    void *result = realloc(memory, size);
+    if (result == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    return result;
+}
+
+static char *xstrdup(const char *src) {
+    size_t len = strlen(src) + 1;
+    char *copy = xrealloc(NULL, len);
+    memcpy(copy, src, len);
+    return copy;
+}
+
+static char *join(const char *a, const char *b) {
+    size_t a_len = strlen(a), b_len = strlen(b);
+    char *joined = xrealloc(NULL, a_len + b_len + 2);
+    memcpy(joined, a, a_len);
+    joined[a_len] = '/';
+    memcpy(joined + a_len + 1, b, b_len + 1);
+    return joined;
+}
+
+static enum http_content_type content_type(const char *path) {
+    const char *ext = strrchr(path, '.');
+    if (ext == NULL || strchr(ext, '/'))
+        return HTTP_CT_BIN;
+    ++ext;
+    char lower[MIME_EXT_MAX];
+    size_t len = 0;
+    for (; ext[len]; ++len) {
+        if (len == MIME_EXT_MAX)
+            return HTTP_CT_BIN;
+        lower[len] = mime_lower(ext[len]);
+    }
+    const struct mime_slot *slot = &mime_slots[mime_hash(lower, len, mime_hash_seed) & mime_hash_mask];
+    if (len == 0 || slot->len != len || memcmp(slot->ext, lower, len) != 0)
+        return HTTP_CT_BIN;
+    return slot->type;
+}
+
+// Symlinks to files are followed, symlinked directories are skipped so that
+// the walk cannot loop.
+static bool collect(const char *dir, const char *prefix) {
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        perror(dir);
+        return false;
+    }
+    struct dirent *ent;
+    bool ok = true;
+    while (ok && (ent = readdir(d)) != NULL) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+            continue;
+        char *source = join(dir, ent->d_name);
+        char *path = join(prefix, ent->d_name);
+        struct stat lst, st;
+        if (lstat(source, &lst) == -1 || stat(source, &st) == -1) {
+            perror(source);
+            ok = false;
+        } else if (S_ISDIR(st.st_mode) && !S_ISLNK(lst.st_mode)) {
+            ok = collect(source, path);
+        } else if (S_ISREG(st.st_mode)) {
+            if (file_count == file_cap) {
+                file_cap = file_cap ? file_cap * 2 : 256;
+                files = xrealloc(files, file_cap * sizeof(*files));
+            }
+            struct file *file = &files[file_count++];
+            memset(file, 0, sizeof(*file));
+            file->path = path;
+            file->source = source;
+            file->size = (uint64_t)st.st_size;
+            file->mtime = (int64_t)st.st_mtime;
+            file->ct = content_type(path);
+            continue;
+        } else {
+            fprintf(stderr, "skipping %s\n", source);
+        }
+        free(source);
+        free(path);
+    }
+    closedir(d);
+    return ok;
+}
+
+static int compare_files(const void *a, const void *b) {
+    return strcmp(((const struct file *)a)->path, ((const struct file *)b)->path);
+}
+
+static int compare_items(const void *a, const void *b) {
+    return strcmp(((const struct item *)a)->path, ((const struct item *)b)->path);
+}
+
+static size_t find_file(const char *path) {
+    struct file key = {.path = (char *)path};
+    struct file *found = bsearch(&key, files, file_count, sizeof(*files), compare_files);
+    return found ? (size_t)(found - files) : SIZE_MAX;
+}
+
+static size_t variant_of(const char *path, const char *suffix) {
+    size_t path_len = strlen(path), suffix_len = strlen(suffix);
+    if (path_len <= suffix_len || strcmp(path + path_len - suffix_len, suffix) != 0)
+        return SIZE_MAX;
+    char *base = xrealloc(NULL, path_len - suffix_len + 1);
+    memcpy(base, path, path_len - suffix_len);
+    base[path_len - suffix_len] = '\0';
+    size_t found = find_file(base);
+    free(base);
+    return found;
+}
+
+static void add_item(char *path, const struct item *target) {
+    if (item_count == item_cap) {
+        item_cap = item_cap ? item_cap * 2 : 256;
+        items = xrealloc(items, item_cap * sizeof(*items));
+    }
+    items[item_count] = *target;
+    items[item_count].path = path;
+    ++item_count;
+}
+
+static void build_items(void) {
+    static const char *const suffixes[PACK_VARIANTS] = {NULL, ".br", ".gz"};
+    for (size_t i = 0; i < file_count; ++i) {
+        const char *path = files[i].path;
+        if (variant_of(path, ".br") != SIZE_MAX || variant_of(path, ".gz") != SIZE_MAX)
+            continue;
+
+        struct item item = {NULL, i, {i, SIZE_MAX, SIZE_MAX}};
+        for (size_t v = 1; v < PACK_VARIANTS; ++v) {
+            char *name = xrealloc(NULL, strlen(path) + 4);
+            sprintf(name, "%s%s", path, suffixes[v]);
+            item.variants[v] = find_file(name);
+            free(name);
+        }
+        add_item(xstrdup(path), &item);
+
+        static const char index_name[] = "index.html";
+        size_t len = strlen(path);
+        if (len < sizeof(index_name) || strcmp(path + len - (sizeof(index_name) - 1), index_name) != 0 ||
+            path[len - sizeof(index_name)] != '/')
+            continue;
+        size_t dir_len = len - (sizeof(index_name) - 1);
+        char *dir = xstrdup(path);
+        dir[dir_len] = '\0';
+        add_item(dir, &item);
+        if (dir_len > 1) {
+            char *bare = xstrdup(dir);
+            bare[dir_len - 1] = '\0';
+            add_item(bare, &item);
+        }
+    }
+    qsort(items, item_count, sizeof(*items), compare_items);
+}
+
+struct strings {
+    char *data;
+    size_t len, cap;
+};
+
+static uint64_t put_string(struct strings *s, const char *str, size_t len) {
+    if (s->len + len + 1 > s->cap) {
+        while (s->len + len + 1 > s->cap)
+            s->cap = s->cap ? s->cap * 2 : 4096;
+        s->data = xrealloc(s->data, s->cap);
+    }
+    uint64_t offset = s->len;
+    memcpy(s->data + s->len, str, len);
+    s->data[s->len + len] = '\0';
+    s->len += len + 1;
+    return offset;
+}
+
+static bool write_all(int fd, const void *data, size_t len, uint64_t offset) {
+    const char *p = data;
+    while (len) {
+        ssize_t n = pwrite(fd, p, len, (off_t)offset);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1)
+            return false;
+        p += n;
+        len -= (size_t)n;
+        offset += (uint64_t)n;
+    }
+    return true;
+}
+
+// Copies the file to offset and returns the FNV-1a hash of its contents
+// through hash. A file that changes size while packed fails the build.
+static bool copy_file(int out, const struct file *file, uint64_t *hash) {
+    int fd = open(file->source, O_RDONLY);
+    if (fd == -1) {
+        perror(file->source);
+        return false;
+    }
+    static char buf[1 << 16];
+    uint64_t h = 14695981039346656037ull;
+    uint64_t copied = 0;
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        for (ssize_t i = 0; i < n; ++i) {
+            h ^= (unsigned char)buf[i];
+            h *= 1099511628211ull;
+        }
+        if (copied + (uint64_t)n > file->size || !write_all(out, buf, (size_t)n, file->offset + copied)) {
+            n = -1;
+            break;
+        }
+        copied += (uint64_t)n;
+    }
+    close(fd);
+    if (n == -1 || copied != file->size) {
+        fprintf(stderr, "%s: changed or unreadable while packing\n", file->source);
+        return false;
+    }
+    *hash = h;
+    return true;
+}
+
+static uint64_t align(uint64_t offset, uint64_t to) {
+    return (offset + to - 1) & ~(to - 1);
+}
+
+static bool write_pack(const char *filename) {
+    // Paths, one copy of every content type used, and the ETags, which are
+    // filled in once the contents are hashed.
+    struct strings strings = {0};
+    uint64_t type_offsets[HTTP_CT_COUNT];
+    bool type_stored[HTTP_CT_COUNT] = {false};
+    char placeholder[PACK_ETAG_LEN];
+    memset(placeholder, '0', sizeof(placeholder));
+    for (size_t i = 0; i < file_count; ++i) {
+        files[i].etag = put_string(&strings, placeholder, PACK_ETAG_LEN);
+        if (!type_stored[files[i].ct]) {
+            const char *type = mime_type_strs[files[i].ct];
+            type_offsets[files[i].ct] = put_string(&strings, type, strlen(type));
+            type_stored[files[i].ct] = true;
+        }
+    }
+
+    struct pack_entry *entries = calloc(item_count ? item_count : 1, sizeof(*entries));
+    if (entries == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return false;
+    }
+    for (size_t i = 0; i < item_count; ++i) {
+        entries[i].path_len = strlen(items[i].path);
+        entries[i].path = put_string(&strings, items[i].path, entries[i].path_len);
+    }
+
+    struct pack_header header = {0};
+    memcpy(header.magic, PACK_MAGIC, sizeof(PACK_MAGIC));
+    header.version = PACK_VERSION;
+    header.entry_size = sizeof(struct pack_entry);
+    header.entry_count = item_count;
+    header.entries = align(sizeof(header), 8);
+    header.strings = header.entries + item_count * sizeof(struct pack_entry);
+    header.strings_size = strings.len;
+
+    uint64_t cursor = align(header.strings + strings.len, PACK_PAGE);
+    for (size_t i = 0; i < file_count; ++i) {
+        files[i].offset = align(cursor, files[i].size >= PACK_PAGE ? PACK_PAGE : 16);
+        cursor = files[i].offset + files[i].size;
+    }
+    header.size = cursor;
+
+    char *tmp = xrealloc(NULL, strlen(filename) + 5);
+    sprintf(tmp, "%s.tmp", filename);
+    int out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out == -1) {
+        perror(tmp);
+        free(tmp);
+        free(entries);
+        return false;
+    }
+
+    bool ok = true;
+    for (size_t i = 0; ok && i < file_count; ++i) {
+        uint64_t hash;
+        ok = copy_file(out, &files[i], &hash);
+        if (ok) {
+            char etag[PACK_ETAG_LEN + 1];
+            snprintf(etag, sizeof(etag), "%016llx", (unsigned long long)hash);
+            memcpy(strings.data + files[i].etag, etag, PACK_ETAG_LEN);
+        }
+    }
+
+    for (size_t i = 0; ok && i < item_count; ++i) {
+        const struct file *file = &files[items[i].file];
+        struct pack_entry *entry = &entries[i];
+        entry->content_type = type_offsets[file->ct];
+        entry->etag = file->etag;
+        entry->mtime = file->mtime;
+        for (size_t v = 0; v < PACK_VARIANTS; ++v) {
+            if (items[i].variants[v] == SIZE_MAX)
+                continue;
+            const struct file *variant = &files[items[i].variants[v]];
+            entry->blobs[v].offset = variant->offset;
+            entry->blobs[v].length = variant->size;
+        }
+    }
+
+    if (ok && !(ftruncate(out, (off_t)header.size) == 0 &&
+                write_all(out, entries, item_count * sizeof(*entries), header.entries) &&
+                write_all(out, strings.data, strings.len, header.strings) &&
+                write_all(out, &header, sizeof(header), 0) && fsync(out) == 0)) {
+        perror(tmp);
+        ok = false;
+    }
+    if (close(out) == -1)
+        ok = false;
+    if (ok && rename(tmp, filename) == -1) {
+        perror(filename);
+        ok = false;
+    }
+    if (!ok)
+        unlink(tmp);
+    free(tmp);
+    free(entries);
+    free(strings.data);
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <dir> <out.pack>\n", argv[0]);
+        return 1;
+    }
+    if (!collect(argv[1], ""))
+        return 1;
+    qsort(files, file_count, sizeof(*files), compare_files);
+    build_items();
+    if (!write_pack(argv[2]))
+        return 1;
+
+    printf("packed %zu files as %zu entries into %s\n", file_count, item_count, argv[2]);
+    return 0;
+}
@@ -0,0 +1,232 @@
+// Build time generator for the MIME type table.
+//
+// Reads src/mime.types and emits a header with enum http_content_type and a
+// source file with a collision-free hash table over the extensions plus the
+// preformatted Content-Type header lines.
+//
+// usage: mime_gen <mime.types> <out.h> <out.c>
+
+#include "mime_hash.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_TYPES 255
+#define MAX_EXTS 1024
+#define MAX_SEED_TRIES 1000000u
+
+struct mime_type_entry {
+    char name[64];
+    char type[128];
+};
+
+struct mime_ext_entry {
+    char ext[MIME_EXT_MAX + 1];
+    size_t len;
+    int type;
+};
+
+static struct mime_type_entry types[MAX_TYPES];
+static size_t type_count;
+static struct mime_ext_entry exts[MAX_EXTS];
+static size_t ext_count;
+
+static const char *charset_suffix(const char *type) {
+    static const char utf8[] = "; charset=utf-8";
+    if (strncmp(type, "text/", 5) == 0)
+        return utf8;
+    if (strcmp(type, "application/json") == 0 || strcmp(type, "application/xml") == 0)
+        return utf8;
+    size_t len = strlen(type);
+    if (len > 5 && (strcmp(type + len - 5, "+json") == 0 || strcmp(type + len - 4, "+xml") == 0))
+        return utf8;
+    return "";
+}
+
+static bool parse_table(const char *filename) {
+    FILE *f = fopen(filename, "r");
+    if (f == NULL) {
+        perror(filename);
+        return false;
+    }
+
+    char line[1024];
+    int lineno = 0;
+    while (fgets(line, sizeof(line), f)) {
+        ++lineno;
+        char *hash = strchr(line, '#');
+        if (hash)
+            *hash = '\0';
+
+        char *tok = strtok(line, " \t\r\n");
+        if (tok == NULL)
+            continue;
+        if (type_count == MAX_TYPES) {
+            fprintf(stderr, "%s:%d: too many types\n", filename, lineno);
+            goto fail;
+        }
+        struct mime_type_entry *entry = &types[type_count];
+        snprintf(entry->name, sizeof(entry->name), "%s", tok);
+
+        tok = strtok(NULL, " \t\r\n");
+        if (tok == NULL) {
+            fprintf(stderr, "%s:%d: missing type for %s\n", filename, lineno, entry->name);
+            goto fail;
+        }
+        snprintf(entry->type, sizeof(entry->type), "%s", tok);
+
+        for (size_t i = 0; i < type_count; ++i) {
+            if (strcmp(types[i].name, entry->name) == 0) {
+                fprintf(stderr, "%s:%d: duplicate name %s\n", filename, lineno, entry->name);
+                goto fail;
+            }
+        }
+
+        while ((tok = strtok(NULL, " \t\r\n")) != NULL) {
+            size_t len = strlen(tok);
+            if (len == 0 || len > MIME_EXT_MAX) {
+                fprintf(stderr, "%s:%d: extension '%s' longer than %d\n", filename, lineno, tok, MIME_EXT_MAX);
+                goto fail;
+            }
+            if (ext_count == MAX_EXTS) {
+                fprintf(stderr, "%s:%d: too many extensions\n", filename, lineno);
+                goto fail;
+            }
+            struct mime_ext_entry *ext = &exts[ext_count];
+            for (size_t i = 0; i < len; ++i)
+                ext->ext[i] = mime_lower(tok[i]);
+            ext->len = len;
+            ext->type = (int)type_count;
+            for (size_t i = 0; i < ext_count; ++i) {
+                if (exts[i].len == len && memcmp(exts[i].ext, ext->ext, len) == 0) {
+                    fprintf(stderr, "%s:%d: duplicate extension %s\n", filename, lineno, tok);
+                    goto fail;
+                }
+            }
+            ++ext_count;
+        }
+        ++type_count;
+    }
+    fclose(f);
+
+    if (type_count == 0) {
+        fprintf(stderr, "%s: no types defined\n", filename);
+        return false;
+    }
+    return true;
+
+fail:
+    fclose(f);
+    return false;
+}
+
+static bool find_seed(size_t slot_count, uint32_t *seed_p) {
+    unsigned char *used = malloc(slot_count);
+    if (used == NULL)
+        return false;
+
+    for (uint32_t seed = 1; seed < MAX_SEED_TRIES; ++seed) {
+        memset(used, 0, slot_count);
+        bool ok = true;
+        for (size_t i = 0; i < ext_count && ok; ++i) {
+            uint32_t slot = mime_hash(exts[i].ext, exts[i].len, seed) & (slot_count - 1);
+            if (used[slot])
+                ok = false;
+            used[slot] = 1;
+        }
+        if (ok) {
+            free(used);
+            *seed_p = seed;
+            return true;
+        }
+    }
+    free(used);
+    return false;
+}
+
+static bool write_header(const char *filename) {
+    FILE *f = fopen(filename, "w");
+    if (f == NULL) {
+        perror(filename);
+        return false;
+    }
+    fprintf(f, "// generated by tools/mime_gen.c from src/mime.types, do not edit\n");
+    fprintf(f, "#ifndef MIME_TYPES_H\n#define MIME_TYPES_H\n\n");
+    fprintf(f, "enum http_content_type {\n");
+    for (size_t i = 0; i < type_count; ++i)
+        fprintf(f, "    HTTP_CT_%s, // %s\n", types[i].name, types[i].type);
+    fprintf(f, "    HTTP_CT_COUNT\n};\n\n#endif\n");
+    return fclose(f) == 0;
+}
+
+static bool write_source(const char *filename, size_t slot_count, uint32_t seed) {
+    struct mime_ext_entry **slots = calloc(slot_count, sizeof(*slots));
+    if (slots == NULL)
+        return false;
+    for (size_t i = 0; i < ext_count; ++i)
+        slots[mime_hash(exts[i].ext, exts[i].len, seed) & (slot_count - 1)] = &exts[i];
+
+    FILE *f = fopen(filename, "w");
+    if (f == NULL) {
+        perror(filename);
+        free(slots);
+        return false;
+    }
+    fprintf(f, "// generated by tools/mime_gen.c from src/mime.types, do not edit\n");
+    fprintf(f, "#include \"server.h\"\n#include \"mime_hash.h\"\n\n");
+    fprintf(f, "const uint32_t mime_hash_seed = %uu;\n", seed);
+    fprintf(f, "const uint32_t mime_hash_mask = %zuu;\n\n", slot_count - 1);
+
+    fprintf(f, "const char *const mime_type_strs[HTTP_CT_COUNT] = {\n");
+    for (size_t i = 0; i < type_count; ++i)
+        fprintf(f, "    \"%s%s\",\n", types[i].type, charset_suffix(types[i].type));
+    fprintf(f, "};\n\n");
+
+    fprintf(f, "const struct mime_header_line mime_header_lines[HTTP_CT_COUNT] = {\n");
+    for (size_t i = 0; i < type_count; ++i) {
+        const char *suffix = charset_suffix(types[i].type);
+        size_t len = strlen("Content-Type: \r\n") + strlen(types[i].type) + strlen(suffix);
+        fprintf(f, "    {\"Content-Type: %s%s\\r\\n\", %zu},\n", types[i].type, suffix, len);
+    }
+    fprintf(f, "};\n\n");
+
+    fprintf(f, "const struct mime_slot mime_slots[%zu] = {\n", slot_count);
+    for (size_t i = 0; i < slot_count; ++i) {
+        if (slots[i] == NULL)
+            continue;
+        fprintf(f, "    [%zu] = {\"%.*s\", %zu, HTTP_CT_%s},\n", i, (int)slots[i]->len, slots[i]->ext, slots[i]->len,
+                types[slots[i]->type].name);
+    }
+    fprintf(f, "};\n");
+    free(slots);
+    return fclose(f) == 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 4) {
+        fprintf(stderr, "usage: %s <mime.types> <out.h> <out.c>\n", argv[0]);
+        return 1;
+    }
+    if (!parse_table(argv[1]))
+        return 1;
+
+    // Start at a load factor of at most 1/2 and grow until a seed is found.
+    size_t slot_count = 16;
+    while (slot_count < ext_count * 2)
+        slot_count <<= 1;
+
+    uint32_t seed = 0;
+    while (!find_seed(slot_count, &seed)) {
+        slot_count <<= 1;
+        if (slot_count > (1u << 16)) {
+            fprintf(stderr, "failed to find a perfect hash for %zu extensions\n", ext_count);
+            return 1;
+        }
+    }
+
+    if (!write_header(argv[2]) || !write_source(argv[3], slot_count, seed))
+        return 1;
+    return 0;
+}
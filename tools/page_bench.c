@@ -0,0 +1,184 @@
+// Measures what huge_pages and numa_local do for the regions page_alloc
+// backs. A region is filled in and then walked in random order one cache
+// line at a time, the way probes land in the cache tables and arena blocks
+// of a busy worker, once for each huge_pages mode. Reports the time to fill
+// the region, the time and dTLB misses per access, and the access rate.
+//
+//   page_bench [-s MiB] [-n accesses] [-N]
+//
+// -N prefers the NUMA node the benchmark starts on, as numa_local does. The
+// "on" mode needs reserved pages, see /proc/sys/vm/nr_hugepages.
+
+#include "log.h"
+#include "page_alloc.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#define LINE 64
+
+// page_alloc logs through these, the server's versions need its settings.
+void log_msg(enum log_level level, const char *fmt, ...) {
+    (void)level;
+    va_list args;
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    fputc('\n', stderr);
+}
+
+void log_perror(enum log_level level, const char *fmt, ...) {
+    (void)level;
+    int err = errno;
+    va_list args;
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    fprintf(stderr, ": %s\n", strerror(err));
+}
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// dTLB read misses of this thread, -1 where perf is not available.
+static int open_tlb_counter(void) {
+#if defined(__linux__) && defined(SYS_perf_event_open)
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+    return -1;
+#endif
+}
+
+static void start_counter(int fd) {
+#ifdef __linux__
+    if (fd != -1) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#else
+    (void)fd;
+#endif
+}
+
+static long long stop_counter(int fd) {
+    long long count = -1;
+#ifdef __linux__
+    if (fd != -1) {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &count, sizeof(count)) != sizeof(count))
+            count = -1;
+    }
+#else
+    (void)fd;
+#endif
+    return count;
+}
+
+static uint64_t next_random(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+// Links every line of the region into one cycle in random order, so the
+// walk cannot be prefetched and touches all of it.
+static void link_lines(char *region, size_t lines) {
+    size_t *order = malloc(lines * sizeof(*order));
+    if (order == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < lines; ++i)
+        order[i] = i;
+    uint64_t state = 88172645463325252ull;
+    for (size_t i = lines - 1; i > 0; --i) {
+        size_t j = next_random(&state) % i;
+        size_t tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+    for (size_t i = 0; i < lines; ++i)
+        *(size_t *)(region + order[i] * LINE) = order[(i + 1) % lines];
+    free(order);
+}
+
+static void run(enum huge_pages mode, const char *name, size_t size, size_t accesses, bool numa, int counter) {
+    page_alloc_init(mode, numa);
+
+    double start = now_s();
+    char *region = page_alloc(size, false);
+    size_t lines = size / LINE;
+    link_lines(region, lines);
+    double filled = now_s() - start;
+
+    size_t line = 0;
+    start_counter(counter);
+    start = now_s();
+    for (size_t i = 0; i < accesses; ++i)
+        line = *(volatile size_t *)(region + line * LINE);
+    double walked = now_s() - start;
+    long long misses = stop_counter(counter);
+
+    char miss_str[32] = "-";
+    if (misses >= 0)
+        snprintf(miss_str, sizeof(miss_str), "%.3f", (double)misses / (double)accesses);
+    printf("%-6s %10.1f %12.2f %12s %12.1f\n", name, filled * 1e3, walked * 1e9 / (double)accesses, miss_str,
+           (double)accesses / walked / 1e6);
+    page_free(region, size);
+}
+
+int main(int argc, char **argv) {
+    size_t size = (size_t)256 << 20;
+    size_t accesses = 20 * 1000 * 1000;
+    bool numa = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:n:N")) != -1) {
+        switch (opt) {
+        case 's': size = strtoull(optarg, NULL, 10) << 20; break;
+        case 'n': accesses = strtoull(optarg, NULL, 10); break;
+        case 'N': numa = true; break;
+        default: fprintf(stderr, "usage: %s [-s MiB] [-n accesses] [-N]\n", argv[0]); return EXIT_FAILURE;
+        }
+    }
+    if (size < LINE * 2 || accesses == 0) {
+        fprintf(stderr, "region and access count must not be empty\n");
+        return EXIT_FAILURE;
+    }
+
+    int counter = open_tlb_counter();
+    if (counter == -1)
+        fprintf(stderr, "dTLB misses unavailable, perf_event_open failed\n");
+    printf("%zu MiB region, %zu random accesses%s\n", size >> 20, accesses, numa ? ", local NUMA node" : "");
+    printf("%-6s %10s %12s %12s %12s\n", "pages", "fill ms", "ns/access", "dTLB/access", "M access/s");
+    run(HUGE_PAGES_OFF, "off", size, accesses, numa, counter);
+    run(HUGE_PAGES_THP, "thp", size, accesses, numa, counter);
+    run(HUGE_PAGES_ON, "on", size, accesses, numa, counter);
+    if (counter != -1)
+        close(counter);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,459 @@
+// Replays request heads recorded by the server's capture setting against a
+// server, to benchmark builds with the traffic they actually see.
+//
+// Each head is sent on a connection of its own and the response is read
+// until the server closes it. At the default speed of 1 requests start at
+// their captured offsets, -s 2 starts them twice as fast, and -s 0 sends
+// them back to back with -c connections in flight. Heads captured on tls
+// listeners are sent in plaintext.
+//
+// The summary reports throughput and latency percentiles. -o saves it, and
+// -b compares the run against a summary saved from another build.
+//
+// usage: replay [-t host:port | -u socket] [-s speed] [-c connections] [-o summary] [-b baseline] capture...
+
+#include "capture_format.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define REQUEST_TIMEOUT_NS (10 * 1000000000ull)
+
+struct request {
+    uint64_t offset_ns; // from the first captured request
+    char *head;
+    uint32_t head_len;
+};
+
+struct slot {
+    int fd; // -1 when free
+    const struct request *request;
+    size_t sent;
+    uint64_t started_ns;
+    uint64_t first_byte_ns;
+    uint64_t bytes;
+    char status[13]; // "HTTP/1.1 200"
+    size_t status_len;
+};
+
+struct summary {
+    double requests;
+    double errors;
+    double seconds;
+    double rps;
+    double mib_per_s;
+    double p50_ms;
+    double p90_ms;
+    double p99_ms;
+    double max_ms;
+    double ttfb_p50_ms;
+    double status_2xx;
+    double status_3xx;
+    double status_4xx;
+    double status_5xx;
+};
+
+// Names and order of the summary as it is printed, saved and compared.
+static const struct {
+    const char *name;
+    size_t offset;
+    bool lower_is_better;
+} summary_fields[] = {
+    {"requests", offsetof(struct summary, requests), false},
+    {"errors", offsetof(struct summary, errors), true},
+    {"seconds", offsetof(struct summary, seconds), true},
+    {"rps", offsetof(struct summary, rps), false},
+    {"mib_per_s", offsetof(struct summary, mib_per_s), false},
+    {"p50_ms", offsetof(struct summary, p50_ms), true},
+    {"p90_ms", offsetof(struct summary, p90_ms), true},
+    {"p99_ms", offsetof(struct summary, p99_ms), true},
+    {"max_ms", offsetof(struct summary, max_ms), true},
+    {"ttfb_p50_ms", offsetof(struct summary, ttfb_p50_ms), true},
+    {"status_2xx", offsetof(struct summary, status_2xx), false},
+    {"status_3xx", offsetof(struct summary, status_3xx), false},
+    {"status_4xx", offsetof(struct summary, status_4xx), true},
+    {"status_5xx", offsetof(struct summary, status_5xx), true},
+};
+
+#define SUMMARY_FIELDS (sizeof(summary_fields) / sizeof(summary_fields[0]))
+
+static struct request *requests;
+static size_t request_count, request_capacity;
+
+static struct sockaddr_storage target;
+static socklen_t target_len;
+
+static uint64_t *latencies, *ttfbs;
+static size_t completed;
+static uint64_t errors, bytes_read, status_classes[6];
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static bool load_capture(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return false;
+    }
+    struct capture_header header;
+    if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, CAPTURE_MAGIC, 8) != 0 ||
+        header.version != CAPTURE_VERSION || header.record_size != sizeof(struct capture_record)) {
+        fprintf(stderr, "%s is not a capture of this server version\n", path);
+        fclose(f);
+        return false;
+    }
+    struct capture_record record;
+    while (fread(&record, sizeof(record), 1, f) == 1) {
+        char *head = malloc(record.head_len);
+        if (head == NULL || fread(head, 1, record.head_len, f) != record.head_len) {
+            fprintf(stderr, "%s is truncated\n", path);
+            free(head);
+            break;
+        }
+        if (request_count == request_capacity) {
+            request_capacity = request_capacity ? request_capacity * 2 : 1024;
+            requests = realloc(requests, request_capacity * sizeof(*requests));
+            if (requests == NULL) {
+                fprintf(stderr, "out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        requests[request_count++] = (struct request){record.time_ns, head, record.head_len};
+    }
+    fclose(f);
+    return true;
+}
+
+static int compare_offsets(const void *a, const void *b) {
+    const struct request *x = a, *y = b;
+    return x->offset_ns < y->offset_ns ? -1 : x->offset_ns > y->offset_ns;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static bool parse_target(const char *host_port, const char *unix_path) {
+    if (unix_path) {
+        struct sockaddr_un *addr = (struct sockaddr_un *)&target;
+        if (strlen(unix_path) >= sizeof(addr->sun_path))
+            return false;
+        addr->sun_family = AF_UNIX;
+        strcpy(addr->sun_path, unix_path);
+        target_len = sizeof(*addr);
+        return true;
+    }
+    char host[256];
+    const char *colon = strrchr(host_port, ':');
+    if (colon == NULL || (size_t)(colon - host_port) >= sizeof(host))
+        return false;
+    memcpy(host, host_port, colon - host_port);
+    host[colon - host_port] = '\0';
+    char *h = host;
+    if (h[0] == '[' && h[strlen(h) - 1] == ']') {
+        h[strlen(h) - 1] = '\0';
+        ++h;
+    }
+    struct addrinfo hints = {0}, *res;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(h, colon + 1, &hints, &res) != 0)
+        return false;
+    memcpy(&target, res->ai_addr, res->ai_addrlen);
+    target_len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return true;
+}
+
+static void finish(struct slot *slot, bool ok) {
+    close(slot->fd);
+    slot->fd = -1;
+    if (!ok || slot->status_len < 12) {
+        ++errors;
+        return;
+    }
+    uint64_t now = now_ns();
+    latencies[completed] = now - slot->started_ns;
+    ttfbs[completed] = slot->first_byte_ns - slot->started_ns;
+    ++completed;
+    int code_class = slot->status[9] - '0';
+    if (code_class >= 1 && code_class <= 5)
+        ++status_classes[code_class];
+}
+
+static bool start(struct slot *slot, const struct request *request) {
+    int fd = socket(target.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("socket");
+        ++errors;
+        return false;
+    }
+    slot->fd = fd;
+    slot->request = request;
+    slot->sent = 0;
+    slot->started_ns = now_ns();
+    slot->first_byte_ns = 0;
+    slot->bytes = 0;
+    slot->status_len = 0;
+    if (connect(fd, (struct sockaddr *)&target, target_len) == -1 && errno != EINPROGRESS) {
+        finish(slot, false);
+        return false;
+    }
+    return true;
+}
+
+// Sends what is left of the head, then reads until the server closes.
+static void advance(struct slot *slot, short revents) {
+    if (revents & (POLLERR | POLLNVAL)) {
+        finish(slot, false);
+        return;
+    }
+    const struct request *request = slot->request;
+    if (slot->sent < request->head_len) {
+        ssize_t n = send(slot->fd, request->head + slot->sent, request->head_len - slot->sent, MSG_NOSIGNAL);
+        if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+            finish(slot, false);
+        else if (n > 0)
+            slot->sent += (size_t)n;
+        return;
+    }
+    char buf[65536];
+    for (;;) {
+        ssize_t n = recv(slot->fd, buf, sizeof(buf), 0);
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n <= 0) {
+            finish(slot, n == 0);
+            return;
+        }
+        if (slot->first_byte_ns == 0)
+            slot->first_byte_ns = now_ns();
+        size_t take = sizeof(slot->status) - 1 - slot->status_len;
+        if (take > (size_t)n)
+            take = (size_t)n;
+        memcpy(slot->status + slot->status_len, buf, take);
+        slot->status_len += take;
+        slot->bytes += (uint64_t)n;
+        bytes_read += (uint64_t)n;
+    }
+}
+
+static double percentile_ms(const uint64_t *sorted, size_t count, double p) {
+    if (count == 0)
+        return 0;
+    size_t i = (size_t)(p * (double)(count - 1) + 0.5);
+    return (double)sorted[i] / 1e6;
+}
+
+static void run(double speed, size_t connections, struct summary *summary) {
+    struct slot *slots = calloc(connections, sizeof(*slots));
+    struct pollfd *pfds = calloc(connections, sizeof(*pfds));
+    latencies = malloc(request_count * sizeof(*latencies));
+    ttfbs = malloc(request_count * sizeof(*ttfbs));
+    if (slots == NULL || pfds == NULL || latencies == NULL || ttfbs == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < connections; ++i)
+        slots[i].fd = -1;
+
+    uint64_t begin = now_ns();
+    size_t next = 0, active = 0, delayed = 0;
+    while (next < request_count || active) {
+        uint64_t now = now_ns();
+        // Starts whatever is due, as far as there are free connections.
+        while (next < request_count && active < connections) {
+            uint64_t due = speed > 0 ? begin + (uint64_t)((double)requests[next].offset_ns / speed) : now;
+            if (due > now)
+                break;
+            if (speed > 0 && now - due > 1000000)
+                ++delayed;
+            size_t free_slot = 0;
+            while (slots[free_slot].fd != -1)
+                ++free_slot;
+            if (start(&slots[free_slot], &requests[next]))
+                ++active;
+            ++next;
+        }
+
+        int timeout = 100;
+        if (next < request_count && active < connections && speed > 0) {
+            uint64_t due = begin + (uint64_t)((double)requests[next].offset_ns / speed);
+            timeout = due > now ? (int)((due - now + 999999) / 1000000) : 0;
+            if (timeout > 100)
+                timeout = 100;
+        }
+        size_t polled = 0;
+        for (size_t i = 0; i < connections; ++i) {
+            if (slots[i].fd == -1)
+                continue;
+            pfds[polled].fd = slots[i].fd;
+            pfds[polled].events = slots[i].sent < slots[i].request->head_len ? POLLOUT : POLLIN;
+            pfds[polled].revents = 0;
+            ++polled;
+        }
+        if (poll(pfds, polled, timeout) == -1 && errno != EINTR) {
+            perror("poll");
+            exit(EXIT_FAILURE);
+        }
+
+        now = now_ns();
+        polled = 0;
+        for (size_t i = 0; i < connections; ++i) {
+            struct slot *slot = &slots[i];
+            if (slot->fd == -1)
+                continue;
+            short revents = pfds[polled++].revents;
+            if (revents)
+                advance(slot, revents);
+            else if (now - slot->started_ns > REQUEST_TIMEOUT_NS)
+                finish(slot, false);
+            if (slot->fd == -1)
+                --active;
+        }
+    }
+    double seconds = (double)(now_ns() - begin) / 1e9;
+    if (delayed)
+        fprintf(stderr, "%zu requests started more than 1ms late\n", delayed);
+
+    qsort(latencies, completed, sizeof(*latencies), compare_u64);
+    qsort(ttfbs, completed, sizeof(*ttfbs), compare_u64);
+    summary->requests = (double)completed;
+    summary->errors = (double)errors;
+    summary->seconds = seconds;
+    summary->rps = (double)completed / seconds;
+    summary->mib_per_s = (double)bytes_read / seconds / (1 << 20);
+    summary->p50_ms = percentile_ms(latencies, completed, 0.50);
+    summary->p90_ms = percentile_ms(latencies, completed, 0.90);
+    summary->p99_ms = percentile_ms(latencies, completed, 0.99);
+    summary->max_ms = percentile_ms(latencies, completed, 1.0);
+    summary->ttfb_p50_ms = percentile_ms(ttfbs, completed, 0.50);
+    summary->status_2xx = (double)status_classes[2];
+    summary->status_3xx = (double)status_classes[3];
+    summary->status_4xx = (double)status_classes[4];
+    summary->status_5xx = (double)status_classes[5];
+    free(slots);
+    free(pfds);
+}
+
+static double *field(struct summary *summary, size_t i) {
+    return (double *)((char *)summary + summary_fields[i].offset);
+}
+
+static bool save_summary(const char *path, struct summary *summary) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return false;
+    }
+    for (size_t i = 0; i < SUMMARY_FIELDS; ++i)
+        fprintf(f, "%s=%.6f\n", summary_fields[i].name, *field(summary, i));
+    return fclose(f) == 0;
+}
+
+static bool load_summary(const char *path, struct summary *summary) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return false;
+    }
+    char line[128];
+    while (fgets(line, sizeof(line), f)) {
+        char *eq = strchr(line, '=');
+        if (eq == NULL)
+            continue;
+        *eq = '\0';
+        for (size_t i = 0; i < SUMMARY_FIELDS; ++i) {
+            if (strcmp(line, summary_fields[i].name) == 0)
+                *field(summary, i) = strtod(eq + 1, NULL);
+        }
+    }
+    fclose(f);
+    return true;
+}
+
+static void print_summary(struct summary *summary, struct summary *baseline) {
+    if (baseline)
+        printf("%-12s %14s %14s %9s\n", "", "baseline", "this run", "change");
+    for (size_t i = 0; i < SUMMARY_FIELDS; ++i) {
+        double value = *field(summary, i);
+        if (baseline == NULL) {
+            printf("%-12s %14.3f\n", summary_fields[i].name, value);
+            continue;
+        }
+        double before = *field(baseline, i);
+        double change = before != 0 ? 100.0 * (value - before) / before : 0;
+        bool better = summary_fields[i].lower_is_better ? value < before : value > before;
+        printf("%-12s %14.3f %14.3f %+8.1f%%%s\n", summary_fields[i].name, before, value, change,
+               value == before ? "" : better ? "  better" : "  worse");
+    }
+}
+
+int main(int argc, char **argv) {
+    const char *host_port = "127.0.0.1:8000", *unix_path = NULL, *out = NULL, *baseline_path = NULL;
+    double speed = 1;
+    size_t connections = 256;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:u:s:c:o:b:")) != -1) {
+        switch (opt) {
+        case 't': host_port = optarg; break;
+        case 'u': unix_path = optarg; break;
+        case 's': speed = strtod(optarg, NULL); break;
+        case 'c': connections = strtoull(optarg, NULL, 10); break;
+        case 'o': out = optarg; break;
+        case 'b': baseline_path = optarg; break;
+        default: optind = argc + 1; break;
+        }
+    }
+    if (optind >= argc || speed < 0 || connections == 0) {
+        fprintf(stderr, "usage: %s [-t host:port | -u socket] [-s speed] [-c connections] [-o summary] "
+                "[-b baseline] capture...\n", argv[0]);
+        return 1;
+    }
+    if (!parse_target(host_port, unix_path)) {
+        fprintf(stderr, "invalid target %s\n", unix_path ? unix_path : host_port);
+        return 1;
+    }
+    for (int i = optind; i < argc; ++i) {
+        if (!load_capture(argv[i]))
+            return 1;
+    }
+    if (request_count == 0) {
+        fprintf(stderr, "no requests captured\n");
+        return 1;
+    }
+    qsort(requests, request_count, sizeof(*requests), compare_offsets);
+    uint64_t first = requests[0].offset_ns;
+    for (size_t i = 0; i < request_count; ++i)
+        requests[i].offset_ns -= first;
+
+    struct summary baseline = {0};
+    if (baseline_path && !load_summary(baseline_path, &baseline))
+        return 1;
+    char pace[32] = "max speed";
+    if (speed > 0)
+        snprintf(pace, sizeof(pace), "%gx speed", speed);
+    printf("replaying %zu requests spanning %.3fs at %s with up to %zu connections\n", request_count,
+           (double)requests[request_count - 1].offset_ns / 1e9, pace, connections);
+    struct summary summary;
+    run(speed, connections, &summary);
+    print_summary(&summary, baseline_path ? &baseline : NULL);
+    if (out && !save_summary(out, &summary))
+        return 1;
+    return 0;
+}
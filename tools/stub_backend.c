@@ -0,0 +1,315 @@
+// A stand-in for the backends behind upstream prefixes, to check the proxy
+// without one. Connections are kept alive and served one request at a time.
+// The last two segments of a path pick the response:
+//
+//   .../length/N   N body bytes with a Content-Length
+//   .../chunked/N  N body bytes in chunks of varying size, with a trailer
+//   .../close/N    N body bytes delimited by closing the connection
+//   .../echo       the request body, by Content-Length, sent back
+//   .../stats      the connections accepted and requests served so far
+//
+// Bodies are a fixed pseudo-random stream, -g N writes its first N bytes to
+// stdout to compare downloads against.
+//
+// usage: stub_backend [-t host:port | -u socket] | -g bytes
+
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define MAX_CONNS 256
+#define HEAD_MAX (1 << 14)
+
+struct conn {
+    int fd; // -1 when free
+    char head[HEAD_MAX];
+    size_t len;
+};
+
+static struct conn conns[MAX_CONNS];
+static uint64_t accepted, served;
+
+// The body stream, the same for every response so any offset can be checked.
+static void fill_body(char *buf, size_t len, uint64_t offset) {
+    for (size_t i = 0; i < len; ++i) {
+        uint64_t x = (offset + i) * 0x9e3779b97f4a7c15ull;
+        buf[i] = (char)(x >> 56);
+    }
+}
+
+static bool write_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+static bool write_body(int fd, uint64_t offset, size_t len) {
+    char buf[1 << 16];
+    while (len) {
+        size_t n = len < sizeof(buf) ? len : sizeof(buf);
+        fill_body(buf, n, offset);
+        if (!write_all(fd, buf, n))
+            return false;
+        offset += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool write_head(int fd, const char *status, const char *fields) {
+    char head[512];
+    int len = snprintf(head, sizeof(head), "HTTP/1.1 %s\r\nServer: stub_backend\r\n%s\r\n", status, fields);
+    return write_all(fd, head, (size_t)len);
+}
+
+static bool write_length(int fd, size_t len) {
+    char fields[64];
+    snprintf(fields, sizeof(fields), "Content-Length: %zu\r\n", len);
+    return write_head(fd, "200 OK", fields) && write_body(fd, 0, len);
+}
+
+// Sizes cycle through one byte, odd lengths and more than a pipe holds, so
+// chunk lines land anywhere in what the proxy reads.
+static bool write_chunked(int fd, size_t len) {
+    static const size_t sizes[] = {1, 10, 4093, 70001, 16};
+    if (!write_head(fd, "200 OK", "Transfer-Encoding: chunked\r\nTrailer: X-Stub\r\n"))
+        return false;
+    uint64_t offset = 0;
+    for (size_t i = 0; offset < len; ++i) {
+        size_t n = sizes[i % (sizeof(sizes) / sizeof(sizes[0]))];
+        if (n > len - offset)
+            n = len - offset;
+        char line[32];
+        int line_len = snprintf(line, sizeof(line), "%zx\r\n", n);
+        if (!write_all(fd, line, (size_t)line_len) || !write_body(fd, offset, n) || !write_all(fd, "\r\n", 2))
+            return false;
+        offset += n;
+    }
+    return write_all(fd, "0\r\nX-Stub: done\r\n\r\n", 19);
+}
+
+static bool write_stats(int fd) {
+    char body[128], fields[64];
+    int len = snprintf(body, sizeof(body), "connections %llu\nrequests %llu\n", (unsigned long long)accepted,
+                       (unsigned long long)served);
+    snprintf(fields, sizeof(fields), "Content-Length: %d\r\n", len);
+    return write_head(fd, "200 OK", fields) && write_all(fd, body, (size_t)len);
+}
+
+// The echoed body is read while it is sent back, it need not fit anywhere.
+static bool echo(struct conn *conn, size_t head_len, size_t body_len) {
+    char fields[64];
+    snprintf(fields, sizeof(fields), "Content-Length: %zu\r\n", body_len);
+    if (!write_head(conn->fd, "200 OK", fields))
+        return false;
+    size_t have = conn->len - head_len;
+    if (have > body_len)
+        have = body_len;
+    if (!write_all(conn->fd, conn->head + head_len, have))
+        return false;
+    memmove(conn->head, conn->head + head_len + have, conn->len - head_len - have);
+    conn->len -= head_len + have;
+    body_len -= have;
+    while (body_len) {
+        char buf[1 << 16];
+        ssize_t n = recv(conn->fd, buf, body_len < sizeof(buf) ? body_len : sizeof(buf), 0);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0 || !write_all(conn->fd, buf, (size_t)n))
+            return false;
+        body_len -= (size_t)n;
+    }
+    return true;
+}
+
+static size_t content_length(const char *head) {
+    for (const char *line = strstr(head, "\r\n"); line; line = strstr(line + 2, "\r\n")) {
+        if (strncasecmp(line + 2, "Content-Length:", 15) == 0)
+            return strtoull(line + 2 + 15, NULL, 10);
+    }
+    return 0;
+}
+
+// Serves every complete head that has arrived. Returns false once the
+// connection is to be closed.
+static bool serve(struct conn *conn) {
+    for (;;) {
+        char *end = memmem(conn->head, conn->len, "\r\n\r\n", 4);
+        if (end == NULL)
+            return conn->len < sizeof(conn->head);
+        *end = '\0';
+        size_t head_len = (size_t)(end - conn->head) + 4;
+        ++served;
+
+        char method[16], path[1024];
+        char *last = NULL;
+        if (sscanf(conn->head, "%15s %1023s", method, path) == 2)
+            last = strrchr(path, '/');
+        if (last == NULL) {
+            write_head(conn->fd, "400 Bad Request", "Content-Length: 0\r\nConnection: close\r\n");
+            return false;
+        }
+        *last = '\0';
+        const char *kind = strrchr(path, '/');
+        kind = kind ? kind + 1 : path;
+        size_t len = strtoull(last + 1, NULL, 10);
+
+        // The echoed body is consumed along with the head.
+        if (strcmp(last + 1, "echo") == 0) {
+            if (!echo(conn, head_len, content_length(conn->head)))
+                return false;
+            continue;
+        }
+        bool ok;
+        if (strcmp(last + 1, "stats") == 0) {
+            ok = write_stats(conn->fd);
+        } else if (strcmp(kind, "length") == 0) {
+            ok = write_length(conn->fd, len);
+        } else if (strcmp(kind, "chunked") == 0) {
+            ok = write_chunked(conn->fd, len);
+        } else if (strcmp(kind, "close") == 0) {
+            if (write_head(conn->fd, "200 OK", "Connection: close\r\n"))
+                write_body(conn->fd, 0, len);
+            return false;
+        } else {
+            ok = write_head(conn->fd, "404 Not Found", "Content-Length: 0\r\n");
+        }
+        if (!ok)
+            return false;
+        memmove(conn->head, conn->head + head_len, conn->len - head_len);
+        conn->len -= head_len;
+    }
+}
+
+static int listen_on(const char *host_port, const char *unix_path) {
+    struct sockaddr_storage addr = {0};
+    socklen_t addr_len;
+    if (unix_path) {
+        struct sockaddr_un *un = (struct sockaddr_un *)&addr;
+        if (strlen(unix_path) >= sizeof(un->sun_path))
+            return -1;
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, unix_path);
+        addr_len = sizeof(*un);
+        unlink(unix_path);
+    } else {
+        char host[256];
+        const char *colon = strrchr(host_port, ':');
+        if (colon == NULL || (size_t)(colon - host_port) >= sizeof(host))
+            return -1;
+        memcpy(host, host_port, colon - host_port);
+        host[colon - host_port] = '\0';
+        struct addrinfo hints = {0}, *res;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        if (getaddrinfo(host, colon + 1, &hints, &res) != 0)
+            return -1;
+        memcpy(&addr, res->ai_addr, res->ai_addrlen);
+        addr_len = res->ai_addrlen;
+        freeaddrinfo(res);
+    }
+    int fd = socket(addr.ss_family, SOCK_STREAM, 0);
+    int one = 1;
+    if (fd == -1 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1 ||
+        bind(fd, (struct sockaddr *)&addr, addr_len) == -1 || listen(fd, 128) == -1) {
+        perror("listen");
+        return -1;
+    }
+    return fd;
+}
+
+int main(int argc, char **argv) {
+    const char *host_port = "127.0.0.1:9000", *unix_path = NULL;
+    long long generate = -1;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:u:g:")) != -1) {
+        switch (opt) {
+        case 't': host_port = optarg; break;
+        case 'u': unix_path = optarg; break;
+        case 'g': generate = strtoll(optarg, NULL, 10); break;
+        default: optind = argc + 1; break;
+        }
+    }
+    if (optind != argc) {
+        fprintf(stderr, "usage: %s [-t host:port | -u socket] | -g bytes\n", argv[0]);
+        return 1;
+    }
+    if (generate >= 0) {
+        char buf[1 << 16];
+        for (uint64_t offset = 0; offset < (uint64_t)generate; offset += sizeof(buf)) {
+            size_t n = (uint64_t)generate - offset < sizeof(buf) ? (size_t)((uint64_t)generate - offset) : sizeof(buf);
+            fill_body(buf, n, offset);
+            fwrite(buf, 1, n, stdout);
+        }
+        return 0;
+    }
+
+    int listen_fd = listen_on(host_port, unix_path);
+    if (listen_fd == -1)
+        return 1;
+    signal(SIGPIPE, SIG_IGN);
+    for (size_t i = 0; i < MAX_CONNS; ++i)
+        conns[i].fd = -1;
+
+    struct pollfd fds[MAX_CONNS + 1];
+    for (;;) {
+        fds[0].fd = listen_fd;
+        fds[0].events = POLLIN;
+        for (size_t i = 0; i < MAX_CONNS; ++i) {
+            fds[i + 1].fd = conns[i].fd;
+            fds[i + 1].events = POLLIN;
+        }
+        if (poll(fds, MAX_CONNS + 1, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            return 1;
+        }
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(listen_fd, NULL, NULL);
+            size_t i = 0;
+            while (fd != -1 && i < MAX_CONNS && conns[i].fd != -1)
+                ++i;
+            if (fd != -1 && i == MAX_CONNS) {
+                close(fd);
+            } else if (fd != -1) {
+                conns[i].fd = fd;
+                conns[i].len = 0;
+                ++accepted;
+            }
+        }
+        for (size_t i = 0; i < MAX_CONNS; ++i) {
+            struct conn *conn = &conns[i];
+            if (conn->fd == -1 || !(fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+            ssize_t n = recv(conn->fd, conn->head + conn->len, sizeof(conn->head) - conn->len - 1, 0);
+            if (n > 0) {
+                conn->len += (size_t)n;
+                if (serve(conn))
+                    continue;
+            } else if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            close(conn->fd);
+            conn->fd = -1;
+        }
+    }
+}
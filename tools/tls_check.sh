@@ -0,0 +1,105 @@
+#!/bin/sh
+# Runs the server with a tls listener on a self-signed certificate made for
+# the run, then checks a full handshake, a resumption from the session ticket
+# of the first one, and that a download through it arrives intact. The size
+# is big enough to go through the file path, so with kTLS it is the kernel
+# that encrypts it. The server log of the run says which handshakes resumed
+# and which used kTLS.
+#
+#   tls_check.sh [-p port] [-s KiB] path/to/server
+#
+# Needs openssl and curl. Exits non-zero on the first check that fails.
+
+set -u
+
+port=8443
+size=4096
+while getopts p:s: opt; do
+    case $opt in
+    p) port=$OPTARG ;;
+    s) size=$OPTARG ;;
+    *) echo "usage: $0 [-p port] [-s KiB] path/to/server" >&2; exit 2 ;;
+    esac
+done
+shift $((OPTIND - 1))
+if [ $# -ne 1 ]; then
+    echo "usage: $0 [-p port] [-s KiB] path/to/server" >&2
+    exit 2
+fi
+server=$1
+
+dir=$(mktemp -d)
+pids=
+cleanup() {
+    [ -n "$pids" ] && kill $pids 2>/dev/null
+    rm -rf "$dir"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+fail() {
+    echo "FAIL: $*" >&2
+    echo "--- server log" >&2
+    cat "$dir/server.log" >&2
+    exit 1
+}
+
+openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj /CN=localhost \
+    -addext subjectAltName=DNS:localhost,IP:127.0.0.1 \
+    -keyout "$dir/key.pem" -out "$dir/cert.pem" 2>/dev/null || fail "could not make a certificate"
+
+mkdir "$dir/www"
+dd if=/dev/urandom of="$dir/www/blob.bin" bs=1024 count="$size" 2>/dev/null
+echo "<h1>tls</h1>" >"$dir/www/index.html"
+
+cat >"$dir/server.conf" <<EOF
+static_dir = $dir/www
+listen = 127.0.0.1:$port tls
+process_count = 1
+tls_cert = $dir/cert.pem
+tls_key = $dir/key.pem
+tls_session_tickets = on
+log_level = trace
+log_file = $dir/server.log
+EOF
+
+"$server" -c "$dir/server.conf" 2>>"$dir/server.log" &
+pids=$!
+# The workers are not taken down with the master, find them by parent.
+i=0
+until curl -s -o /dev/null --cacert "$dir/cert.pem" "https://localhost:$port/" 2>/dev/null; do
+    i=$((i + 1))
+    [ $i -lt 50 ] || fail "server did not come up on port $port"
+    sleep 0.1
+done
+for stat in /proc/[0-9]*/stat; do
+    [ -r "$stat" ] || continue
+    set -- $(cat "$stat" 2>/dev/null)
+    [ "${4:-}" = "${pids%% *}" ] && pids="$pids $1"
+done
+
+# Full handshake. The request is answered before the session is written out,
+# so a TLS 1.3 ticket sent after the handshake is in it.
+printf 'GET / HTTP/1.1\r\nHost: localhost\r\n\r\n' |
+    openssl s_client -connect "127.0.0.1:$port" -servername localhost -CAfile "$dir/cert.pem" \
+        -verify_return_error -ign_eof -sess_out "$dir/session.pem" >"$dir/full.txt" 2>&1 ||
+    fail "full handshake: $(tail -n 3 "$dir/full.txt")"
+grep -q '^HTTP/1.1 200' "$dir/full.txt" || fail "full handshake: no 200 response"
+grep -q '^New, ' "$dir/full.txt" || fail "full handshake was not a new session"
+echo "ok: full handshake, $(grep -m 1 '^New, ' "$dir/full.txt")"
+
+printf 'GET / HTTP/1.1\r\nHost: localhost\r\n\r\n' |
+    openssl s_client -connect "127.0.0.1:$port" -servername localhost -CAfile "$dir/cert.pem" \
+        -ign_eof -sess_in "$dir/session.pem" >"$dir/resumed.txt" 2>&1 ||
+    fail "resumption: $(tail -n 3 "$dir/resumed.txt")"
+grep -q '^HTTP/1.1 200' "$dir/resumed.txt" || fail "resumption: no 200 response"
+grep -q '^Reused, ' "$dir/resumed.txt" || fail "session was not resumed"
+echo "ok: resumed, $(grep -m 1 '^Reused, ' "$dir/resumed.txt")"
+
+curl -sS --fail --cacert "$dir/cert.pem" -o "$dir/blob.out" "https://localhost:$port/blob.bin" ||
+    fail "download failed"
+cmp -s "$dir/www/blob.bin" "$dir/blob.out" || fail "downloaded body differs"
+echo "ok: downloaded $size KiB intact"
+
+grep 'TLS handshake done' "$dir/server.log" | sed 's/^.*TLS handshake done: /server: /'
+exit 0
@@ -0,0 +1,118 @@
+#!/bin/sh
+# Runs the server with two upstream prefixes, /tcp on a TCP stub_backend and
+# /unix on a unix socket one, and checks what comes through them: bodies
+# delimited by length, by chunks and by the backend closing, at sizes around
+# the pipe capacity, a request body streamed to the backend and back, and
+# that backend connections are reused across requests rather than opened
+# for each one.
+#
+#   upstream_check.sh [-p port] path/to/server path/to/stub_backend
+#
+# Needs curl. Exits non-zero on the first check that fails.
+
+set -u
+
+port=8090
+while getopts p: opt; do
+    case $opt in
+    p) port=$OPTARG ;;
+    *) echo "usage: $0 [-p port] path/to/server path/to/stub_backend" >&2; exit 2 ;;
+    esac
+done
+shift $((OPTIND - 1))
+if [ $# -ne 2 ]; then
+    echo "usage: $0 [-p port] path/to/server path/to/stub_backend" >&2
+    exit 2
+fi
+server=$1
+stub=$2
+backend_port=$((port + 1))
+
+dir=$(mktemp -d)
+pids=
+cleanup() {
+    [ -n "$pids" ] && kill $pids 2>/dev/null
+    rm -rf "$dir"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+fail() {
+    echo "FAIL: $*" >&2
+    echo "--- server log" >&2
+    cat "$dir/server.log" >&2
+    exit 1
+}
+
+"$stub" -t "127.0.0.1:$backend_port" &
+pids=$!
+"$stub" -u "$dir/backend.sock" &
+pids="$pids $!"
+
+mkdir "$dir/www"
+cat >"$dir/server.conf" <<EOF
+static_dir = $dir/www
+listen = 127.0.0.1:$port
+process_count = 1
+upstream = /tcp 127.0.0.1:$backend_port
+upstream = /unix unix:$dir/backend.sock
+upstream_keepalive = 4
+log_level = info
+log_file = $dir/server.log
+EOF
+
+"$server" -c "$dir/server.conf" 2>>"$dir/server.log" &
+master=$!
+pids="$pids $master"
+i=0
+until curl -s -o /dev/null "http://127.0.0.1:$port/tcp/stats" 2>/dev/null; do
+    i=$((i + 1))
+    [ $i -lt 50 ] || fail "server did not come up on port $port"
+    sleep 0.1
+done
+# The workers are not taken down with the master, find them by parent.
+for stat in /proc/[0-9]*/stat; do
+    [ -r "$stat" ] || continue
+    set -- $(cat "$stat" 2>/dev/null)
+    [ "${4:-}" = "$master" ] && pids="$pids $1"
+done
+
+fetch() {
+    curl -sS --fail -o "$dir/body" "$@" || fail "request failed: $*"
+}
+
+for prefix in tcp unix; do
+    for framing in length chunked close; do
+        for size in 0 1 65535 65536 65537 1048576; do
+            fetch "http://127.0.0.1:$port/$prefix/$framing/$size"
+            "$stub" -g "$size" >"$dir/expected"
+            cmp -s "$dir/expected" "$dir/body" || fail "$prefix $framing body of $size bytes differs"
+        done
+        echo "ok: $prefix, $framing framed bodies"
+    done
+    "$stub" -g 300000 >"$dir/upload"
+    fetch --data-binary "@$dir/upload" -H 'Content-Type: application/octet-stream' \
+        "http://127.0.0.1:$port/$prefix/echo"
+    cmp -s "$dir/upload" "$dir/body" || fail "$prefix echoed request body differs"
+    echo "ok: $prefix, request body streamed both ways"
+done
+
+# Length and chunk delimited responses leave the backend connection reusable,
+# so a run of them should not open new ones.
+stat_of() {
+    fetch "http://127.0.0.1:$port/tcp/stats"
+    sed -n "s/^$1 //p" "$dir/body"
+}
+before=$(stat_of connections)
+requests=20
+i=0
+while [ $i -lt $requests ]; do
+    fetch "http://127.0.0.1:$port/tcp/length/1000"
+    fetch "http://127.0.0.1:$port/tcp/chunked/1000"
+    i=$((i + 1))
+done
+after=$(stat_of connections)
+opened=$((after - before))
+[ "$opened" -le 1 ] || fail "$opened backend connections opened for $((requests * 2)) requests"
+echo "ok: keep-alive, $opened backend connections opened for $((requests * 2)) requests"
+exit 0